@@ -322,6 +322,7 @@ CODE:
 
   // Set thumbnail specs
   // Array of hashes: { format => 'AUTO|JPEG|PNG', width => 100, height => 100, keep_aspect => 1, bgcolor => 0xffffff, quality => 90 },
+  // storyboards also have frames => 10, columns => 5
   thumbnails = (AV *)SvRV(*(my_hv_fetch(selfh, "thumbnails")));
   for (i = 0; i < av_len(thumbnails) + 1; i++) {
     SV **spec_sv = av_fetch(thumbnails, i, 0);
@@ -335,6 +336,8 @@ CODE:
       int keep_aspect = 1;
       uint32_t bgcolor = 0;
       int quality = 90;
+      int frames = 0;
+      int columns = 0;
 
       if (my_hv_exists(spec, "format")) {
         SV *f = *(my_hv_fetch(spec, "format"));
@@ -369,7 +372,21 @@ CODE:
           quality = SvUV(u);
       }
 
-      ms_add_thumbnail_spec(s, format, width, height, keep_aspect, bgcolor, quality);
+      if (my_hv_exists(spec, "frames")) {
+        SV *u = *(my_hv_fetch(spec, "frames"));
+        if (SvIOK(u))
+          frames = SvUV(u);
+      }
+      if (my_hv_exists(spec, "columns")) {
+        SV *u = *(my_hv_fetch(spec, "columns"));
+        if (SvIOK(u))
+          columns = SvUV(u);
+      }
+
+      if (frames > 0)
+        ms_add_storyboard_spec(s, format, width, height, keep_aspect, bgcolor, quality, frames, columns);
+      else
+        ms_add_thumbnail_spec(s, format, width, height, keep_aspect, bgcolor, quality);
     }
   }
 
@@ -23,13 +23,15 @@ use constant MS_RESCAN          => 1 << 2;
 use constant MS_INCLUDE_DELETED => 1 << 3;
 use constant MS_WATCH_CHANGES   => 1 << 4;
 use constant MS_CLEARDB         => 1 << 5;
+use constant MS_DETECT_DUPLICATES => 1 << 6;
+use constant MS_KEYFRAME_INDEX  => 1 << 7;
 
 our $VERSION = '0.02';
 
 our @EXPORT = qw(
     MS_LOG_ERR MS_LOG_WARN MS_LOG_INFO MS_LOG_DEBUG MS_LOG_MEMORY
     MS_USE_EXTENSION MS_FULL_SCAN MS_RESCAN MS_INCLUDE_DELETED
-    MS_WATCH_CHANGES MS_CLEARDB
+    MS_WATCH_CHANGES MS_CLEARDB MS_DETECT_DUPLICATES MS_KEYFRAME_INDEX
 );
 
 require XSLoader;
@@ -76,6 +78,11 @@ An OR'ed list of flags, the possible flags are:
                          since the last scan.
     MS_WATCH_CHANGES   - Continue watching for changes after the scan has completed.
     MS_CLEARDB         - Wipe the internal libmediascan database before scanning.
+    MS_DETECT_DUPLICATES - Reuse the result of an already scanned file with the same content
+                         for copies of that file, see duplicate_of in Media::Scan::Result.
+                         Only copies under the same path from 'paths' are found.
+    MS_KEYFRAME_INDEX  - Record a sparse index of the keyframes of each video in the cache,
+                         see ms_set_flags in libmediascan.h.
 
 =item ignore (default: none)
 
@@ -107,6 +114,12 @@ The format of a thumbnail spec is:
 
 Most values are optional, however at least width or height must be specified.
 
+A spec with C<frames> is a storyboard for videos: a sprite sheet of that many keyframes spread
+evenly across the video, C<columns> frames per row (default: all in one row), each frame sized by
+width and height. Files other than videos get no thumbnail for a storyboard spec.
+
+    { width => 160, frames => 10, columns => 5 }
+
 =item on_result
 
 A callback that will be called for each scanned file. The function will be passed
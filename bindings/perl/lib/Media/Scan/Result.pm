@@ -10,6 +10,8 @@ sub as_hash {
     return {
         type         => $self->type,
         path         => $self->path,
+        moved_from   => $self->moved_from,
+        duplicate_of => $self->duplicate_of,
         mime_type    => $self->mime_type,
         dlna_profile => $self->dlna_profile,
         size         => $self->size,
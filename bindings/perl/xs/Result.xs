@@ -18,6 +18,24 @@ CODE:
 OUTPUT:
   RETVAL
 
+SV *
+moved_from(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->moved_from ? newSVpv(r->moved_from, 0) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
+
+SV *
+duplicate_of(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->duplicate_of ? newSVpv(r->duplicate_of, 0) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
+
 SV *
 mime_type(MediaScanResult *r)
 CODE:
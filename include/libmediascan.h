@@ -50,7 +50,9 @@ enum scan_flags {
   MS_RESCAN = 1 << 2,
   MS_INCLUDE_DELETED = 1 << 3,
   MS_WATCH_CHANGES = 1 << 4,
-  MS_CLEARDB = 1 << 5           /* DEBUG: Clear the BDB when ms_scan is called */
+  MS_CLEARDB = 1 << 5,          /* DEBUG: Clear the BDB when ms_scan is called */
+  MS_DETECT_DUPLICATES = 1 << 6,
+  MS_KEYFRAME_INDEX = 1 << 7
 };
 
 enum thumb_format {
@@ -144,12 +146,19 @@ struct _Image {
   void *_png;                   // PNG-specific internal data
   void *_bmp;                   // BMP-specific internal data
   void *_gif;                   // GIF-specific internal data
+  uint64_t _pack_offset;        // Offset of the compressed data in the thumbnail pack, 0 if not packed
 #ifdef TIFF_SUPPORT
   void *_tiff;                  // TIFF-specific internal data
 #endif
 };
 typedef struct _Image MediaScanImage;
 
+struct _Keyframe {
+  int pts_ms;                   ///< Time of the keyframe from the start of the video
+  uint64_t offset;              ///< Byte offset of the packet that starts the keyframe
+};
+typedef struct _Keyframe MediaScanKeyframe;
+
 struct _Video {
   const char *path;             ///< Path to the file containing this video
   const char *codec;
@@ -159,11 +168,15 @@ struct _Video {
 
   struct _Audio **streams;
 
+  int nkeyframes;               ///< Entries in keyframes, set if scan flag MS_KEYFRAME_INDEX was used
+  MediaScanKeyframe *keyframes; ///< Sparse keyframe index in time order, at least 2 seconds apart
+
   // private members
   uint32_t *_pixbuf;            // Uncompressed frame image data used during resize
   int _pixbuf_size;             // Size of data in pixbuf
   void *_codecs;                // av_codecs_t containing AVStream, AVCodecContext for video/audio
   void *_avc;                   // AVCodec instance
+  int _indexed;                 // Set if the keyframes were indexed, even if none were found
 };
 typedef struct _Video MediaScanVideo;
 
@@ -183,6 +196,10 @@ struct _Result {
   int deleted;                  ///< Set if scan flag MS_INCLUDE_DELETED was used and this result is for a deleted file.
   /// NOTE: Only the type and path data will be set for deleted files.
   int changed;                  ///< Set if scan flag MS_RESCAN was used and this result is for a changed file.
+  char *moved_from;             ///< Set if this file was found to be a moved or renamed copy of a file
+  /// that is no longer present, to the old path. All other data was carried over from the cache.
+  char *duplicate_of;           ///< Set if scan flag MS_DETECT_DUPLICATES was used and this file has the same
+  /// content as an already scanned file, to the path of that file. All other data was copied from its result.
 
   const char *mime_type;
   const char *dlna_profile;
@@ -203,6 +220,7 @@ struct _Result {
   // private members
   void *_scan;                  // reference to scan that created this result
   void *_avf;                   // AVFormatContext instance
+  void *_io;                    // reader of a video, shared with the AVFormatContext
   FILE *_fp;                    // opened file if necessary
   void *_buf;                   // buffer if necessary
   struct _Image *_thumbs[MAX_THUMBS]; // generated thumbs
@@ -232,6 +250,8 @@ typedef struct _ThumbSpec {
   int keep_aspect;
   uint32_t bgcolor;
   int jpeg_quality;
+  int frames;                   ///< storyboard frames, 0 for a single image thumbnail
+  int columns;                  ///< storyboard frames per row
 
   // Internal data
   int width_padding;
@@ -240,6 +260,23 @@ typedef struct _ThumbSpec {
   int height_inner;
 } MediaScanThumbSpec;
 
+typedef struct _CacheDir {
+  char *path;
+  int entries;
+} MediaScanCacheDir;
+
+struct _CacheStats {
+  int entries;                  ///< files in the cache
+  int thumbnails;               ///< thumbnails in the thumbnail pack
+  uint64_t disk_size;           ///< size of all cache files in cachedir, in bytes
+  int hits;                     ///< files in the last scan that were unchanged, moved or copies
+  int misses;                   ///< files in the last scan that had to be scanned
+  int inserts;                  ///< cache entries written by the last scan
+  int ndirs;
+  MediaScanCacheDir *dirs;      ///< number of cached files per directory, sorted by path
+};
+typedef struct _CacheStats MediaScanCacheStats;
+
 struct _Scan {
   int npaths;
   char *paths[MAX_PATHS];
@@ -254,6 +291,10 @@ struct _Scan {
   char *cachedir;
   int flags;
   int watch_interval;
+  int watch_settle_ms;
+  int probe_bytes;              // limits for probing video streams, 0 for the FFmpeg default
+  int analyze_ms;
+  int fps_frames;
 
   MediaScanProgress *progress;
   MediaScanThread *thread;
@@ -264,12 +305,23 @@ struct _Scan {
   void (*on_finish) (struct _Scan *, void *);
   void *userdata;
 
+  // Databases of the cache shard of the file being scanned, there is one shard per scan path
   DB *dbp;                      /* DB structure handle */
+  DB *results_dbp;              /* Cached result records, keyed by path */
+  DB *ident_dbp;                /* Index of cached files by size and mtime, used to detect moves */
+  DB *content_dbp;              /* Index of cached files by size and content, used to detect copies */
+  DB *thumbs_dbp;               /* Index of the thumbnail pack */
 
   // private
   void *_dirq;                  // simple queue of all directories found
   void *_dlna;                  // libdlna instance
   int _want_abort;              // set when scan should abort as soon as possible
+  int _nshards;
+  void *_shards[MAX_PATHS];     // open cache shards
+  void *_shard;                 // shard the database handles above belong to
+  void *_watch;                 // change watch state while MS_WATCH_CHANGES is active
+  int _watch_poll;              // poll all directories even where inotify could watch them, for tests
+  void *_swsc;                  // swscale context for video thumbnails, reused between videos
 };
 
 typedef struct _Scan MediaScan;
@@ -362,6 +414,21 @@ void ms_add_ignore_extension(MediaScan *s, const char *extension);
 void ms_add_thumbnail_spec(MediaScan *s, enum thumb_format format, int width,
                            int height, int keep_aspect, uint32_t bgcolor, int quality);
 
+/**
+ * Specify a storyboard thumbnail for videos: a sprite sheet of keyframes spread evenly across the
+ * video, laid out left to right and top to bottom. The keyframes are decoded in one pass over the
+ * file the scan already has open. Other media get no thumbnail for a storyboard spec, and the
+ * thumbnails of a video are in the order their specs were added.
+ * @param format, width, height, keep_aspect, bgcolor, quality As for ms_add_thumbnail_spec, the
+ * width and height being the size of one frame of the storyboard.
+ * @param frames The number of frames, at least 1.
+ * @param columns The number of frames in a row of the sheet, 0 for a single row.
+ * A sheet is at most 65535 pixels wide and high, the largest JPEG: a wider one gets fewer columns,
+ * a higher one fewer frames.
+ */
+void ms_add_storyboard_spec(MediaScan *s, enum thumb_format format, int width, int height,
+                            int keep_aspect, uint32_t bgcolor, int quality, int frames, int columns);
+
 /**
  * By default, scans are synchronous. This means the call to ms_scan will
  * not return until the scan is finished. To enable background asynchronous
@@ -371,7 +438,15 @@ void ms_set_async(MediaScan *s, int enabled);
 
 /**
  * Specify a directory to be used for cache files. If not specified the current directory will
- * be used, which is probably not what you want.
+ * be used, which is probably not what you want. Each path added with ms_add_path gets its own
+ * cache shard, a shard-XXXXXXXXXXXXXXXX subdirectory named after a 64-bit hash of the absolute
+ * path. A scan only opens and locks the shards of its own paths, so scans of different paths can
+ * run in parallel, a full scan of one path leaves the others alone, and the shard of a path that
+ * is not available (e.g. a detached volume) is kept for when it comes back. Thumbnails are kept
+ * in a pack file in each shard (libmediascan_thumbs.pack) which survives a full scan, so a file
+ * whose size and modification time have not changed is not decoded again for thumbnails it
+ * already has. Each shard has its own index for move detection, so a file moved from one scan
+ * path to another is not detected as a move, it is scanned again as a new file.
  */
 void ms_set_cachedir(MediaScan *s, const char *path);
 
@@ -383,11 +458,17 @@ void ms_set_cachedir(MediaScan *s, const char *path);
  * @param flags Available flags are:
  * MS_USE_EXTENSION - Use a file's extension to determine file format. If unset, the scanner
  *   will try to detect a file's type by looking at the actual data. This method is also slower.
- * MS_FULL_SCAN - Scan all files found that are not specified in the ignore list.
+ * MS_FULL_SCAN - Scan all files found that are not specified in the ignore list. Only the cache
+ *   shards of the paths being scanned are started over.
  * MS_RESCAN - Perform a fast rescan by only scanning files that are new, or have changed their
  *   size and/or modification timestamp since the last scan was run. If the database from a prior
  *   scan is not available (libmediascan.db), the scan is the same as a full scan. The result for a changed
- *   file will have r->changed set.
+ *   file will have r->changed set. A new file that matches a previously scanned file which no longer exists
+ *   (same size, modification time and inode or sampled content) is treated as a move: its cached metadata and
+ *   thumbnails are reused without decoding the file, and r->moved_from is set to the old path. Moves are
+ *   only detected within one scan path, see ms_set_cachedir. When thumbnail specs were added since the last
+ *   scan, an unchanged file is reported again with its cached metadata, and only the thumbnails that are not
+ *   in the thumbnail pack yet are made.
  * MS_INCLUDE_DELETED - It is often useful to know that a file has been deleted. With this flag,
  *   a file that was previously scanned but has since been deleted will be reported to the result_callback
  *   and the r->deleted value will be set. NOTE: Only r->type, r->path, and r->deleted are valid for deleted
@@ -396,18 +477,44 @@ void ms_set_cachedir(MediaScan *s, const char *path);
  *   For files located on a local drive under OSX, Linux, or Windows, OS-native change detection will be used.
  *   For files on other systems or on remote network shares, the library will manually look for changes at regular
  *   intervals. Use ms_set_watch_interval() to configure this interval. To stop watching for changes, call
- *   ms_clear_watch().
+ *   ms_clear_watch(). Watching requires async mode: the scan thread keeps running after the finish callback and
+ *   sends a result for each new or changed file, and a deleted result if MS_INCLUDE_DELETED is also set.
+ *   On Linux each directory uses one inotify watch, see fs.inotify.max_user_watches. Directories on network
+ *   filesystems (NFS, SMB/CIFS, FUSE), directories beyond the inotify watch limit, and all directories on other
+ *   platforms are polled: every directory is checked with one stat() per interval and only directories whose
+ *   modification time or link count changed are read again. Polling notices files that are added, removed or
+ *   renamed; a file that is rewritten in place is picked up the next time its directory changes.
+ * MS_DETECT_DUPLICATES - Fingerprint the content of each new or changed file. A file with the same size and
+ *   fingerprint as a file scanned before, in this scan or a prior one, is not scanned again. Its result is a copy
+ *   of the earlier result, including thumbnails, with r->duplicate_of set to the path of the earlier file.
+ *   Fingerprints are kept in the cache shard of each path given to ms_add_path, so only copies under the
+ *   same path are found; a file and its copy under another path are both scanned.
+ * MS_KEYFRAME_INDEX - Record a sparse index of the keyframes of each video, in r->video->keyframes, for
+ *   seeking by time without reading the file again. It comes from the container's index when the file has one
+ *   (MP4, Matroska cues, AVI idx1), from keyframes sampled across the file for MPEG-TS, and otherwise from
+ *   the packets at the start of the file up to a bound. The index is kept in the cache with the result.
  */
 void ms_set_flags(MediaScan *s, int flags);
 
 /**
  * Set the interval the library will use to look for changes to files located on non-local filesystems
  * or on systems that don't support OS-specific change notification methods. If this is not called, the
- * default watch interval is 10 minutes.
+ * default watch interval is 10 minutes. While changes are being found the library polls more often, halving
+ * the interval after each poll that found changes down to 10 seconds, and doubles it again back to this
+ * interval after each poll that found none.
  * @param interval Watch interval, in seconds.
  */
 void ms_set_watch_interval(MediaScan *s, int interval_seconds);
 
+/**
+ * Set how long a changed file must stay unchanged before MS_WATCH_CHANGES scans it. A file counts as
+ * changed while there are change events for it or its size or modification time differ, so a file that
+ * is still being copied is not scanned until the copy is done. Changes to many files in one directory
+ * within this time are scanned together as a rescan of the files in the directory. The default is 2 seconds.
+ * @param settle_ms Settle time, in milliseconds.
+ */
+void ms_set_watch_settle_time(MediaScan *s, int settle_ms);
+
 /**
  * Set a callback that will be called for every scanned file.
  * This callback is required or a scan cannot be started.
@@ -433,6 +540,20 @@ void ms_set_progress_callback(MediaScan *s, ProgressCallback callback);
  */
 void ms_set_progress_interval(MediaScan *s, int seconds);
 
+/**
+ * Set how much of a video file FFmpeg may read to find the parameters of its streams. Most containers
+ * (MP4/MOV, Matroska/WebM, ASF/WMV, AVI) describe their streams in the header; if the header has everything
+ * needed, the streams are not probed at all. Other files are probed within these limits, and probed again
+ * with FFmpeg's defaults if the limited probe could not find a codec, the video size or the audio format.
+ * The defaults are 1 MB and 1000 ms. Passing 0 for all limits turns this off: streams are always probed
+ * with FFmpeg's defaults.
+ * @param probe_bytes Most bytes to read while probing (probesize), 0 for the FFmpeg default.
+ * @param analyze_ms Most stream time to read while probing, in milliseconds (analyzeduration), 0 for the
+ *   FFmpeg default.
+ * @param fps_frames Most frames to read to find the frame rate (fpsprobesize), 0 for the FFmpeg default.
+ */
+void ms_set_probe_limits(MediaScan *s, int probe_bytes, int analyze_ms, int fps_frames);
+
 /**
  * Set a callback that will be called when the scanning has finished.
  * This callback is optional.
@@ -505,6 +626,19 @@ MediaScanImage *ms_result_get_thumbnail(MediaScanResult *r, int index);
  */
 const uint8_t *ms_result_get_thumbnail_data(MediaScanResult *r, int index, int *length);
 
+/**
+ * Get the location of a thumbnail in the thumbnail pack. Thumbnails are stored in
+ * libmediascan_thumbs.pack in the cache shard of the file's scan path, the
+ * shard-XXXXXXXXXXXXXXXX subdirectory of the cache directory (see ms_set_cachedir). It is
+ * an append-only file that may be memory-mapped to serve thumbnails directly. The data is
+ * ms_result_get_thumbnail_data's length bytes starting at the returned offset.
+ * @param r MediaScanResult instance.
+ * @param index 0-based index of the thumbnail. Check r->nthumbnails for the total number.
+ * @param *offset (OUT) Returns the byte offset of the thumbnail data in the pack.
+ * @return 1 if the thumbnail is in the pack, 0 if not.
+ */
+int ms_result_get_thumbnail_pack_offset(MediaScanResult *r, int index, uint64_t *offset);
+
 /**
  * Return the total number of tags for a given result.
  * @param r MediaScanResult instance.
@@ -536,8 +670,44 @@ void ms_watch_directory(MediaScan *s, const char *path);
 
 /**
  * If ms_scan was run with the flag MS_WATCH_CHANGES, this call will stop watching for changes.
- * To begin watching again, you must call ms_scan() again.
+ * It waits for the scan thread to exit, so pending results not yet processed by ms_async_process
+ * are dropped. To begin watching again, you must call ms_scan() again.
  */
 void ms_clear_watch(MediaScan *s);
 
+/**
+ * Report on the cache shards of the paths given to ms_add_path: the number of cached files in
+ * total and per directory, the size of the cache files on disk, and how many files the last
+ * scan found in the cache (hits), had to scan (misses) and stored (inserts). Do not call this
+ * while a scan is running.
+ * @return A new MediaScanCacheStats, free it with ms_cache_stats_destroy. NULL if the cache
+ * could not be opened.
+ */
+MediaScanCacheStats *ms_cache_stats(MediaScan *s);
+
+/**
+ * Free cache statistics returned by ms_cache_stats.
+ */
+void ms_cache_stats_destroy(MediaScanCacheStats *stats);
+
+/**
+ * Check the cache shards of the paths given to ms_add_path for entries that are unreadable or
+ * refer to data that no longer exists.
+ * Problems are logged at the warning level. Do not call this while a scan is running.
+ * @return The number of problems found, 0 if the cache is consistent, or -1 if the cache
+ * could not be opened.
+ */
+int ms_cache_verify(MediaScan *s);
+
+/**
+ * Compact the cache shards of the paths given to ms_add_path. Files that do not belong under a
+ * shard's path are removed, along with the problems ms_cache_verify reports and thumbnails no
+ * cached file uses. The thumbnail pack is rewritten and free pages are returned to the
+ * filesystem. The cache files of older library versions are removed, as are the shards of
+ * other paths that no scan has used for 90 days and that no scan holds open. Do not call this
+ * while a scan is running.
+ * @return The number of entries removed, or -1 on failure.
+ */
+int ms_cache_compact(MediaScan *s);
+
 #endif // _LIBMEDIASCAN_H
@@ -865,6 +865,20 @@ void put_u32(void *vp, uint32_t v) {
   p[3] = (unsigned char)v & 0xff;
 }
 
+void put_u64(void *vp, uint64_t v) {
+  unsigned char *p = (unsigned char *)vp;
+
+  put_u32(p, (uint32_t)(v >> 32));
+  put_u32(p + 4, (uint32_t)v);
+}
+
+void buffer_put_short(Buffer *buffer, uint16_t value) {
+  char buf[2];
+
+  put_u16(buf, value);
+  buffer_append(buffer, buf, 2);
+}
+
 void buffer_put_int(Buffer *buffer, unsigned int value) {
   char buf[4];
 
@@ -872,6 +886,13 @@ void buffer_put_int(Buffer *buffer, unsigned int value) {
   buffer_append(buffer, buf, 4);
 }
 
+void buffer_put_int64(Buffer *buffer, uint64_t value) {
+  char buf[8];
+
+  put_u64(buf, value);
+  buffer_append(buffer, buf, 8);
+}
+
 // Warnings:
 // Do not request more than 32 bits at a time.
 // Be careful if using other buffer functions without reading a multiple of 8 bits.
@@ -937,6 +958,10 @@ int buffer_check_load(Buffer *buf, FILE *fp, int min_wanted, int max_wanted) {
     uint32_t actual_wanted;
     unsigned char *tmp;
 
+    // A buffer without a file already holds all of its data, e.g. cover art from a video
+    if (fp == NULL)
+      return 0;
+
     if (min_wanted > max_wanted) {
       max_wanted = min_wanted;
     }
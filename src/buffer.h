@@ -105,6 +105,10 @@ float get_f32(const void *vp);
 double buffer_get_ieee_float(Buffer *buffer);
 void put_u16(void *vp, uint16_t v);
 void put_u32(void *vp, uint32_t v);
+void put_u64(void *vp, uint64_t v);
+void buffer_put_short(Buffer *buffer, uint16_t value);
+void buffer_put_int(Buffer *buffer, unsigned int value);
+void buffer_put_int64(Buffer *buffer, uint64_t value);
 uint32_t buffer_get_bits(Buffer *buffer, uint32_t bits);
 uint32_t buffer_get_syncsafe(Buffer *buffer, uint8_t bytes);
 int buffer_check_load(Buffer *buffer, FILE *fp, int min_wanted, int max_wanted);
@@ -0,0 +1,1300 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\cache.c
+//
+// summary: Cached scan results, used to recognize files that were moved, renamed or copied
+///-------------------------------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libmediascan.h>
+#include <libavformat/avformat.h>
+#include <db.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "cache.h"
+#include "result.h"
+#include "video.h"
+#include "audio.h"
+#include "image.h"
+#include "thumb.h"
+#include "thumbpack.h"
+#include "tag.h"
+#include "util.h"
+#include "database.h"
+#include "mediascan.h"
+
+// Bump this whenever the record layout below changes, older records are then ignored
+#define CACHE_RECORD_VERSION 5
+
+// Identity index data: dev, inode and fingerprint followed by the NUL-terminated path
+#define IDENT_HEADER_SIZE 24
+
+// Identity index key is the file size followed by the mtime
+static void cache_ident_key(unsigned char *key, uint64_t size, int mtime) {
+  put_u32(key, (uint32_t)(size >> 32));
+  put_u32(key + 4, (uint32_t)size);
+  put_u32(key + 8, (uint32_t)mtime);
+}
+
+// Content index key is the file size followed by the fingerprint
+static void cache_content_key(unsigned char *key, uint64_t size, uint64_t fingerprint) {
+  put_u64(key, size);
+  put_u64(key + 8, fingerprint);
+}
+
+// Unsigned LEB128, for string lengths and counts and the keyframe index, whose deltas mostly fit in
+// 2 or 3 bytes
+static void cache_put_varint(Buffer *buf, uint64_t value) {
+  while (value >= 0x80) {
+    buffer_put_char(buf, (int)(value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  buffer_put_char(buf, (int)value);
+}
+
+static int cache_get_varint(Buffer *buf, uint64_t *value) {
+  int shift = 0;
+  char c;
+
+  *value = 0;
+  do {
+    if (shift > 63 || buffer_get_char_ret(&c, buf) == -1)
+      return 0;
+    *value |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return 1;
+}
+
+// Strings are stored with their NUL so they can be used in place, a length of 0 means NULL. Tag
+// values such as lyrics or comments can be longer than 64 KB.
+static void cache_put_string(Buffer *buf, const char *str) {
+  if (str == NULL) {
+    cache_put_varint(buf, 0);
+    return;
+  }
+
+  cache_put_varint(buf, (uint64_t)strlen(str) + 1);
+  buffer_append(buf, str, strlen(str) + 1);
+}
+
+static int cache_get_string(Buffer *buf, const char **str) {
+  uint64_t len;
+  char *ptr;
+
+  if (!cache_get_varint(buf, &len))
+    return 0;
+
+  if (len == 0) {
+    *str = NULL;
+    return 1;
+  }
+
+  if (buffer_len(buf) < len)
+    return 0;
+
+  ptr = (char *)buffer_ptr(buf);
+  if (ptr[len - 1] != '\0')
+    return 0;
+
+  *str = ptr;
+  buffer_consume(buf, len);
+
+  return 1;
+}
+
+// Thumbnails are not part of the record, they are found in the thumbnail pack through the path
+static void cache_pack_result(MediaScanResult *r, Buffer *buf) {
+  uint64_t fps_bits;
+  int i;
+
+  buffer_put_char(buf, CACHE_RECORD_VERSION);
+  buffer_put_int(buf, r->hash);
+  buffer_put_char(buf, r->type);
+  buffer_put_int64(buf, r->size);
+  buffer_put_int(buf, (uint32_t)r->mtime);
+  buffer_put_int(buf, (uint32_t)r->bitrate);
+  buffer_put_int(buf, (uint32_t)r->duration_ms);
+  cache_put_string(buf, r->mime_type);
+  cache_put_string(buf, r->dlna_profile);
+
+  buffer_put_char(buf, r->video ? 1 : 0);
+  if (r->video) {
+    cache_put_string(buf, r->video->codec);
+    buffer_put_int(buf, (uint32_t)r->video->width);
+    buffer_put_int(buf, (uint32_t)r->video->height);
+    memcpy(&fps_bits, &r->video->fps, sizeof(fps_bits));
+    buffer_put_int64(buf, fps_bits);
+    buffer_put_char(buf, r->video->_indexed || r->video->nkeyframes ? 1 : 0);
+
+    // The keyframe index, as the differences to the previous entry
+    cache_put_varint(buf, (uint64_t)r->video->nkeyframes);
+    for (i = 0; i < r->video->nkeyframes; i++) {
+      MediaScanKeyframe *k = &r->video->keyframes[i];
+      cache_put_varint(buf, (uint64_t)(k->pts_ms - (i ? k[-1].pts_ms : 0)));
+      cache_put_varint(buf, k->offset - (i ? k[-1].offset : 0));
+    }
+  }
+
+  buffer_put_char(buf, r->audio ? 1 : 0);
+  if (r->audio) {
+    cache_put_string(buf, r->audio->codec);
+    buffer_put_int64(buf, r->audio->audio_offset);
+    buffer_put_int64(buf, r->audio->audio_size);
+    buffer_put_int(buf, (uint32_t)r->audio->bitrate);
+    buffer_put_char(buf, r->audio->vbr);
+    buffer_put_int(buf, (uint32_t)r->audio->samplerate);
+    buffer_put_int(buf, (uint32_t)r->audio->channels);
+  }
+
+  buffer_put_char(buf, r->image ? 1 : 0);
+  if (r->image) {
+    cache_put_string(buf, r->image->codec);
+    buffer_put_int(buf, (uint32_t)r->image->width);
+    buffer_put_int(buf, (uint32_t)r->image->height);
+    buffer_put_int(buf, (uint32_t)r->image->channels);
+    buffer_put_char(buf, r->image->has_alpha);
+    buffer_put_int(buf, (uint32_t)r->image->offset);
+    buffer_put_char(buf, r->image->orientation);
+  }
+
+  buffer_put_char(buf, r->_tag ? 1 : 0);
+  if (r->_tag) {
+    MediaScanTag *t = r->_tag;
+    cache_put_string(buf, t->type);
+    cache_put_varint(buf, (uint64_t)t->nitems);
+    for (i = 0; i < t->nitems; i++) {
+      cache_put_string(buf, t->items[i]->key);
+      cache_put_string(buf, t->items[i]->value);
+    }
+  }
+}                               /* cache_pack_result() */
+
+///-------------------------------------------------------------------------------------------------
+///  Fill in a result from a cached record. Strings in the result point into the record, which
+///   is attached to the result as r->_buf and freed along with it. r->hash is set to the change
+///   key the record was stored with.
+///
+/// @return 1 on success, 0 if the record is unusable
+///-------------------------------------------------------------------------------------------------
+
+static int cache_unpack_result(MediaScanResult *r, Buffer *buf) {
+  char c;
+  int n;
+  uint32_t v;
+  uint64_t v64;
+  int i;
+
+  if (buffer_get_char_ret(&c, buf) == -1 || c != CACHE_RECORD_VERSION)
+    goto err;
+
+  if (buffer_get_int_ret(&r->hash, buf) == -1)
+    goto err;
+
+  if (buffer_get_char_ret(&c, buf) == -1)
+    goto err;
+  r->type = (enum media_type)c;
+
+  if (buffer_get_int64_ret(&v64, buf) == -1)
+    goto err;
+  r->size = v64;
+
+  if (buffer_get_int_ret(&v, buf) == -1)
+    goto err;
+  r->mtime = (int)v;
+
+  if (buffer_get_int_ret(&v, buf) == -1)
+    goto err;
+  r->bitrate = (int)v;
+
+  if (buffer_get_int_ret(&v, buf) == -1)
+    goto err;
+  r->duration_ms = (int)v;
+
+  if (!cache_get_string(buf, &r->mime_type) || !cache_get_string(buf, &r->dlna_profile))
+    goto err;
+
+  if (buffer_get_char_ret(&c, buf) == -1)
+    goto err;
+  if (c) {
+    MediaScanVideo *vid = r->video = video_create();
+    vid->path = r->path;
+
+    if (!cache_get_string(buf, &vid->codec))
+      goto err;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    vid->width = (int)v;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    vid->height = (int)v;
+    if (buffer_get_int64_ret(&v64, buf) == -1)
+      goto err;
+    memcpy(&vid->fps, &v64, sizeof(v64));
+    if (buffer_get_char_ret(&c, buf) == -1)
+      goto err;
+    vid->_indexed = c;
+
+    if (!cache_get_varint(buf, &v64) || v64 > buffer_len(buf) / 2)
+      goto err;
+    if (v64) {
+      uint64_t pts_delta, offset_delta;
+
+      vid->keyframes = (MediaScanKeyframe *)malloc((size_t)v64 * sizeof(MediaScanKeyframe));
+      if (vid->keyframes == NULL)
+        goto err;
+
+      for (i = 0; i < (int)v64; i++) {
+        MediaScanKeyframe *k = &vid->keyframes[i];
+
+        if (!cache_get_varint(buf, &pts_delta) || !cache_get_varint(buf, &offset_delta))
+          goto err;
+        k->pts_ms = (i ? k[-1].pts_ms : 0) + (int)pts_delta;
+        k->offset = (i ? k[-1].offset : 0) + offset_delta;
+        vid->nkeyframes++;
+      }
+    }
+  }
+
+  if (buffer_get_char_ret(&c, buf) == -1)
+    goto err;
+  if (c) {
+    MediaScanAudio *a = r->audio = audio_create();
+
+    if (!cache_get_string(buf, &a->codec))
+      goto err;
+    if (buffer_get_int64_ret(&a->audio_offset, buf) == -1)
+      goto err;
+    if (buffer_get_int64_ret(&a->audio_size, buf) == -1)
+      goto err;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    a->bitrate = (int)v;
+    if (buffer_get_char_ret(&c, buf) == -1)
+      goto err;
+    a->vbr = c;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    a->samplerate = (int)v;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    a->channels = (int)v;
+  }
+
+  if (buffer_get_char_ret(&c, buf) == -1)
+    goto err;
+  if (c) {
+    MediaScanImage *img = r->image = image_create();
+    img->path = r->path;
+
+    if (!cache_get_string(buf, &img->codec))
+      goto err;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    img->width = (int)v;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    img->height = (int)v;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    img->channels = (int)v;
+    if (buffer_get_char_ret(&c, buf) == -1)
+      goto err;
+    img->has_alpha = c;
+    if (buffer_get_int_ret(&v, buf) == -1)
+      goto err;
+    img->offset = (int)v;
+    if (buffer_get_char_ret(&c, buf) == -1)
+      goto err;
+    img->orientation = (enum exif_orientation)c;
+  }
+
+  if (buffer_get_char_ret(&c, buf) == -1)
+    goto err;
+  if (c) {
+    const char *type, *key, *value;
+
+    if (!cache_get_string(buf, &type))
+      goto err;
+    result_create_tag(r, type);
+
+    // Each item takes at least two bytes
+    if (!cache_get_varint(buf, &v64) || v64 > buffer_len(buf) / 2)
+      goto err;
+    n = (int)v64;
+    for (i = 0; i < n; i++) {
+      if (!cache_get_string(buf, &key) || !cache_get_string(buf, &value))
+        goto err;
+      tag_add_item(r->_tag, key, value);
+    }
+  }
+
+  return 1;
+
+err:
+  LOG_WARN("Ignoring unusable cache record for %s\n", r->path);
+  return 0;
+}                               /* cache_unpack_result() */
+
+// Delete the entry for a path from one of the index databases, which may hold several paths per key
+static void cache_remove_index_entry(DB *dbp, unsigned char *keybuf, uint32_t keysize, uint32_t header,
+                                     const char *path) {
+  DBC *cursor = NULL;
+  DBT key, data;
+  int ret;
+
+  if (dbp->cursor(dbp, NULL, &cursor, 0) != 0)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = keybuf;
+  key.size = keysize;
+
+  for (ret = cursor->c_get(cursor, &key, &data, DB_SET); ret == 0;
+       ret = cursor->c_get(cursor, &key, &data, DB_NEXT_DUP)) {
+    if (data.size > header && !strcmp((char *)data.data + header, path)) {
+      cursor->c_del(cursor, 0);
+      break;
+    }
+  }
+
+  cursor->c_close(cursor);
+}                               /* cache_remove_index_entry() */
+
+///-------------------------------------------------------------------------------------------------
+///  Remove the identity and content index entries for a path. They are found through the size
+///   and mtime of the cached record for that path, and the fingerprint in the identity entry.
+///-------------------------------------------------------------------------------------------------
+
+static void cache_remove_index(MediaScan *s, const char *path) {
+  DBC *cursor = NULL;
+  DBT key, data;
+  unsigned char keybuf[12];
+  unsigned char content_key[16];
+  int found = 0;
+  int ret;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+
+  if (s->results_dbp->get(s->results_dbp, NULL, &key, &data, 0) != 0)
+    return;
+
+  // version (1 byte), change key (4 bytes) and type (1 byte) come before size and mtime
+  if (data.size < 18)
+    return;
+
+  memcpy(keybuf, (unsigned char *)data.data + 6, sizeof(keybuf));
+
+  if (s->ident_dbp->cursor(s->ident_dbp, NULL, &cursor, 0) != 0)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = keybuf;
+  key.size = sizeof(keybuf);
+
+  for (ret = cursor->c_get(cursor, &key, &data, DB_SET); ret == 0;
+       ret = cursor->c_get(cursor, &key, &data, DB_NEXT_DUP)) {
+    if (data.size > IDENT_HEADER_SIZE && !strcmp((char *)data.data + IDENT_HEADER_SIZE, path)) {
+      // Content index key is the size followed by the fingerprint
+      memcpy(content_key, keybuf, 8);
+      memcpy(content_key + 8, (unsigned char *)data.data + 16, 8);
+      found = 1;
+
+      cursor->c_del(cursor, 0);
+      break;
+    }
+  }
+
+  cursor->c_close(cursor);
+
+  if (found)
+    cache_remove_index_entry(s->content_dbp, content_key, sizeof(content_key), 0, path);
+}                               /* cache_remove_index() */
+
+///-------------------------------------------------------------------------------------------------
+///  Store a scanned result in the cache so it can be reused if the file moves or is copied.
+///
+/// @param [in,out] s The scan.
+/// @param [in] r     The result, r->path is used as the key.
+/// @param file       The file r->path resolves to, used for the file's identity.
+/// @param fingerprint Content fingerprint of the file, or 0 if it has not been calculated yet.
+///-------------------------------------------------------------------------------------------------
+
+void cache_store_result(MediaScan *s, MediaScanResult *r, const char *file, uint64_t fingerprint) {
+  Buffer rec;
+  DBT key, data;
+  unsigned char keybuf[12];
+  unsigned char content_key[16];
+  uint64_t dev, ino;
+  int ret;
+
+  if (s->results_dbp == NULL || s->ident_dbp == NULL || s->content_dbp == NULL)
+    return;
+
+  // Drop the index entries for whatever was cached at this path before
+  cache_remove_index(s, r->path);
+
+  buffer_init(&rec, 1024);
+  cache_pack_result(r, &rec);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = r->path;
+  key.size = strlen(r->path) + 1;
+  data.data = buffer_ptr(&rec);
+  data.size = buffer_len(&rec);
+
+  ret = s->results_dbp->put(s->results_dbp, NULL, &key, &data, 0);
+  if (ret != 0) {
+    s->results_dbp->err(s->results_dbp, ret, "Cache store failed: %s", db_strerror(ret));
+    goto out;
+  }
+
+  // Add the file to the identity index
+  GetFileIdentity(file, &dev, &ino);
+  if (!fingerprint)
+    fingerprint = FingerprintFile(file, r->size);
+
+  buffer_clear(&rec);
+  buffer_put_int64(&rec, dev);
+  buffer_put_int64(&rec, ino);
+  buffer_put_int64(&rec, fingerprint);
+  buffer_append(&rec, r->path, strlen(r->path) + 1);
+
+  cache_ident_key(keybuf, r->size, r->mtime);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = keybuf;
+  key.size = sizeof(keybuf);
+  data.data = buffer_ptr(&rec);
+  data.size = buffer_len(&rec);
+
+  ret = s->ident_dbp->put(s->ident_dbp, NULL, &key, &data, 0);
+  if (ret != 0) {
+    s->ident_dbp->err(s->ident_dbp, ret, "Cache index store failed: %s", db_strerror(ret));
+    goto out;
+  }
+
+  // And to the content index, unless the file could not be read
+  if (!fingerprint)
+    goto out;
+
+  cache_content_key(content_key, r->size, fingerprint);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = content_key;
+  key.size = sizeof(content_key);
+  data.data = r->path;
+  data.size = strlen(r->path) + 1;
+
+  ret = s->content_dbp->put(s->content_dbp, NULL, &key, &data, 0);
+  if (ret != 0) {
+    s->content_dbp->err(s->content_dbp, ret, "Cache index store failed: %s", db_strerror(ret));
+  }
+
+out:
+  buffer_free(&rec);
+}                               /* cache_store_result() */
+
+///-------------------------------------------------------------------------------------------------
+///  Remove everything cached for a path.
+///-------------------------------------------------------------------------------------------------
+
+void cache_delete_path(MediaScan *s, const char *path) {
+  DBT key;
+
+  memset(&key, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+
+  if (s->results_dbp != NULL && s->ident_dbp != NULL && s->content_dbp != NULL) {
+    cache_remove_index(s, path);
+    s->results_dbp->del(s->results_dbp, NULL, &key, 0);
+  }
+
+  if (s->dbp != NULL)
+    s->dbp->del(s->dbp, NULL, &key, 0);
+}                               /* cache_delete_path() */
+
+// Turn a cached record into a result for path, or NULL if the record is unusable
+static MediaScanResult *cache_record_result(MediaScan *s, const char *path, DBT *data) {
+  MediaScanResult *r;
+  Buffer *rec;
+
+  r = result_create(s);
+  if (r == NULL)
+    return NULL;
+
+  r->path = strdup(path);
+
+  // Keep the record around, strings in the result point into it
+  rec = (Buffer *)malloc(sizeof(Buffer));
+  LOG_MEM("new result buffer @ %p\n", rec);
+  buffer_init(rec, data->size);
+  buffer_append(rec, data->data, data->size);
+  r->_buf = rec;
+
+  if (!cache_unpack_result(r, rec)) {
+    result_destroy(r);
+    return NULL;
+  }
+
+  return r;
+}                               /* cache_record_result() */
+
+///-------------------------------------------------------------------------------------------------
+///  Build a result for path from the record cached for another path. Thumbnails are taken from
+///   the thumbnail pack and linked to the new path there, thumbnails of specs added since the file
+///   was scanned are made from the file.
+///
+/// @return The result, or NULL if there is no usable record or a missing thumbnail could not be made.
+///-------------------------------------------------------------------------------------------------
+
+static MediaScanResult *cache_load_result(MediaScan *s, const char *cached_path, const char *path, uint32_t hash,
+                                          int mtime) {
+  MediaScanResult *r;
+  DBT key, data;
+  int x;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)cached_path;
+  key.size = strlen(cached_path) + 1;
+
+  if (s->results_dbp->get(s->results_dbp, NULL, &key, &data, 0) != 0)
+    return NULL;
+
+  r = cache_record_result(s, path, &data);
+  if (r == NULL)
+    return NULL;
+
+  // A video scanned without the keyframe index needs to be scanned again for it
+  if ((s->flags & MS_KEYFRAME_INDEX) && r->video && !r->video->_indexed)
+    goto err;
+
+  // Only adds index entries, the data is already in the pack
+  for (x = 0; x < s->nthumbspecs; x++) {
+    // Only videos have storyboards
+    if (s->thumbspecs[x]->frames && r->type != TYPE_VIDEO)
+      continue;
+
+    thumbpack_link(s, cached_path, r->size, r->mtime, path, mtime, s->thumbspecs[x]);
+  }
+
+  r->hash = hash;
+  r->mtime = mtime;
+
+  if (!result_scan_thumbnails(r))
+    goto err;
+
+  return r;
+
+err:
+  result_destroy(r);
+  return NULL;
+}                               /* cache_load_result() */
+
+///-------------------------------------------------------------------------------------------------
+///  Check that an unchanged file has a thumbnail for each thumbnail spec. The thumbnails of specs
+///   added since the file was scanned are made from the file, everything else comes from the cache.
+///
+/// @param [in,out] s The scan.
+/// @param path       Path of the file.
+/// @param size       Size of the file.
+/// @param mtime      Modification time of the file.
+///
+/// @return A result built from the cache with all thumbnails, or NULL if no thumbnail was missing
+///   or there is no usable record.
+///-------------------------------------------------------------------------------------------------
+
+MediaScanResult *cache_update_thumbnails(MediaScan *s, const char *path, uint64_t size, int mtime) {
+  MediaScanResult *r;
+  DBT key, data;
+  int type;
+  int x;
+
+  if (!s->nthumbspecs || s->results_dbp == NULL)
+    return NULL;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+
+  if (s->results_dbp->get(s->results_dbp, NULL, &key, &data, 0) != 0)
+    return NULL;
+
+  // version (1 byte) and change key (4 bytes) come before the type
+  if (data.size < 6)
+    return NULL;
+  type = ((unsigned char *)data.data)[5];
+
+  // Only look at the index, most of the time nothing is missing
+  for (x = 0; x < s->nthumbspecs; x++) {
+    if (s->thumbspecs[x]->frames && type != TYPE_VIDEO)
+      continue;
+
+    if (!thumbpack_has(s, path, size, mtime, s->thumbspecs[x]))
+      break;
+  }
+
+  if (x == s->nthumbspecs)
+    return NULL;
+
+  r = cache_record_result(s, path, &data);
+  if (r == NULL)
+    return NULL;
+
+  r->size = size;
+  r->mtime = mtime;
+
+  LOG_INFO("Making new thumbnails of %s\n", path);
+
+  if (!result_scan_thumbnails(r)) {
+    result_destroy(r);
+    return NULL;
+  }
+
+  return r;
+}                               /* cache_update_thumbnails() */
+
+///-------------------------------------------------------------------------------------------------
+///  Check if a file not yet in the cache is a cached file that was moved or renamed. Candidates
+///   are cached files with the same size and mtime whose old path no longer exists. A candidate
+///   with the same device and inode is the same file, otherwise (for example after a move to
+///   another filesystem) the sampled content fingerprint has to match.
+///
+/// @param [in,out] s The scan.
+/// @param path       Path of the new file, used as the cache key.
+/// @param file       The file path resolves to.
+/// @param hash       Change key of the file.
+/// @param size       Size of the file.
+/// @param mtime      Modification time of the file.
+/// @param [in,out] fingerprint Content fingerprint of the file, calculated here if 0 and needed.
+///
+/// @return A result built from the cache with moved_from set, or NULL if this is not a moved
+///   file. The old path is removed from the cache.
+///-------------------------------------------------------------------------------------------------
+
+MediaScanResult *cache_find_moved(MediaScan *s, const char *path, const char *file, uint32_t hash, uint64_t size,
+                                  int mtime, uint64_t *fingerprint) {
+  MediaScanResult *r = NULL;
+  DBC *cursor = NULL;
+  DBT key, data;
+  unsigned char keybuf[12];
+  uint64_t dev, ino, odev, oino;
+  int have_identity;
+  char *old_path = NULL;
+  int ret;
+
+  if (s->results_dbp == NULL || s->ident_dbp == NULL)
+    return NULL;
+
+  cache_ident_key(keybuf, size, mtime);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = keybuf;
+  key.size = sizeof(keybuf);
+
+  if (s->ident_dbp->cursor(s->ident_dbp, NULL, &cursor, 0) != 0)
+    return NULL;
+
+  have_identity = GetFileIdentity(file, &dev, &ino);
+
+  for (ret = cursor->c_get(cursor, &key, &data, DB_SET); ret == 0;
+       ret = cursor->c_get(cursor, &key, &data, DB_NEXT_DUP)) {
+    unsigned char *p = (unsigned char *)data.data;
+    const char *candidate;
+
+    if (data.size <= IDENT_HEADER_SIZE)
+      continue;
+
+    candidate = (const char *)p + IDENT_HEADER_SIZE;
+    if (!strcmp(candidate, path))
+      continue;
+
+    // A file that still exists at its old path was copied, not moved
+    if (GetFileIdentity(candidate, &odev, &oino))
+      continue;
+
+    if (!(have_identity && get_u64(p) == dev && get_u64(p + 8) == ino)) {
+      // Only read the file if there is a candidate to compare against
+      if (!*fingerprint)
+        *fingerprint = FingerprintFile(file, size);
+
+      if (!*fingerprint || get_u64(p + 16) != *fingerprint)
+        continue;
+    }
+
+    old_path = strdup(candidate);
+    break;
+  }
+
+  cursor->c_close(cursor);
+
+  if (old_path == NULL)
+    return NULL;
+
+  r = cache_load_result(s, old_path, path, hash, mtime);
+  if (r == NULL) {
+    free(old_path);
+    return NULL;
+  }
+
+  LOG_INFO("File %s was moved from %s, using cached result\n", path, old_path);
+
+  cache_delete_path(s, old_path);
+  r->moved_from = old_path;
+
+  return r;
+}                               /* cache_find_moved() */
+
+///-------------------------------------------------------------------------------------------------
+///  Check if a file not yet in the cache has the same content as a file that is, either from an
+///   earlier scan or earlier in this one. Only the shard in use is searched, its thumbnails can
+///   not be shared with other shards.
+///
+/// @param [in,out] s  The scan.
+/// @param path        Path of the new file, used as the cache key.
+/// @param hash        Change key of the file.
+/// @param size        Size of the file.
+/// @param mtime       Modification time of the file.
+/// @param fingerprint Content fingerprint of the file.
+///
+/// @return A result cloned from the cached file with duplicate_of set, or NULL if no copy of
+///   this file is cached.
+///-------------------------------------------------------------------------------------------------
+
+MediaScanResult *cache_find_duplicate(MediaScan *s, const char *path, uint32_t hash, uint64_t size, int mtime,
+                                      uint64_t fingerprint) {
+  MediaScanResult *r = NULL;
+  DBC *cursor = NULL;
+  DBT key, data;
+  unsigned char content_key[16];
+  char *original = NULL;
+  int ret;
+
+  if (s->results_dbp == NULL || s->content_dbp == NULL || !fingerprint)
+    return NULL;
+
+  cache_content_key(content_key, size, fingerprint);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = content_key;
+  key.size = sizeof(content_key);
+
+  if (s->content_dbp->cursor(s->content_dbp, NULL, &cursor, 0) != 0)
+    return NULL;
+
+  for (ret = cursor->c_get(cursor, &key, &data, DB_SET); ret == 0;
+       ret = cursor->c_get(cursor, &key, &data, DB_NEXT_DUP)) {
+    if (data.size > 1 && strcmp((char *)data.data, path)) {
+      original = strdup((char *)data.data);
+      break;
+    }
+  }
+
+  cursor->c_close(cursor);
+
+  if (original == NULL)
+    return NULL;
+
+  r = cache_load_result(s, original, path, hash, mtime);
+  if (r == NULL) {
+    free(original);
+    return NULL;
+  }
+
+  LOG_INFO("File %s is a copy of %s, using cached result\n", path, original);
+
+  r->duplicate_of = original;
+
+  return r;
+}                               /* cache_find_duplicate() */
+
+// The counters of the last scan are stored in each shard's libmediascan.db under an empty key,
+// no file has an empty path
+#define CACHE_COUNTERS_KEY ""
+
+///-------------------------------------------------------------------------------------------------
+///  Store the hit, miss and insert counters of the scan that just finished.
+///-------------------------------------------------------------------------------------------------
+
+void cache_save_counters(MediaScan *s) {
+  DBT key, data;
+  unsigned char rec[12];
+  int ret;
+  int i;
+
+  for (i = 0; i < s->_nshards; i++) {
+    CacheShard *shard = (CacheShard *)s->_shards[i];
+
+    put_u32(rec, (uint32_t)shard->hits);
+    put_u32(rec + 4, (uint32_t)shard->misses);
+    put_u32(rec + 8, (uint32_t)shard->inserts);
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = CACHE_COUNTERS_KEY;
+    key.size = 1;
+    data.data = rec;
+    data.size = sizeof(rec);
+
+    ret = shard->dbp->put(shard->dbp, NULL, &key, &data, 0);
+    if (ret != 0) {
+      shard->dbp->err(shard->dbp, ret, "Cache store failed: %s", db_strerror(ret));
+    }
+
+    LOG_INFO("Cache for %s: %d hits, %d misses, %d inserts\n", shard->root, shard->hits, shard->misses,
+             shard->inserts);
+  }
+}                               /* cache_save_counters() */
+
+// Open the cache without starting it over, as a full scan would. opened is set if the cache was
+// not already open and should be closed again when done.
+static int cache_open(MediaScan *s, int *opened) {
+  int flags = s->flags;
+  int ret;
+
+  *opened = 0;
+
+  if (s->_nshards)
+    return 1;
+
+  s->flags &= ~MS_FULL_SCAN;
+  ret = init_bdb(s);
+  s->flags = flags;
+
+  if (!ret)
+    return 0;
+
+  *opened = 1;
+  return 1;
+}                               /* cache_open() */
+
+// Close the cache again if cache_open opened it
+static void cache_close(MediaScan *s, int opened) {
+  if (opened)
+    bdb_destroy(s);
+  else
+    bdb_use_shard(s, NULL);
+}
+
+static int cache_has_key(DB *dbp, const char *path) {
+  DBT key, data;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+
+  return dbp->get(dbp, NULL, &key, &data, 0) == 0;
+}
+
+// A cached record is usable if it can be turned into a result
+static int cache_record_ok(MediaScan *s, const char *path, DBT *data) {
+  MediaScanResult *r = cache_record_result(s, path, data);
+
+  if (r == NULL)
+    return 0;
+
+  result_destroy(r);
+  return 1;
+}
+
+// Path of an index entry, or NULL if the entry is malformed
+static const char *cache_index_path(DBT *data, uint32_t header) {
+  if (data->size <= header || ((char *)data->data)[data->size - 1] != '\0')
+    return NULL;
+
+  return (char *)data->data + header;
+}
+
+// Walk one of the index databases and count, or delete, entries whose path has no cached record
+static int cache_check_index(MediaScan *s, DB *dbp, uint32_t header, int fix) {
+  DBC *cursor = NULL;
+  DBT key, data;
+  int bad = 0;
+
+  if (dbp->cursor(dbp, NULL, &cursor, 0) != 0)
+    return 0;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+    const char *path = cache_index_path(&data, header);
+
+    if (path == NULL || !cache_has_key(s->results_dbp, path)) {
+      if (!fix) {
+        LOG_WARN("Cache index entry for %s has no cached record\n", path ? path : "(invalid)");
+      }
+      else {
+        cursor->c_del(cursor, 0);
+      }
+      bad++;
+    }
+  }
+
+  cursor->c_close(cursor);
+
+  return bad;
+}                               /* cache_check_index() */
+
+// Walk the cached records and count, or delete, records that are unusable or whose path is no
+// longer in libmediascan.db
+static int cache_check_results(MediaScan *s, int fix) {
+  DBC *cursor = NULL;
+  DBT key, data;
+  int bad = 0;
+
+  if (s->results_dbp->cursor(s->results_dbp, NULL, &cursor, 0) != 0)
+    return 0;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+    const char *path = cache_index_path(&key, 0);
+
+    if (path != NULL && cache_has_key(s->dbp, path) && cache_record_ok(s, path, &data))
+      continue;
+
+    if (!fix) {
+      LOG_WARN("Cached record for %s is unusable or stale\n", path ? path : "(invalid)");
+    }
+    else {
+      if (path != NULL)
+        cache_remove_index(s, path);
+      cursor->c_del(cursor, 0);
+    }
+    bad++;
+  }
+
+  cursor->c_close(cursor);
+
+  return bad;
+}                               /* cache_check_results() */
+
+static int cache_dir_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Size of one of the files in a shard
+static uint64_t cache_file_size(CacheShard *shard, const char *file) {
+  char path[MAX_PATH_STR_LEN];
+  uint64_t size;
+  FILE *fp;
+
+  sprintf(path, "%s/%s", shard->dir, file);
+
+  fp = fopen(path, "rb");
+  if (fp == NULL)
+    return 0;
+
+  SeekFile(fp, 0, SEEK_END);
+  size = TellFile(fp);
+  fclose(fp);
+
+  return size;
+}                               /* cache_file_size() */
+
+///-------------------------------------------------------------------------------------------------
+///  Report on the cache shards of all scan paths.
+///
+/// @param [in,out] s The scan.
+///
+/// @return New statistics, NULL if the cache could not be opened.
+///-------------------------------------------------------------------------------------------------
+
+MediaScanCacheStats *ms_cache_stats(MediaScan *s) {
+  MediaScanCacheStats *stats = NULL;
+  DBC *cursor = NULL;
+  DBT key, data;
+  char **dirs = NULL;
+  int ndirs = 0, maxdirs = 0;
+  int maxstats = 0;
+  int opened;
+  int i, j;
+
+  if (s == NULL) {
+    ms_errno = MSENO_NULLSCANOBJ;
+    LOG_ERROR("MediaScan = NULL\n");
+    return NULL;
+  }
+
+  if (!cache_open(s, &opened))
+    return NULL;
+
+  stats = (MediaScanCacheStats *)calloc(sizeof(MediaScanCacheStats), 1);
+  if (stats == NULL) {
+    ms_errno = MSENO_MEMERROR;
+    FATAL("Out of memory for cache stats\n");
+    goto out;
+  }
+  LOG_MEM("new MediaScanCacheStats @ %p\n", stats);
+
+  for (j = 0; j < s->_nshards; j++) {
+    CacheShard *shard = (CacheShard *)s->_shards[j];
+    int thumbnails;
+    uint64_t pack_size;
+
+    bdb_use_shard(s, shard);
+
+    if (shard->dbp->cursor(shard->dbp, NULL, &cursor, 0) != 0)
+      continue;
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+
+    while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+      const char *path = cache_index_path(&key, 0);
+      const char *p;
+      char *dir;
+
+      if (path == NULL)
+        continue;
+
+      if (path[0] == '\0') {
+        if (data.size == 12) {
+          stats->hits += (int)get_u32(data.data);
+          stats->misses += (int)get_u32((unsigned char *)data.data + 4);
+          stats->inserts += (int)get_u32((unsigned char *)data.data + 8);
+        }
+        continue;
+      }
+
+      stats->entries++;
+
+      p = strrchr(path, '/');
+      if (strrchr(path, '\\') > p)
+        p = strrchr(path, '\\');
+      if (p == NULL)
+        p = path;
+
+      dir = (char *)malloc(p - path + 1);
+      memcpy(dir, path, p - path);
+      dir[p - path] = '\0';
+
+      if (ndirs == maxdirs) {
+        maxdirs = maxdirs ? maxdirs * 2 : 256;
+        dirs = (char **)realloc(dirs, maxdirs * sizeof(char *));
+      }
+      dirs[ndirs++] = dir;
+    }
+
+    cursor->c_close(cursor);
+
+    thumbpack_stats(s, &thumbnails, &pack_size);
+    stats->thumbnails += thumbnails;
+
+    stats->disk_size += pack_size + cache_file_size(shard, "libmediascan.db") +
+      cache_file_size(shard, "libmediascan_results.db") + cache_file_size(shard, "libmediascan_ident.db") +
+      cache_file_size(shard, "libmediascan_content.db") + cache_file_size(shard, "libmediascan_thumbs.db");
+  }
+
+  // Count the files per directory
+  qsort(dirs, ndirs, sizeof(char *), cache_dir_cmp);
+
+  for (i = 0; i < ndirs; i++) {
+    if (stats->ndirs && !strcmp(stats->dirs[stats->ndirs - 1].path, dirs[i])) {
+      stats->dirs[stats->ndirs - 1].entries++;
+      free(dirs[i]);
+      continue;
+    }
+
+    if (stats->ndirs == maxstats) {
+      maxstats = maxstats ? maxstats * 2 : 64;
+      stats->dirs = (MediaScanCacheDir *)realloc(stats->dirs, maxstats * sizeof(MediaScanCacheDir));
+    }
+
+    stats->dirs[stats->ndirs].path = dirs[i];
+    stats->dirs[stats->ndirs].entries = 1;
+    stats->ndirs++;
+  }
+
+  if (dirs)
+    free(dirs);
+
+out:
+  cache_close(s, opened);
+
+  return stats;
+}                               /* ms_cache_stats() */
+
+void ms_cache_stats_destroy(MediaScanCacheStats *stats) {
+  int i;
+
+  for (i = 0; i < stats->ndirs; i++)
+    free(stats->dirs[i].path);
+
+  if (stats->dirs)
+    free(stats->dirs);
+
+  LOG_MEM("destroy MediaScanCacheStats @ %p\n", stats);
+  free(stats);
+}                               /* ms_cache_stats_destroy() */
+
+///-------------------------------------------------------------------------------------------------
+///  Check the cache shards of all scan paths for unusable records, index entries without a
+///   record and thumbnail index entries that point outside the thumbnail pack.
+///
+/// @param [in,out] s The scan.
+///
+/// @return The number of problems found, or -1 if the cache could not be opened.
+///-------------------------------------------------------------------------------------------------
+
+int ms_cache_verify(MediaScan *s) {
+  int bad = 0;
+  int opened;
+  int i;
+
+  if (s == NULL) {
+    ms_errno = MSENO_NULLSCANOBJ;
+    LOG_ERROR("MediaScan = NULL\n");
+    return -1;
+  }
+
+  if (!cache_open(s, &opened))
+    return -1;
+
+  for (i = 0; i < s->_nshards; i++) {
+    bdb_use_shard(s, (CacheShard *)s->_shards[i]);
+
+    bad += cache_check_results(s, 0);
+    bad += cache_check_index(s, s->ident_dbp, IDENT_HEADER_SIZE, 0);
+    bad += cache_check_index(s, s->content_dbp, 0, 0);
+    bad += thumbpack_verify(s);
+  }
+
+  cache_close(s, opened);
+
+  return bad;
+}                               /* ms_cache_verify() */
+
+// Compact the shard in use, see ms_cache_compact
+static int cache_compact_shard(MediaScan *s, CacheShard *shard) {
+  DBC *cursor = NULL;
+  DBT key, data;
+  DB *dbs[5];
+  int removed = 0;
+  int ret;
+  int i;
+
+  // Purge files that do not belong under the shard's path
+  if (shard->dbp->cursor(shard->dbp, NULL, &cursor, 0) != 0)
+    return -1;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+    const char *path = cache_index_path(&key, 0);
+
+    if (path != NULL && path[0] == '\0')
+      continue;
+
+    if (path == NULL || data.size != sizeof(uint32_t) || !bdb_path_in_root(path, shard->root)) {
+      LOG_DEBUG("Purging %s from cache\n", path ? path : "(invalid)");
+      cursor->c_del(cursor, 0);
+      removed++;
+    }
+  }
+
+  cursor->c_close(cursor);
+
+  // Records of purged files go along with their index entries
+  removed += cache_check_results(s, 1);
+  removed += cache_check_index(s, shard->ident_dbp, IDENT_HEADER_SIZE, 1);
+  removed += cache_check_index(s, shard->content_dbp, 0, 1);
+
+  // Thumbnails of the purged files go too
+  ret = thumbpack_compact(s);
+
+  if (ret < 0)
+    return -1;
+  removed += ret;
+
+  // Give the pages freed above back to the filesystem
+  dbs[0] = shard->dbp;
+  dbs[1] = shard->results_dbp;
+  dbs[2] = shard->ident_dbp;
+  dbs[3] = shard->content_dbp;
+  dbs[4] = shard->thumbs_dbp;
+
+  for (i = 0; i < 5; i++) {
+    ret = dbs[i]->compact(dbs[i], NULL, NULL, NULL, NULL, DB_FREE_SPACE, NULL);
+    if (ret != 0)
+      dbs[i]->err(dbs[i], ret, "Cache compaction failed: %s", db_strerror(ret));
+  }
+
+  LOG_INFO("Cache for %s compacted, %d entries removed\n", shard->root, removed);
+
+  return removed;
+}                               /* cache_compact_shard() */
+
+///-------------------------------------------------------------------------------------------------
+///  Compact the cache shards of all scan paths: purge files that do not belong to the shard,
+///   fix what ms_cache_verify reports, rewrite the thumbnail pack and give free database pages
+///   back to the filesystem.
+///
+/// @param [in,out] s The scan.
+///
+/// @return The number of entries removed, or -1 on failure.
+///-------------------------------------------------------------------------------------------------
+
+int ms_cache_compact(MediaScan *s) {
+  int removed = 0;
+  int opened;
+  int ret;
+  int i;
+
+  if (s == NULL) {
+    ms_errno = MSENO_NULLSCANOBJ;
+    LOG_ERROR("MediaScan = NULL\n");
+    return -1;
+  }
+
+  if (!cache_open(s, &opened))
+    return -1;
+
+  for (i = 0; i < s->_nshards; i++) {
+    CacheShard *shard = (CacheShard *)s->_shards[i];
+
+    bdb_use_shard(s, shard);
+
+    ret = cache_compact_shard(s, shard);
+    if (ret < 0) {
+      removed = -1;
+      break;
+    }
+    removed += ret;
+  }
+
+  // Shards of other paths are only visited here, and removed once they are stale
+  if (removed >= 0) {
+    ret = bdb_remove_stale(s);
+    if (ret > 0)
+      LOG_INFO("Removed %d unused cache shards\n", ret);
+  }
+
+  cache_close(s, opened);
+
+  return removed;
+}                               /* ms_cache_compact() */
@@ -0,0 +1,13 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+void cache_store_result(MediaScan *s, MediaScanResult *r, const char *file, uint64_t fingerprint);
+void cache_delete_path(MediaScan *s, const char *path);
+void cache_save_counters(MediaScan *s);
+MediaScanResult *cache_update_thumbnails(MediaScan *s, const char *path, uint64_t size, int mtime);
+MediaScanResult *cache_find_moved(MediaScan *s, const char *path, const char *file, uint32_t hash, uint64_t size,
+                                  int mtime, uint64_t *fingerprint);
+MediaScanResult *cache_find_duplicate(MediaScan *s, const char *path, uint32_t hash, uint64_t size, int mtime,
+                                      uint64_t fingerprint);
+
+#endif // _CACHE_H
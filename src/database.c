@@ -10,6 +10,8 @@
 #include <direct.h>
 #endif
 
+#include <sys/stat.h>
+
 #include <libmediascan.h>
 #include <libavformat/avformat.h>
 #include <db.h>
@@ -28,91 +30,509 @@
 #include "error.h"
 #include "mediascan.h"
 #include "thread.h"
+#include "thumbpack.h"
 #include "util.h"
 
-DB_ENV *myEnv;                  /* Env structure handle */
+// Make a scan path absolute, the way recurse_dir does for the paths it finds
+char *bdb_scan_root(const char *path) {
+  char *root = (char *)malloc(MAX_PATH_STR_LEN);
+  int len;
+
+  if (root == NULL)
+    return NULL;
+
+  if (is_absolute_path(path)) {
+    strncpy(root, path, MAX_PATH_STR_LEN - 1);
+    root[MAX_PATH_STR_LEN - 1] = '\0';
+  }
+  else {
+#ifdef WIN32
+    _getcwd(root, MAX_PATH_STR_LEN);
+    strcat(root, "\\");
+#else
+    getcwd(root, MAX_PATH_STR_LEN);
+    strcat(root, "/");
+#endif
+    strncat(root, path, MAX_PATH_STR_LEN - strlen(root) - 1);
+  }
+
+  // Strip trailing slashes
+  len = strlen(root);
+  while (len > 1 && (root[len - 1] == '/' || root[len - 1] == '\\'))
+    root[--len] = '\0';
+
+  return root;
+}                               /* bdb_scan_root() */
+
+// Is path the root itself or somewhere below it?
+int bdb_path_in_root(const char *path, const char *root) {
+  int len = strlen(root);
+
+  return !strncmp(path, root, len) && (path[len] == '/' || path[len] == '\\' || path[len] == '\0');
+}                               /* bdb_path_in_root() */
+
+// Shards not used by a scan for this long are removed by bdb_remove_stale(), unless they belong to
+// one of the scan paths
+#define SHARD_MAX_AGE (90 * 24 * 3600)
+
+// Cache files of the layout before shards, directly in cachedir
+static const char *LegacyFiles[] = {
+  "libmediascan.db", "libmediascan_results.db", "libmediascan_ident.db", "libmediascan_content.db",
+  "libmediascan_thumbs.db", THUMBPACK_FILE, NULL
+};
+
+// Cache files in a shard, besides the environment and the lock
+static const char *ShardFiles[] = {
+  "libmediascan.db", "libmediascan_results.db", "libmediascan_ident.db", "libmediascan_content.db",
+  "libmediascan_thumbs.db", THUMBPACK_FILE, THUMBPACK_FILE ".tmp", THUMBPACK_FILE ".old", NULL
+};
+
+static const char *bdb_cachedir(MediaScan *s) {
+  return s->cachedir ? s->cachedir : ".";
+}
+
+// The shard directory of a scan path. The shard is named after its path, so it is found again when
+// a volume comes back.
+static void bdb_shard_dir(MediaScan *s, const char *root, char *dir) {
+  uint32_t pc = 0, pb = 0;
+
+  hashlittle2(root, strlen(root), &pc, &pb);
+  sprintf(dir, "%s/shard-%08x%08x", bdb_cachedir(s), pc, pb);
+}                               /* bdb_shard_dir() */
+
+static int bdb_file_exists(const char *path) {
+  struct stat st;
+
+  return stat(path, &st) == 0;
+}
+
+// Remove a Berkeley DB environment and the given files from a directory. The environment is only
+// removed if no one has it open. Returns 0 if it is in use.
+static int bdb_remove_files(const char *dir, const char **files) {
+  DB_ENV *env;
+  char path[MAX_PATH_STR_LEN];
+  int i;
+
+  if (db_env_create(&env, 0) != 0)
+    return 0;
+
+  // Frees env whether or not it succeeds
+  if (env->remove(env, dir, 0) != 0)
+    return 0;
+
+  for (i = 0; files[i] != NULL; i++) {
+    sprintf(path, "%s/%s", dir, files[i]);
+    remove(path);
+  }
+
+  return 1;
+}                               /* bdb_remove_files() */
+
+///-------------------------------------------------------------------------------------------------
+///  Make a shard the one the cache functions work on. s->dbp and the other database handles are
+///   pointed at the shard's databases, or set to NULL if shard is NULL.
+///-------------------------------------------------------------------------------------------------
+
+void bdb_use_shard(MediaScan *s, CacheShard *shard) {
+  s->_shard = shard;
+
+  if (shard == NULL) {
+    s->dbp = NULL;
+    s->results_dbp = NULL;
+    s->ident_dbp = NULL;
+    s->content_dbp = NULL;
+    s->thumbs_dbp = NULL;
+    return;
+  }
+
+  s->dbp = shard->dbp;
+  s->results_dbp = shard->results_dbp;
+  s->ident_dbp = shard->ident_dbp;
+  s->content_dbp = shard->content_dbp;
+  s->thumbs_dbp = shard->thumbs_dbp;
+}                               /* bdb_use_shard() */
+
+///-------------------------------------------------------------------------------------------------
+///  Use the shard of the scan path a file is under. If the scan paths are nested the innermost
+///   one wins. No shard is used for files outside all scan paths.
+///-------------------------------------------------------------------------------------------------
+
+void bdb_select_shard(MediaScan *s, const char *path) {
+  CacheShard *best = NULL;
+  int i;
+
+  for (i = 0; i < s->_nshards; i++) {
+    CacheShard *shard = (CacheShard *)s->_shards[i];
+
+    if (bdb_path_in_root(path, shard->root) && (best == NULL || strlen(shard->root) > strlen(best->root)))
+      best = shard;
+  }
+
+  bdb_use_shard(s, best);
+}                               /* bdb_select_shard() */
 
 void reset_bdb(MediaScan *s) {
   u_int32_t records;
+  u_int32_t discarded;
+  int i;
+
+  for (i = 0; i < s->_nshards; i++) {
+    CacheShard *shard = (CacheShard *)s->_shards[i];
 
-  s->dbp->truncate(s->dbp, NULL, &records, 0);
+    bdb_use_shard(s, shard);
+
+    shard->dbp->truncate(shard->dbp, NULL, &records, 0);
+    shard->results_dbp->truncate(shard->results_dbp, NULL, &discarded, 0);
+    shard->ident_dbp->truncate(shard->ident_dbp, NULL, &discarded, 0);
+    shard->content_dbp->truncate(shard->content_dbp, NULL, &discarded, 0);
+    thumbpack_reset(s);
+
+    LOG_INFO("Database for %s cleared. %d records deleted\n", shard->root, records);
+  }
 
-  LOG_INFO("Database cleared. %d records deleted\n", records);
+  bdb_use_shard(s, NULL);
 }                               /* reset_bdb() */
 
-int init_bdb(MediaScan *s) {
+// Create and open one of the cache databases in a shard. Unless keep is set, a full scan starts
+// the database over.
+static int open_bdb(MediaScan *s, CacheShard *shard, DB **dbpp, const char *file, u_int32_t db_flags,
+                    int keep) {
   int ret;
   int tmp_flags;
   char dbpath[MAX_PATH_STR_LEN];
 
-  if (s->dbp)
-    return 1;
+  /* Initialize the structure. This
+   * database is opened in the shard's environment. */
+  ret = db_create(dbpp, shard->env, 0);
+  if (ret != 0) {
+    LOG_ERROR("Database creation failed: %s", db_strerror(ret));
+    return 0;
+  }
+
+  if (db_flags)
+    (*dbpp)->set_flags(*dbpp, db_flags);
+
+  /* open the database */
+  sprintf(dbpath, "%s/%s", shard->dir, file);
+
+  if ((s->flags & MS_FULL_SCAN) && !keep) {
+    tmp_flags = DB_CREATE | DB_TRUNCATE;
+  }
+  else {
+    tmp_flags = DB_CREATE;
+  };
+
+  ret = (*dbpp)->open(*dbpp,    /* DB structure pointer */
+                      NULL,     /* Transaction pointer */
+                      dbpath,   /* On-disk file that holds the database. */
+                      NULL,     /* Optional logical database name */
+                      DB_BTREE, /* Database access method */
+                      tmp_flags,  /* Open flags */
+                      0);       /* File mode (using defaults) */
+
+  if (ret != 0) {
+    LOG_ERROR("Database open failed: %s\n", db_strerror(ret));
+    return 0;
+  }
+
+  return 1;
+}                               /* open_bdb() */
+
+///-------------------------------------------------------------------------------------------------
+///  Open the cache shard of a scan path. Each shard lives in its own directory in cachedir with
+///   its own environment and lock, so scanners working on different paths do not get in each
+///   other's way.
+///
+/// @param [in,out] s The scan.
+/// @param root       Absolute scan path, owned by the shard from here on.
+///
+/// @return 1 on success, 0 on failure
+///-------------------------------------------------------------------------------------------------
+
+static int open_shard(MediaScan *s, char *root) {
+  CacheShard *shard;
+  char lockpath[MAX_PATH_STR_LEN];
+  int ret;
+
+  shard = (CacheShard *)calloc(sizeof(CacheShard), 1);
+  if (shard == NULL) {
+    FATAL("Out of memory for cache shard\n");
+    free(root);
+    return 0;
+  }
+  LOG_MEM("new CacheShard @ %p\n", shard);
+
+  shard->root = root;
+  shard->lock = -1;
+  s->_shards[s->_nshards++] = shard;
+
+  shard->dir = (char *)malloc(MAX_PATH_STR_LEN);
+  bdb_shard_dir(s, root, shard->dir);
+
+#ifdef WIN32
+  _mkdir(shard->dir);
+#else
+  mkdir(shard->dir, 0755);
+#endif
+
+  sprintf(lockpath, "%s/lock", shard->dir);
+  shard->lock = LockCacheFile(lockpath);
+  if (shard->lock == -1) {
+    LOG_ERROR("Cache for %s is in use by another scan\n", root);
+    return 0;
+  }
 
   // Create an environment object and initialize it for error reporting.
-  ret = db_env_create(&myEnv, 0);
+  ret = db_env_create(&shard->env, 0);
   if (ret != 0) {
     LOG_ERROR("Error creating database env handle: %s\n", db_strerror(ret));
     return 0;
   }
 
   // Open the environment.
-  ret = myEnv->open(myEnv,      // DB_ENV ptr
-                    s->cachedir ? s->cachedir : ".",  // env home directory
-                    DB_CREATE | DB_INIT_MPOOL,  // Open flags
-                    0);         // File mode (default)
+  ret = shard->env->open(shard->env,  // DB_ENV ptr
+                         shard->dir,  // env home directory
+                         DB_CREATE | DB_INIT_MPOOL, // Open flags
+                         0);    // File mode (default)
 
   if (ret != 0) {
     LOG_ERROR("Environment open failed: %s\n", db_strerror(ret));
     return 0;
   }
 
-  /* Initialize the structure. This
-   * database is opened in an environment,
-   * so the environment pointer is myEnv. */
-  ret = db_create(&s->dbp, myEnv, 0);
-  if (ret != 0) {
-    bdb_destroy(s);
-    ms_errno = MSENO_DBERROR;
-    LOG_ERROR("Database creation failed: %s", db_strerror(ret));
+  // path -> hash, used to skip unchanged files
+  // path -> packed result, used to reuse the data for moved files
+  // size/mtime -> identity and path of each cached file, may hold several files per key
+  // size/fingerprint -> path of each cached file, used to find copies of a file
+  // path/spec -> location of a thumbnail in the pack, kept across full scans
+  if (!open_bdb(s, shard, &shard->dbp, "libmediascan.db", 0, 0) ||
+      !open_bdb(s, shard, &shard->results_dbp, "libmediascan_results.db", 0, 0) ||
+      !open_bdb(s, shard, &shard->ident_dbp, "libmediascan_ident.db", DB_DUP, 0) ||
+      !open_bdb(s, shard, &shard->content_dbp, "libmediascan_content.db", DB_DUP, 0) ||
+      !open_bdb(s, shard, &shard->thumbs_dbp, "libmediascan_thumbs.db", 0, 1))
     return 0;
+
+  bdb_use_shard(s, shard);
+
+  return thumbpack_open(s);
+}                               /* open_shard() */
+
+int init_bdb(MediaScan *s) {
+  char legacy[MAX_PATH_STR_LEN];
+  int i, j;
+
+  if (s->_nshards)
+    return 1;
+
+  sprintf(legacy, "%s/%s", bdb_cachedir(s), LegacyFiles[0]);
+  if (bdb_file_exists(legacy))
+    LOG_WARN("%s is the cache of an older version and is no longer used, ms_cache_compact removes it\n", legacy);
+
+  for (i = 0; i < s->npaths; i++) {
+    char *root = bdb_scan_root(s->paths[i]);
+
+    if (root == NULL)
+      continue;
+
+    // A volume that is not mounted keeps its cache for when it comes back
+    if (!PathIsDirectory(root)) {
+      LOG_WARN("%s is not available, leaving its cache alone\n", root);
+      free(root);
+      continue;
+    }
+
+    for (j = 0; j < s->_nshards; j++) {
+      if (!strcmp(((CacheShard *)s->_shards[j])->root, root))
+        break;
+    }
+
+    if (j < s->_nshards) {
+      free(root);
+      continue;
+    }
+
+    if (!open_shard(s, root)) {
+      bdb_destroy(s);
+      ms_errno = MSENO_DBERROR;
+      return 0;
+    }
   }
 
-  /* open the database */
-  sprintf(dbpath, "%s/libmediascan.db", s->cachedir ? s->cachedir : ".");
+  bdb_use_shard(s, NULL);
 
-  if (s->flags & MS_FULL_SCAN) {
-    tmp_flags = DB_CREATE | DB_TRUNCATE;
+  return 1;
+}                               /* init_bdb() */
+
+void bdb_destroy(MediaScan *s) {
+  int i;
+
+  for (i = 0; i < s->_nshards; i++) {
+    CacheShard *shard = (CacheShard *)s->_shards[i];
+
+    if (shard->dbp != NULL)
+      shard->dbp->close(shard->dbp, 0);
+
+    if (shard->results_dbp != NULL)
+      shard->results_dbp->close(shard->results_dbp, 0);
+
+    if (shard->ident_dbp != NULL)
+      shard->ident_dbp->close(shard->ident_dbp, 0);
+
+    if (shard->content_dbp != NULL)
+      shard->content_dbp->close(shard->content_dbp, 0);
+
+    if (shard->thumbs_dbp != NULL)
+      shard->thumbs_dbp->close(shard->thumbs_dbp, 0);
+
+    bdb_use_shard(s, shard);
+    thumbpack_close(s);
+
+    if (shard->env != NULL)
+      shard->env->close(shard->env, DB_FORCESYNC);
+
+    if (shard->lock != -1)
+      UnlockCacheFile(shard->lock);
+
+    free(shard->root);
+    if (shard->dir)
+      free(shard->dir);
+
+    LOG_MEM("destroy CacheShard @ %p\n", shard);
+    free(shard);
+    s->_shards[i] = NULL;
   }
-  else {
-    tmp_flags = DB_CREATE;
-  };
 
-  ret = s->dbp->open(s->dbp,    /* DB structure pointer */
-                     NULL,      /* Transaction pointer */
-                     dbpath,    /* On-disk file that holds the database. */
-                     NULL,      /* Optional logical database name */
-                     DB_BTREE,  /* Database access method */
-                     tmp_flags, /* Open flags */
-                     0);        /* File mode (using defaults) */
+  s->_nshards = 0;
+  bdb_use_shard(s, NULL);
+}
 
-  if (ret != 0) {
-    bdb_destroy(s);
-    ms_errno = MSENO_DBERROR;
-    LOG_ERROR("Database open failed: %s\n", db_strerror(ret));
+// Remove one shard directory, unless it is in use or was used recently
+static int bdb_remove_shard(const char *dir) {
+  char path[MAX_PATH_STR_LEN];
+  struct stat st;
+  intptr_t lock;
+
+  // The counters in libmediascan.db are written by every scan
+  sprintf(path, "%s/%s", dir, ShardFiles[0]);
+  if (stat(path, &st) != 0) {
+    sprintf(path, "%s/lock", dir);
+    if (stat(path, &st) != 0)
+      return 0;
+  }
+
+  if (st.st_mtime > time(NULL) - SHARD_MAX_AGE)
+    return 0;
+
+  sprintf(path, "%s/lock", dir);
+  lock = LockCacheFile(path);
+  if (lock == -1)
+    return 0;
+
+  if (!bdb_remove_files(dir, ShardFiles)) {
+    UnlockCacheFile(lock);
     return 0;
   }
 
+  UnlockCacheFile(lock);
+  remove(path);
+
+#ifdef WIN32
+  _rmdir(dir);
+#else
+  rmdir(dir);
+#endif
+
+  LOG_INFO("Removed unused cache shard %s\n", dir);
+
   return 1;
-}                               /* init_bdb() */
+}                               /* bdb_remove_shard() */
 
-void bdb_destroy(MediaScan *s) {
-  if (s->dbp != NULL) {
-    s->dbp->close(s->dbp, 0);
-    s->dbp = NULL;
+// Remove an entry of cachedir if it is a stale shard that is not in keep
+static int bdb_remove_other_shard(const char *cachedir, const char *name, char **keep, int nkeep) {
+  char dir[MAX_PATH_STR_LEN];
+  int i;
+
+  if (strncmp(name, "shard-", 6))
+    return 0;
+
+  sprintf(dir, "%s/%s", cachedir, name);
+
+  for (i = 0; i < nkeep; i++) {
+    if (!strcmp(keep[i], dir))
+      return 0;
   }
 
-  if (myEnv != NULL) {
-    myEnv->close(myEnv, DB_FORCESYNC);
-    myEnv = NULL;
+  return PathIsDirectory(dir) ? bdb_remove_shard(dir) : 0;
+}                               /* bdb_remove_other_shard() */
+
+///-------------------------------------------------------------------------------------------------
+///  Remove the cache files of older versions from cachedir, and the shards of paths that are not
+///   scan paths of s and that no scan has used for SHARD_MAX_AGE. Shards in use are left alone.
+///
+/// @param [in,out] s The scan.
+///
+/// @return The number of shards removed.
+///-------------------------------------------------------------------------------------------------
+
+int bdb_remove_stale(MediaScan *s) {
+  const char *cachedir = bdb_cachedir(s);
+  char *keep[MAX_PATHS];
+  char dir[MAX_PATH_STR_LEN];
+  int nkeep = 0;
+  int removed = 0;
+  int i;
+#ifdef WIN32
+  WIN32_FIND_DATA ffd;
+  HANDLE hFind;
+#else
+  DIR *dirp;
+  struct dirent *dp;
+#endif
+
+  sprintf(dir, "%s/%s", cachedir, LegacyFiles[0]);
+  if (bdb_file_exists(dir)) {
+    if (bdb_remove_files(cachedir, LegacyFiles)) {
+      LOG_INFO("Removed the cache of an older version from %s\n", cachedir);
+    }
+    else {
+      LOG_WARN("The cache of an older version in %s is in use, leaving it alone\n", cachedir);
+    }
   }
-}
+
+  // The shards of all scan paths are kept, including those of volumes that are not available
+  for (i = 0; i < s->npaths; i++) {
+    char *root = bdb_scan_root(s->paths[i]);
+
+    if (root == NULL)
+      continue;
+
+    keep[nkeep] = (char *)malloc(MAX_PATH_STR_LEN);
+    bdb_shard_dir(s, root, keep[nkeep]);
+    nkeep++;
+    free(root);
+  }
+
+#ifdef WIN32
+  sprintf(dir, "%s\\shard-*", cachedir);
+  hFind = FindFirstFile(dir, &ffd);
+  if (hFind != INVALID_HANDLE_VALUE) {
+    do {
+      removed += bdb_remove_other_shard(cachedir, ffd.cFileName, keep, nkeep);
+    } while (FindNextFile(hFind, &ffd) != 0);
+
+    FindClose(hFind);
+  }
+#else
+  if ((dirp = opendir(cachedir)) != NULL) {
+    while ((dp = readdir(dirp)) != NULL)
+      removed += bdb_remove_other_shard(cachedir, dp->d_name, keep, nkeep);
+
+    closedir(dirp);
+  }
+#endif
+
+  for (i = 0; i < nkeep; i++)
+    free(keep[i]);
+
+  return removed;
+}                               /* bdb_remove_stale() */
@@ -1,9 +1,33 @@
-
 #ifndef DATABASE_H
 #define DATABASE_H
 
+// The cache of one scan path, in its own directory in cachedir
+struct _CacheShard {
+  char *root;                   // absolute scan path
+  char *dir;                    // shard directory
+  DB_ENV *env;
+  DB *dbp;
+  DB *results_dbp;
+  DB *ident_dbp;
+  DB *content_dbp;
+  DB *thumbs_dbp;
+  FILE *thumbpack;              // thumbnail pack file
+  intptr_t lock;                // held while the shard is open
+
+  // cache counters for the current scan
+  int hits;
+  int misses;
+  int inserts;
+};
+typedef struct _CacheShard CacheShard;
+
 int init_bdb(MediaScan *s);
 void reset_bdb(MediaScan *s);
 void bdb_destroy(MediaScan *s);
+int bdb_remove_stale(MediaScan *s);
+void bdb_use_shard(MediaScan *s, CacheShard *shard);
+void bdb_select_shard(MediaScan *s, const char *path);
+char *bdb_scan_root(const char *path);
+int bdb_path_in_root(const char *path, const char *root);
 
 #endif
@@ -40,6 +40,8 @@ static void HandleRemovedFile(MediaScan *s, const char *filename) {
   key.data = (char *)filename;
   key.size = strlen(filename) + 1;
 
+  bdb_select_shard(s, filename);
+
   if (s->dbp != NULL) {
 
     if ((ret = s->dbp->get(s->dbp, NULL, &key, &data, 0)) == 0) {
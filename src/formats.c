@@ -0,0 +1,143 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\formats.c
+//
+// summary: Lookup of the FFmpeg demuxer for a file extension, used with MS_USE_EXTENSION. The
+//          table is built once per process from all registered demuxers, so picking the format
+//          of a file is a single hash lookup instead of matching every demuxer's extension list.
+///-------------------------------------------------------------------------------------------------
+
+#include <ctype.h>
+#include <string.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libavformat/avformat.h>
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "formats.h"
+#include "util.h"
+
+#define FORMATS_TABLE_SIZE 1024       // power of 2, well above the number of extensions FFmpeg knows
+#define FORMATS_EXT_LEN 16
+
+typedef struct {
+  char ext[FORMATS_EXT_LEN];          // lowercased, empty if the slot is free
+  AVInputFormat *iformat;
+} FormatEntry;
+
+static FormatEntry FormatTable[FORMATS_TABLE_SIZE];
+static int FormatCount = 0;
+static int FormatsInitialized = 0;
+
+// Lowercase an extension into buf, returns its length or 0 if it can't be in the table
+static int formats_key(const char *ext, size_t len, char *buf) {
+  size_t i;
+
+  if (len == 0 || len >= FORMATS_EXT_LEN)
+    return 0;
+
+  for (i = 0; i < len; i++)
+    buf[i] = tolower((unsigned char)ext[i]);
+  buf[len] = '\0';
+
+  return (int)len;
+}                               /* formats_key() */
+
+static FormatEntry *formats_slot(const char *key, int len) {
+  uint32_t h = hashlittle(key, len, 0) & (FORMATS_TABLE_SIZE - 1);
+
+  while (FormatTable[h].ext[0] && strcmp(FormatTable[h].ext, key))
+    h = (h + 1) & (FORMATS_TABLE_SIZE - 1);
+
+  return &FormatTable[h];
+}                               /* formats_slot() */
+
+// Add each extension of a comma separated list. The first demuxer to claim an extension keeps it,
+// the same one av_match_ext would find first when walking the demuxers in order.
+static void formats_add(const char *list, AVInputFormat *iformat) {
+  char key[FORMATS_EXT_LEN];
+  FormatEntry *e;
+  const char *p;
+  int len;
+
+  while (*list) {
+    p = strchr(list, ',');
+    if (p == NULL)
+      p = list + strlen(list);
+
+    len = formats_key(list, p - list, key);
+    if (len) {
+      if (FormatCount >= FORMATS_TABLE_SIZE * 3 / 4) {
+        LOG_WARN("Demuxer extension table is full, not adding %s\n", key);
+        return;
+      }
+
+      e = formats_slot(key, len);
+      if (!e->ext[0]) {
+        strcpy(e->ext, key);
+        e->iformat = iformat;
+        FormatCount++;
+      }
+    }
+
+    list = *p ? p + 1 : p;
+  }
+}                               /* formats_add() */
+
+///-------------------------------------------------------------------------------------------------
+///  Build the extension table from all registered demuxers. Called once per process from _init().
+///-------------------------------------------------------------------------------------------------
+
+void formats_init(void) {
+  AVInputFormat *iformat;
+  void *i = 0;
+
+  if (FormatsInitialized)
+    return;
+
+  // Demuxer names are matched as extensions too, like "mov,mp4,m4a,3gp,3g2,mj2"
+  while ((iformat = (AVInputFormat *)av_demuxer_iterate(&i))) {
+    formats_add(iformat->name, iformat);
+
+    if (iformat->extensions)
+      formats_add(iformat->extensions, iformat);
+  }
+
+  FormatsInitialized = 1;
+
+  LOG_DEBUG("Demuxer extension table has %d entries\n", FormatCount);
+}                               /* formats_init() */
+
+///-------------------------------------------------------------------------------------------------
+///  Find the demuxer for a file by its extension.
+///
+/// @param path Full pathname of the file.
+///
+/// @return The demuxer, or NULL if no demuxer claims the extension.
+///-------------------------------------------------------------------------------------------------
+
+AVInputFormat *formats_find(const char *path) {
+  char key[FORMATS_EXT_LEN];
+  const char *ext;
+  FormatEntry *e;
+  int len;
+
+  formats_init();
+
+  ext = strrchr(path, '.');
+  if (ext == NULL)
+    return NULL;
+
+  ext++;
+  len = formats_key(ext, strlen(ext), key);
+  if (!len)
+    return NULL;
+
+  e = formats_slot(key, len);
+
+  return e->ext[0] ? e->iformat : NULL;
+}                               /* formats_find() */
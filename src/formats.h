@@ -0,0 +1,7 @@
+#ifndef _FORMATS_H
+#define _FORMATS_H
+
+void formats_init(void);
+AVInputFormat *formats_find(const char *path);
+
+#endif // _FORMATS_H
@@ -7,12 +7,13 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_bmp.h"
+#include "pixconv.h"
 
 typedef struct BMPData {
   int flipped;
   int bpp;
   int compression;
-  int palette_colors[256];
+  uint32_t palette_colors[256];
   Buffer *buf;
   FILE *fp;
 } BMPData;
@@ -204,11 +205,35 @@ int image_bmp_load(MediaScanImage *i) {
 
   y = starty;
 
+  // Whole rows of the depths with a converter
+  if (bmp->bpp == 32 || bmp->bpp == 24 || bmp->bpp == 8) {
+    for (; y != lasty; y += incy) {
+      // The row and its padding
+      if (!buffer_check_load(bmp->buf, bmp->fp, linebytes, BUF_SIZE)) {
+        image_bmp_destroy(i);
+        LOG_WARN("Unable to read entire BMP file (%s)\n", i->path);
+        return 0;
+      }
+
+      bptr = buffer_ptr(bmp->buf);
+
+      if (bmp->bpp == 32)       // XXX how to detect alpha channel?
+        pixconv_bgrx(bptr, i->_pixbuf + y * i->width, i->width);
+      else if (bmp->bpp == 24)  // 24-bit BGR
+        pixconv_bgr(bptr, i->_pixbuf + y * i->width, i->width);
+      else
+        pixconv_palette(bptr, i->_pixbuf + y * i->width, i->width, bmp->palette_colors);
+
+      buffer_consume(bmp->buf, linebytes);
+    }
+  }
+
   if (bmp->bpp == 1)
     mask = 0x80;
   else if (bmp->bpp == 4)
     mask = 0xF0;
 
+  // The other depths a pixel at a time
   while (y != lasty) {
     for (x = 0; x < i->width; x++) {
       if (blen <= 0 || blen < bmp->bpp / 8) {
@@ -232,21 +257,6 @@ int image_bmp_load(MediaScanImage *i) {
       j = x + (y * i->width);
 
       switch (bmp->bpp) {
-        case 32:               // XXX how to detect alpha channel?
-          //im->pixbuf[i] = COL_FULL(bptr[offset+2], bptr[offset+1], bptr[offset], bptr[offset+3]);
-          i->_pixbuf[j] = COL(bptr[offset + 2], bptr[offset + 1], bptr[offset]);
-          offset += 4;
-          blen -= 4;
-          linebytes -= 4;
-          break;
-
-        case 24:               // 24-bit BGR
-          i->_pixbuf[j] = COL(bptr[offset + 2], bptr[offset + 1], bptr[offset]);
-          offset += 3;
-          blen -= 3;
-          linebytes -= 3;
-          break;
-
         case 16:
           {
             int p = (bptr[offset + 1] << 8) | bptr[offset];
@@ -270,13 +280,6 @@ int image_bmp_load(MediaScanImage *i) {
             break;
           }
 
-        case 8:
-          i->_pixbuf[j] = bmp->palette_colors[bptr[offset]];
-          offset++;
-          blen--;
-          linebytes--;
-          break;
-
         case 4:
           // uncompressed
           if (mask == 0xF0) {
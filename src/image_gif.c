@@ -9,6 +9,7 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_gif.h"
+#include "pixconv.h"
 
 typedef struct GIFData {
   Buffer *buf;
@@ -68,7 +69,7 @@ int image_gif_read_header(MediaScanImage *i, MediaScanResult *r, int is_gif89) {
 }
 
 int image_gif_load(MediaScanImage *i) {
-  int x, y, ofs;
+  int x, ofs;
   GifRecordType RecordType;
   GifPixelType *line = NULL;
   int ExtFunction = 0;
@@ -79,6 +80,7 @@ int image_gif_load(MediaScanImage *i) {
   int trans_index = 0;          // transparent index if any
   ColorMapObject *ColorMap;
   GifColorType *ColorMapEntry;
+  uint32_t palette[256];        // pixel of each color index
   int ret = 1;
 
   GIFData *g = (GIFData *)i->_gif;
@@ -114,6 +116,14 @@ int image_gif_load(MediaScanImage *i) {
           goto err;
         }
 
+        // Each color with its alpha, unused indexes are transparent black
+        memset(palette, 0, sizeof(palette));
+        for (x = 0; x < ColorMap->ColorCount && x < 256; x++) {
+          ColorMapEntry = &ColorMap->Colors[x];
+          palette[x] = COL_FULL(ColorMapEntry->Red, ColorMapEntry->Green, ColorMapEntry->Blue,
+                                trans_index == x ? 0 : 255);
+        }
+
         // Allocate storage for decompressed image
         if (!i->_pixbuf_size)
           image_alloc_pixbuf(i, i->width, i->height);
@@ -131,12 +141,7 @@ int image_gif_load(MediaScanImage *i) {
                 goto err;
               }
 
-              for (y = 0; y < i->width; y++) {
-                ColorMapEntry = &ColorMap->Colors[line[y]];
-                i->_pixbuf[ofs++] = COL_FULL(ColorMapEntry->Red,
-                                             ColorMapEntry->Green,
-                                             ColorMapEntry->Blue, trans_index == line[y] ? 0 : 255);
-              }
+              pixconv_palette(line, i->_pixbuf + ofs, i->width, palette);
             }
           }
         }
@@ -148,11 +153,8 @@ int image_gif_load(MediaScanImage *i) {
               goto err;
             }
 
-            for (y = 0; y < i->width; y++) {
-              ColorMapEntry = &ColorMap->Colors[line[y]];
-              i->_pixbuf[ofs++] = COL_FULL(ColorMapEntry->Red,
-                                           ColorMapEntry->Green, ColorMapEntry->Blue, trans_index == line[y] ? 0 : 255);
-            }
+            pixconv_palette(line, i->_pixbuf + ofs, i->width, palette);
+            ofs += i->width;
           }
         }
 
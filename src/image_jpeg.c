@@ -15,6 +15,7 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_jpeg.h"
+#include "pixconv.h"
 #include "tag.h"
 #include "result.h"
 
@@ -23,6 +24,19 @@
 
 #define DEFAULT_JPEG_QUALITY 90
 
+// Scanlines decoded per jpeg_read_scanlines() call when they have to be converted
+#define JPEG_BATCH_LINES 16
+
+// libjpeg-turbo can decode straight into the pixbuf, in the byte order of a pixel in memory
+// with alpha set to 0xFF, so only CMYK and grayscale images need converting
+#ifdef JCS_ALPHA_EXTENSIONS
+# if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#  define JPEG_PIXBUF_COLOR_SPACE JCS_EXT_RGBA
+# else
+#  define JPEG_PIXBUF_COLOR_SPACE JCS_EXT_ABGR
+# endif
+#endif
+
 // Forward declarations
 static void parse_exif_ifd(ExifContent * content, void *data);
 static void parse_exif_entry(ExifEntry * e, void *data);
@@ -92,6 +106,8 @@ char Filename[FILENAME_LEN + 1];
 typedef struct JPEGData {
   struct jpeg_decompress_struct *cinfo;
   struct jpeg_error_mgr *jpeg_error_pub;
+  Buffer *exif_thumb;           // JPEG thumbnail embedded in the EXIF block, if any
+  MediaScan *scan;              // Scan whose thumbnail specs the EXIF thumbnail must be large enough for
 } JPEGData;
 
 jmp_buf setjmp_buffer;
@@ -169,9 +185,7 @@ static void buf_src_term_source(j_decompress_ptr cinfo) {
   // Nothing
 }
 
-static void image_jpeg_buf_src(MediaScanImage *i, MediaScanResult *r) {
-  JPEGData *j = (JPEGData *)i->_jpeg;
-  j_decompress_ptr cinfo = (j_decompress_ptr)j->cinfo;
+static void image_jpeg_buf_src(j_decompress_ptr cinfo, Buffer *buf, FILE *fp) {
   buf_src_mgr *src;
 
   if (cinfo->src == NULL) {
@@ -181,8 +195,8 @@ static void image_jpeg_buf_src(MediaScanImage *i, MediaScanResult *r) {
 
   src = (buf_src_mgr *)cinfo->src;
 
-  src->buf = (Buffer *)r->_buf;
-  src->fp = r->_fp;
+  src->buf = buf;
+  src->fp = fp;
 
   src->jsrc.init_source = buf_src_init;
   src->jsrc.fill_input_buffer = buf_src_fill_input_buffer;
@@ -280,6 +294,8 @@ int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
   j->jpeg_error_pub = malloc(sizeof(struct jpeg_error_mgr));
   LOG_MEM("new JPEG cinfo @ %p\n", j->cinfo);
   LOG_MEM("new JPEG error_pub @ %p\n", j->jpeg_error_pub);
+  j->exif_thumb = NULL;
+  j->scan = (MediaScan *)r->_scan;
 
   j->cinfo->err = jpeg_std_error(j->jpeg_error_pub);
   j->jpeg_error_pub->error_exit = libjpeg_error_handler;
@@ -298,7 +314,7 @@ int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
   jpeg_create_decompress(j->cinfo);
 
   // Init custom source manager to read from existing buffer
-  image_jpeg_buf_src(i, r);
+  image_jpeg_buf_src(j->cinfo, (Buffer *)r->_buf, r->_fp);
 
   // Save APP1 marker for EXIF
   jpeg_save_markers(j->cinfo, 0xE1, 1024 * 64);
@@ -334,6 +350,15 @@ int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
         LOG_MEM("new EXIF data @ %p\n", exif);
         if (exif != NULL) {
           exif_data_foreach_content(exif, parse_exif_ifd, (void *)r);
+
+          // Keep the thumbnail, small thumbnails can be made from it
+          if (exif->size > 2 && exif->data[0] == 0xFF && exif->data[1] == 0xD8) {
+            j->exif_thumb = (Buffer *)malloc(sizeof(Buffer));
+            buffer_init(j->exif_thumb, exif->size);
+            buffer_append(j->exif_thumb, exif->data, exif->size);
+            LOG_MEM("new EXIF thumbnail buffer @ %p\n", j->exif_thumb);
+          }
+
           LOG_MEM("destroy EXIF data @ %p\n", exif);
           exif_data_free(exif);
         }
@@ -348,13 +373,216 @@ int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
   return ret;
 }
 
+// Pick the smallest DCT scale M/8 whose output still covers width x height. libjpeg-turbo and
+// libjpeg 7+ scale by any M/8, libjpeg 6b rounds M/8 up to 1/8, 1/4, 1/2 or 1.
+static void image_jpeg_scale(j_decompress_ptr cinfo, int width, int height) {
+  unsigned int m;
+
+  for (m = 1; m <= 8; m++) {
+    cinfo->scale_num = m;
+    cinfo->scale_denom = 8;
+    jpeg_calc_output_dimensions(cinfo);
+
+    if ((int)cinfo->output_width >= width && (int)cinfo->output_height >= height)
+      return;
+  }
+}                               /* image_jpeg_scale() */
+
+// Decompress into a new pixbuf the size of the output of cinfo. ptr is the caller's, so it can
+// free the row buffer if libjpeg fails.
+static void image_jpeg_decode(j_decompress_ptr cinfo, MediaScanImage *i, unsigned char **ptr) {
+  int w, h, y;
+  JSAMPROW *rows;
+  void (*convert) (const uint8_t *src, uint32_t *dst, int width);
+
+#ifdef JPEG_PIXBUF_COLOR_SPACE
+  if (cinfo->jpeg_color_space == JCS_YCbCr || cinfo->jpeg_color_space == JCS_RGB)
+    cinfo->out_color_space = JPEG_PIXBUF_COLOR_SPACE;
+#endif
+
+  jpeg_start_decompress(cinfo);
+
+  w = cinfo->output_width;
+  h = cinfo->output_height;
+
+  // Allocate storage for decompressed image
+  image_alloc_pixbuf(i, w, h);
+
+  if (cinfo->output_components == 3)  // RGB
+    convert = pixconv_rgb;
+  else if (cinfo->output_components == 4)  // CMYK inverted (Photoshop)
+    convert = pixconv_cmyk_inverted;
+  else                          // grayscale
+    convert = pixconv_gray;
+
+#ifdef JPEG_PIXBUF_COLOR_SPACE
+  if (cinfo->out_color_space == JPEG_PIXBUF_COLOR_SPACE)
+    convert = NULL;
+#endif
+
+  if (convert == NULL) {
+    // Scanlines straight into the pixbuf
+    *ptr = (unsigned char *)malloc(h * sizeof(JSAMPROW));
+    LOG_MEM("new JPEG load ptr @ %p\n", *ptr);
+
+    rows = (JSAMPROW *)*ptr;
+    for (y = 0; y < h; y++)
+      rows[y] = (JSAMPROW)&i->_pixbuf[y * w];
+
+    while (cinfo->output_scanline < cinfo->output_height)
+      jpeg_read_scanlines(cinfo, &rows[cinfo->output_scanline], h - cinfo->output_scanline);
+  }
+  else {
+    // Batches of scanlines into a buffer, then converted into the pixbuf
+    int stride = w * cinfo->output_components;
+    int lines;
+
+    *ptr = (unsigned char *)malloc(JPEG_BATCH_LINES * (sizeof(JSAMPROW) + stride));
+    LOG_MEM("new JPEG load ptr @ %p\n", *ptr);
+
+    rows = (JSAMPROW *)*ptr;
+    for (y = 0; y < JPEG_BATCH_LINES; y++)
+      rows[y] = *ptr + JPEG_BATCH_LINES * sizeof(JSAMPROW) + y * stride;
+
+    while (cinfo->output_scanline < cinfo->output_height) {
+      int ofs = cinfo->output_scanline * w;
+
+      lines = jpeg_read_scanlines(cinfo, rows, JPEG_BATCH_LINES);
+      for (y = 0; y < lines; y++)
+        convert(rows[y], i->_pixbuf + ofs + y * w, w);
+    }
+  }
+
+  LOG_MEM("destroy JPEG load ptr @ %p\n", *ptr);
+  free(*ptr);
+  *ptr = NULL;
+
+  jpeg_finish_decompress(cinfo);
+}                               /* image_jpeg_decode() */
+
+// Size of the largest thumbnail of i for spec, before it is rotated, as thumb_geometry() works it out
+static void image_jpeg_thumb_size(MediaScanImage *i, MediaScanThumbSpec *spec, int *width, int *height) {
+  int sw = i->orientation >= 5 ? spec->height : spec->width;
+  int sh = i->orientation >= 5 ? spec->width : spec->height;
+
+  if (!sh)
+    sh = (int)((float)i->height / i->width * sw);
+  else if (!sw)
+    sw = (int)((float)i->width / i->height * sh);
+  else if (spec->keep_aspect) {
+    if ((float)i->width / i->height >= (float)sw / sh)
+      sh = (int)((float)sw * i->height / i->width);
+    else
+      sw = (int)((float)sh * i->width / i->height);
+  }
+
+  *width = sw;
+  *height = sh;
+}                               /* image_jpeg_thumb_size() */
+
+///-------------------------------------------------------------------------------------------------
+///  Load the thumbnail embedded in the EXIF block instead of the image, if it is large enough for
+///   every thumbnail spec of the scan and has the aspect ratio of the image. Cameras often
+///   letterbox a 160x120 thumbnail of a 3:2 photo, such a thumbnail is not used.
+///
+/// @param i    The image, its header read.
+///
+/// @return 0 if the image has to be decompressed.
+///-------------------------------------------------------------------------------------------------
+
+static int image_jpeg_load_exif_thumb(MediaScanImage *i) {
+  JPEGData *j = (JPEGData *)i->_jpeg;
+  MediaScan *s = j->scan;
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  unsigned char *ptr = NULL;
+  int w = 0, h = 0, tw, th, x, ret = 0;
+  int64_t skew;
+
+  if (s == NULL)
+    return 0;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jerr.error_exit = libjpeg_error_handler;
+  jerr.output_message = libjpeg_output_message;
+
+  jpeg_create_decompress(&cinfo);
+
+  if (setjmp(setjmp_buffer)) {
+    // A broken thumbnail, decompress the image instead
+    if (ptr != NULL) {
+      LOG_MEM("destroy JPEG load ptr @ %p\n", ptr);
+      free(ptr);
+    }
+    image_free_pixbuf(i);
+    goto out;
+  }
+
+  image_jpeg_buf_src(&cinfo, j->exif_thumb, NULL);
+  jpeg_read_header(&cinfo, TRUE);
+
+  tw = cinfo.image_width;
+  th = cinfo.image_height;
+
+  // Any spec may be the largest in one dimension, storyboards are not made of images
+  for (x = 0; x < s->nthumbspecs; x++) {
+    int sw, sh;
+
+    if (s->thumbspecs[x]->frames)
+      continue;
+
+    image_jpeg_thumb_size(i, s->thumbspecs[x], &sw, &sh);
+    w = MAX(w, sw);
+    h = MAX(h, sh);
+  }
+
+  // Pixel counts of a large image overflow an int when multiplied
+  skew = (int64_t)tw * i->height - (int64_t)th * i->width;
+  if (skew < 0)
+    skew = -skew;
+
+  if (!w || tw < w || th < h || skew > MAX(i->width, i->height)) {
+    LOG_DEBUG("Not using the %d x %d EXIF thumbnail for a %d x %d thumbnail of %d x %d\n",
+              tw, th, w, h, i->width, i->height);
+    goto out;
+  }
+
+  image_jpeg_decode(&cinfo, i, &ptr);
+
+  // A truncated or corrupt thumbnail only gives warnings, but is missing pixels
+  if (jerr.num_warnings) {
+    image_free_pixbuf(i);
+    goto out;
+  }
+
+  LOG_DEBUG("Using the %d x %d EXIF thumbnail for a %d x %d thumbnail of %d x %d\n",
+            tw, th, w, h, i->width, i->height);
+
+  // Change the original values to the size of the thumbnail
+  i->width = tw;
+  i->height = th;
+  ret = 1;
+
+out:
+  jpeg_destroy_decompress(&cinfo);
+
+  return ret;
+}                               /* image_jpeg_load_exif_thumb() */
+
 int image_jpeg_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint) {
-  float scale_factor;
-  int x, w, h, ofs;
-  unsigned char *line[1], *ptr = NULL;
+  unsigned char *ptr = NULL;
 
   JPEGData *j = (JPEGData *)i->_jpeg;
 
+  // Save filename in case any warnings/errors occur
+  strncpy(Filename, i->path, FILENAME_LEN);
+  if (strlen(i->path) > FILENAME_LEN)
+    Filename[FILENAME_LEN] = 0;
+
+  // Small thumbnails can be made without decompressing the image at all
+  if (j->exif_thumb && image_jpeg_load_exif_thumb(i))
+    return 1;
+
   if (setjmp(setjmp_buffer)) {
     // See if we have partially decoded an image and hit a fatal error, but still have a usable image
     if (ptr != NULL) {
@@ -388,80 +616,20 @@ int image_jpeg_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint) {
   j->cinfo->do_fancy_upsampling = FALSE;
   j->cinfo->do_block_smoothing = FALSE;
 
-  // Choose optimal scaling factor
-  jpeg_calc_output_dimensions(j->cinfo);
-  scale_factor = (float)j->cinfo->output_width / spec_hint->width;
-  if (scale_factor > ((float)j->cinfo->output_height / spec_hint->height))
-    scale_factor = (float)j->cinfo->output_height / spec_hint->height;
-  if (scale_factor > 1) {       // Avoid divide by 0
-    j->cinfo->scale_denom *= (unsigned int)scale_factor;
-    jpeg_calc_output_dimensions(j->cinfo);
-  }
-
-  w = j->cinfo->output_width;
-  h = j->cinfo->output_height;
+  // Choose optimal scaling factor, the spec is for the image as displayed
+  if (i->orientation >= 5)
+    image_jpeg_scale(j->cinfo, spec_hint->height, spec_hint->width);
+  else
+    image_jpeg_scale(j->cinfo, spec_hint->width, spec_hint->height);
 
   // Change the original values to the scaled size
-  i->width = w;
-  i->height = h;
+  i->width = j->cinfo->output_width;
+  i->height = j->cinfo->output_height;
 
   LOG_DEBUG("Using JPEG scale factor %d/%d, new source dimensions %d x %d\n",
-            j->cinfo->scale_num, j->cinfo->scale_denom, w, h);
+            j->cinfo->scale_num, j->cinfo->scale_denom, i->width, i->height);
 
-  // Save filename in case any warnings/errors occur
-  strncpy(Filename, i->path, FILENAME_LEN);
-  if (strlen(i->path) > FILENAME_LEN)
-    Filename[FILENAME_LEN] = 0;
-
-  // Note: I tested libjpeg-turbo's JCS_EXT_XBGR but it writes zeros
-  // instead of FF for alpha, doesn't support CMYK, etc
-
-  jpeg_start_decompress(j->cinfo);
-
-  // Allocate storage for decompressed image
-  image_alloc_pixbuf(i, w, h);
-
-  ofs = 0;
-
-  ptr = (unsigned char *)malloc(w * j->cinfo->output_components);
-  line[0] = ptr;
-  LOG_MEM("new JPEG load ptr @ %p\n", ptr);
-
-  if (j->cinfo->output_components == 3) { // RGB
-    while (j->cinfo->output_scanline < j->cinfo->output_height) {
-      jpeg_read_scanlines(j->cinfo, line, 1);
-      for (x = 0; x < w; x++) {
-        i->_pixbuf[ofs++] = COL(ptr[x + x + x], ptr[x + x + x + 1], ptr[x + x + x + 2]);
-      }
-    }
-  }
-  else if (j->cinfo->output_components == 4) {  // CMYK inverted (Photoshop)
-    while (j->cinfo->output_scanline < j->cinfo->output_height) {
-      JSAMPROW row = *line;
-      jpeg_read_scanlines(j->cinfo, line, 1);
-      for (x = 0; x < w; x++) {
-        int c = *row++;
-        int m = *row++;
-        int y = *row++;
-        int k = *row++;
-
-        i->_pixbuf[ofs++] = COL((c * k) / MAXJSAMPLE, (m * k) / MAXJSAMPLE, (y * k) / MAXJSAMPLE);
-      }
-    }
-  }
-  else {                        // grayscale
-    while (j->cinfo->output_scanline < j->cinfo->output_height) {
-      jpeg_read_scanlines(j->cinfo, line, 1);
-      for (x = 0; x < w; x++) {
-        i->_pixbuf[ofs++] = COL(ptr[x], ptr[x], ptr[x]);
-      }
-    }
-  }
-
-  LOG_MEM("destroy JPEG load ptr @ %p\n", ptr);
-  free(ptr);
-
-  jpeg_finish_decompress(j->cinfo);
+  image_jpeg_decode(j->cinfo, i, &ptr);
 
   return 1;
 }
@@ -473,13 +641,13 @@ int image_jpeg_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
   struct jpeg_error_mgr jerr;
   struct buf_dst_mgr dst;
   int quality = spec->jpeg_quality;
-  int x;
 #ifdef JCS_EXTENSIONS
   JSAMPROW *data = NULL;
+  int x;
 #else
   volatile unsigned char *data = NULL;  // volatile = won't be rolled back if longjmp is called
   JSAMPROW row_pointer[1];
-  int y, row_stride;
+  int row_stride;
 #endif
 
   if (!i->_pixbuf_size) {
@@ -535,14 +703,8 @@ int image_jpeg_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
   data = (unsigned char *)malloc(row_stride);
   LOG_MEM("new JPEG data row @ %p\n", data);
 
-  y = 0;
   while (cinfo.next_scanline < cinfo.image_height) {
-    for (x = 0; x < cinfo.image_width; x++) {
-      data[x + x + x] = COL_RED(i->_pixbuf[y]);
-      data[x + x + x + 1] = COL_GREEN(i->_pixbuf[y]);
-      data[x + x + x + 2] = COL_BLUE(i->_pixbuf[y]);
-      y++;
-    }
+    pixconv_to_rgb(i->_pixbuf + cinfo.next_scanline * i->width, (uint8_t *)data, i->width);
     row_pointer[0] = (unsigned char *)data;
     jpeg_write_scanlines(&cinfo, row_pointer, 1);
   }
@@ -571,6 +733,12 @@ void image_jpeg_destroy(MediaScanImage *i) {
     LOG_MEM("destroy JPEG error_pub @ %p\n", j->jpeg_error_pub);
     free(j->jpeg_error_pub);
 
+    if (j->exif_thumb) {
+      buffer_free(j->exif_thumb);
+      LOG_MEM("destroy EXIF thumbnail buffer @ %p\n", j->exif_thumb);
+      free(j->exif_thumb);
+    }
+
     LOG_MEM("destroy JPEGData @ %p\n", i->_jpeg);
     free(i->_jpeg);
     i->_jpeg = NULL;
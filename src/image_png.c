@@ -7,6 +7,7 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_png.h"
+#include "pixconv.h"
 
 #include "libdlna/dlna_internals.h"
 #include "libdlna/profiles.h"
@@ -144,9 +145,15 @@ image_png_interlace_pass_gray(MediaScanImage *i, unsigned char *ptr,
     png_read_row(p->png_ptr, ptr, NULL);
     if (start_y == 0) {
       start_y = stride_y;
-      for (x = start_x; x < i->width; x += stride_x) {
-        i->_pixbuf[y * i->width + x] = COL_FULL(ptr[x * 2], ptr[x * 2], ptr[x * 2], ptr[x * 2 + 1]
-          );
+      // The last pass fills whole rows
+      if (stride_x == 1) {
+        pixconv_gray_alpha(ptr, i->_pixbuf + y * i->width, i->width);
+      }
+      else {
+        for (x = start_x; x < i->width; x += stride_x) {
+          i->_pixbuf[y * i->width + x] = COL_FULL(ptr[x * 2], ptr[x * 2], ptr[x * 2], ptr[x * 2 + 1]
+            );
+        }
       }
     }
     start_y--;
@@ -162,9 +169,15 @@ image_png_interlace_pass(MediaScanImage *i, unsigned char *ptr, int start_y, int
     png_read_row(p->png_ptr, ptr, NULL);
     if (start_y == 0) {
       start_y = stride_y;
-      for (x = start_x; x < i->width; x += stride_x) {
-        i->_pixbuf[y * i->width + x] = COL_FULL(ptr[x * 4], ptr[x * 4 + 1], ptr[x * 4 + 2], ptr[x * 4 + 3]
-          );
+      // The last pass fills whole rows
+      if (stride_x == 1) {
+        pixconv_rgba(ptr, i->_pixbuf + y * i->width, i->width);
+      }
+      else {
+        for (x = start_x; x < i->width; x += stride_x) {
+          i->_pixbuf[y * i->width + x] = COL_FULL(ptr[x * 4], ptr[x * 4 + 1], ptr[x * 4 + 2], ptr[x * 4 + 3]
+            );
+        }
       }
     }
     start_y--;
@@ -172,7 +185,7 @@ image_png_interlace_pass(MediaScanImage *i, unsigned char *ptr, int start_y, int
 }
 
 int image_png_load(MediaScanImage *i) {
-  int bit_depth, color_type, num_passes, x, y;
+  int bit_depth, color_type, num_passes, y;
   int ofs;
   volatile unsigned char *ptr = NULL; // volatile = won't be rolled back if longjmp is called
   PNGData *p = (PNGData *)i->_png;
@@ -225,9 +238,8 @@ int image_png_load(MediaScanImage *i) {
     if (num_passes == 1) {      // Non-interlaced
       for (y = 0; y < i->height; y++) {
         png_read_row(p->png_ptr, (unsigned char *)ptr, NULL);
-        for (x = 0; x < i->width; x++) {
-          i->_pixbuf[ofs++] = COL_FULL(ptr[x * 2], ptr[x * 2], ptr[x * 2], ptr[x * 2 + 1]);
-        }
+        pixconv_gray_alpha((const uint8_t *)ptr, i->_pixbuf + ofs, i->width);
+        ofs += i->width;
       }
     }
     else if (num_passes == 7) { // Interlaced
@@ -244,9 +256,8 @@ int image_png_load(MediaScanImage *i) {
     if (num_passes == 1) {      // Non-interlaced
       for (y = 0; y < i->height; y++) {
         png_read_row(p->png_ptr, (unsigned char *)ptr, NULL);
-        for (x = 0; x < i->width; x++) {
-          i->_pixbuf[ofs++] = COL_FULL(ptr[x * 4], ptr[x * 4 + 1], ptr[x * 4 + 2], ptr[x * 4 + 3]);
-        }
+        pixconv_rgba((const uint8_t *)ptr, i->_pixbuf + ofs, i->width);
+        ofs += i->width;
       }
     }
     else if (num_passes == 7) { // Interlaced
@@ -306,7 +317,7 @@ static void image_png_flush_buf(png_structp png_ptr) {
 }
 
 int image_png_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
-  int j, x, y;
+  int y;
   int color_space = PNG_COLOR_TYPE_RGB_ALPHA;
   volatile unsigned char *ptr = NULL;
   png_structp png_ptr;
@@ -363,29 +374,12 @@ int image_png_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
 
   ptr = (unsigned char *)malloc(png_get_rowbytes(png_ptr, info_ptr));
 
-  j = 0;
-
-  if (color_space == PNG_COLOR_TYPE_GRAY_ALPHA) {
-    for (y = 0; y < spec->height; y++) {
-      for (x = 0; x < spec->width; x++) {
-        ptr[x * 2] = COL_BLUE(i->_pixbuf[j]);
-        ptr[x * 2 + 1] = COL_ALPHA(i->_pixbuf[j]);
-        j++;
-      }
-      png_write_row(png_ptr, (png_bytep) ptr);
-    }
-  }
-  else {                        // RGB
-    for (y = 0; y < spec->height; y++) {
-      for (x = 0; x < spec->width; x++) {
-        ptr[x * 4] = COL_RED(i->_pixbuf[j]);
-        ptr[x * 4 + 1] = COL_GREEN(i->_pixbuf[j]);
-        ptr[x * 4 + 2] = COL_BLUE(i->_pixbuf[j]);
-        ptr[x * 4 + 3] = COL_ALPHA(i->_pixbuf[j]);
-        j++;
-      }
-      png_write_row(png_ptr, (png_bytep) ptr);
-    }
+  for (y = 0; y < spec->height; y++) {
+    if (color_space == PNG_COLOR_TYPE_GRAY_ALPHA)
+      pixconv_to_gray_alpha(i->_pixbuf + y * spec->width, (uint8_t *)ptr, spec->width);
+    else                        // RGB
+      pixconv_to_rgba(i->_pixbuf + y * spec->width, (uint8_t *)ptr, spec->width);
+    png_write_row(png_ptr, (png_bytep) ptr);
   }
 
   free((void *)ptr);
@@ -42,16 +42,13 @@ static const struct {
   { NULL, 0 }
 };
 
-static dlna_container_type_t
-mpeg_find_container_type (const char *filename)
+dlna_container_type_t
+stream_get_mpeg_container (const unsigned char *buffer, int len)
 {
-  unsigned char buffer[2*MPEG_TS_PACKET_LENGTH_DLNA+1];
-  int fd, i;
+  int i;
 
-  /* read file header */
-  fd = open (filename, O_RDONLY);
-  read (fd, buffer, 2 * MPEG_TS_PACKET_LENGTH_DLNA);
-  close (fd);
+  if (len < 2 * MPEG_TS_PACKET_LENGTH_DLNA)
+    return CT_UNKNOWN;
 
   /* check for MPEG-TS container */
   for (i = 0; i < MPEG_TS_PACKET_LENGTH; i++)
@@ -87,6 +84,22 @@ mpeg_find_container_type (const char *filename)
   return CT_UNKNOWN;
 }
 
+static dlna_container_type_t
+mpeg_find_container_type (const char *filename)
+{
+  unsigned char buffer[2*MPEG_TS_PACKET_LENGTH_DLNA+1];
+  int fd, len;
+
+  /* read file header */
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return CT_UNKNOWN;
+  len = read (fd, buffer, 2 * MPEG_TS_PACKET_LENGTH_DLNA);
+  close (fd);
+
+  return stream_get_mpeg_container (buffer, len);
+}
+
 static dlna_container_type_t
 mov_find_container_type (const char *filename)
 {
@@ -102,7 +115,7 @@ mov_find_container_type (const char *filename)
 }
 
 dlna_container_type_t
-stream_get_container (AVFormatContext *ctx)
+stream_get_container (AVFormatContext *ctx, const unsigned char *header, int len)
 {
   int i;
 
@@ -117,6 +130,9 @@ stream_get_container (AVFormatContext *ctx)
       {
       case CT_FF_MPEG:
       case CT_FF_MPEG_TS:
+        /* use the start of the file if the caller already read it */
+        if (header)
+          return stream_get_mpeg_container (header, len);
         return mpeg_find_container_type (ctx->url);
       case CT_MOV:
         return mov_find_container_type (ctx->url);
@@ -43,6 +43,9 @@ typedef enum {
   CT_MPEG_TRANSPORT_STREAM_DLNA_NO_TS,
 } dlna_container_type_t;
 
-dlna_container_type_t stream_get_container (AVFormatContext *ctx);
+dlna_container_type_t stream_get_container (AVFormatContext *ctx,
+                                            const unsigned char *header, int len);
+dlna_container_type_t stream_get_mpeg_container (const unsigned char *buffer,
+                                                 int len);
 
 #endif /* _CONTAINERS_H_ */
@@ -216,8 +216,10 @@ av_profile_get_codecs (AVFormatContext *ctx)
       audio_stream = i;
       continue;
     }
+    /* cover art is not the video */
     else if (video_stream == -1 &&
-             ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+             ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+             !(ctx->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC))
     {
       video_stream = i;
       continue;
@@ -316,7 +318,7 @@ dlna_guess_media_profile (dlna_t *dlna, const char *filename)
     return NULL;
 
   /* check for container type */
-  st = stream_get_container (ctx);
+  st = stream_get_container (ctx, NULL, 0);
 
   p = dlna->first_profile;
   while (p)
@@ -41,10 +41,15 @@
 #include "progress.h"
 #include "result.h"
 #include "error.h"
+#include "formats.h"
 #include "mediascan.h"
 #include "thread.h"
 #include "util.h"
+#include "video.h"
+#include "thumb.h"
 #include "database.h"
+#include "cache.h"
+#include "watch.h"
 
 // If we are on MSVC, disable some stupid MSVC warnings
 #ifdef _MSC_VER
@@ -121,6 +126,9 @@ static void _init(void) {
   }
   CoInitialize(NULL);           // To initialize the COM library on the current thread
 #endif
+
+  formats_init();
+
   Initialized = 1;
   ms_errno = 0;
 
@@ -193,6 +201,9 @@ MediaScan *ms_create(void) {
 
   s->flags = MS_USE_EXTENSION | MS_FULL_SCAN;
   s->watch_interval = 600;      // 10 minutes
+  s->watch_settle_ms = 2000;
+  s->probe_bytes = 1 << 20;     // 1 MB
+  s->analyze_ms = 1000;
 
   s->thread = NULL;
   s->dbp = NULL;
@@ -251,6 +262,7 @@ void ms_destroy(MediaScan *s) {
   }
 
   progress_destroy(s->progress);
+  video_scaler_destroy(s);
 
   free(s->_dirq);
   free(s->_dlna);
@@ -414,6 +426,38 @@ ms_add_thumbnail_spec(MediaScan *s, enum thumb_format format, int width,
   }
 }                               /* ms_add_thumbnail_spec() */
 
+///-------------------------------------------------------------------------------------------------
+///  Add a storyboard thumbnail spec: frames keyframes of a video in a sprite sheet columns wide,
+///   each frame sized like a thumbnail of ms_add_thumbnail_spec.
+///
+/// @param [in,out] s  The scan.
+/// @param frames      The number of frames.
+/// @param columns     The frames in a row, 0 or more than frames for a single row.
+///-------------------------------------------------------------------------------------------------
+
+void
+ms_add_storyboard_spec(MediaScan *s, enum thumb_format format, int width, int height,
+                       int keep_aspect, uint32_t bgcolor, int quality, int frames, int columns) {
+  int nthumbspecs = s->nthumbspecs;
+  MediaScanThumbSpec *spec;
+
+  if (frames < 1)
+    return;
+
+  ms_add_thumbnail_spec(s, format, width, height, keep_aspect, bgcolor, quality);
+  if (s->nthumbspecs == nthumbspecs)
+    return;
+
+  spec = s->thumbspecs[s->nthumbspecs - 1];
+  spec->frames = frames;
+  spec->columns = columns > 0 && columns < frames ? columns : frames;
+
+  // The sheet has to fit in a JPEG, with a missing cell dimension this is checked again per video
+  thumb_storyboard_fit(spec->width, spec->height, &spec->frames, &spec->columns);
+
+  LOG_DEBUG("ms_add_storyboard_spec %d frames in %d columns\n", spec->frames, spec->columns);
+}                               /* ms_add_storyboard_spec() */
+
 ///-------------------------------------------------------------------------------------------------
 ///  By default, scans are synchronous. This means the call to ms_scan will not return until
 ///   the scan is finished. To enable background asynchronous scanning, pass a true value to
@@ -451,6 +495,17 @@ void ms_set_watch_interval(MediaScan *s, int interval_seconds) {
     s->watch_interval = interval_seconds;
 }
 
+void ms_set_watch_settle_time(MediaScan *s, int settle_ms) {
+  if (settle_ms >= 0)
+    s->watch_settle_ms = settle_ms;
+}
+
+void ms_set_probe_limits(MediaScan *s, int probe_bytes, int analyze_ms, int fps_frames) {
+  s->probe_bytes = probe_bytes > 0 ? probe_bytes : 0;
+  s->analyze_ms = analyze_ms > 0 ? analyze_ms : 0;
+  s->fps_frames = fps_frames > 0 ? fps_frames : 0;
+}
+
 ///-------------------------------------------------------------------------------------------------
 ///  Set a callback that will be called for every scanned file. This callback is required or a
 ///   scan cannot be started.
@@ -704,6 +759,14 @@ void ms_clear_watch(MediaScan *s) {
 
 #endif
 
+  // The watch runs on the scan thread, stop it and wait for the thread to exit
+  if (s->thread != NULL && (s->flags & MS_WATCH_CHANGES)) {
+    ms_abort(s);
+    thread_destroy(s->thread);
+    s->thread = NULL;
+    s->_want_abort = 0;
+  }
+
 }                               /* ms_clear_watch() */
 
 ///-------------------------------------------------------------------------------------------------
@@ -862,45 +925,14 @@ void send_finish(MediaScan *s) {
 }
 
 
-// Called by ms_scan either in a thread or synchronously
-static void *do_scan(void *userdata) {
-  MediaScan *s = ((thread_data_type *)userdata)->s;
-  int i;
+// Scan all files in the directory queue built by recurse_dir, returns 0 if the scan was aborted
+int scan_dirq(MediaScan *s) {
   struct dirq *dir_head = (struct dirq *)s->_dirq;
   struct dirq_entry *dir_entry = NULL;
   struct fileq *file_head = NULL;
   struct fileq_entry *file_entry = NULL;
   char tmp_full_path[MAX_PATH_STR_LEN];
 
-  // Initialize the cache database
-  if (!init_bdb(s)) {
-    MediaScanError *e = error_create("", MS_ERROR_CACHE, "Unable to initialize libmediascan cache");
-    send_error(s, e);
-    goto out;
-  }
-
-  if (s->flags & MS_CLEARDB) {
-    reset_bdb(s);
-  }
-
-  if (s->progress == NULL) {
-    MediaScanError *e = error_create("", MS_ERROR_TYPE_INVALID_PARAMS, "Progress object not created");
-    send_error(s, e);
-    goto out;
-  }
-
-  // Build a list of all directories and paths
-  // We do this first so we can present an accurate scan eta later
-  progress_start_phase(s->progress, "Discovering");
-
-  for (i = 0; i < s->npaths; i++) {
-    LOG_INFO("Scanning %s\n", s->paths[i]);
-    recurse_dir(s, s->paths[i], 0);
-  }
-
-  // Scan all files found
-  progress_start_phase(s->progress, "Scanning");
-
   while (!SIMPLEQ_EMPTY(dir_head)) {
     dir_entry = SIMPLEQ_FIRST(dir_head);
 
@@ -909,7 +941,7 @@ static void *do_scan(void *userdata) {
       // check if the scan has been aborted
       if (s->_want_abort) {
         LOG_DEBUG("Aborting scan\n");
-        goto aborted;
+        return 0;
       }
 
       file_entry = SIMPLEQ_FIRST(file_head);
@@ -944,6 +976,62 @@ static void *do_scan(void *userdata) {
     free(dir_entry);
   }
 
+  return 1;
+}                               /* scan_dirq() */
+
+// Called by ms_scan either in a thread or synchronously
+static void *do_scan(void *userdata) {
+  MediaScan *s = ((thread_data_type *)userdata)->s;
+  int i;
+
+  // Initialize the cache database
+  if (!init_bdb(s)) {
+    MediaScanError *e = error_create("", MS_ERROR_CACHE, "Unable to initialize libmediascan cache");
+    send_error(s, e);
+    goto out;
+  }
+
+  if (s->flags & MS_CLEARDB) {
+    reset_bdb(s);
+  }
+
+  for (i = 0; i < s->_nshards; i++) {
+    CacheShard *shard = (CacheShard *)s->_shards[i];
+
+    shard->hits = 0;
+    shard->misses = 0;
+    shard->inserts = 0;
+  }
+
+  if (s->progress == NULL) {
+    MediaScanError *e = error_create("", MS_ERROR_TYPE_INVALID_PARAMS, "Progress object not created");
+    send_error(s, e);
+    goto out;
+  }
+
+  // Watching runs on the scan thread once the scan is done, so it needs async mode
+  if (s->flags & MS_WATCH_CHANGES) {
+    if (s->async)
+      watch_init(s);
+    else
+      LOG_WARN("MS_WATCH_CHANGES requires async mode, not watching for changes\n");
+  }
+
+  // Build a list of all directories and paths
+  // We do this first so we can present an accurate scan eta later
+  progress_start_phase(s->progress, "Discovering");
+
+  for (i = 0; i < s->npaths; i++) {
+    LOG_INFO("Scanning %s\n", s->paths[i]);
+    recurse_dir(s, s->paths[i], 0);
+  }
+
+  // Scan all files found
+  progress_start_phase(s->progress, "Scanning");
+
+  if (!scan_dirq(s))
+    goto aborted;
+
   // Send final progress callback
   if (s->on_progress) {
     progress_update(s->progress, NULL);
@@ -952,11 +1040,20 @@ static void *do_scan(void *userdata) {
 
   LOG_DEBUG("Finished scanning\n");
 
+  cache_save_counters(s);
+
 out:
   if (s->on_finish)
     send_finish(s);
 
+  if (s->_watch) {
+    watch_run(s);
+    cache_save_counters(s);
+  }
+
 aborted:
+  watch_destroy(s);
+
   if (s->async) {
     LOG_MEM("destroy thread_data @ %p\n", userdata);
     free(userdata);
@@ -1032,10 +1129,12 @@ out:
 void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
   MediaScanError *e = NULL;
   MediaScanResult *r = NULL;
+  CacheShard *shard;
   int ret;
   uint32_t hash;
   int mtime = 0;
   uint64_t size = 0;
+  uint64_t fingerprint = 0;
   DBT key, data;
   char tmp_full_path[MAX_PATH_STR_LEN];
 
@@ -1088,6 +1187,10 @@ void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
   }
 #endif
 
+  // Use the cache shard of the scan path this file was found under
+  bdb_select_shard(s, full_path);
+  shard = (CacheShard *)s->_shard;
+
   // Check if the file has been recently scanned
   hash = HashFile(tmp_full_path, &mtime, &size);
 
@@ -1114,6 +1217,13 @@ void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
       int ret = s->dbp->get(s->dbp, NULL, &key, &data, DB_GET_BOTH);
       if (ret != DB_NOTFOUND) {
         //  LOG_INFO("File %s already scanned, skipping\n", tmp_full_path);
+        shard->hits++;
+
+        // Thumbnail specs added since the last scan only need their thumbnails made
+        if ((s->flags & MS_RESCAN) && (r = cache_update_thumbnails(s, full_path, size, mtime)) != NULL) {
+          r->hash = hash;
+          send_result(s, r);
+        }
         return;
       }
     }
@@ -1134,41 +1244,71 @@ void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
     }
   }
 
-  r = result_create(s);
-  if (r == NULL)
-    return;
+  // A file we have not seen at this path may be a cached file that was moved or renamed
+  if ((s->flags & MS_RESCAN) && s->dbp != NULL)
+    r = cache_find_moved(s, full_path, tmp_full_path, hash, size, mtime, &fingerprint);
+
+  // Or a copy of a file that was already scanned
+  if (r == NULL && (s->flags & MS_DETECT_DUPLICATES) && s->dbp != NULL) {
+    if (!fingerprint)
+      fingerprint = FingerprintFile(tmp_full_path, size);
+
+    r = cache_find_duplicate(s, full_path, hash, size, mtime, fingerprint);
+  }
+
+  if (r != NULL) {
+    shard->hits++;
+  }
+  else {
+    if (shard != NULL)
+      shard->misses++;
 
-  r->type = type;
-  r->path = strdup(full_path);
+    r = result_create(s);
+    if (r == NULL)
+      return;
+
+    r->type = type;
+    r->path = strdup(full_path);
 
-  if (result_scan(r)) {
-    // These were determined by HashFile
+    // Thumbnails are looked up in the thumbnail pack by the file's path, size and mtime
+    r->hash = hash;
     r->mtime = mtime;
     r->size = size;
-    r->hash = hash;
 
-    // Store path -> hash data in cache
-    if (s->dbp != NULL) {
-      memset(&data, 0, sizeof(DBT));
-      data.data = &hash;
-      data.size = sizeof(uint32_t);
-
-      ret = s->dbp->put(s->dbp, NULL, &key, &data, 0);
-      if (ret != 0) {
-        s->dbp->err(s->dbp, ret, "Cache store failed: %s", db_strerror(ret));
+    if (!result_scan(r)) {
+      if (s->on_error && r->error) {
+        // Copy the error, because the original will be cleaned up by result_destroy below
+        MediaScanError *ecopy = error_copy(r->error);
+        send_error(s, ecopy);
       }
+
+      result_destroy(r);
+      return;
     }
-    send_result(s, r);
   }
-  else {
-    if (s->on_error && r->error) {
-      // Copy the error, because the original will be cleaned up by result_destroy below
-      MediaScanError *ecopy = error_copy(r->error);
-      send_error(s, ecopy);
+
+  // These were determined by HashFile
+  r->mtime = mtime;
+  r->size = size;
+  r->hash = hash;
+
+  // Store path -> hash data in cache
+  if (s->dbp != NULL) {
+    memset(&data, 0, sizeof(DBT));
+    data.data = &hash;
+    data.size = sizeof(uint32_t);
+
+    ret = s->dbp->put(s->dbp, NULL, &key, &data, 0);
+    if (ret != 0) {
+      s->dbp->err(s->dbp, ret, "Cache store failed: %s", db_strerror(ret));
+    }
+    else {
+      shard->inserts++;
     }
 
-    result_destroy(r);
+    cache_store_result(s, r, tmp_full_path, fingerprint);
   }
+  send_result(s, r);
 }                               /* ms_scan_file() */
 
 ///-------------------------------------------------------------------------------------------------
@@ -1233,6 +1373,17 @@ const uint8_t *ms_result_get_thumbnail_data(MediaScanResult *r, int index, int *
   return (const uint8_t *)ret;
 }
 
+int ms_result_get_thumbnail_pack_offset(MediaScanResult *r, int index, uint64_t *offset) {
+  *offset = 0;
+
+  if (index < r->nthumbnails && r->_thumbs[index]->_pack_offset) {
+    *offset = r->_thumbs[index]->_pack_offset;
+    return 1;
+  }
+
+  return 0;
+}
+
 int ms_result_get_tag_count(MediaScanResult *r) {
   if (r->_tag)
     return r->_tag->nitems;
@@ -140,6 +140,15 @@ void send_result(MediaScan *s, MediaScanResult *r);
 
 void send_finish(MediaScan *s);
 
+///-------------------------------------------------------------------------------------------------
+/// Scan all files in the directory queue filled by recurse_dir(), emptying the queue.
+///
+/// @param s Scan instance.
+///
+/// @return 0 if the scan was aborted, 1 otherwise.
+///-------------------------------------------------------------------------------------------------
+int scan_dirq(MediaScan *s);
+
 #ifdef WIN32
 
 ///-------------------------------------------------------------------------------------------------
@@ -14,6 +14,7 @@
 #include "common.h"
 #include "progress.h"
 #include "mediascan.h"
+#include "watch.h"
 
 ///-------------------------------------------------------------------------------------------------
 ///  Recursively walk a directory struction.
@@ -104,6 +105,9 @@ void recurse_dir(MediaScan *s, const char *path, int recurse_count) {
     goto out;
   }
 
+  if (s->_watch)
+    watch_add_dir(s, dir);
+
   subdirq = malloc(sizeof(struct dirq));
   SIMPLEQ_INIT(subdirq);
 
@@ -0,0 +1,933 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\mkv.c
+//
+// summary: Native parser for Matroska/WebM headers. Reads the EBML header, then Info, Tracks, Tags
+//          and Attachments of the Segment, following SeekHead to the ones stored after the
+//          Clusters, which are never read. Like the MP4 parser, the streams and tags are described
+//          in an AVFormatContext that FFmpeg never opened.
+///-------------------------------------------------------------------------------------------------
+
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "reader.h"
+#include "mkv.h"
+#include "mp4.h"
+#include "util.h"
+
+#define MKV_EXTENSIONS "mkv,webm"
+#define MKV_MAX_ELEMENT (8 * 1024 * 1024)   // largest element loaded into memory
+#define MKV_MAX_DEPTH 8
+#define MKV_EPOCH 978307200                 // DateUTC counts from 2001-01-01
+#define MKV_UNKNOWN_SIZE UINT64_MAX
+
+// Element IDs, with their length marker bits like they are stored
+#define ID_EBML               0x1A45DFA3
+#define ID_DOCTYPE            0x4282
+#define ID_SEGMENT            0x18538067
+#define ID_SEEKHEAD           0x114D9B74
+#define ID_SEEK               0x4DBB
+#define ID_SEEKID             0x53AB
+#define ID_SEEKPOSITION       0x53AC
+#define ID_INFO               0x1549A966
+#define ID_TIMECODESCALE      0x2AD7B1
+#define ID_DURATION           0x4489
+#define ID_TITLE              0x7BA9
+#define ID_MUXINGAPP          0x4D80
+#define ID_DATEUTC            0x4461
+#define ID_TRACKS             0x1654AE6B
+#define ID_TRACKENTRY         0xAE
+#define ID_TRACKTYPE          0x83
+#define ID_CODECID            0x86
+#define ID_CODECPRIVATE       0x63A2
+#define ID_DEFAULTDURATION    0x23E383
+#define ID_VIDEO              0xE0
+#define ID_PIXELWIDTH         0xB0
+#define ID_PIXELHEIGHT        0xBA
+#define ID_AUDIO              0xE1
+#define ID_SAMPLINGFREQ       0xB5
+#define ID_OUTSAMPLINGFREQ    0x78B5
+#define ID_CHANNELS           0x9F
+#define ID_BITDEPTH           0x6264
+#define ID_TAGS               0x1254C367
+#define ID_TAG                0x7373
+#define ID_TARGETS            0x63C0
+#define ID_TAGTRACKUID        0x63C5
+#define ID_TAGEDITIONUID      0x63C9
+#define ID_TAGCHAPTERUID      0x63C4
+#define ID_TAGATTACHMENTUID   0x63C6
+#define ID_SIMPLETAG          0x67C8
+#define ID_TAGNAME            0x45A3
+#define ID_TAGSTRING          0x4487
+#define ID_ATTACHMENTS        0x1941A469
+#define ID_ATTACHEDFILE       0x61A7
+#define ID_FILENAME           0x466E
+#define ID_FILEMIMETYPE       0x4660
+#define ID_FILEDATA           0x465C
+#define ID_CLUSTER            0x1F43B675
+
+#define TRACK_VIDEO 1
+#define TRACK_AUDIO 2
+
+// Top level elements the parser reads, by the order of the done flags
+enum {
+  MKV_INFO,
+  MKV_TRACKS,
+  MKV_TAGS,
+  MKV_ATTACHMENTS,
+  MKV_SECTIONS
+};
+
+static const uint32_t MKVSections[MKV_SECTIONS] = { ID_INFO, ID_TRACKS, ID_TAGS, ID_ATTACHMENTS };
+
+typedef struct {
+  Reader *rd;
+  uint64_t size;
+  Buffer buf;
+  AVFormatContext *avf;
+  uint64_t segment;             // start of the segment data, SeekHead positions count from here
+  uint64_t segment_end;
+  uint64_t timecode_scale;      // ns per timecode
+  double duration;              // in timecodes
+  int done[MKV_SECTIONS];
+  uint64_t seek[MKV_SECTIONS];  // positions from SeekHead, 0 if not known
+  uint64_t seekhead;            // position of a second SeekHead, 0 if none
+} MKVParser;
+
+typedef struct {
+  int type;
+  char codec[64];
+  const uint8_t *private_data;
+  uint64_t private_size;
+  uint64_t default_duration;    // ns per frame
+  int width, height;
+  double sample_rate, out_sample_rate;
+  int channels, bits;
+} MKVTrack;
+
+// CodecID prefixes, more specific ones first
+// *INDENT-OFF*
+static const struct {
+  const char *id;
+  enum AVCodecID codec_id;
+} MKVCodecs[] = {
+  { "V_MPEG4/ISO/AVC",  AV_CODEC_ID_H264 },
+  { "V_MPEGH/ISO/HEVC", AV_CODEC_ID_HEVC },
+  { "V_MPEG4/ISO/",     AV_CODEC_ID_MPEG4 },
+  { "V_MPEG4/MS/V3",    AV_CODEC_ID_MSMPEG4V3 },
+  { "V_MPEG1",          AV_CODEC_ID_MPEG1VIDEO },
+  { "V_MPEG2",          AV_CODEC_ID_MPEG2VIDEO },
+  { "V_VP8",            AV_CODEC_ID_VP8 },
+  { "V_VP9",            AV_CODEC_ID_VP9 },
+  { "V_AV1",            AV_CODEC_ID_AV1 },
+  { "V_THEORA",         AV_CODEC_ID_THEORA },
+  { "V_MJPEG",          AV_CODEC_ID_MJPEG },
+  { "A_AAC",            AV_CODEC_ID_AAC },
+  { "A_AC3",            AV_CODEC_ID_AC3 },
+  { "A_EAC3",           AV_CODEC_ID_EAC3 },
+  { "A_DTS",            AV_CODEC_ID_DTS },
+  { "A_MPEG/L3",        AV_CODEC_ID_MP3 },
+  { "A_MPEG/L2",        AV_CODEC_ID_MP2 },
+  { "A_MPEG/L1",        AV_CODEC_ID_MP1 },
+  { "A_VORBIS",         AV_CODEC_ID_VORBIS },
+  { "A_OPUS",           AV_CODEC_ID_OPUS },
+  { "A_FLAC",           AV_CODEC_ID_FLAC },
+  { "A_ALAC",           AV_CODEC_ID_ALAC },
+  { "A_TRUEHD",         AV_CODEC_ID_TRUEHD },
+  { "A_PCM/INT/LIT",    AV_CODEC_ID_PCM_S16LE },
+  { "A_PCM/INT/BIG",    AV_CODEC_ID_PCM_S16BE },
+  { NULL,               AV_CODEC_ID_NONE }
+};
+// *INDENT-ON*
+
+// Read an element ID, keeping the length marker. Returns 0 if it is invalid or runs past end.
+static int ebml_read_id(const uint8_t **p, const uint8_t *end, uint32_t *id) {
+  int len, i;
+
+  if (*p >= end || !**p)
+    return 0;
+
+  for (len = 1; len <= 4 && !(**p & (0x100 >> len)); len++);
+  if (len > 4 || *p + len > end)
+    return 0;
+
+  *id = 0;
+  for (i = 0; i < len; i++)
+    *id = (*id << 8) | *(*p)++;
+
+  return 1;
+}                               /* ebml_read_id() */
+
+// Read an element size. All ones means unknown, returned as MKV_UNKNOWN_SIZE.
+static int ebml_read_size(const uint8_t **p, const uint8_t *end, uint64_t *size) {
+  int len, i;
+  uint64_t mask;
+
+  if (*p >= end || !**p)
+    return 0;
+
+  for (len = 1; !(**p & (0x100 >> len)); len++);
+  if (*p + len > end)
+    return 0;
+
+  mask = (1ULL << (7 * len)) - 1;
+  *size = *(*p)++ & (0xff >> len);
+  for (i = 1; i < len; i++)
+    *size = (*size << 8) | *(*p)++;
+
+  if (*size == mask)
+    *size = MKV_UNKNOWN_SIZE;
+
+  return 1;
+}                               /* ebml_read_size() */
+
+// Read the header of the next child element in memory, data points at its body on return
+static int ebml_next(const uint8_t **p, const uint8_t *end, uint32_t *id, const uint8_t **data, uint64_t *size) {
+  if (!ebml_read_id(p, end, id) || !ebml_read_size(p, end, size))
+    return 0;
+
+  if (*size == MKV_UNKNOWN_SIZE || *size > (uint64_t)(end - *p))
+    return 0;
+
+  *data = *p;
+  *p += *size;
+
+  return 1;
+}
+
+static uint64_t ebml_uint(const uint8_t *d, uint64_t len) {
+  uint64_t v = 0;
+
+  while (len--)
+    v = (v << 8) | *d++;
+
+  return v;
+}
+
+static double ebml_float(const uint8_t *d, uint64_t len) {
+  if (len == 4)
+    return get_f32(d);
+
+  if (len == 8) {
+    uint64_t bits = get_u64(d);
+    double v;
+
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  return 0;
+}
+
+// Copy a string element, which need not be null terminated
+static void ebml_string(const uint8_t *d, uint64_t len, char *out, size_t outlen) {
+  if (len >= outlen)
+    len = outlen - 1;
+
+  memcpy(out, d, len);
+  out[len] = '\0';
+}
+
+// Read the header of the element at offset in the file. Returns 0 if there is none before end.
+static int mkv_read_header(MKVParser *p, uint64_t offset, uint64_t end, uint32_t *id, uint64_t *size,
+                           uint32_t *header_size) {
+  uint8_t hdr[12];
+  const uint8_t *ptr = hdr;
+  size_t n;
+
+  if (offset >= end)
+    return 0;
+
+  n = reader_read(p->rd, offset, hdr, sizeof(hdr));
+  if (!ebml_read_id(&ptr, hdr + n, id) || !ebml_read_size(&ptr, hdr + n, size))
+    return 0;
+
+  *header_size = (uint32_t)(ptr - hdr);
+
+  if (*size != MKV_UNKNOWN_SIZE && offset + *header_size + *size > end) {
+    // Truncated, use what is there
+    *size = end - offset - *header_size;
+  }
+
+  return 1;
+}                               /* mkv_read_header() */
+
+// Load len bytes of the file at offset into the buffer
+static int mkv_load(MKVParser *p, uint64_t offset, uint64_t len) {
+  if (len > MKV_MAX_ELEMENT) {
+    LOG_DEBUG("Skipping %"PRIu64" byte Matroska element at %"PRIu64"\n", len, offset);
+    return 0;
+  }
+
+  buffer_clear(&p->buf);
+
+  if (!len)
+    return 1;
+
+  return reader_load(p->rd, &p->buf, offset, (uint32_t)len) == len;
+}                               /* mkv_load() */
+
+static void mkv_parse_seekhead(MKVParser *p, const uint8_t *d, const uint8_t *end) {
+  const uint8_t *seek, *data;
+  uint64_t size, seek_size;
+  uint32_t id;
+  int i;
+
+  while (ebml_next(&d, end, &id, &seek, &seek_size)) {
+    const uint8_t *seek_end = seek + seek_size;
+    uint32_t seek_id = 0;
+    uint64_t pos = 0;
+
+    if (id != ID_SEEK)
+      continue;
+
+    while (ebml_next(&seek, seek_end, &id, &data, &size)) {
+      if (id == ID_SEEKID)
+        seek_id = (uint32_t)ebml_uint(data, size);
+      else if (id == ID_SEEKPOSITION)
+        pos = ebml_uint(data, size);
+    }
+
+    if (!pos)
+      continue;
+
+    for (i = 0; i < MKV_SECTIONS; i++) {
+      if (seek_id == MKVSections[i] && !p->seek[i])
+        p->seek[i] = pos;
+    }
+
+    if (seek_id == ID_SEEKHEAD && !p->seekhead)
+      p->seekhead = pos;
+  }
+}                               /* mkv_parse_seekhead() */
+
+static void mkv_parse_info(MKVParser *p, const uint8_t *d, const uint8_t *end) {
+  const uint8_t *data;
+  uint64_t size;
+  uint32_t id;
+  char str[256];
+
+  while (ebml_next(&d, end, &id, &data, &size)) {
+    switch (id) {
+      case ID_TIMECODESCALE:
+        p->timecode_scale = ebml_uint(data, size);
+        break;
+
+      case ID_DURATION:
+        p->duration = ebml_float(data, size);
+        break;
+
+      case ID_TITLE:
+        ebml_string(data, size, str, sizeof(str));
+        if (*str)
+          av_dict_set(&p->avf->metadata, "title", str, 0);
+        break;
+
+      case ID_MUXINGAPP:
+        ebml_string(data, size, str, sizeof(str));
+        if (*str)
+          av_dict_set(&p->avf->metadata, "encoder", str, 0);
+        break;
+
+      case ID_DATEUTC:
+        if (size == 8) {
+          time_t t = (time_t)((int64_t)get_u64(data) / 1000000000 + MKV_EPOCH);
+          struct tm *tm = gmtime(&t);
+
+          if (tm && strftime(str, sizeof(str), "%Y-%m-%dT%H:%M:%S.000000Z", tm))
+            av_dict_set(&p->avf->metadata, "creation_time", str, 0);
+        }
+        break;
+    }
+  }
+}                               /* mkv_parse_info() */
+
+static void mkv_parse_track_video(MKVTrack *t, const uint8_t *d, const uint8_t *end) {
+  const uint8_t *data;
+  uint64_t size;
+  uint32_t id;
+
+  while (ebml_next(&d, end, &id, &data, &size)) {
+    if (id == ID_PIXELWIDTH)
+      t->width = (int)ebml_uint(data, size);
+    else if (id == ID_PIXELHEIGHT)
+      t->height = (int)ebml_uint(data, size);
+  }
+}
+
+static void mkv_parse_track_audio(MKVTrack *t, const uint8_t *d, const uint8_t *end) {
+  const uint8_t *data;
+  uint64_t size;
+  uint32_t id;
+
+  while (ebml_next(&d, end, &id, &data, &size)) {
+    if (id == ID_SAMPLINGFREQ)
+      t->sample_rate = ebml_float(data, size);
+    else if (id == ID_OUTSAMPLINGFREQ)
+      t->out_sample_rate = ebml_float(data, size);
+    else if (id == ID_CHANNELS)
+      t->channels = (int)ebml_uint(data, size);
+    else if (id == ID_BITDEPTH)
+      t->bits = (int)ebml_uint(data, size);
+  }
+}
+
+static enum AVCodecID mkv_codec_id(MKVTrack *t, AVCodecParameters *par) {
+  const struct AVCodecTag *tags[2] = { NULL, NULL };
+  const uint8_t *priv = t->private_data;
+  int i;
+
+  // VfW and ACM codecs keep a BITMAPINFOHEADER or WAVEFORMATEX in the codec private data
+  if (!strcmp(t->codec, "V_MS/VFW/FOURCC")) {
+    if (t->private_size < 40)
+      return AV_CODEC_ID_NONE;
+    tags[0] = avformat_get_riff_video_tags();
+    par->codec_tag = get_u32le(priv + 16);
+    t->private_data += 40;
+    t->private_size -= 40;
+    return av_codec_get_id(tags, par->codec_tag);
+  }
+
+  if (!strcmp(t->codec, "A_MS/ACM")) {
+    if (t->private_size < 18)
+      return AV_CODEC_ID_NONE;
+    tags[0] = avformat_get_riff_audio_tags();
+    par->codec_tag = get_u16le(priv);
+    t->channels = get_u16le(priv + 2);
+    t->sample_rate = get_u32le(priv + 4);
+    par->bit_rate = (int64_t)get_u32le(priv + 8) * 8;
+    t->bits = get_u16le(priv + 14);
+    t->private_data += 18;
+    t->private_size -= 18;
+    return av_codec_get_id(tags, par->codec_tag);
+  }
+
+  for (i = 0; MKVCodecs[i].id; i++) {
+    if (!strncmp(t->codec, MKVCodecs[i].id, strlen(MKVCodecs[i].id)))
+      break;
+  }
+
+  // PCM is chosen by its bit depth
+  if (MKVCodecs[i].codec_id == AV_CODEC_ID_PCM_S16LE) {
+    if (t->bits == 8)
+      return AV_CODEC_ID_PCM_U8;
+    if (t->bits == 24)
+      return AV_CODEC_ID_PCM_S24LE;
+    if (t->bits == 32)
+      return AV_CODEC_ID_PCM_S32LE;
+  }
+  else if (MKVCodecs[i].codec_id == AV_CODEC_ID_PCM_S16BE) {
+    if (t->bits == 24)
+      return AV_CODEC_ID_PCM_S24BE;
+    if (t->bits == 32)
+      return AV_CODEC_ID_PCM_S32BE;
+  }
+
+  return MKVCodecs[i].codec_id;
+}                               /* mkv_codec_id() */
+
+// Add a TrackEntry as a stream, if it is audio or video
+static void mkv_add_stream(MKVParser *p, MKVTrack *t) {
+  AVCodecParameters *par;
+  AVStream *st;
+
+  if (t->type != TRACK_VIDEO && t->type != TRACK_AUDIO)
+    return;
+
+  st = avformat_new_stream(p->avf, NULL);
+  if (st == NULL) {
+    FATAL("Out of memory for Matroska stream\n");
+    return;
+  }
+
+  par = st->codecpar;
+  par->codec_type = t->type == TRACK_VIDEO ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO;
+  par->codec_id = mkv_codec_id(t, par);
+
+  if (t->private_size && t->private_size < MKV_MAX_ELEMENT) {
+    par->extradata = (uint8_t *)av_mallocz(t->private_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (par->extradata == NULL) {
+      FATAL("Out of memory for Matroska codec private data\n");
+    }
+    else {
+      memcpy(par->extradata, t->private_data, t->private_size);
+      par->extradata_size = (int)t->private_size;
+    }
+  }
+
+  av_reduce(&st->time_base.num, &st->time_base.den, p->timecode_scale, 1000000000, INT_MAX);
+
+  if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+    par->width = t->width;
+    par->height = t->height;
+
+    if (par->codec_id == AV_CODEC_ID_H264)
+      mp4_avc_config(t->private_data, (int)t->private_size, &par->profile, &par->level);
+    else if (par->codec_id == AV_CODEC_ID_HEVC)
+      mp4_hevc_config(t->private_data, (int)t->private_size, &par->profile, &par->level);
+
+    // Frame rate from the default frame duration, like the matroska demuxer
+    if (t->default_duration) {
+      av_reduce(&st->avg_frame_rate.num, &st->avg_frame_rate.den, 1000000000, t->default_duration, 30000);
+      st->r_frame_rate = st->avg_frame_rate;
+    }
+  }
+  else {
+    par->sample_rate = (int)(t->out_sample_rate ? t->out_sample_rate : t->sample_rate);
+    par->channels = t->channels ? t->channels : 1;
+    par->bits_per_coded_sample = t->bits;
+
+    if (par->codec_id == AV_CODEC_ID_AAC) {
+      if (t->private_size)
+        mp4_aac_config(t->private_data, (int)t->private_size, &par->profile, &par->sample_rate, &par->channels);
+      else if (strstr(t->codec, "SBR"))
+        par->profile = FF_PROFILE_AAC_HE;
+      else if (strstr(t->codec, "LC"))
+        par->profile = FF_PROFILE_AAC_LOW;
+      else if (strstr(t->codec, "MAIN"))
+        par->profile = FF_PROFILE_AAC_MAIN;
+    }
+  }
+}                               /* mkv_add_stream() */
+
+static void mkv_parse_tracks(MKVParser *p, const uint8_t *d, const uint8_t *end) {
+  const uint8_t *entry, *data;
+  uint64_t entry_size, size;
+  uint32_t id;
+
+  while (ebml_next(&d, end, &id, &entry, &entry_size)) {
+    const uint8_t *entry_end = entry + entry_size;
+    MKVTrack t;
+
+    if (id != ID_TRACKENTRY)
+      continue;
+
+    memset(&t, 0, sizeof(t));
+
+    while (ebml_next(&entry, entry_end, &id, &data, &size)) {
+      switch (id) {
+        case ID_TRACKTYPE:
+          t.type = (int)ebml_uint(data, size);
+          break;
+
+        case ID_CODECID:
+          ebml_string(data, size, t.codec, sizeof(t.codec));
+          break;
+
+        case ID_CODECPRIVATE:
+          t.private_data = data;
+          t.private_size = size;
+          break;
+
+        case ID_DEFAULTDURATION:
+          t.default_duration = ebml_uint(data, size);
+          break;
+
+        case ID_VIDEO:
+          mkv_parse_track_video(&t, data, data + size);
+          break;
+
+        case ID_AUDIO:
+          mkv_parse_track_audio(&t, data, data + size);
+          break;
+      }
+    }
+
+    mkv_add_stream(p, &t);
+  }
+}                               /* mkv_parse_tracks() */
+
+// Add the SimpleTags of a Tag, nested names joined with '/' like FFmpeg does
+static void mkv_parse_simple_tags(MKVParser *p, const uint8_t *d, const uint8_t *end, const char *prefix, int depth) {
+  const uint8_t *tag, *data;
+  uint64_t tag_size, size;
+  uint32_t id;
+
+  if (depth > MKV_MAX_DEPTH)
+    return;
+
+  while (ebml_next(&d, end, &id, &tag, &tag_size)) {
+    const uint8_t *tag_end = tag + tag_size;
+    const uint8_t *nested = NULL;
+    uint64_t nested_size = 0;
+    char name[128];
+    char key[256];
+    char *value = NULL;
+
+    if (id != ID_SIMPLETAG)
+      continue;
+
+    name[0] = '\0';
+
+    for (;;) {
+      const uint8_t *element = tag;
+
+      if (!ebml_next(&tag, tag_end, &id, &data, &size))
+        break;
+
+      if (id == ID_TAGNAME) {
+        ebml_string(data, size, name, sizeof(name));
+      }
+      else if (id == ID_TAGSTRING && !value) {
+        value = (char *)malloc(size + 1);
+        if (value)
+          ebml_string(data, size, value, size + 1);
+      }
+      else if (id == ID_SIMPLETAG && !nested) {
+        // Nested tags follow the name and value, walk them all from the first
+        nested = element;
+        nested_size = tag_end - element;
+      }
+    }
+
+    if (*name) {
+      if (*prefix)
+        snprintf(key, sizeof(key), "%s/%s", prefix, name);
+      else
+        snprintf(key, sizeof(key), "%s", name);
+
+      // The two names FFmpeg converts to its own
+      if (!strcmp(key, "LEAD_PERFORMER"))
+        strcpy(key, "performer");
+      else if (!strcmp(key, "PART_NUMBER"))
+        strcpy(key, "track");
+
+      if (value && *value)
+        av_dict_set(&p->avf->metadata, key, value, 0);
+
+      if (nested)
+        mkv_parse_simple_tags(p, nested, nested + nested_size, key, depth + 1);
+    }
+
+    free(value);
+  }
+}                               /* mkv_parse_simple_tags() */
+
+static void mkv_parse_tags(MKVParser *p, const uint8_t *d, const uint8_t *end) {
+  const uint8_t *tag, *data;
+  uint64_t tag_size, size;
+  uint32_t id;
+
+  while (ebml_next(&d, end, &id, &tag, &tag_size)) {
+    const uint8_t *tag_end = tag + tag_size;
+    const uint8_t *targets, *targets_end;
+    uint64_t targets_size;
+    int global = 1;
+
+    if (id != ID_TAG)
+      continue;
+
+    // Only tags of the whole file, not of a track, edition, chapter or attachment
+    targets = tag;
+    while (ebml_next(&targets, tag_end, &id, &data, &targets_size)) {
+      const uint8_t *target;
+
+      if (id != ID_TARGETS)
+        continue;
+
+      target = data;
+      targets_end = data + targets_size;
+      while (ebml_next(&target, targets_end, &id, &data, &size)) {
+        if ((id == ID_TAGTRACKUID || id == ID_TAGEDITIONUID || id == ID_TAGCHAPTERUID
+             || id == ID_TAGATTACHMENTUID) && ebml_uint(data, size))
+          global = 0;
+      }
+    }
+
+    if (global)
+      mkv_parse_simple_tags(p, tag, tag_end, "", 0);
+  }
+}                               /* mkv_parse_tags() */
+
+// Image attachments FFmpeg shows as cover art
+// *INDENT-OFF*
+static const struct {
+  const char *mimetype;
+  enum AVCodecID codec_id;
+} MKVPictures[] = {
+  { "image/jpeg", AV_CODEC_ID_MJPEG },
+  { "image/png",  AV_CODEC_ID_PNG },
+  { "image/bmp",  AV_CODEC_ID_BMP },
+  { "image/gif",  AV_CODEC_ID_GIF },
+  { NULL,         AV_CODEC_ID_NONE }
+};
+// *INDENT-ON*
+
+// Add an image attachment as an attached picture stream, with the picture read from the file
+static AVStream *mkv_add_picture(MKVParser *p, enum AVCodecID codec_id, uint64_t offset, uint64_t size) {
+  AVStream *st;
+
+  if (!size || size > MKV_MAX_ELEMENT) {
+    LOG_DEBUG("Skipping %"PRIu64" byte Matroska picture at %"PRIu64"\n", size, offset);
+    return NULL;
+  }
+
+  st = avformat_new_stream(p->avf, NULL);
+  if (st == NULL || av_new_packet(&st->attached_pic, (int)size) < 0) {
+    FATAL("Out of memory for Matroska picture\n");
+    return NULL;
+  }
+
+  if (reader_read(p->rd, offset, st->attached_pic.data, (uint32_t)size) != size) {
+    // Leave an empty stream, it is not used without the picture
+    av_packet_unref(&st->attached_pic);
+    st->codecpar->codec_type = AVMEDIA_TYPE_ATTACHMENT;
+    return st;
+  }
+
+  st->attached_pic.stream_index = st->index;
+  st->attached_pic.flags |= AV_PKT_FLAG_KEY;
+  st->disposition |= AV_DISPOSITION_ATTACHED_PIC;
+  st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+  st->codecpar->codec_id = codec_id;
+
+  return st;
+}                               /* mkv_add_picture() */
+
+// Attachments are walked in the file, to skip over their data without reading it unless it is a
+// picture
+static void mkv_parse_attachments(MKVParser *p, uint64_t offset, uint64_t end) {
+  uint32_t id, header_size;
+  uint64_t size;
+
+  while (mkv_read_header(p, offset, end, &id, &size, &header_size) && size != MKV_UNKNOWN_SIZE) {
+    uint64_t file = offset + header_size;
+    uint64_t file_end = file + size;
+    char filename[256] = "";
+    char mimetype[64] = "";
+    uint64_t data = 0, data_size = 0;
+
+    if (id == ID_ATTACHEDFILE) {
+      uint64_t child_size;
+      uint32_t child_header;
+      AVStream *st = NULL;
+      int i;
+
+      while (mkv_read_header(p, file, file_end, &id, &child_size, &child_header)
+             && child_size != MKV_UNKNOWN_SIZE) {
+        if ((id == ID_FILENAME || id == ID_FILEMIMETYPE) && mkv_load(p, file + child_header, child_size)) {
+          if (id == ID_FILENAME)
+            ebml_string(buffer_ptr(&p->buf), child_size, filename, sizeof(filename));
+          else
+            ebml_string(buffer_ptr(&p->buf), child_size, mimetype, sizeof(mimetype));
+        }
+        else if (id == ID_FILEDATA) {
+          data = file + child_header;
+          data_size = child_size;
+        }
+
+        file += child_header + child_size;
+      }
+
+      // FFmpeg makes a stream of each attachment, an attached picture for images
+      if (*filename && *mimetype) {
+        for (i = 0; MKVPictures[i].mimetype; i++) {
+          if (!strcmp(mimetype, MKVPictures[i].mimetype))
+            break;
+        }
+
+        if (MKVPictures[i].mimetype && data)
+          st = mkv_add_picture(p, MKVPictures[i].codec_id, data, data_size);
+        else if ((st = avformat_new_stream(p->avf, NULL)) != NULL)
+          st->codecpar->codec_type = AVMEDIA_TYPE_ATTACHMENT;
+
+        if (st) {
+          av_dict_set(&st->metadata, "filename", filename, 0);
+          av_dict_set(&st->metadata, "mimetype", mimetype, 0);
+        }
+      }
+    }
+
+    offset = file_end;
+  }
+}                               /* mkv_parse_attachments() */
+
+// Parse the top level element at offset if it is one of the sections not read yet
+static void mkv_parse_element(MKVParser *p, uint32_t id, uint64_t offset, uint64_t size) {
+  const uint8_t *d;
+  int i;
+
+  for (i = 0; i < MKV_SECTIONS; i++) {
+    if (id == MKVSections[i])
+      break;
+  }
+
+  if (id == ID_SEEKHEAD) {
+    if (mkv_load(p, offset, size)) {
+      d = (const uint8_t *)buffer_ptr(&p->buf);
+      mkv_parse_seekhead(p, d, d + size);
+    }
+    return;
+  }
+
+  if (i == MKV_SECTIONS || p->done[i])
+    return;
+
+  p->done[i] = 1;
+
+  if (id == ID_ATTACHMENTS) {
+    mkv_parse_attachments(p, offset, offset + size);
+    return;
+  }
+
+  if (!mkv_load(p, offset, size))
+    return;
+
+  d = (const uint8_t *)buffer_ptr(&p->buf);
+
+  if (id == ID_INFO)
+    mkv_parse_info(p, d, d + size);
+  else if (id == ID_TRACKS)
+    mkv_parse_tracks(p, d, d + size);
+  else if (id == ID_TAGS)
+    mkv_parse_tags(p, d, d + size);
+}                               /* mkv_parse_element() */
+
+// Parse the element SeekHead points to at pos, if it is the one expected
+static void mkv_seek_element(MKVParser *p, uint32_t expected, uint64_t pos) {
+  uint32_t id, header_size;
+  uint64_t size;
+  uint64_t offset = p->segment + pos;
+
+  if (!mkv_read_header(p, offset, p->segment_end, &id, &size, &header_size)
+      || id != expected || size == MKV_UNKNOWN_SIZE) {
+    LOG_DEBUG("Invalid SeekHead entry at %"PRIu64" in %s\n", offset, p->avf->url ? p->avf->url : "");
+    return;
+  }
+
+  mkv_parse_element(p, id, offset + header_size, size);
+}
+
+// Read the EBML header, returns 1 for Matroska and WebM files
+static int mkv_check_header(MKVParser *p, uint64_t *next) {
+  uint32_t id, header_size;
+  uint64_t size;
+  const uint8_t *d, *end, *data;
+  uint64_t len;
+  char doctype[16] = "";
+
+  if (!mkv_read_header(p, 0, p->size, &id, &size, &header_size) || id != ID_EBML
+      || size == MKV_UNKNOWN_SIZE || !mkv_load(p, header_size, size))
+    return 0;
+
+  d = (const uint8_t *)buffer_ptr(&p->buf);
+  end = d + size;
+  while (ebml_next(&d, end, &id, &data, &len)) {
+    if (id == ID_DOCTYPE)
+      ebml_string(data, len, doctype, sizeof(doctype));
+  }
+
+  *next = header_size + size;
+
+  return !strcmp(doctype, "matroska") || !strcmp(doctype, "webm");
+}                               /* mkv_check_header() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read the streams and tags of a Matroska or WebM file without FFmpeg.
+///
+/// @param r  The result being scanned.
+/// @param rd Reader of the file.
+///
+/// @return A format context with the streams and tags of the file, which is not opened and must be
+///   freed with avformat_free_context(), or NULL if the file is not one this parser understands and
+///   should be opened with FFmpeg instead.
+///-------------------------------------------------------------------------------------------------
+
+AVFormatContext *mkv_scan(MediaScanResult *r, Reader *rd) {
+  MKVParser p;
+  uint32_t id, header_size;
+  uint64_t size, offset;
+  int i;
+
+  if (!match_file_extension(r->path, MKV_EXTENSIONS))
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  p.timecode_scale = 1000000;
+  p.rd = rd;
+  p.size = rd->size;
+
+  buffer_init(&p.buf, BUF_SIZE);
+
+  if (!mkv_check_header(&p, &offset))
+    goto fail;
+
+  // Find the Segment, skipping any Void in between
+  for (;;) {
+    if (!mkv_read_header(&p, offset, p.size, &id, &size, &header_size))
+      goto fail;
+    if (id == ID_SEGMENT)
+      break;
+    if (size == MKV_UNKNOWN_SIZE)
+      goto fail;
+    offset += header_size + size;
+  }
+
+  p.segment = offset + header_size;
+  p.segment_end = size == MKV_UNKNOWN_SIZE ? p.size : p.segment + size;
+
+  p.avf = avformat_alloc_context();
+  if (p.avf == NULL) {
+    FATAL("Out of memory for Matroska format context\n");
+    goto fail;
+  }
+
+  // Read the elements before the first Cluster, that is usually all of them except Tags
+  offset = p.segment;
+  while (mkv_read_header(&p, offset, p.segment_end, &id, &size, &header_size)) {
+    if (id == ID_CLUSTER || size == MKV_UNKNOWN_SIZE)
+      break;
+
+    mkv_parse_element(&p, id, offset + header_size, size);
+    offset += header_size + size;
+  }
+
+  // Then jump to the others with SeekHead, and to a second SeekHead listing them if there is one
+  if (p.seekhead)
+    mkv_seek_element(&p, ID_SEEKHEAD, p.seekhead);
+
+  for (i = 0; i < MKV_SECTIONS; i++) {
+    if (!p.done[i] && p.seek[i])
+      mkv_seek_element(&p, MKVSections[i], p.seek[i]);
+  }
+
+  if (!p.done[MKV_TRACKS] || !p.avf->nb_streams) {
+    LOG_DEBUG("No Matroska tracks found, using FFmpeg: %s\n", r->path);
+    goto fail;
+  }
+
+  buffer_free(&p.buf);
+
+  // The DLNA profiles look at the container name and the file, so describe it like the demuxer does
+  p.avf->iformat = av_find_input_format("matroska");
+  p.avf->url = av_strdup(r->path);
+  if (p.avf->iformat == NULL || p.avf->url == NULL)
+    goto fail_free;
+
+  if (p.duration > 0)
+    p.avf->duration = (int64_t)(p.duration * p.timecode_scale / 1000);
+
+  if (p.avf->duration > 0)
+    p.avf->bit_rate = av_rescale(p.size, 8 * AV_TIME_BASE, p.avf->duration);
+
+  return p.avf;
+
+fail:
+  buffer_free(&p.buf);
+fail_free:
+  if (p.avf)
+    avformat_free_context(p.avf);
+
+  return NULL;
+}                               /* mkv_scan() */
@@ -0,0 +1,6 @@
+#ifndef _MKV_H
+#define _MKV_H
+
+AVFormatContext *mkv_scan(MediaScanResult *r, Reader *rd);
+
+#endif // _MKV_H
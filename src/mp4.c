@@ -0,0 +1,1042 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\mp4.c
+//
+// summary: Native parser for MP4/MOV headers. Walks ftyp, moov/trak/mdia/stsd and udta/meta/ilst,
+//          seeking over media data so a file with moov at the end costs a few reads, and describes
+//          its streams and tags in an AVFormatContext that FFmpeg never opened. scan_video() runs
+//          the DLNA profiles and fills in the result from that context like from an opened file.
+///-------------------------------------------------------------------------------------------------
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "reader.h"
+#include "mp4.h"
+#include "util.h"
+
+#define MP4_EXTENSIONS "mp4,m4v,mov,m4a,3gp,3g2"
+#define MP4_MAX_BOX (16 * 1024 * 1024)    // largest box loaded into memory, stsz of a long video fits
+#define MP4_MAX_DEPTH 10
+#define MP4_MAC_EPOCH 2082844800U         // seconds from 1904, the MP4 epoch, to 1970
+
+#define FOURCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+typedef struct {
+  uint32_t handler;             // 'vide', 'soun' or anything else, which is ignored
+  uint32_t fourcc;              // sample entry format, big-endian like the box types
+  uint32_t codec_tag;           // the same in FFmpeg's byte order
+  uint32_t timescale;
+  uint64_t duration;
+  uint32_t nb_samples;
+  uint64_t stream_size;         // sum of the sample sizes
+  int width, height;
+  int channels, sample_rate, bits;
+  int object_type;              // esds objectTypeIndication, 0 if there is none
+  int64_t bit_rate;
+  int profile, level;
+  uint8_t *extradata;
+  int extradata_size;
+} MP4Track;
+
+typedef struct {
+  Reader *rd;
+  uint64_t size;
+  Buffer buf;
+  AVFormatContext *avf;
+  MP4Track *track;              // trak being parsed, NULL outside of one
+  uint32_t timescale;
+  uint64_t duration;
+  int found_moov;
+  int fragmented;
+} MP4Parser;
+
+// iTunes and QuickTime tag names, named like the FFmpeg mov demuxer names them
+// *INDENT-OFF*
+static const struct {
+  uint32_t key;
+  const char *name;
+} MP4Tags[] = {
+  { FOURCC(0xa9, 'n', 'a', 'm'), "title" },
+  { FOURCC(0xa9, 'A', 'R', 'T'), "artist" },
+  { FOURCC(0xa9, 'a', 'u', 't'), "artist" },
+  { FOURCC('a', 'A', 'R', 'T'),  "album_artist" },
+  { FOURCC(0xa9, 'a', 'l', 'b'), "album" },
+  { FOURCC(0xa9, 'd', 'a', 'y'), "date" },
+  { FOURCC(0xa9, 'g', 'e', 'n'), "genre" },
+  { FOURCC(0xa9, 'c', 'm', 't'), "comment" },
+  { FOURCC(0xa9, 'w', 'r', 't'), "composer" },
+  { FOURCC(0xa9, 't', 'o', 'o'), "encoder" },
+  { FOURCC(0xa9, 'e', 'n', 'c'), "encoder" },
+  { FOURCC(0xa9, 's', 'w', 'r'), "encoder" },
+  { FOURCC(0xa9, 'c', 'p', 'y'), "copyright" },
+  { FOURCC('c', 'p', 'r', 't'),  "copyright" },
+  { FOURCC(0xa9, 'g', 'r', 'p'), "grouping" },
+  { FOURCC(0xa9, 'l', 'y', 'r'), "lyrics" },
+  { FOURCC(0xa9, 'x', 'y', 'z'), "location" },
+  { FOURCC('d', 'e', 's', 'c'),  "description" },
+  { FOURCC('l', 'd', 'e', 's'),  "synopsis" },
+  { FOURCC('t', 'v', 's', 'h'),  "show" },
+  { FOURCC('t', 'v', 'e', 'n'),  "episode_id" },
+  { FOURCC('t', 'v', 'n', 'n'),  "network" },
+  { FOURCC('t', 'v', 's', 'n'),  "season_number" },
+  { FOURCC('t', 'v', 'e', 's'),  "episode_sort" },
+  { FOURCC('t', 'r', 'k', 'n'),  "track" },
+  { FOURCC('d', 'i', 's', 'k'),  "disc" },
+  { FOURCC('c', 'p', 'i', 'l'),  "compilation" },
+  { FOURCC('p', 'g', 'a', 'p'),  "gapless_playback" },
+  { FOURCC('h', 'd', 'v', 'd'),  "hd_video" },
+  { FOURCC('s', 't', 'i', 'k'),  "media_type" },
+  { FOURCC('r', 't', 'n', 'g'),  "rating" },
+  { 0, NULL }
+};
+
+// esds objectTypeIndication values, which override the codec of the sample entry
+static const struct {
+  int object_type;
+  enum AVCodecID codec_id;
+} MP4ObjectTypes[] = {
+  { 0x20, AV_CODEC_ID_MPEG4 },
+  { 0x21, AV_CODEC_ID_H264 },
+  { 0x23, AV_CODEC_ID_HEVC },
+  { 0x40, AV_CODEC_ID_AAC },
+  { 0x60, AV_CODEC_ID_MPEG2VIDEO },
+  { 0x61, AV_CODEC_ID_MPEG2VIDEO },
+  { 0x62, AV_CODEC_ID_MPEG2VIDEO },
+  { 0x63, AV_CODEC_ID_MPEG2VIDEO },
+  { 0x64, AV_CODEC_ID_MPEG2VIDEO },
+  { 0x65, AV_CODEC_ID_MPEG2VIDEO },
+  { 0x66, AV_CODEC_ID_AAC },
+  { 0x67, AV_CODEC_ID_AAC },
+  { 0x68, AV_CODEC_ID_AAC },
+  { 0x69, AV_CODEC_ID_MP3 },
+  { 0x6A, AV_CODEC_ID_MPEG1VIDEO },
+  { 0x6B, AV_CODEC_ID_MP3 },
+  { 0x6C, AV_CODEC_ID_MJPEG },
+  { 0xA5, AV_CODEC_ID_AC3 },
+  { 0xA6, AV_CODEC_ID_EAC3 },
+  { 0xDD, AV_CODEC_ID_VORBIS },
+  { 0, AV_CODEC_ID_NONE }
+};
+
+static const int AACSampleRates[] = {
+  96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+// *INDENT-ON*
+
+static int mp4_parse_boxes(MP4Parser *p, uint32_t parent, uint64_t offset, uint64_t end, int depth);
+
+// Read the header of the box at offset, which must end before end. Returns 0 if there is no valid box.
+static int mp4_read_header(MP4Parser *p, uint64_t offset, uint64_t end, uint32_t *type, uint64_t *size,
+                           uint32_t *header_size) {
+  unsigned char hdr[16];
+
+  if (offset + 8 > end || reader_read(p->rd, offset, hdr, 8) != 8)
+    return 0;
+
+  *size = get_u32(hdr);
+  *type = get_u32(hdr + 4);
+  *header_size = 8;
+
+  if (*size == 1) {
+    // 64-bit size follows the type
+    if (offset + 16 > end || reader_read(p->rd, offset + 8, hdr + 8, 8) != 8)
+      return 0;
+    *size = get_u64(hdr + 8);
+    *header_size = 16;
+  }
+  else if (*size == 0) {
+    // Box extends to the end of its parent, only allowed at the top level for mdat
+    *size = end - offset;
+  }
+
+  if (*size < *header_size)
+    return 0;
+
+  // A truncated last box is common in files still being written, use what is there
+  if (offset + *size > end)
+    *size = end - offset;
+
+  return 1;
+}                               /* mp4_read_header() */
+
+// Load len bytes of the file at offset into the buffer
+static int mp4_load(MP4Parser *p, uint64_t offset, uint64_t len) {
+  if (len > MP4_MAX_BOX) {
+    LOG_DEBUG("Skipping %"PRIu64" byte MP4 box at %"PRIu64"\n", len, offset);
+    return 0;
+  }
+
+  buffer_clear(&p->buf);
+
+  if (!len)
+    return 1;
+
+  return reader_load(p->rd, &p->buf, offset, (uint32_t)len) == len;
+}                               /* mp4_load() */
+
+static void mp4_set_tag(MP4Parser *p, const char *key, const char *value) {
+  if (*value)
+    av_dict_set(&p->avf->metadata, key, value, 0);
+}
+
+static const char *mp4_tag_name(uint32_t key) {
+  int i;
+
+  for (i = 0; MP4Tags[i].key; i++) {
+    if (MP4Tags[i].key == key)
+      return MP4Tags[i].name;
+  }
+
+  return NULL;
+}
+
+static void mp4_parse_ftyp(MP4Parser *p, Buffer *buf) {
+  char brand[5];
+  char brands[64];
+  int n = 0;
+
+  if (buffer_len(buf) < 8)
+    return;
+
+  brand[4] = '\0';
+  buffer_get(buf, brand, 4);
+  mp4_set_tag(p, "major_brand", brand);
+
+  sprintf(brands, "%u", buffer_get_int(buf));
+  mp4_set_tag(p, "minor_version", brands);
+
+  while (buffer_len(buf) >= 4 && n + 4 < (int)sizeof(brands)) {
+    buffer_get(buf, brands + n, 4);
+    n += 4;
+  }
+  brands[n] = '\0';
+  mp4_set_tag(p, "compatible_brands", brands);
+}                               /* mp4_parse_ftyp() */
+
+// Read the times, timescale and duration shared by mvhd and mdhd
+static int mp4_parse_times(Buffer *buf, uint64_t *created, uint32_t *timescale, uint64_t *duration) {
+  int version;
+
+  if (buffer_len(buf) < 4)
+    return 0;
+
+  version = buffer_get_char(buf);
+  buffer_consume(buf, 3);
+
+  if (version == 1) {
+    if (buffer_len(buf) < 28)
+      return 0;
+    *created = buffer_get_int64(buf);
+    buffer_consume(buf, 8);
+    *timescale = buffer_get_int(buf);
+    *duration = buffer_get_int64(buf);
+  }
+  else {
+    if (buffer_len(buf) < 16)
+      return 0;
+    *created = buffer_get_int(buf);
+    buffer_consume(buf, 4);
+    *timescale = buffer_get_int(buf);
+    *duration = buffer_get_int(buf);
+
+    // All ones means unknown
+    if (*duration == UINT32_MAX)
+      *duration = 0;
+  }
+
+  return 1;
+}                               /* mp4_parse_times() */
+
+static void mp4_parse_mvhd(MP4Parser *p, Buffer *buf) {
+  uint64_t created;
+
+  if (!mp4_parse_times(buf, &created, &p->timescale, &p->duration))
+    return;
+
+  // Some writers use the Unix epoch, FFmpeg accepts either
+  if (created >= MP4_MAC_EPOCH)
+    created -= MP4_MAC_EPOCH;
+
+  if (created) {
+    char date[32];
+    time_t t = (time_t)created;
+    struct tm *tm = gmtime(&t);
+
+    if (tm && strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S.000000Z", tm))
+      mp4_set_tag(p, "creation_time", date);
+  }
+}                               /* mp4_parse_mvhd() */
+
+static uint32_t mp4_bits(const uint8_t *d, int len, int *pos, int n) {
+  uint32_t v = 0;
+
+  while (n--) {
+    int byte = *pos >> 3;
+
+    v <<= 1;
+    if (byte < len)
+      v |= (d[byte] >> (7 - (*pos & 7))) & 1;
+    (*pos)++;
+  }
+
+  return v;
+}
+
+static int mp4_aac_sample_rate(const uint8_t *d, int len, int *pos) {
+  uint32_t index = mp4_bits(d, len, pos, 4);
+
+  if (index == 15)
+    return (int)mp4_bits(d, len, pos, 24);
+
+  return index < sizeof(AACSampleRates) / sizeof(AACSampleRates[0]) ? AACSampleRates[index] : 0;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Read an AAC AudioSpecificConfig, also used by other containers. The sample rate is the SBR rate
+///   for HE-AAC, like FFmpeg reports it. Values not in the config are left alone.
+///
+/// @param d            The config.
+/// @param len          Length of the config.
+/// @param [out] profile     FF_PROFILE_AAC_* profile.
+/// @param [out] sample_rate Sample rate.
+/// @param [out] channels    Number of channels.
+///-------------------------------------------------------------------------------------------------
+
+void mp4_aac_config(const uint8_t *d, int len, int *profile, int *sample_rate, int *channels) {
+  int pos = 0;
+  int object_type, rate, chans;
+
+  if (len < 2)
+    return;
+
+  object_type = mp4_bits(d, len, &pos, 5);
+  if (object_type == 31)
+    object_type = 32 + mp4_bits(d, len, &pos, 6);
+
+  rate = mp4_aac_sample_rate(d, len, &pos);
+  chans = mp4_bits(d, len, &pos, 4);
+
+  if (object_type == 5 || object_type == 29) {
+    int ext_rate = mp4_aac_sample_rate(d, len, &pos);
+    if (ext_rate)
+      rate = ext_rate;
+  }
+
+  // AAC profiles are the object type minus one, FF_PROFILE_AAC_LOW for AAC LC and so on
+  *profile = object_type - 1;
+
+  if (rate)
+    *sample_rate = rate;
+  if (chans > 0 && chans < 7)
+    *channels = chans;
+  else if (chans == 7)
+    *channels = 8;
+}                               /* mp4_aac_config() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read the profile and level of an AVCDecoderConfigurationRecord (avcC), also used by other
+///   containers. Values not in the record are left alone.
+///-------------------------------------------------------------------------------------------------
+
+void mp4_avc_config(const uint8_t *d, int len, int *profile, int *level) {
+  // version, profile, compatibility, level
+  if (len >= 4) {
+    *profile = d[1];
+    *level = d[3];
+  }
+}                               /* mp4_avc_config() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read the profile and level of an HEVCDecoderConfigurationRecord (hvcC).
+///-------------------------------------------------------------------------------------------------
+
+void mp4_hevc_config(const uint8_t *d, int len, int *profile, int *level) {
+  // version, then profile space, tier and profile, compatibility and constraint flags, level
+  if (len >= 13) {
+    *profile = d[1] & 0x1f;
+    *level = d[12];
+  }
+}                               /* mp4_hevc_config() */
+
+static void mp4_set_extradata(MP4Track *t, const uint8_t *d, int len) {
+  if (t->extradata || len <= 0)
+    return;
+
+  t->extradata = (uint8_t *)av_mallocz(len + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (t->extradata == NULL) {
+    FATAL("Out of memory for MP4 codec config\n");
+    return;
+  }
+
+  memcpy(t->extradata, d, len);
+  t->extradata_size = len;
+}
+
+// Length of an MPEG-4 descriptor, up to 4 bytes of 7 bits each
+static uint32_t mp4_desc_len(const uint8_t **d, const uint8_t *end) {
+  uint32_t len = 0;
+  int i;
+
+  for (i = 0; i < 4 && *d < end; i++) {
+    uint8_t c = *(*d)++;
+    len = (len << 7) | (c & 0x7f);
+    if (!(c & 0x80))
+      break;
+  }
+
+  return len;
+}
+
+static void mp4_parse_esds(MP4Track *t, const uint8_t *d, uint32_t len) {
+  const uint8_t *end = d + len;
+
+  // Skip version and flags
+  if (len < 4)
+    return;
+  d += 4;
+
+  while (d + 2 <= end) {
+    int tag = *d++;
+    uint32_t dlen = mp4_desc_len(&d, end);
+
+    if (dlen > (uint32_t)(end - d))
+      dlen = (uint32_t)(end - d);
+
+    if (tag == 0x03) {
+      // ES_Descriptor, the descriptors below are nested in it
+      int flags;
+
+      if (dlen < 3)
+        return;
+      flags = d[2];
+      d += 3;
+      if (flags & 0x80)
+        d += 2;
+      if ((flags & 0x40) && d < end)
+        d += 1 + *d;
+      if (flags & 0x20)
+        d += 2;
+      if (d > end)
+        return;
+    }
+    else if (tag == 0x04) {
+      // DecoderConfigDescriptor, DecoderSpecificInfo is nested in it
+      if (dlen < 13)
+        return;
+      t->object_type = d[0];
+      if (!t->bit_rate)
+        t->bit_rate = get_u32(d + 9);
+      d += 13;
+    }
+    else if (tag == 0x05) {
+      mp4_set_extradata(t, d, dlen);
+      if (t->object_type == 0x40 || (t->object_type >= 0x66 && t->object_type <= 0x68))
+        mp4_aac_config(d, dlen, &t->profile, &t->sample_rate, &t->channels);
+      return;
+    }
+    else {
+      d += dlen;
+    }
+  }
+}                               /* mp4_parse_esds() */
+
+// Walk the boxes inside a sample entry, the next len bytes of the buffer
+static void mp4_parse_entry_boxes(MP4Track *t, Buffer *buf, uint32_t len) {
+  while (len >= 8 && buffer_len(buf) >= 8) {
+    uint32_t size = buffer_get_int(buf);
+    uint32_t type = buffer_get_int(buf);
+    uint32_t body, left;
+    uint8_t *d;
+
+    if (size < 8 || size > len || size - 8 > buffer_len(buf))
+      return;
+
+    body = size - 8;
+    left = buffer_len(buf);
+    d = (uint8_t *)buffer_ptr(buf);
+
+    switch (type) {
+      case FOURCC('a', 'v', 'c', 'C'):
+        mp4_set_extradata(t, d, body);
+        mp4_avc_config(d, body, &t->profile, &t->level);
+        break;
+
+      case FOURCC('h', 'v', 'c', 'C'):
+        mp4_set_extradata(t, d, body);
+        mp4_hevc_config(d, body, &t->profile, &t->level);
+        break;
+
+      case FOURCC('e', 's', 'd', 's'):
+        mp4_parse_esds(t, d, body);
+        break;
+
+      case FOURCC('b', 't', 'r', 't'):
+        // bufferSizeDB, maxBitrate, avgBitrate
+        if (body >= 12 && !t->bit_rate)
+          t->bit_rate = get_u32(d + 8);
+        break;
+
+      case FOURCC('w', 'a', 'v', 'e'):
+        // QuickTime audio keeps esds in here
+        mp4_parse_entry_boxes(t, buf, body);
+        break;
+    }
+
+    // Only wave consumes from the buffer, the others read the box in place
+    buffer_consume(buf, body - (left - buffer_len(buf)));
+    len -= size;
+  }
+}                               /* mp4_parse_entry_boxes() */
+
+// Sample description, only the first entry is used like FFmpeg does for the codec parameters
+static void mp4_parse_stsd(MP4Track *t, Buffer *buf) {
+  uint32_t size;
+  uint8_t *d;
+
+  // version, flags, entry count, then the entry size and format
+  if (buffer_len(buf) < 16)
+    return;
+
+  buffer_consume(buf, 8);
+  size = buffer_get_int(buf);
+  d = (uint8_t *)buffer_ptr(buf);
+  t->fourcc = get_u32(d);
+  t->codec_tag = get_u32le(d);
+  buffer_consume(buf, 4);
+
+  if (size < 16 || size - 8 > buffer_len(buf))
+    return;
+  size -= 8;
+
+  // reserved, data reference index
+  buffer_consume(buf, 8);
+  size -= 8;
+
+  if (t->handler == FOURCC('v', 'i', 'd', 'e')) {
+    if (size < 70)
+      return;
+
+    // version, revision, vendor, temporal and spatial quality
+    buffer_consume(buf, 16);
+    t->width = buffer_get_short(buf);
+    t->height = buffer_get_short(buf);
+    // resolution, data size, frame count, compressor name, depth, color table
+    buffer_consume(buf, 50);
+    size -= 70;
+  }
+  else if (t->handler == FOURCC('s', 'o', 'u', 'n')) {
+    int version;
+
+    if (size < 20)
+      return;
+
+    version = buffer_get_short(buf);
+    // revision, vendor
+    buffer_consume(buf, 6);
+    t->channels = buffer_get_short(buf);
+    t->bits = buffer_get_short(buf);
+    // compression id, packet size
+    buffer_consume(buf, 4);
+    t->sample_rate = buffer_get_int(buf) >> 16;
+    size -= 20;
+
+    if (version == 1 && size >= 16) {
+      // samples per packet, bytes per packet, frame and sample
+      buffer_consume(buf, 16);
+      size -= 16;
+    }
+    else if (version == 2 && size >= 36) {
+      uint64_t bits;
+      double rate;
+
+      buffer_consume(buf, 4);
+      bits = buffer_get_int64(buf);
+      memcpy(&rate, &bits, sizeof(rate));
+      t->sample_rate = (int)rate;
+      t->channels = buffer_get_int(buf);
+      // always 0x7F000000, bits per channel, flags, bytes and frames per packet
+      buffer_consume(buf, 20);
+      size -= 36;
+    }
+  }
+  else {
+    return;
+  }
+
+  mp4_parse_entry_boxes(t, buf, size);
+}                               /* mp4_parse_stsd() */
+
+// Sample sizes, for the frame rate and the stream bitrate
+static void mp4_parse_stsz(MP4Track *t, Buffer *buf) {
+  uint32_t sample_size, count, i;
+
+  if (buffer_len(buf) < 12)
+    return;
+
+  buffer_consume(buf, 4);
+  sample_size = buffer_get_int(buf);
+  count = buffer_get_int(buf);
+  t->nb_samples = count;
+
+  if (sample_size) {
+    t->stream_size = (uint64_t)sample_size * count;
+  }
+  else {
+    const uint8_t *d = (const uint8_t *)buffer_ptr(buf);
+
+    if (count > buffer_len(buf) / 4)
+      count = buffer_len(buf) / 4;
+    for (i = 0; i < count; i++)
+      t->stream_size += get_u32(d + i * 4);
+  }
+}                               /* mp4_parse_stsz() */
+
+static void mp4_parse_track_box(MP4Parser *p, uint32_t parent, uint32_t type, Buffer *buf) {
+  MP4Track *t = p->track;
+  uint64_t created;
+
+  switch (type) {
+    case FOURCC('m', 'd', 'h', 'd'):
+      mp4_parse_times(buf, &created, &t->timescale, &t->duration);
+      break;
+
+    case FOURCC('h', 'd', 'l', 'r'):
+      // Only the media handler, udta/meta has one of its own
+      if (parent == FOURCC('m', 'd', 'i', 'a') && buffer_len(buf) >= 12) {
+        buffer_consume(buf, 8);
+        t->handler = buffer_get_int(buf);
+      }
+      break;
+
+    case FOURCC('s', 't', 's', 'd'):
+      mp4_parse_stsd(t, buf);
+      break;
+
+    case FOURCC('s', 't', 's', 'z'):
+      mp4_parse_stsz(t, buf);
+      break;
+  }
+}                               /* mp4_parse_track_box() */
+
+// Add the trak just parsed as a stream, if it is audio or video
+static void mp4_add_stream(MP4Parser *p, MP4Track *t) {
+  const struct AVCodecTag *tags[2] = { NULL, NULL };
+  AVCodecParameters *par;
+  AVStream *st;
+  int i;
+
+  if (!t->fourcc || !t->timescale)
+    return;
+
+  if (t->handler == FOURCC('v', 'i', 'd', 'e'))
+    tags[0] = avformat_get_mov_video_tags();
+  else if (t->handler == FOURCC('s', 'o', 'u', 'n'))
+    tags[0] = avformat_get_mov_audio_tags();
+  else
+    return;
+
+  st = avformat_new_stream(p->avf, NULL);
+  if (st == NULL) {
+    FATAL("Out of memory for MP4 stream\n");
+    return;
+  }
+
+  par = st->codecpar;
+  par->codec_type = t->handler == FOURCC('v', 'i', 'd', 'e') ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO;
+  par->codec_tag = t->codec_tag;
+  par->codec_id = av_codec_get_id(tags, t->codec_tag);
+
+  for (i = 0; t->object_type && MP4ObjectTypes[i].object_type; i++) {
+    if (MP4ObjectTypes[i].object_type == t->object_type) {
+      par->codec_id = MP4ObjectTypes[i].codec_id;
+      break;
+    }
+  }
+
+  if (t->profile)
+    par->profile = t->profile;
+  if (t->level)
+    par->level = t->level;
+
+  par->extradata = t->extradata;
+  par->extradata_size = t->extradata_size;
+  t->extradata = NULL;
+
+  st->time_base.num = 1;
+  st->time_base.den = t->timescale;
+  st->duration = t->duration;
+
+  if (t->bit_rate)
+    par->bit_rate = t->bit_rate;
+  else if (t->duration)
+    par->bit_rate = av_rescale(t->stream_size * 8, t->timescale, t->duration);
+
+  if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+    par->width = t->width;
+    par->height = t->height;
+    st->nb_frames = t->nb_samples;
+
+    // Average frame rate like the mov demuxer computes it. The header has no real base frame rate,
+    // the average stands in for it, which is exact for the constant frame rates DLNA profiles check.
+    if (t->nb_samples && t->duration)
+      av_reduce(&st->avg_frame_rate.num, &st->avg_frame_rate.den,
+                (int64_t)t->timescale * t->nb_samples, t->duration, INT_MAX);
+    st->r_frame_rate = st->avg_frame_rate;
+  }
+  else {
+    par->sample_rate = t->sample_rate;
+    par->channels = t->channels;
+    par->bits_per_coded_sample = t->bits;
+  }
+}                               /* mp4_add_stream() */
+
+// Cover art becomes an attached picture stream, like FFmpeg makes of it
+static void mp4_add_cover(MP4Parser *p, uint32_t flags, const uint8_t *d, uint32_t len) {
+  enum AVCodecID codec_id;
+  AVStream *st;
+
+  // Well-known data types of covr
+  switch (flags) {
+    case 13:
+      codec_id = AV_CODEC_ID_MJPEG;
+      break;
+    case 14:
+      codec_id = AV_CODEC_ID_PNG;
+      break;
+    case 27:
+      codec_id = AV_CODEC_ID_BMP;
+      break;
+    default:
+      return;
+  }
+
+  st = avformat_new_stream(p->avf, NULL);
+  if (st == NULL || av_new_packet(&st->attached_pic, (int)len) < 0) {
+    FATAL("Out of memory for MP4 cover art\n");
+    return;
+  }
+
+  memcpy(st->attached_pic.data, d, len);
+  st->attached_pic.stream_index = st->index;
+  st->attached_pic.flags |= AV_PKT_FLAG_KEY;
+  st->disposition |= AV_DISPOSITION_ATTACHED_PIC;
+  st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+  st->codecpar->codec_id = codec_id;
+}                               /* mp4_add_cover() */
+
+// An ilst item: a data box with the value, and for freeform '----' items a name box with the key
+static void mp4_parse_ilst_item(MP4Parser *p, uint32_t key, Buffer *buf) {
+  const char *name = mp4_tag_name(key);
+  char freeform[128];
+  char value[32];
+  Buffer utf8;
+
+  while (buffer_len(buf) >= 8) {
+    uint32_t size = buffer_get_int(buf);
+    uint32_t type = buffer_get_int(buf);
+    uint32_t body, vlen, flags;
+    uint8_t *d;
+
+    if (size < 8 || size - 8 > buffer_len(buf))
+      return;
+
+    body = size - 8;
+    d = (uint8_t *)buffer_ptr(buf);
+
+    if (type == FOURCC('n', 'a', 'm', 'e') && body > 4) {
+      int len = MIN(body - 4, sizeof(freeform) - 1);
+      memcpy(freeform, d + 4, len);
+      freeform[len] = '\0';
+      name = freeform;
+    }
+    else if (type == FOURCC('d', 'a', 't', 'a') && body > 8 && key == FOURCC('c', 'o', 'v', 'r')) {
+      // One data box per picture
+      mp4_add_cover(p, get_u32(d) & 0xffffff, d + 8, body - 8);
+    }
+    else if (type == FOURCC('d', 'a', 't', 'a') && body >= 8 && name) {
+      // type flags, locale, then the value
+      flags = get_u32(d) & 0xffffff;
+      d += 8;
+      vlen = body - 8;
+
+      if (key == FOURCC('t', 'r', 'k', 'n') || key == FOURCC('d', 'i', 's', 'k')) {
+        // reserved, number, total
+        if (vlen >= 6) {
+          int n = get_u16(d + 2);
+          int total = get_u16(d + 4);
+
+          if (total)
+            sprintf(value, "%d/%d", n, total);
+          else
+            sprintf(value, "%d", n);
+          mp4_set_tag(p, name, value);
+        }
+      }
+      else if (flags == 1) {
+        // UTF-8 text, not null terminated
+        buffer_init(&utf8, vlen + 1);
+        buffer_append(&utf8, d, vlen);
+        buffer_put_char(&utf8, 0);
+        mp4_set_tag(p, name, (char *)buffer_ptr(&utf8));
+        buffer_free(&utf8);
+      }
+      else if ((flags == 0 || flags == 21) && vlen >= 1 && vlen <= 4) {
+        // Big-endian integer
+        uint32_t n = 0;
+        uint32_t i;
+
+        for (i = 0; i < vlen; i++)
+          n = (n << 8) | d[i];
+        sprintf(value, "%u", n);
+        mp4_set_tag(p, name, value);
+      }
+    }
+
+    buffer_consume(buf, body);
+  }
+}                               /* mp4_parse_ilst_item() */
+
+// QuickTime text in udta: length, language, then the text
+static void mp4_parse_udta_text(MP4Parser *p, uint32_t key, Buffer *buf) {
+  const char *name = mp4_tag_name(key);
+  uint16_t len, lang;
+  Buffer utf8;
+
+  if (!name || buffer_len(buf) < 4)
+    return;
+
+  len = buffer_get_short(buf);
+  lang = buffer_get_short(buf);
+  if (!len || len > buffer_len(buf))
+    return;
+
+  buffer_init(&utf8, len * 2 + 1);
+
+  // Language codes below 0x400 mean Mac encoded text, Latin-1 is near enough for what tags hold
+  if (lang < 0x400)
+    buffer_get_latin1_as_utf8(buf, &utf8, len);
+  else
+    buffer_get_utf8(buf, &utf8, len);
+
+  mp4_set_tag(p, name, (char *)buffer_ptr(&utf8));
+  buffer_free(&utf8);
+}                               /* mp4_parse_udta_text() */
+
+static int mp4_parse_boxes(MP4Parser *p, uint32_t parent, uint64_t offset, uint64_t end, int depth) {
+  uint32_t type, header_size;
+  uint64_t size, start, len;
+
+  if (depth > MP4_MAX_DEPTH)
+    return 1;
+
+  while (mp4_read_header(p, offset, end, &type, &size, &header_size)) {
+    start = offset + header_size;
+    len = size - header_size;
+
+    switch (type) {
+      case FOURCC('f', 't', 'y', 'p'):
+        if (parent == 0 && mp4_load(p, start, len))
+          mp4_parse_ftyp(p, &p->buf);
+        break;
+
+      case FOURCC('m', 'o', 'o', 'v'):
+        if (parent == 0) {
+          mp4_parse_boxes(p, type, start, start + len, depth + 1);
+          p->found_moov = 1;
+        }
+        break;
+
+      case FOURCC('m', 'v', 'e', 'x'):
+      case FOURCC('m', 'o', 'o', 'f'):
+        p->fragmented = 1;
+        break;
+
+      case FOURCC('m', 'v', 'h', 'd'):
+        if (parent == FOURCC('m', 'o', 'o', 'v') && mp4_load(p, start, len))
+          mp4_parse_mvhd(p, &p->buf);
+        break;
+
+      case FOURCC('t', 'r', 'a', 'k'):
+        if (parent == FOURCC('m', 'o', 'o', 'v')) {
+          MP4Track t;
+
+          memset(&t, 0, sizeof(t));
+          p->track = &t;
+          mp4_parse_boxes(p, type, start, start + len, depth + 1);
+          p->track = NULL;
+
+          mp4_add_stream(p, &t);
+          if (t.extradata)
+            av_free(t.extradata);
+        }
+        break;
+
+      case FOURCC('m', 'd', 'i', 'a'):
+      case FOURCC('m', 'i', 'n', 'f'):
+      case FOURCC('s', 't', 'b', 'l'):
+        if (p->track)
+          mp4_parse_boxes(p, type, start, start + len, depth + 1);
+        break;
+
+      case FOURCC('m', 'd', 'h', 'd'):
+      case FOURCC('h', 'd', 'l', 'r'):
+      case FOURCC('s', 't', 's', 'd'):
+      case FOURCC('s', 't', 's', 'z'):
+        if (p->track && mp4_load(p, start, len))
+          mp4_parse_track_box(p, parent, type, &p->buf);
+        break;
+
+      case FOURCC('u', 'd', 't', 'a'):
+        // Tags of the movie, not of single tracks
+        if (parent == FOURCC('m', 'o', 'o', 'v'))
+          mp4_parse_boxes(p, type, start, start + len, depth + 1);
+        break;
+
+      case FOURCC('m', 'e', 't', 'a'):
+        if (parent == FOURCC('u', 'd', 't', 'a') || parent == FOURCC('m', 'o', 'o', 'v')) {
+          unsigned char vf[4];
+
+          // A full box in MP4, a plain one in QuickTime
+          if (len >= 4 && reader_read(p->rd, start, vf, 4) == 4 && !get_u32(vf)) {
+            start += 4;
+            len -= 4;
+          }
+          mp4_parse_boxes(p, type, start, start + len, depth + 1);
+        }
+        break;
+
+      case FOURCC('i', 'l', 's', 't'):
+        if (parent == FOURCC('m', 'e', 't', 'a'))
+          mp4_parse_boxes(p, type, start, start + len, depth + 1);
+        break;
+
+      default:
+        if (parent == FOURCC('i', 'l', 's', 't')) {
+          if (mp4_load(p, start, len))
+            mp4_parse_ilst_item(p, type, &p->buf);
+        }
+        else if (parent == FOURCC('u', 'd', 't', 'a') && (type >> 24) == 0xa9) {
+          if (mp4_load(p, start, len))
+            mp4_parse_udta_text(p, type, &p->buf);
+        }
+        break;
+    }
+
+    // Everything needed is in moov, don't walk the rest of the file
+    if (parent == 0 && p->found_moov)
+      break;
+
+    offset += size;
+  }
+
+  return 1;
+}                               /* mp4_parse_boxes() */
+
+// Is the first box one an MP4/MOV file starts with
+static int mp4_check_header(MP4Parser *p) {
+  uint32_t type, header_size;
+  uint64_t size;
+
+  if (!mp4_read_header(p, 0, p->size, &type, &size, &header_size))
+    return 0;
+
+  switch (type) {
+    case FOURCC('f', 't', 'y', 'p'):
+    case FOURCC('m', 'o', 'o', 'v'):
+    case FOURCC('m', 'd', 'a', 't'):
+    case FOURCC('f', 'r', 'e', 'e'):
+    case FOURCC('s', 'k', 'i', 'p'):
+    case FOURCC('w', 'i', 'd', 'e'):
+    case FOURCC('p', 'n', 'o', 't'):
+      return 1;
+  }
+
+  return 0;
+}                               /* mp4_check_header() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read the streams and tags of an MP4/MOV file without FFmpeg.
+///
+/// @param r  The result being scanned.
+/// @param rd Reader of the file.
+///
+/// @return A format context with the streams and tags of the file, which is not opened and must be
+///   freed with avformat_free_context(), or NULL if the file is not one this parser understands and
+///   should be opened with FFmpeg instead.
+///-------------------------------------------------------------------------------------------------
+
+AVFormatContext *mp4_scan(MediaScanResult *r, Reader *rd) {
+  MP4Parser p;
+  unsigned int i;
+  int64_t duration;
+
+  if (!match_file_extension(r->path, MP4_EXTENSIONS))
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  p.rd = rd;
+  p.size = rd->size;
+
+  if (!mp4_check_header(&p))
+    goto fail;
+
+  p.avf = avformat_alloc_context();
+  if (p.avf == NULL) {
+    FATAL("Out of memory for MP4 format context\n");
+    goto fail;
+  }
+
+  buffer_init(&p.buf, BUF_SIZE);
+
+  mp4_parse_boxes(&p, 0, 0, p.size, 0);
+
+  buffer_free(&p.buf);
+
+  // Fragmented files keep their samples in moof boxes all over the file, FFmpeg reads those
+  if (!p.found_moov || p.fragmented || !p.avf->nb_streams) {
+    LOG_DEBUG("Not a plain MP4 file, using FFmpeg: %s\n", r->path);
+    goto fail;
+  }
+
+  // The DLNA profiles look at the container name and the file, so describe it like the demuxer does
+  p.avf->iformat = av_find_input_format("mov");
+  p.avf->url = av_strdup(r->path);
+  if (p.avf->iformat == NULL || p.avf->url == NULL)
+    goto fail;
+
+  if (p.timescale && p.duration) {
+    p.avf->duration = av_rescale(p.duration, AV_TIME_BASE, p.timescale);
+  }
+  else {
+    for (i = 0; i < p.avf->nb_streams; i++) {
+      AVStream *st = p.avf->streams[i];
+
+      duration = av_rescale_q(st->duration, st->time_base, AV_TIME_BASE_Q);
+      if (duration > p.avf->duration)
+        p.avf->duration = duration;
+    }
+  }
+
+  if (p.avf->duration > 0)
+    p.avf->bit_rate = av_rescale(p.size, 8 * AV_TIME_BASE, p.avf->duration);
+
+  return p.avf;
+
+fail:
+  if (p.avf)
+    avformat_free_context(p.avf);
+
+  return NULL;
+}                               /* mp4_scan() */
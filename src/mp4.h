@@ -0,0 +1,10 @@
+#ifndef _MP4_H
+#define _MP4_H
+
+AVFormatContext *mp4_scan(MediaScanResult *r, Reader *rd);
+
+void mp4_aac_config(const uint8_t *d, int len, int *profile, int *sample_rate, int *channels);
+void mp4_avc_config(const uint8_t *d, int len, int *profile, int *level);
+void mp4_hevc_config(const uint8_t *d, int len, int *profile, int *level);
+
+#endif // _MP4_H
@@ -0,0 +1,460 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\mpeg.c
+//
+// summary: Native probe of MPEG program and transport streams. The start and the end of the file
+//          are read once: the start decides the DLNA container variant and holds the PAT and PMT,
+//          and the timestamps of the program's streams at both ends give the duration, which
+//          libavformat would otherwise find by reading the end of the file itself.
+///-------------------------------------------------------------------------------------------------
+
+#include <string.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libavformat/avformat.h>
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "reader.h"
+#include "mpeg.h"
+#include "util.h"
+
+#include "libdlna/containers.h"
+
+#define MPEG_EXTENSIONS "mpg,mpeg,mpe,m1v,m2v,m2p,ps,vob,ts,m2t,m2ts,mts,tp,trp,tts"
+#define MPEG_SCAN_SIZE (256 * 1024)   // read at each end of the file
+#define MPEG_SAMPLE_SIZE (64 * 1024)  // read at a time from a point sampled for a keyframe
+#define MPEG_SAMPLE_MAX (4 * 1024 * 1024)   // read from a point at most
+#define MPEG_SAMPLE_SPACING 2000      // ms of the video per sampled point, at least
+#define MPEG_MAX_STREAMS 32
+
+#define TS_SYNC 0x47
+#define TS_PACKET 188
+#define TS_PID_PAT 0x0000
+#define TS_PID_NULL 0x1fff
+#define PTS_MASK ((INT64_C(1) << 33) - 1)
+#define PTS_NONE -1
+
+typedef struct {
+  int pid;
+  int type;                     // stream_type of the PMT
+  int64_t first;                // first and last PTS, PTS_NONE if none seen
+  int64_t last;
+} MPEGStream;
+
+typedef struct {
+  int packet_size;
+  int pmt_pid;                  // -1 until the PAT is read
+  int pcr_pid;                  // -1 until the PMT is read
+  int64_t first_pcr, last_pcr;
+  int nstreams;
+  MPEGStream streams[MPEG_MAX_STREAMS];
+} TSParser;
+
+// Read a 33 bit PTS from the 5 bytes of a PES header
+static int64_t pes_pts(const uint8_t *p) {
+  return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] >> 1) << 15) | (p[3] << 7) | (p[4] >> 1);
+}
+
+// Find the first packet, seen at least three times in a row if the buffer is long enough
+static int ts_sync(const uint8_t *buf, int len, int packet_size) {
+  int i;
+
+  for (i = 0; i < packet_size && i + packet_size < len; i++) {
+    if (buf[i] == TS_SYNC && buf[i + packet_size] == TS_SYNC
+        && (i + 2 * packet_size >= len || buf[i + 2 * packet_size] == TS_SYNC))
+      return i;
+  }
+
+  return -1;
+}                               /* ts_sync() */
+
+static void ts_parse_pat(TSParser *ts, const uint8_t *p, const uint8_t *end) {
+  int len;
+
+  // Pointer field, then the section
+  p += 1 + p[0];
+  if (p + 8 > end || p[0] != 0x00)
+    return;
+
+  len = ((p[1] & 0x0f) << 8) | p[2];
+  if (p + 3 + len < end)
+    end = p + 3 + len;
+  end -= 4;                     // CRC
+
+  // The first program, number 0 is the network PID
+  for (p += 8; p + 4 <= end; p += 4) {
+    if (p[0] || p[1]) {
+      ts->pmt_pid = ((p[2] & 0x1f) << 8) | p[3];
+      return;
+    }
+  }
+}                               /* ts_parse_pat() */
+
+static void ts_parse_pmt(TSParser *ts, const uint8_t *p, const uint8_t *end) {
+  int len, info_len;
+
+  p += 1 + p[0];
+  if (p + 12 > end || p[0] != 0x02)
+    return;
+
+  len = ((p[1] & 0x0f) << 8) | p[2];
+  if (p + 3 + len < end)
+    end = p + 3 + len;
+  end -= 4;
+
+  ts->pcr_pid = ((p[8] & 0x1f) << 8) | p[9];
+  info_len = ((p[10] & 0x0f) << 8) | p[11];
+
+  for (p += 12 + info_len; p + 5 <= end && ts->nstreams < MPEG_MAX_STREAMS; p += 5 + info_len) {
+    MPEGStream *st = &ts->streams[ts->nstreams++];
+
+    st->type = p[0];
+    st->pid = ((p[1] & 0x1f) << 8) | p[2];
+    st->first = st->last = PTS_NONE;
+    info_len = ((p[3] & 0x0f) << 8) | p[4];
+
+    LOG_DEBUG("MPEG-TS stream type 0x%02x on PID %d\n", p[0], st->pid);
+  }
+}                               /* ts_parse_pmt() */
+
+// Walk the packets of buf, reading the tables until the PMT is found and the PCR and PTS of the
+// program's streams
+static void ts_parse(TSParser *ts, const uint8_t *buf, int len) {
+  const uint8_t *p, *payload, *end;
+  int start, pid, i;
+
+  start = ts_sync(buf, len, ts->packet_size);
+  if (start < 0)
+    return;
+
+  for (p = buf + start; p + TS_PACKET <= buf + len; p += ts->packet_size) {
+    if (p[0] != TS_SYNC)
+      break;
+
+    pid = ((p[1] & 0x1f) << 8) | p[2];
+    if (pid == TS_PID_NULL)
+      continue;
+
+    end = p + TS_PACKET;
+    payload = p + 4;
+
+    // Adaptation field, with the PCR
+    if (p[3] & 0x20) {
+      payload += 1 + p[4];
+      if (p[4] >= 7 && (p[5] & 0x10) && pid == ts->pcr_pid) {
+        int64_t pcr = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+
+        if (ts->first_pcr == PTS_NONE)
+          ts->first_pcr = pcr;
+        ts->last_pcr = pcr;
+      }
+    }
+
+    // Only the start of a table or PES packet is needed
+    if (!(p[3] & 0x10) || !(p[1] & 0x40) || payload >= end)
+      continue;
+
+    if (pid == TS_PID_PAT) {
+      if (ts->pmt_pid < 0)
+        ts_parse_pat(ts, payload, end);
+      continue;
+    }
+
+    if (pid == ts->pmt_pid) {
+      if (ts->pcr_pid < 0)
+        ts_parse_pmt(ts, payload, end);
+      continue;
+    }
+
+    for (i = 0; i < ts->nstreams; i++) {
+      MPEGStream *st = &ts->streams[i];
+
+      if (st->pid != pid)
+        continue;
+
+      // PES header with a PTS
+      if (payload + 14 <= end && !payload[0] && !payload[1] && payload[2] == 0x01
+          && (payload[7] & 0x80)) {
+        int64_t pts = pes_pts(payload + 9);
+
+        if (st->first == PTS_NONE)
+          st->first = pts;
+        st->last = pts;
+      }
+      break;
+    }
+  }
+}                               /* ts_parse() */
+
+// The duration from the PTS of the streams, from the earliest start to the latest end like
+// libavformat does, or from the PCR if no stream has a PTS at both ends. 0 if neither is seen at both
+// ends, e.g. when the end of the file has no PCR, so libavformat estimates the duration itself.
+static int64_t ts_duration(TSParser *ts) {
+  int64_t start = PTS_NONE;
+  int64_t duration = 0;
+  int i;
+
+  for (i = 0; i < ts->nstreams; i++) {
+    if (ts->streams[i].first != PTS_NONE && (start == PTS_NONE || ts->streams[i].first < start))
+      start = ts->streams[i].first;
+  }
+
+  if (start != PTS_NONE) {
+    for (i = 0; i < ts->nstreams; i++) {
+      if (ts->streams[i].last != PTS_NONE && ts->streams[i].first != PTS_NONE) {
+        int64_t d = (ts->streams[i].last - start) & PTS_MASK;
+        if (d > duration)
+          duration = d;
+      }
+    }
+  }
+
+  if (!duration && ts->first_pcr != PTS_NONE && ts->last_pcr != PTS_NONE)
+    duration = (ts->last_pcr - ts->first_pcr) & PTS_MASK;
+
+  return duration * AV_TIME_BASE / 90000;
+}                               /* ts_duration() */
+
+// Video stream types: MPEG-1/2, MPEG-4 part 2, H.264, HEVC, and VC-1 of the BD and HD DVD muxers
+static int ts_is_video(int type) {
+  switch (type) {
+    case 0x01:
+    case 0x02:
+    case 0x10:
+    case 0x1b:
+    case 0x24:
+    case 0xea:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Does the elementary stream data at the start of a PES packet start a keyframe: a sequence header
+// or an I picture for MPEG-1/2, an I-VOP for MPEG-4, an SPS or IDR slice for H.264, a parameter
+// set or IRAP picture for HEVC, and an entry point for VC-1
+static int ts_es_is_keyframe(int type, const uint8_t *p, const uint8_t *end) {
+  for (; p + 5 < end; p++) {
+    int code, nal;
+
+    if (p[0] || p[1] || p[2] != 0x01)
+      continue;
+
+    code = p[3];
+
+    switch (type) {
+      case 0x01:
+      case 0x02:
+        if (code == 0xb3 || (code == 0x00 && ((p[5] >> 3) & 0x07) == 1))
+          return 1;
+        break;
+      case 0x10:
+        if (code == 0xb0 || (code == 0xb6 && (p[4] >> 6) == 0))
+          return 1;
+        break;
+      case 0x1b:
+        nal = code & 0x1f;
+        if (nal == 5 || nal == 7)
+          return 1;
+        break;
+      case 0x24:
+        nal = (code >> 1) & 0x3f;
+        if ((nal >= 16 && nal <= 21) || nal == 32 || nal == 33)
+          return 1;
+        break;
+      case 0xea:
+        if (code == 0x0e || code == 0x0f)
+          return 1;
+        break;
+    }
+
+    // Only the first picture of the packet matters
+    if ((type == 0x01 || type == 0x02) && code == 0x00)
+      return 0;
+    if (type == 0x10 && code == 0xb6)
+      return 0;
+  }
+
+  return 0;
+}                               /* ts_es_is_keyframe() */
+
+// The offset in buf of the first packet of the video stream that starts a keyframe, with a PTS in
+// its PES header, -1 if there is none. Muxers flag those packets as random access points, or the
+// start of the elementary stream data shows it when they don't.
+static int ts_find_keyframe(TSParser *ts, MPEGStream *video, const uint8_t *buf, int len, int64_t *pts) {
+  const uint8_t *p, *payload, *end;
+  int start;
+
+  start = ts_sync(buf, len, ts->packet_size);
+  if (start < 0)
+    return -1;
+
+  for (p = buf + start; p + TS_PACKET <= buf + len; p += ts->packet_size) {
+    int rai = 0;
+
+    if (p[0] != TS_SYNC)
+      break;
+
+    // The video stream, payload unit start, with a payload
+    if ((((p[1] & 0x1f) << 8) | p[2]) != video->pid || !(p[1] & 0x40) || !(p[3] & 0x10))
+      continue;
+
+    end = p + TS_PACKET;
+    payload = p + 4;
+    if (p[3] & 0x20) {
+      payload += 1 + p[4];
+      rai = p[4] && (p[5] & 0x40);
+    }
+
+    if (payload + 14 > end || payload[0] || payload[1] || payload[2] != 0x01 || !(payload[7] & 0x80))
+      continue;
+
+    if (rai || ts_es_is_keyframe(video->type, payload + 9 + payload[8], end)) {
+      *pts = pes_pts(payload + 9);
+      return (int)(p - buf);
+    }
+  }
+
+  return -1;
+}                               /* ts_find_keyframe() */
+
+// Sample a transport stream for keyframes at points spread evenly over the file. From each point
+// the file is read until the first keyframe, up to the next point or MPEG_SAMPLE_MAX, and the
+// keyframe becomes an entry of the index.
+static void ts_keyframes(TSParser *ts, Reader *rd, Buffer *buf, MPEGHeader *mpeg) {
+  MPEGStream *video = NULL;
+  int extra = ts->packet_size - TS_PACKET;
+  int64_t pts;
+  int points, x, i;
+
+  for (i = 0; i < ts->nstreams; i++) {
+    if (ts_is_video(ts->streams[i].type) && ts->streams[i].first != PTS_NONE) {
+      video = &ts->streams[i];
+      break;
+    }
+  }
+
+  if (video == NULL || mpeg->duration <= 0)
+    return;
+
+  points = (int)(mpeg->duration / (MPEG_SAMPLE_SPACING * 1000));
+  points = points < 1 ? 1 : points > MPEG_KEYFRAMES ? MPEG_KEYFRAMES : points;
+
+  for (x = 0; x < points; x++) {
+    uint64_t point = mpeg->size / points * x;
+    uint64_t end = x + 1 < points ? mpeg->size / points * (x + 1) : mpeg->size;
+    uint64_t offset = point;
+
+    if (end > point + MPEG_SAMPLE_MAX)
+      end = point + MPEG_SAMPLE_MAX;
+
+    while (offset < end) {
+      buffer_clear(buf);
+      if (reader_load(rd, buf, offset, MPEG_SAMPLE_SIZE) < TS_PACKET)
+        return;
+
+      i = ts_find_keyframe(ts, video, (const uint8_t *)buffer_ptr(buf), buffer_len(buf), &pts);
+
+      // The packet of a 192 byte stream starts with its timestamp, before the sync byte
+      if (i >= 0 && offset + i >= (uint64_t)extra) {
+        MediaScanKeyframe *k = &mpeg->keyframes[mpeg->nkeyframes++];
+
+        k->pts_ms = (int)(((pts - video->first) & PTS_MASK) / 90);
+        k->offset = offset + i - extra;
+        break;
+      }
+
+      // The next read overlaps this one by a packet, for the one cut off at the end
+      if (buffer_len(buf) <= (uint32_t)ts->packet_size)
+        break;
+      offset += buffer_len(buf) - ts->packet_size;
+    }
+  }
+
+  LOG_DEBUG("MPEG-TS keyframes found at %d of %d points\n", mpeg->nkeyframes, points);
+}                               /* ts_keyframes() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read the start of an MPEG file, and for a transport stream its duration.
+///
+/// @param r          The result being scanned.
+/// @param rd         Reader of the file.
+/// @param [out] mpeg The header, packet size and duration.
+///
+/// @return 1 if the start of the file was read, 0 if it is not an MPEG file or could not be read.
+///-------------------------------------------------------------------------------------------------
+
+int mpeg_scan(MediaScanResult *r, Reader *rd, MPEGHeader *mpeg) {
+  TSParser ts;
+  Buffer buf;
+  uint64_t tail;
+  int i;
+
+  memset(mpeg, 0, sizeof(MPEGHeader));
+
+  if (!match_file_extension(r->path, MPEG_EXTENSIONS))
+    return 0;
+
+  mpeg->size = rd->size;
+
+  buffer_init(&buf, MPEG_SCAN_SIZE);
+
+  if (reader_load(rd, &buf, 0, MPEG_SCAN_SIZE) < MPEG_HEADER_LEN) {
+    buffer_free(&buf);
+    return 0;
+  }
+
+  mpeg->header_len = MPEG_HEADER_LEN;
+  memcpy(mpeg->header, buffer_ptr(&buf), MPEG_HEADER_LEN);
+
+  switch (stream_get_mpeg_container(mpeg->header, mpeg->header_len)) {
+    case CT_MPEG_TRANSPORT_STREAM:
+      mpeg->packet_size = TS_PACKET;
+      break;
+    case CT_MPEG_TRANSPORT_STREAM_DLNA:
+    case CT_MPEG_TRANSPORT_STREAM_DLNA_NO_TS:
+      mpeg->packet_size = TS_PACKET + 4;
+      break;
+    default:
+      break;
+  }
+
+  if (mpeg->packet_size) {
+    memset(&ts, 0, sizeof(ts));
+    ts.packet_size = mpeg->packet_size;
+    ts.pmt_pid = ts.pcr_pid = -1;
+    ts.first_pcr = ts.last_pcr = PTS_NONE;
+
+    ts_parse(&ts, (const uint8_t *)buffer_ptr(&buf), buffer_len(&buf));
+
+    // Only the last PTS and PCR are wanted from the end of the file
+    for (i = 0; i < ts.nstreams; i++)
+      ts.streams[i].last = PTS_NONE;
+    ts.last_pcr = PTS_NONE;
+
+    tail = mpeg->size > MPEG_SCAN_SIZE ? mpeg->size - MPEG_SCAN_SIZE : 0;
+
+    if (ts.pcr_pid >= 0) {
+      buffer_clear(&buf);
+      if (reader_load(rd, &buf, tail, MPEG_SCAN_SIZE) >= TS_PACKET)
+        ts_parse(&ts, (const uint8_t *)buffer_ptr(&buf), buffer_len(&buf));
+    }
+
+    mpeg->duration = ts_duration(&ts);
+
+    if (r->_scan && (((MediaScan *)r->_scan)->flags & MS_KEYFRAME_INDEX))
+      ts_keyframes(&ts, rd, &buf, mpeg);
+
+    LOG_DEBUG("MPEG-TS with %d byte packets, %d streams, duration %"PRId64" us: %s\n", mpeg->packet_size,
+              ts.nstreams, mpeg->duration, r->path);
+  }
+
+  buffer_free(&buf);
+
+  return 1;
+}                               /* mpeg_scan() */
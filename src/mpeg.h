@@ -0,0 +1,19 @@
+#ifndef _MPEG_H
+#define _MPEG_H
+
+#define MPEG_HEADER_LEN 384     // what libdlna looks at, two 192 byte TS packets
+#define MPEG_KEYFRAMES 128      // points of a transport stream sampled for keyframes, at most
+
+typedef struct {
+  unsigned char header[MPEG_HEADER_LEN];  // start of the file
+  int header_len;
+  int packet_size;              // 188 or 192 for a transport stream, 0 otherwise
+  int64_t duration;             // from the timestamps at both ends, AV_TIME_BASE units, 0 if unknown
+  uint64_t size;
+  int nkeyframes;               // sampled keyframes of a transport stream, with MS_KEYFRAME_INDEX
+  MediaScanKeyframe keyframes[MPEG_KEYFRAMES];
+} MPEGHeader;
+
+int mpeg_scan(MediaScanResult *r, Reader *rd, MPEGHeader *mpeg);
+
+#endif // _MPEG_H
@@ -0,0 +1,548 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\pixconv.c
+//
+// summary: Row converters between the pixel formats of the decoders and encoders and the 32-bit
+//          pixels of a pixbuf, red in the top byte and alpha in the bottom one like COL_FULL().
+//          The C versions build each pixel with shifts, the SIMD ones shuffle the bytes of whole
+//          blocks of pixels. They all give the same result, simd_get() picks one.
+///-------------------------------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "pixconv.h"
+#include "simd.h"
+
+// The SIMD versions move the bytes of pixels laid out in memory as on a little-endian CPU
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# undef SIMD_HAVE_NEON
+#endif
+
+#define PIXCONV(r, g, b, a) ((uint32_t)(r) << 24 | (uint32_t)(g) << 16 | (uint32_t)(b) << 8 | (uint32_t)(a))
+
+// Exact x / 255 of a product of two channels
+#define PIXCONV_DIV255(x) (((x) + 1 + ((x) >> 8)) >> 8)
+
+typedef void (*pixconv_in_t) (const uint8_t *src, uint32_t *dst, int width);
+typedef void (*pixconv_out_t) (const uint32_t *src, uint8_t *dst, int width);
+
+typedef struct {
+  pixconv_in_t rgb;
+  pixconv_in_t bgr;
+  pixconv_in_t bgrx;
+  pixconv_in_t rgba;
+  pixconv_in_t gray;
+  pixconv_in_t gray_alpha;
+  pixconv_in_t cmyk_inverted;
+  pixconv_out_t to_rgb;
+  pixconv_out_t to_rgba;
+  pixconv_out_t to_gray_alpha;
+} PixconvKernel;
+
+static void pixconv_rgb_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 3)
+    dst[x] = PIXCONV(src[0], src[1], src[2], 0xFF);
+}
+
+static void pixconv_bgr_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 3)
+    dst[x] = PIXCONV(src[2], src[1], src[0], 0xFF);
+}
+
+static void pixconv_bgrx_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 4)
+    dst[x] = PIXCONV(src[2], src[1], src[0], 0xFF);
+}
+
+static void pixconv_rgba_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 4)
+    dst[x] = PIXCONV(src[0], src[1], src[2], src[3]);
+}
+
+static void pixconv_gray_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++)
+    dst[x] = PIXCONV(src[x], src[x], src[x], 0xFF);
+}
+
+static void pixconv_gray_alpha_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 2)
+    dst[x] = PIXCONV(src[0], src[0], src[0], src[1]);
+}
+
+// Inverted CMYK as written by Photoshop, each of C, M and Y times K is the red, green and blue
+static void pixconv_cmyk_inverted_c(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 4) {
+    int k = src[3];
+
+    dst[x] = PIXCONV(PIXCONV_DIV255(src[0] * k), PIXCONV_DIV255(src[1] * k), PIXCONV_DIV255(src[2] * k), 0xFF);
+  }
+}
+
+static void pixconv_to_rgb_c(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, dst += 3) {
+    dst[0] = (uint8_t)(src[x] >> 24);
+    dst[1] = (uint8_t)(src[x] >> 16);
+    dst[2] = (uint8_t)(src[x] >> 8);
+  }
+}
+
+static void pixconv_to_rgba_c(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, dst += 4) {
+    dst[0] = (uint8_t)(src[x] >> 24);
+    dst[1] = (uint8_t)(src[x] >> 16);
+    dst[2] = (uint8_t)(src[x] >> 8);
+    dst[3] = (uint8_t)src[x];
+  }
+}
+
+static void pixconv_to_gray_alpha_c(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, dst += 2) {
+    dst[0] = (uint8_t)(src[x] >> 8);
+    dst[1] = (uint8_t)src[x];
+  }
+}
+
+#ifdef SIMD_HAVE_SSE2
+// Reverse the bytes of each pixel, RGBA in memory to a pixel and back
+static inline __m128i pixconv_swap_sse2(__m128i px) {
+  px = _mm_or_si128(_mm_slli_epi16(px, 8), _mm_srli_epi16(px, 8));
+  px = _mm_shufflelo_epi16(px, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_shufflehi_epi16(px, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static void pixconv_rgba_sse2(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4)
+    _mm_storeu_si128((__m128i *)(dst + x), pixconv_swap_sse2(_mm_loadu_si128((const __m128i *)(src + 4 * x))));
+
+  pixconv_rgba_c(src + 4 * x, dst + x, width - x);
+}
+
+static void pixconv_to_rgba_sse2(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4)
+    _mm_storeu_si128((__m128i *)(dst + 4 * x), pixconv_swap_sse2(_mm_loadu_si128((const __m128i *)(src + x))));
+
+  pixconv_to_rgba_c(src + x, dst + 4 * x, width - x);
+}
+
+static void pixconv_bgrx_sse2(const uint8_t *src, uint32_t *dst, int width) {
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x;
+
+  // B, G, R, X in memory is the pixel shifted right by 8 with X on top
+  for (x = 0; x + 4 <= width; x += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_slli_epi32(px, 8), alpha));
+  }
+
+  pixconv_bgrx_c(src + 4 * x, dst + x, width - x);
+}
+
+static void pixconv_gray_sse2(const uint8_t *src, uint32_t *dst, int width) {
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    __m128i g = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i lo = _mm_unpacklo_epi8(g, g);
+    __m128i hi = _mm_unpackhi_epi8(g, g);
+
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+    _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+    _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+    _mm_storeu_si128((__m128i *)(dst + x + 12), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+  }
+
+  pixconv_gray_c(src + x, dst + x, width - x);
+}
+
+static void pixconv_gray_alpha_sse2(const uint8_t *src, uint32_t *dst, int width) {
+  const __m128i low = _mm_set1_epi16(0xFF);
+  int x;
+
+  for (x = 0; x + 8 <= width; x += 8) {
+    __m128i ga = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+    __m128i g = _mm_and_si128(ga, low);
+    // The bottom half of each pixel is alpha then gray, the top half gray twice
+    __m128i bottom = _mm_or_si128(_mm_slli_epi16(ga, 8), _mm_srli_epi16(ga, 8));
+    __m128i top = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_unpacklo_epi16(bottom, top));
+    _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_unpackhi_epi16(bottom, top));
+  }
+
+  pixconv_gray_alpha_c(src + 2 * x, dst + x, width - x);
+}
+
+// C, M, Y, K of two pixels as 16 bits each times K and divided by 255
+static inline __m128i pixconv_cmyk_mul_sse2(__m128i cmyk) {
+  __m128i k = _mm_shufflehi_epi16(_mm_shufflelo_epi16(cmyk, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i p = _mm_mullo_epi16(cmyk, k);
+
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(p, _mm_set1_epi16(1)), _mm_srli_epi16(p, 8)), 8);
+}
+
+static void pixconv_cmyk_inverted_sse2(const uint8_t *src, uint32_t *dst, int width) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4) {
+    __m128i cmyk = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+    __m128i lo = pixconv_cmyk_mul_sse2(_mm_unpacklo_epi8(cmyk, zero));
+    __m128i hi = pixconv_cmyk_mul_sse2(_mm_unpackhi_epi8(cmyk, zero));
+
+    // R, G, B, K in memory, reversed into a pixel with alpha in place of K
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(pixconv_swap_sse2(_mm_packus_epi16(lo, hi)), alpha));
+  }
+
+  pixconv_cmyk_inverted_c(src + 4 * x, dst + x, width - x);
+}
+
+static void pixconv_to_gray_alpha_sse2(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 8 <= width; x += 8) {
+    // Blue then alpha, the bottom half of each pixel with its bytes swapped
+    __m128i lo = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(src + x + 4));
+
+    lo = _mm_or_si128(_mm_slli_epi16(lo, 8), _mm_srli_epi16(lo, 8));
+    hi = _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(hi, 8));
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_packs_epi32(lo, hi));
+  }
+
+  pixconv_to_gray_alpha_c(src + x, dst + 2 * x, width - x);
+}
+#endif
+
+#ifdef SIMD_HAVE_AVX2
+// Four 3-byte pixels at p and four at p + 12, one group in each lane. Reads 4 bytes past the 24.
+__attribute__ ((target("avx2")))
+static inline __m256i pixconv_load24_avx2(const uint8_t *p) {
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                 _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+}
+
+__attribute__ ((target("avx2")))
+static void pixconv_rgb_avx2(const uint8_t *src, uint32_t *dst, int width) {
+  const __m256i order = _mm256_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+                                         -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+  const __m256i alpha = _mm256_set1_epi32(0xFF);
+  int x;
+
+  for (x = 0; x + 10 <= width; x += 8) {
+    __m256i px = _mm256_shuffle_epi8(pixconv_load24_avx2(src + 3 * x), order);
+    _mm256_storeu_si256((__m256i *)(dst + x), _mm256_or_si256(px, alpha));
+  }
+
+  pixconv_rgb_c(src + 3 * x, dst + x, width - x);
+}
+
+__attribute__ ((target("avx2")))
+static void pixconv_bgr_avx2(const uint8_t *src, uint32_t *dst, int width) {
+  const __m256i order = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                         -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m256i alpha = _mm256_set1_epi32(0xFF);
+  int x;
+
+  for (x = 0; x + 10 <= width; x += 8) {
+    __m256i px = _mm256_shuffle_epi8(pixconv_load24_avx2(src + 3 * x), order);
+    _mm256_storeu_si256((__m256i *)(dst + x), _mm256_or_si256(px, alpha));
+  }
+
+  pixconv_bgr_c(src + 3 * x, dst + x, width - x);
+}
+
+__attribute__ ((target("avx2")))
+static void pixconv_to_rgb_avx2(const uint32_t *src, uint8_t *dst, int width) {
+  const __m256i order = _mm256_setr_epi8(3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1,
+                                         3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+  int x;
+
+  // Each lane leaves 12 bytes, stored 16 at a time with the second store over the end of the first
+  for (x = 0; x + 10 <= width; x += 8) {
+    __m256i rgb = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + x)), order);
+
+    _mm_storeu_si128((__m128i *)(dst + 3 * x), _mm256_castsi256_si128(rgb));
+    _mm_storeu_si128((__m128i *)(dst + 3 * x + 12), _mm256_extracti128_si256(rgb, 1));
+  }
+
+  pixconv_to_rgb_c(src + x, dst + 3 * x, width - x);
+}
+#endif
+
+#ifdef SIMD_HAVE_NEON
+static void pixconv_rgb_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8x16x3_t in = vld3q_u8(src + 3 * x);
+    uint8x16x4_t out;
+
+    out.val[0] = vdupq_n_u8(0xFF);
+    out.val[1] = in.val[2];
+    out.val[2] = in.val[1];
+    out.val[3] = in.val[0];
+    vst4q_u8((uint8_t *)(dst + x), out);
+  }
+
+  pixconv_rgb_c(src + 3 * x, dst + x, width - x);
+}
+
+static void pixconv_bgr_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8x16x3_t in = vld3q_u8(src + 3 * x);
+    uint8x16x4_t out;
+
+    out.val[0] = vdupq_n_u8(0xFF);
+    out.val[1] = in.val[0];
+    out.val[2] = in.val[1];
+    out.val[3] = in.val[2];
+    vst4q_u8((uint8_t *)(dst + x), out);
+  }
+
+  pixconv_bgr_c(src + 3 * x, dst + x, width - x);
+}
+
+static void pixconv_bgrx_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4) {
+    uint32x4_t px = vreinterpretq_u32_u8(vld1q_u8(src + 4 * x));
+    vst1q_u32(dst + x, vorrq_u32(vshlq_n_u32(px, 8), vdupq_n_u32(0xFF)));
+  }
+
+  pixconv_bgrx_c(src + 4 * x, dst + x, width - x);
+}
+
+static void pixconv_rgba_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4)
+    vst1q_u8((uint8_t *)(dst + x), vrev32q_u8(vld1q_u8(src + 4 * x)));
+
+  pixconv_rgba_c(src + 4 * x, dst + x, width - x);
+}
+
+static void pixconv_to_rgba_neon(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4)
+    vst1q_u8(dst + 4 * x, vrev32q_u8(vld1q_u8((const uint8_t *)(src + x))));
+
+  pixconv_to_rgba_c(src + x, dst + 4 * x, width - x);
+}
+
+static void pixconv_gray_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8x16x4_t out;
+
+    out.val[0] = vdupq_n_u8(0xFF);
+    out.val[1] = out.val[2] = out.val[3] = vld1q_u8(src + x);
+    vst4q_u8((uint8_t *)(dst + x), out);
+  }
+
+  pixconv_gray_c(src + x, dst + x, width - x);
+}
+
+static void pixconv_gray_alpha_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8x16x2_t in = vld2q_u8(src + 2 * x);
+    uint8x16x4_t out;
+
+    out.val[0] = in.val[1];
+    out.val[1] = out.val[2] = out.val[3] = in.val[0];
+    vst4q_u8((uint8_t *)(dst + x), out);
+  }
+
+  pixconv_gray_alpha_c(src + 2 * x, dst + x, width - x);
+}
+
+static inline uint8x8_t pixconv_mul255_neon(uint8x8_t a, uint8x8_t k) {
+  uint16x8_t p = vmull_u8(a, k);
+
+  return vshrn_n_u16(vsraq_n_u16(vaddq_u16(p, vdupq_n_u16(1)), p, 8), 8);
+}
+
+static void pixconv_cmyk_inverted_neon(const uint8_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 8 <= width; x += 8) {
+    uint8x8x4_t in = vld4_u8(src + 4 * x);
+    uint8x8x4_t out;
+
+    out.val[0] = vdup_n_u8(0xFF);
+    out.val[1] = pixconv_mul255_neon(in.val[2], in.val[3]);
+    out.val[2] = pixconv_mul255_neon(in.val[1], in.val[3]);
+    out.val[3] = pixconv_mul255_neon(in.val[0], in.val[3]);
+    vst4_u8((uint8_t *)(dst + x), out);
+  }
+
+  pixconv_cmyk_inverted_c(src + 4 * x, dst + x, width - x);
+}
+
+static void pixconv_to_rgb_neon(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8x16x4_t in = vld4q_u8((const uint8_t *)(src + x));
+    uint8x16x3_t out;
+
+    out.val[0] = in.val[3];
+    out.val[1] = in.val[2];
+    out.val[2] = in.val[1];
+    vst3q_u8(dst + 3 * x, out);
+  }
+
+  pixconv_to_rgb_c(src + x, dst + 3 * x, width - x);
+}
+
+static void pixconv_to_gray_alpha_neon(const uint32_t *src, uint8_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8x16x4_t in = vld4q_u8((const uint8_t *)(src + x));
+    uint8x16x2_t out;
+
+    out.val[0] = in.val[1];
+    out.val[1] = in.val[0];
+    vst2q_u8(dst + 2 * x, out);
+  }
+
+  pixconv_to_gray_alpha_c(src + x, dst + 2 * x, width - x);
+}
+#endif
+
+// *INDENT-OFF*
+#define PIXCONV_KERNEL_C { pixconv_rgb_c, pixconv_bgr_c, pixconv_bgrx_c, pixconv_rgba_c, pixconv_gray_c, \
+  pixconv_gray_alpha_c, pixconv_cmyk_inverted_c, pixconv_to_rgb_c, pixconv_to_rgba_c, pixconv_to_gray_alpha_c }
+
+// Formats needing byte shuffles SSE2 does not have stay with C until AVX2
+static const PixconvKernel Kernels[] = {
+  PIXCONV_KERNEL_C,
+#ifdef SIMD_HAVE_SSE2
+  { pixconv_rgb_c, pixconv_bgr_c, pixconv_bgrx_sse2, pixconv_rgba_sse2, pixconv_gray_sse2,
+    pixconv_gray_alpha_sse2, pixconv_cmyk_inverted_sse2, pixconv_to_rgb_c, pixconv_to_rgba_sse2,
+    pixconv_to_gray_alpha_sse2 },
+#else
+  PIXCONV_KERNEL_C,
+#endif
+#ifdef SIMD_HAVE_AVX2
+  { pixconv_rgb_avx2, pixconv_bgr_avx2, pixconv_bgrx_sse2, pixconv_rgba_sse2, pixconv_gray_sse2,
+    pixconv_gray_alpha_sse2, pixconv_cmyk_inverted_sse2, pixconv_to_rgb_avx2, pixconv_to_rgba_sse2,
+    pixconv_to_gray_alpha_sse2 },
+#else
+  PIXCONV_KERNEL_C,
+#endif
+#ifdef SIMD_HAVE_NEON
+  { pixconv_rgb_neon, pixconv_bgr_neon, pixconv_bgrx_neon, pixconv_rgba_neon, pixconv_gray_neon,
+    pixconv_gray_alpha_neon, pixconv_cmyk_inverted_neon, pixconv_to_rgb_neon, pixconv_to_rgba_neon,
+    pixconv_to_gray_alpha_neon },
+#else
+  PIXCONV_KERNEL_C,
+#endif
+};
+// *INDENT-ON*
+
+void pixconv_rgb(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].rgb(src, dst, width);
+}
+
+void pixconv_bgr(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].bgr(src, dst, width);
+}
+
+// 32-bit BMP, the fourth byte is not used
+void pixconv_bgrx(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].bgrx(src, dst, width);
+}
+
+void pixconv_rgba(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].rgba(src, dst, width);
+}
+
+void pixconv_gray(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].gray(src, dst, width);
+}
+
+void pixconv_gray_alpha(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].gray_alpha(src, dst, width);
+}
+
+void pixconv_cmyk_inverted(const uint8_t *src, uint32_t *dst, int width) {
+  Kernels[simd_get()].cmyk_inverted(src, dst, width);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Look up a row of 8-bit palette indexes. A table of finished pixels, alpha included, turns
+///   each pixel into a single load.
+///
+/// @param src   The indexes.
+/// @param dst   The pixels.
+/// @param width Number of pixels.
+/// @param lut   The pixel of each of the 256 indexes.
+///-------------------------------------------------------------------------------------------------
+
+void pixconv_palette(const uint8_t *src, uint32_t *dst, int width, const uint32_t *lut) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4) {
+    dst[x] = lut[src[x]];
+    dst[x + 1] = lut[src[x + 1]];
+    dst[x + 2] = lut[src[x + 2]];
+    dst[x + 3] = lut[src[x + 3]];
+  }
+
+  for (; x < width; x++)
+    dst[x] = lut[src[x]];
+}                               /* pixconv_palette() */
+
+void pixconv_to_rgb(const uint32_t *src, uint8_t *dst, int width) {
+  Kernels[simd_get()].to_rgb(src, dst, width);
+}
+
+void pixconv_to_rgba(const uint32_t *src, uint8_t *dst, int width) {
+  Kernels[simd_get()].to_rgba(src, dst, width);
+}
+
+void pixconv_to_gray_alpha(const uint32_t *src, uint8_t *dst, int width) {
+  Kernels[simd_get()].to_gray_alpha(src, dst, width);
+}
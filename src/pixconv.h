@@ -0,0 +1,19 @@
+#ifndef _PIXCONV_H
+#define _PIXCONV_H
+
+// Rows of decoded pixels into the 32-bit pixels of a pixbuf, opaque unless the format has alpha
+void pixconv_rgb(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_bgr(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_bgrx(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_rgba(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_gray(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_gray_alpha(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_cmyk_inverted(const uint8_t *src, uint32_t *dst, int width);
+void pixconv_palette(const uint8_t *src, uint32_t *dst, int width, const uint32_t *lut);
+
+// Rows of a pixbuf into the pixels an encoder wants, gray being the blue channel
+void pixconv_to_rgb(const uint32_t *src, uint8_t *dst, int width);
+void pixconv_to_rgba(const uint32_t *src, uint8_t *dst, int width);
+void pixconv_to_gray_alpha(const uint32_t *src, uint8_t *dst, int width);
+
+#endif // _PIXCONV_H
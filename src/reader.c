@@ -0,0 +1,274 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\reader.c
+//
+// summary: Per-file reader shared by everything that looks at a video. The native container
+//          parsers, the MPEG probe and libavformat, through a custom AVIOContext, all read the
+//          file through one small block cache, so the header bytes are read from disk once and
+//          the bytes read for each file can be counted.
+///-------------------------------------------------------------------------------------------------
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libavformat/avformat.h>
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "reader.h"
+#include "util.h"
+
+#define READER_DIRECT (512 * 1024)    // reads at least this long bypass the cache
+#define READER_AVIO_SIZE (32 * 1024)  // buffer of the AVIOContext
+
+///-------------------------------------------------------------------------------------------------
+///  Open a file for reading through the block cache.
+///
+/// @param path Full path of the file.
+///
+/// @return NULL if the file cannot be opened.
+///-------------------------------------------------------------------------------------------------
+
+Reader *reader_open(const char *path) {
+  Reader *rd = (Reader *)calloc(1, sizeof(Reader));
+  if (rd == NULL) {
+    FATAL("Out of memory for new Reader object\n");
+    return NULL;
+  }
+
+  rd->blocks = (uint8_t *)malloc(READER_BLOCKS * READER_BLOCK_SIZE);
+  if (rd->blocks == NULL) {
+    FATAL("Out of memory for reader blocks\n");
+    free(rd);
+    return NULL;
+  }
+
+  if ((rd->fp = fopen(path, "rb")) == NULL) {
+    LOG_WARN("Cannot open %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  if (SeekFile(rd->fp, 0, SEEK_END) != 0) {
+    LOG_WARN("Cannot seek in %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+  rd->size = TellFile(rd->fp);
+  rd->path = path;
+
+  LOG_MEM("new Reader @ %p\n", rd);
+
+  return rd;
+
+fail:
+  if (rd->fp)
+    fclose(rd->fp);
+  free(rd->blocks);
+  free(rd);
+
+  return NULL;
+}                               /* reader_open() */
+
+// Read straight from the file
+static uint32_t reader_read_file(Reader *rd, uint64_t offset, void *dst, uint32_t len) {
+  size_t n;
+
+  if (SeekFile(rd->fp, offset, SEEK_SET) != 0)
+    return 0;
+
+  n = fread(dst, 1, len, rd->fp);
+  rd->bytes_read += n;
+  rd->reads++;
+
+  return (uint32_t)n;
+}                               /* reader_read_file() */
+
+// Find the block holding offset, reading it if it is not cached. Returns NULL past the end of the file.
+static uint8_t *reader_block(Reader *rd, uint64_t offset, uint32_t *len) {
+  uint64_t start = offset - offset % READER_BLOCK_SIZE;
+  int i, victim = 0;
+
+  for (i = 0; i < READER_BLOCKS; i++) {
+    if (rd->lengths[i] && rd->offsets[i] == start)
+      goto found;
+    if (rd->stamps[i] < rd->stamps[victim])
+      victim = i;
+  }
+
+  i = victim;
+  rd->offsets[i] = start;
+  rd->lengths[i] = reader_read_file(rd, start, rd->blocks + i * READER_BLOCK_SIZE,
+                                    (uint32_t)MIN(READER_BLOCK_SIZE, rd->size - start));
+  if (!rd->lengths[i])
+    return NULL;
+
+found:
+  rd->stamps[i] = ++rd->clock;
+  *len = rd->lengths[i];
+
+  return rd->blocks + i * READER_BLOCK_SIZE;
+}                               /* reader_block() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read part of the file. Short reads are served from the block cache, long ones like a large
+///   box or an attachment go to the file directly.
+///
+/// @param rd     The reader.
+/// @param offset Offset in the file.
+/// @param dst    Destination of the bytes.
+/// @param len    Number of bytes wanted.
+///
+/// @return Number of bytes read, less than len only at the end of the file or on an error.
+///-------------------------------------------------------------------------------------------------
+
+uint32_t reader_read(Reader *rd, uint64_t offset, void *dst, uint32_t len) {
+  uint8_t *out = (uint8_t *)dst;
+  uint32_t done = 0;
+
+  if (offset >= rd->size)
+    return 0;
+
+  len = (uint32_t)MIN(len, rd->size - offset);
+  rd->bytes_requested += len;
+
+  if (len >= READER_DIRECT)
+    return reader_read_file(rd, offset, dst, len);
+
+  while (done < len) {
+    uint32_t block_len, skip, n;
+    uint8_t *block = reader_block(rd, offset + done, &block_len);
+
+    skip = (uint32_t)((offset + done) % READER_BLOCK_SIZE);
+    if (block == NULL || skip >= block_len)
+      break;
+
+    n = MIN(block_len - skip, len - done);
+    memcpy(out + done, block + skip, n);
+    done += n;
+  }
+
+  return done;
+}                               /* reader_read() */
+
+///-------------------------------------------------------------------------------------------------
+///  Append part of the file to a buffer.
+///
+/// @param rd     The reader.
+/// @param buf    Buffer the bytes are appended to.
+/// @param offset Offset in the file.
+/// @param len    Number of bytes wanted.
+///
+/// @return Number of bytes appended.
+///-------------------------------------------------------------------------------------------------
+
+uint32_t reader_load(Reader *rd, Buffer *buf, uint64_t offset, uint32_t len) {
+  uint32_t n;
+
+  if (!len)
+    return 0;
+
+  n = reader_read(rd, offset, buffer_append_space(buf, len), len);
+  if (n < len)
+    buffer_consume_end(buf, len - n);
+
+  return n;
+}                               /* reader_load() */
+
+static int reader_avio_read(void *opaque, uint8_t *buf, int buf_size) {
+  Reader *rd = (Reader *)opaque;
+  uint32_t n = reader_read(rd, rd->pos, buf, buf_size);
+
+  if (!n)
+    return AVERROR_EOF;
+
+  rd->pos += n;
+
+  return n;
+}                               /* reader_avio_read() */
+
+static int64_t reader_avio_seek(void *opaque, int64_t offset, int whence) {
+  Reader *rd = (Reader *)opaque;
+
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return rd->size;
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += rd->pos;
+      break;
+    case SEEK_END:
+      offset += rd->size;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+
+  if (offset < 0)
+    return AVERROR(EINVAL);
+
+  rd->pos = offset;
+
+  return offset;
+}                               /* reader_avio_seek() */
+
+///-------------------------------------------------------------------------------------------------
+///  Get an AVIOContext reading the file through the reader, for the pb of a format context
+///   before avformat_open_input(). libavformat does not free a custom context, reader_close()
+///   does. Each call replaces the previous context and starts at the beginning of the file.
+///
+/// @param rd The reader.
+///
+/// @return NULL if out of memory.
+///-------------------------------------------------------------------------------------------------
+
+AVIOContext *reader_avio(Reader *rd) {
+  uint8_t *buf;
+
+  if (rd->avio) {
+    av_freep(&rd->avio->buffer);
+    avio_context_free(&rd->avio);
+  }
+
+  rd->pos = 0;
+
+  if ((buf = (uint8_t *)av_malloc(READER_AVIO_SIZE)) == NULL) {
+    FATAL("Out of memory for AVIO buffer\n");
+    return NULL;
+  }
+
+  rd->avio = avio_alloc_context(buf, READER_AVIO_SIZE, 0, rd, reader_avio_read, NULL, reader_avio_seek);
+  if (rd->avio == NULL) {
+    FATAL("Out of memory for AVIO context\n");
+    av_free(buf);
+  }
+
+  return rd->avio;
+}                               /* reader_avio() */
+
+///-------------------------------------------------------------------------------------------------
+///  Close the file and free the reader. A format context using reader_avio() must be closed
+///   first.
+///
+/// @param rd The reader.
+///-------------------------------------------------------------------------------------------------
+
+void reader_close(Reader *rd) {
+  LOG_DEBUG("Read %"PRIu64" of %"PRIu64" bytes in %d reads, %"PRIu64" bytes requested: %s\n",
+            rd->bytes_read, rd->size, rd->reads, rd->bytes_requested, rd->path);
+
+  if (rd->avio) {
+    av_freep(&rd->avio->buffer);
+    avio_context_free(&rd->avio);
+  }
+
+  fclose(rd->fp);
+  free(rd->blocks);
+
+  LOG_MEM("destroy Reader @ %p\n", rd);
+  free(rd);
+}                               /* reader_close() */
@@ -0,0 +1,32 @@
+#ifndef _READER_H
+#define _READER_H
+
+#define READER_BLOCK_SIZE (64 * 1024)
+#define READER_BLOCKS 16
+
+typedef struct {
+  FILE *fp;
+  const char *path;
+  uint64_t size;
+  uint64_t pos;                 // position of the AVIOContext
+  AVIOContext *avio;
+
+  // Block cache, least recently used block replaced first
+  uint8_t *blocks;
+  uint64_t offsets[READER_BLOCKS];
+  uint32_t lengths[READER_BLOCKS];  // 0 for an unused block
+  uint32_t stamps[READER_BLOCKS];
+  uint32_t clock;
+
+  uint64_t bytes_read;          // from the file
+  uint64_t bytes_requested;     // by the readers, cached or not
+  int reads;
+} Reader;
+
+Reader *reader_open(const char *path);
+uint32_t reader_read(Reader *rd, uint64_t offset, void *dst, uint32_t len);
+uint32_t reader_load(Reader *rd, Buffer *buf, uint64_t offset, uint32_t len);
+AVIOContext *reader_avio(Reader *rd);
+void reader_close(Reader *rd);
+
+#endif // _READER_H
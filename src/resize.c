@@ -0,0 +1,677 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\resize.c
+//
+// summary: Separable box resampler for thumbnails, the same area-averaging filter libgd's
+//          copyResampled uses. The weights of each destination column and row are computed once,
+//          each source row is resampled horizontally once into a small ring of rows, and those are
+//          combined vertically. Weights are 14-bit and add up to exactly 1, so the accumulators
+//          cannot overflow whatever the size of the source. The row kernels have C, SSE2, AVX2 and
+//          NEON versions which give identical results, simd_get() picks one.
+//          EXIF orientation is applied after resizing, by a separate pass moving the resized rows to
+//          their place in tiles, with SIMD 4x4 transposes for the rotations by 90 degrees.
+///-------------------------------------------------------------------------------------------------
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include <libmediascan.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "resize.h"
+#include "simd.h"
+
+#define RESIZE_BITS 14          // of the weights, the weights of a pixel add up to RESIZE_ONE
+#define RESIZE_ONE (1 << RESIZE_BITS)
+#define RESIZE_HSHIFT 7         // dropped after the horizontal pass, channels keep 7 more bits
+#define RESIZE_VSHIFT (2 * RESIZE_BITS - RESIZE_HSHIFT)
+#define RESIZE_TILE 8           // pixels along each side of a tile to rotate
+
+// The source pixels making up each destination pixel along one axis
+typedef struct {
+  int taps;                     // source pixels per destination pixel, the most any of them needs
+  int *start;                   // first source pixel of each destination pixel
+  int16_t *weights;             // taps weights for each destination pixel, some at the end may be 0
+} ResizeFilter;
+
+// Resample a source row horizontally into 4 channels of 16 bits per destination pixel
+typedef void (*resize_hrow_t) (const uint32_t *src, int16_t *out, const ResizeFilter *f, int width);
+
+// Combine taps horizontally resampled rows into a destination row
+typedef void (*resize_vrow_t) (int16_t **rows, const int16_t *weights, int taps, uint32_t *dst, int width,
+                               int has_alpha);
+
+// Copy a row of width pixels into dst reversed, dst[-x] = src[x]
+typedef void (*resize_rrow_t) (const uint32_t *src, uint32_t *dst, int width);
+
+// Move the pixels of an image rotated by 90 degrees, the pixel at x, y to dst + x * xstep + y * ystep,
+// ystep being 1 or -1
+typedef void (*resize_transpose_t) (const uint32_t *src, int width, int height, uint32_t *dst, ptrdiff_t xstep,
+                                    int ystep);
+
+typedef struct {
+  resize_hrow_t hrow;
+  resize_vrow_t vrow;
+  resize_rrow_t rrow;
+  resize_transpose_t transpose;
+} ResizeKernel;
+
+// Move a 4x4 block of pixels at s, in an image width pixels wide, for resize_transpose_tiles()
+typedef void (*resize_block_t) (const uint32_t *s, int width, uint32_t *d, ptrdiff_t xstep, int ystep);
+
+static void resize_filter_free(ResizeFilter *f) {
+  free(f->start);
+  free(f->weights);
+}
+
+// Weigh each source pixel by how much of it falls into the destination pixel, like libgd
+static int resize_filter_init(ResizeFilter *f, int src_len, int dst_len) {
+  double scale = (double)src_len / dst_len;
+  int i, j;
+
+  f->taps = 1;
+  for (i = 0; i < dst_len; i++) {
+    int first = (int)(i * scale);
+    int last = MIN((int)ceil((i + 1) * scale), src_len) - 1;
+
+    if (last - first + 1 > f->taps)
+      f->taps = last - first + 1;
+  }
+
+  f->start = (int *)malloc(dst_len * sizeof(int));
+  f->weights = (int16_t *)calloc((size_t)dst_len * f->taps, sizeof(int16_t));
+  if (f->start == NULL || f->weights == NULL) {
+    FATAL("Out of memory for resize filter\n");
+    resize_filter_free(f);
+    return 0;
+  }
+
+  for (i = 0; i < dst_len; i++) {
+    double s1 = i * scale;
+    double s2 = MIN((i + 1) * scale, src_len);
+    double overlap, total = 0;
+    int16_t *w = f->weights + (size_t)i * f->taps;
+    int sum = 0, big = 0;
+
+    // Taps past the last pixel are moved in front of the first, with no weight
+    f->start[i] = MIN((int)s1, src_len - f->taps);
+
+    for (j = 0; j < f->taps; j++) {
+      overlap = MIN(f->start[i] + j + 1, s2) - MAX(f->start[i] + j, s1);
+      if (overlap > 0)
+        total += overlap;
+    }
+
+    for (j = 0; j < f->taps; j++) {
+      overlap = MIN(f->start[i] + j + 1, s2) - MAX(f->start[i] + j, s1);
+      if (overlap > 0) {
+        w[j] = (int16_t)(overlap / total * RESIZE_ONE + 0.5);
+        sum += w[j];
+        if (w[j] > w[big])
+          big = j;
+      }
+    }
+
+    // Rounding leftovers go to the heaviest tap, so the weights add up to exactly 1
+    w[big] += RESIZE_ONE - sum;
+  }
+
+  return 1;
+}                               /* resize_filter_init() */
+
+static void resize_hrow_c(const uint32_t *src, int16_t *out, const ResizeFilter *f, int width) {
+  int x, k;
+
+  for (x = 0; x < width; x++) {
+    const uint8_t *p = (const uint8_t *)(src + f->start[x]);
+    const int16_t *w = f->weights + (size_t)x * f->taps;
+    int32_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+
+    for (k = 0; k < f->taps; k++, p += 4) {
+      c0 += p[0] * w[k];
+      c1 += p[1] * w[k];
+      c2 += p[2] * w[k];
+      c3 += p[3] * w[k];
+    }
+
+    out[4 * x] = (int16_t)((c0 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT);
+    out[4 * x + 1] = (int16_t)((c1 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT);
+    out[4 * x + 2] = (int16_t)((c2 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT);
+    out[4 * x + 3] = (int16_t)((c3 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT);
+  }
+}                               /* resize_hrow_c() */
+
+// Destination pixels from from to width, also the tail of the SIMD kernels
+static void resize_vrow_range(int16_t **rows, const int16_t *weights, int taps, uint32_t *dst, int from, int width,
+                              int has_alpha) {
+  uint8_t *d = (uint8_t *)dst;
+  int i, k;
+
+  for (i = 4 * from; i < 4 * width; i++) {
+    int32_t c = 0;
+
+    for (k = 0; k < taps; k++)
+      c += rows[k][i] * weights[k];
+
+    c = (c + (1 << (RESIZE_VSHIFT - 1))) >> RESIZE_VSHIFT;
+    d[i] = (uint8_t)(c > 255 ? 255 : c);
+  }
+
+  if (!has_alpha) {
+    for (i = from; i < width; i++)
+      dst[i] |= 0xFF;
+  }
+}                               /* resize_vrow_range() */
+
+static void resize_vrow_c(int16_t **rows, const int16_t *weights, int taps, uint32_t *dst, int width,
+                          int has_alpha) {
+  resize_vrow_range(rows, weights, taps, dst, 0, width, has_alpha);
+}
+
+static void resize_rrow_c(const uint32_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x < width; x++)
+    dst[-x] = src[x];
+}
+
+// Move the pixels from x0, y0 up to x1, y1 one at a time, also the edges the SIMD kernels leave
+static void resize_transpose_range(const uint32_t *src, int width, uint32_t *dst, ptrdiff_t xstep, int ystep,
+                                   int x0, int y0, int x1, int y1) {
+  int x, y;
+
+  for (x = x0; x < x1; x++) {
+    const uint32_t *s = src + x;
+    uint32_t *d = dst + x * xstep;
+
+    for (y = y0; y < y1; y++)
+      d[y * ystep] = s[(size_t)y * width];
+  }
+}                               /* resize_transpose_range() */
+
+// Transpose tile by tile, so the rows read and the rows written stay in the cache while a tile is
+// moved. block moves 4x4 blocks of a tile, the rest is moved a pixel at a time.
+static inline void resize_transpose_tiles(const uint32_t *src, int width, int height, uint32_t *dst,
+                                          ptrdiff_t xstep, int ystep, resize_block_t block) {
+  int tx, ty, x, y;
+
+  for (ty = 0; ty < height; ty += RESIZE_TILE) {
+    int th = MIN(RESIZE_TILE, height - ty);
+    int h4 = block ? th & ~3 : 0;
+
+    for (tx = 0; tx < width; tx += RESIZE_TILE) {
+      int tw = MIN(RESIZE_TILE, width - tx);
+      int w4 = block ? tw & ~3 : 0;
+
+      for (y = ty; y < ty + h4; y += 4) {
+        for (x = tx; x < tx + w4; x += 4)
+          block(src + (size_t)y * width + x, width, dst + x * xstep + y * ystep, xstep, ystep);
+      }
+
+      resize_transpose_range(src, width, dst, xstep, ystep, tx + w4, ty, tx + tw, ty + th);
+      resize_transpose_range(src, width, dst, xstep, ystep, tx, ty + h4, tx + w4, ty + th);
+    }
+  }
+}                               /* resize_transpose_tiles() */
+
+static void resize_transpose_c(const uint32_t *src, int width, int height, uint32_t *dst, ptrdiff_t xstep,
+                               int ystep) {
+  resize_transpose_tiles(src, width, height, dst, xstep, ystep, NULL);
+}
+
+#ifdef SIMD_HAVE_SSE2
+// Two weights in each 32-bit lane, for _mm_madd_epi16 of two interleaved pixels or rows
+# define RESIZE_PAIR(w0, w1) ((int)((uint32_t)(uint16_t)(w1) << 16 | (uint16_t)(w0)))
+
+// Add the channels of the pixels at p weighed by w to acc, two pixels or the last one
+static inline __m128i resize_hpair_sse2(__m128i acc, const uint32_t *p, const int16_t *w, int n) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i px;
+
+  if (n == 2) {
+    px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+    px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+    return _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(RESIZE_PAIR(w[0], w[1]))));
+  }
+
+  px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p[0]), zero), zero);
+  return _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(RESIZE_PAIR(w[0], 0))));
+}
+
+static inline void resize_hstore_sse2(int16_t *out, __m128i acc) {
+  acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << (RESIZE_HSHIFT - 1))), RESIZE_HSHIFT);
+  _mm_storel_epi64((__m128i *)out, _mm_packs_epi32(acc, acc));
+}
+
+static void resize_hrow_sse2(const uint32_t *src, int16_t *out, const ResizeFilter *f, int width) {
+  int x, k;
+
+  for (x = 0; x < width; x++) {
+    const uint32_t *p = src + f->start[x];
+    const int16_t *w = f->weights + (size_t)x * f->taps;
+    __m128i acc = _mm_setzero_si128();
+
+    for (k = 0; k + 1 < f->taps; k += 2)
+      acc = resize_hpair_sse2(acc, p + k, w + k, 2);
+    if (k < f->taps)
+      acc = resize_hpair_sse2(acc, p + k, w + k, 1);
+
+    resize_hstore_sse2(out + 4 * x, acc);
+  }
+}                               /* resize_hrow_sse2() */
+
+static void resize_vrow_sse2(int16_t **rows, const int16_t *weights, int taps, uint32_t *dst, int width,
+                             int has_alpha) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (RESIZE_VSHIFT - 1));
+  const __m128i alpha = _mm_set1_epi32(has_alpha ? 0 : 0xFF);
+  int i, k;
+
+  // Two pixels at a time
+  for (i = 0; i + 8 <= 4 * width; i += 8) {
+    __m128i lo = zero, hi = zero, a, b, w;
+
+    for (k = 0; k + 1 < taps; k += 2) {
+      a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+      b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + i));
+      w = _mm_set1_epi32(RESIZE_PAIR(weights[k], weights[k + 1]));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+    if (k < taps) {
+      a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+      w = _mm_set1_epi32(RESIZE_PAIR(weights[k], 0));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), w));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), w));
+    }
+
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, round), RESIZE_VSHIFT);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, round), RESIZE_VSHIFT);
+    a = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i *)(dst + i / 4), _mm_or_si128(_mm_packus_epi16(a, a), alpha));
+  }
+
+  resize_vrow_range(rows, weights, taps, dst, i / 4, width, has_alpha);
+}                               /* resize_vrow_sse2() */
+
+static void resize_rrow_sse2(const uint32_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i *)(src + x));
+    _mm_storeu_si128((__m128i *)(dst - x - 3), _mm_shuffle_epi32(px, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+
+  for (; x < width; x++)
+    dst[-x] = src[x];
+}                               /* resize_rrow_sse2() */
+
+static inline void resize_block_sse2(const uint32_t *s, int width, uint32_t *d, ptrdiff_t xstep, int ystep) {
+  __m128i r0 = _mm_loadu_si128((const __m128i *)s);
+  __m128i r1 = _mm_loadu_si128((const __m128i *)(s + width));
+  __m128i r2 = _mm_loadu_si128((const __m128i *)(s + 2 * width));
+  __m128i r3 = _mm_loadu_si128((const __m128i *)(s + 3 * width));
+  __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+  __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+  __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+  __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+  __m128i c[4];
+  int i;
+
+  // Column i of the block
+  c[0] = _mm_unpacklo_epi64(t0, t1);
+  c[1] = _mm_unpackhi_epi64(t0, t1);
+  c[2] = _mm_unpacklo_epi64(t2, t3);
+  c[3] = _mm_unpackhi_epi64(t2, t3);
+
+  for (i = 0; i < 4; i++) {
+    if (ystep > 0)
+      _mm_storeu_si128((__m128i *)(d + i * xstep), c[i]);
+    else
+      _mm_storeu_si128((__m128i *)(d + i * xstep - 3), _mm_shuffle_epi32(c[i], _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+}                               /* resize_block_sse2() */
+
+static void resize_transpose_sse2(const uint32_t *src, int width, int height, uint32_t *dst, ptrdiff_t xstep,
+                                  int ystep) {
+  resize_transpose_tiles(src, width, height, dst, xstep, ystep, resize_block_sse2);
+}
+#endif
+
+#ifdef SIMD_HAVE_AVX2
+__attribute__ ((target("avx2")))
+static void resize_hrow_avx2(const uint32_t *src, int16_t *out, const ResizeFilter *f, int width) {
+  int x, k;
+
+  for (x = 0; x < width; x++) {
+    const uint32_t *p = src + f->start[x];
+    const int16_t *w = f->weights + (size_t)x * f->taps;
+    __m256i acc8 = _mm256_setzero_si256();
+    __m128i acc;
+
+    // Four pixels at a time, two in each lane
+    for (k = 0; k + 3 < f->taps; k += 4) {
+      __m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + k)));
+      __m256i wk = _mm256_setr_epi32(RESIZE_PAIR(w[k], w[k + 1]), RESIZE_PAIR(w[k], w[k + 1]),
+                                     RESIZE_PAIR(w[k], w[k + 1]), RESIZE_PAIR(w[k], w[k + 1]),
+                                     RESIZE_PAIR(w[k + 2], w[k + 3]), RESIZE_PAIR(w[k + 2], w[k + 3]),
+                                     RESIZE_PAIR(w[k + 2], w[k + 3]), RESIZE_PAIR(w[k + 2], w[k + 3]));
+
+      px = _mm256_unpacklo_epi16(px, _mm256_srli_si256(px, 8));
+      acc8 = _mm256_add_epi32(acc8, _mm256_madd_epi16(px, wk));
+    }
+
+    acc = _mm_add_epi32(_mm256_castsi256_si128(acc8), _mm256_extracti128_si256(acc8, 1));
+    for (; k + 1 < f->taps; k += 2)
+      acc = resize_hpair_sse2(acc, p + k, w + k, 2);
+    if (k < f->taps)
+      acc = resize_hpair_sse2(acc, p + k, w + k, 1);
+
+    resize_hstore_sse2(out + 4 * x, acc);
+  }
+}                               /* resize_hrow_avx2() */
+
+__attribute__ ((target("avx2")))
+static void resize_vrow_avx2(int16_t **rows, const int16_t *weights, int taps, uint32_t *dst, int width,
+                             int has_alpha) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(1 << (RESIZE_VSHIFT - 1));
+  const __m128i alpha = _mm_set1_epi32(has_alpha ? 0 : 0xFF);
+  int i, k;
+
+  // Four pixels at a time. Unpacking and packing work within each lane, so the two undo each other.
+  for (i = 0; i + 16 <= 4 * width; i += 16) {
+    __m256i lo = zero, hi = zero, a, b, w;
+
+    for (k = 0; k + 1 < taps; k += 2) {
+      a = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+      b = _mm256_loadu_si256((const __m256i *)(rows[k + 1] + i));
+      w = _mm256_set1_epi32(RESIZE_PAIR(weights[k], weights[k + 1]));
+      lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+    if (k < taps) {
+      a = _mm256_loadu_si256((const __m256i *)(rows[k] + i));
+      w = _mm256_set1_epi32(RESIZE_PAIR(weights[k], 0));
+      lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), w));
+      hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), w));
+    }
+
+    lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), RESIZE_VSHIFT);
+    hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), RESIZE_VSHIFT);
+    a = _mm256_packs_epi32(lo, hi);
+    a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, a), 0x08);
+    _mm_storeu_si128((__m128i *)(dst + i / 4), _mm_or_si128(_mm256_castsi256_si128(a), alpha));
+  }
+
+  resize_vrow_range(rows, weights, taps, dst, i / 4, width, has_alpha);
+}                               /* resize_vrow_avx2() */
+#endif
+
+#ifdef SIMD_HAVE_NEON
+static void resize_hrow_neon(const uint32_t *src, int16_t *out, const ResizeFilter *f, int width) {
+  int x, k;
+
+  for (x = 0; x < width; x++) {
+    const uint32_t *p = src + f->start[x];
+    const int16_t *w = f->weights + (size_t)x * f->taps;
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    for (k = 0; k + 1 < f->taps; k += 2) {
+      uint16x8_t px = vmovl_u8(vld1_u8((const uint8_t *)(p + k)));
+
+      acc = vmlal_n_u16(acc, vget_low_u16(px), (uint16_t)w[k]);
+      acc = vmlal_n_u16(acc, vget_high_u16(px), (uint16_t)w[k + 1]);
+    }
+    if (k < f->taps) {
+      uint16x8_t px = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(p[k])));
+
+      acc = vmlal_n_u16(acc, vget_low_u16(px), (uint16_t)w[k]);
+    }
+
+    vst1_s16(out + 4 * x, vreinterpret_s16_u16(vrshrn_n_u32(acc, RESIZE_HSHIFT)));
+  }
+}                               /* resize_hrow_neon() */
+
+static void resize_vrow_neon(int16_t **rows, const int16_t *weights, int taps, uint32_t *dst, int width,
+                             int has_alpha) {
+  const uint32x2_t alpha = vdup_n_u32(has_alpha ? 0 : 0xFF);
+  int i, k;
+
+  // Two pixels at a time
+  for (i = 0; i + 8 <= 4 * width; i += 8) {
+    int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
+    uint16x8_t px;
+
+    for (k = 0; k < taps; k++) {
+      int16x8_t a = vld1q_s16(rows[k] + i);
+
+      lo = vmlal_n_s16(lo, vget_low_s16(a), weights[k]);
+      hi = vmlal_n_s16(hi, vget_high_s16(a), weights[k]);
+    }
+
+    px = vcombine_u16(vqmovun_s32(vrshrq_n_s32(lo, RESIZE_VSHIFT)), vqmovun_s32(vrshrq_n_s32(hi, RESIZE_VSHIFT)));
+    vst1_u32(dst + i / 4, vorr_u32(vreinterpret_u32_u8(vqmovn_u16(px)), alpha));
+  }
+
+  resize_vrow_range(rows, weights, taps, dst, i / 4, width, has_alpha);
+}                               /* resize_vrow_neon() */
+
+static inline uint32x4_t resize_reverse_neon(uint32x4_t px) {
+  px = vrev64q_u32(px);
+  return vcombine_u32(vget_high_u32(px), vget_low_u32(px));
+}
+
+static void resize_rrow_neon(const uint32_t *src, uint32_t *dst, int width) {
+  int x;
+
+  for (x = 0; x + 4 <= width; x += 4)
+    vst1q_u32(dst - x - 3, resize_reverse_neon(vld1q_u32(src + x)));
+
+  for (; x < width; x++)
+    dst[-x] = src[x];
+}                               /* resize_rrow_neon() */
+
+static inline void resize_block_neon(const uint32_t *s, int width, uint32_t *d, ptrdiff_t xstep, int ystep) {
+  uint32x4x2_t t01 = vtrnq_u32(vld1q_u32(s), vld1q_u32(s + width));
+  uint32x4x2_t t23 = vtrnq_u32(vld1q_u32(s + 2 * width), vld1q_u32(s + 3 * width));
+  uint32x4_t c[4];
+  int i;
+
+  // Column i of the block
+  c[0] = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+  c[1] = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+  c[2] = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+  c[3] = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+
+  for (i = 0; i < 4; i++) {
+    if (ystep > 0)
+      vst1q_u32(d + i * xstep, c[i]);
+    else
+      vst1q_u32(d + i * xstep - 3, resize_reverse_neon(c[i]));
+  }
+}                               /* resize_block_neon() */
+
+static void resize_transpose_neon(const uint32_t *src, int width, int height, uint32_t *dst, ptrdiff_t xstep,
+                                  int ystep) {
+  resize_transpose_tiles(src, width, height, dst, xstep, ystep, resize_block_neon);
+}
+#endif
+
+// *INDENT-OFF*
+static const ResizeKernel Kernels[] = {
+  { resize_hrow_c, resize_vrow_c, resize_rrow_c, resize_transpose_c },
+#ifdef SIMD_HAVE_SSE2
+  { resize_hrow_sse2, resize_vrow_sse2, resize_rrow_sse2, resize_transpose_sse2 },
+#else
+  { NULL, NULL, NULL, NULL },
+#endif
+#ifdef SIMD_HAVE_AVX2
+  // Moving pixels is bound by memory, the SSE2 ones do for AVX2
+  { resize_hrow_avx2, resize_vrow_avx2, resize_rrow_sse2, resize_transpose_sse2 },
+#else
+  { NULL, NULL, NULL, NULL },
+#endif
+#ifdef SIMD_HAVE_NEON
+  { resize_hrow_neon, resize_vrow_neon, resize_rrow_neon, resize_transpose_neon },
+#else
+  { NULL, NULL, NULL, NULL },
+#endif
+};
+// *INDENT-ON*
+
+static const ResizeKernel *resize_kernel(void) {
+  return &Kernels[simd_get()];
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Resize an image with a box filter, averaging the source pixels covered by each destination
+///   pixel like libgd's copyResampled.
+///
+/// @param src        Source pixels, src_width * src_height of them.
+/// @param src_width  Width of the source.
+/// @param src_height Height of the source.
+/// @param dst        First destination pixel.
+/// @param dst_width  Width of the destination.
+/// @param dst_height Height of the destination.
+/// @param dst_stride Pixels from one destination row to the next.
+/// @param has_alpha  If the source has an alpha channel, the destination is opaque otherwise.
+///
+/// @return 0 if out of memory.
+///-------------------------------------------------------------------------------------------------
+
+int resize_box(const uint32_t *src, int src_width, int src_height, uint32_t *dst, int dst_width, int dst_height,
+               int dst_stride, int has_alpha) {
+  ResizeFilter h, v;
+  const ResizeKernel *k;
+  int16_t *ring = NULL;
+  int16_t **rows = NULL;
+  int *ring_rows = NULL;
+  int x, y, ret = 0;
+
+  if (src_width < 1 || src_height < 1 || dst_width < 1 || dst_height < 1)
+    return 0;
+
+  k = resize_kernel();
+
+  if (!resize_filter_init(&h, src_width, dst_width))
+    return 0;
+  if (!resize_filter_init(&v, src_height, dst_height)) {
+    resize_filter_free(&h);
+    return 0;
+  }
+
+  // The taps source rows of a destination row, each kept in ring slot (source row % taps). The first
+  // source row only moves forward, so each source row is resampled horizontally once.
+  ring = (int16_t *)malloc((size_t)v.taps * dst_width * 4 * sizeof(int16_t));
+  rows = (int16_t **)malloc(v.taps * sizeof(int16_t *));
+  ring_rows = (int *)malloc(v.taps * sizeof(int));
+  if (ring == NULL || rows == NULL || ring_rows == NULL) {
+    FATAL("Out of memory for resize rows\n");
+    goto out;
+  }
+
+  for (x = 0; x < v.taps; x++)
+    ring_rows[x] = -1;
+
+  for (y = 0; y < dst_height; y++) {
+    for (x = 0; x < v.taps; x++) {
+      int sy = v.start[y] + x;
+      int slot = sy % v.taps;
+
+      rows[x] = ring + (size_t)slot * dst_width * 4;
+      if (ring_rows[slot] != sy) {
+        k->hrow(src + (size_t)sy * src_width, rows[x], &h, dst_width);
+        ring_rows[slot] = sy;
+      }
+    }
+
+    k->vrow(rows, v.weights + (size_t)y * v.taps, v.taps, dst + (size_t)y * dst_stride, dst_width, has_alpha);
+  }
+
+  ret = 1;
+
+out:
+  free(ring);
+  free(rows);
+  free(ring_rows);
+  resize_filter_free(&h);
+  resize_filter_free(&v);
+
+  return ret;
+}                               /* resize_box() */
+
+///-------------------------------------------------------------------------------------------------
+///  Place an image in a larger one and rotate or mirror that by an EXIF orientation, moving the
+///   pixels row by row, or tile by tile for the rotations by 90 degrees. Only the pixels of src are
+///   written, dst may hold the padding already.
+///
+/// @param src         Source pixels, width * height of them.
+/// @param width       Width of the source.
+/// @param height      Height of the source.
+/// @param dst         The rotated image, dst_height * dst_width for orientations 5 to 8.
+/// @param dst_width   Width of the image before rotating.
+/// @param dst_height  Height of the image before rotating.
+/// @param dst_x       Column of the source in the image before rotating.
+/// @param dst_y       Row of the source in the image before rotating.
+/// @param orientation The EXIF orientation, an unknown one is taken as ORIENTATION_NORMAL.
+///-------------------------------------------------------------------------------------------------
+
+void resize_orient(const uint32_t *src, int width, int height, uint32_t *dst, int dst_width, int dst_height,
+                   int dst_x, int dst_y, int orientation) {
+  const ResizeKernel *k = resize_kernel();
+  int flip_x = 0, flip_y = 0, transpose = 0;
+  ptrdiff_t xstep, ystep;
+  int x, y;
+
+  switch (orientation) {
+    case ORIENTATION_MIRROR_HORIZ:
+      flip_x = 1;
+      break;
+    case ORIENTATION_180:
+      flip_x = flip_y = 1;
+      break;
+    case ORIENTATION_MIRROR_VERT:
+      flip_y = 1;
+      break;
+    case ORIENTATION_MIRROR_HORIZ_270_CCW:
+      transpose = 1;
+      break;
+    case ORIENTATION_90_CCW:
+      transpose = flip_y = 1;
+      break;
+    case ORIENTATION_MIRROR_HORIZ_90_CCW:
+      transpose = flip_x = flip_y = 1;
+      break;
+    case ORIENTATION_270_CCW:
+      transpose = flip_x = 1;
+      break;
+  }
+
+  // Where the first source pixel goes, and the steps to the next one along x and y
+  x = flip_x ? dst_width - 1 - dst_x : dst_x;
+  y = flip_y ? dst_height - 1 - dst_y : dst_y;
+
+  if (transpose) {
+    dst += (size_t)x * dst_height + y;
+    xstep = flip_x ? -dst_height : dst_height;
+    k->transpose(src, width, height, dst, xstep, flip_y ? -1 : 1);
+    return;
+  }
+
+  dst += (size_t)y * dst_width + x;
+  ystep = flip_y ? -dst_width : dst_width;
+
+  for (y = 0; y < height; y++, dst += ystep, src += width) {
+    if (flip_x)
+      k->rrow(src, dst, width);
+    else
+      memcpy(dst, src, width * sizeof(uint32_t));
+  }
+}                               /* resize_orient() */
@@ -0,0 +1,9 @@
+#ifndef _RESIZE_H
+#define _RESIZE_H
+
+int resize_box(const uint32_t *src, int src_width, int src_height, uint32_t *dst, int dst_width, int dst_height,
+               int dst_stride, int has_alpha);
+void resize_orient(const uint32_t *src, int width, int height, uint32_t *dst, int dst_width, int dst_height,
+                   int dst_x, int dst_y, int orientation);
+
+#endif // _RESIZE_H
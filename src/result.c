@@ -29,10 +29,16 @@
 #include "buffer.h"
 #include "result.h"
 #include "error.h"
+#include "formats.h"
+#include "reader.h"
+#include "mkv.h"
+#include "mp4.h"
+#include "mpeg.h"
 #include "video.h"
 #include "audio.h"
 #include "image.h"
 #include "thumb.h"
+#include "thumbpack.h"
 #include "util.h"
 #include "mediascan.h"
 #include "tag.h"
@@ -148,17 +154,21 @@ static const struct {
 /// @date 03/24/2011
 ///
 /// @param [in,out] r    If non-null, the.
+/// @param [in,out] avf  The format context, opened by FFmpeg or filled in by a native parser.
 /// @param [in,out] codecs If non-null, the codecs.
+/// @param mpeg          The start of the file if it was already read, or NULL.
 ///-------------------------------------------------------------------------------------------------
 
-static void scan_dlna_profile(MediaScanResult *r, av_codecs_t *codecs) {
+static void scan_dlna_profile(MediaScanResult *r, AVFormatContext *avf, av_codecs_t *codecs, MPEGHeader *mpeg) {
   dlna_registered_profile_t *p;
   dlna_profile_t *profile = NULL;
   dlna_container_type_t st;
-  AVFormatContext *avf = (AVFormatContext *)r->_avf;
   dlna_t *dlna = (dlna_t *)((MediaScan *)r->_scan)->_dlna;
 
-  st = stream_get_container(avf);
+  if (mpeg && mpeg->header_len)
+    st = stream_get_container(avf, mpeg->header, mpeg->header_len);
+  else
+    st = stream_get_container(avf, NULL, 0);
 
   p = dlna->first_profile;
   while (p) {
@@ -241,6 +251,436 @@ static const char *find_mime_type(const char *path) {
   return NULL;
 }
 
+///-------------------------------------------------------------------------------------------------
+///  Fill thumbs with the thumbnails for this file that are already in the thumbnail pack, one
+///   entry per thumbnail spec.
+///
+/// @param r                 The result.
+/// @param [out] thumbs      The thumbnails, NULL for the missing ones.
+/// @param [out] storyboards The number of storyboard specs that still need a thumbnail, NULL if
+///                          the file is not a video and has no storyboards.
+///
+/// @return The number of other specs that still need a thumbnail.
+///-------------------------------------------------------------------------------------------------
+
+static int get_packed_thumbnails(MediaScanResult *r, MediaScanImage **thumbs, int *storyboards) {
+  MediaScan *s = (MediaScan *)r->_scan;
+  int missing = 0;
+  int x;
+
+  if (storyboards)
+    *storyboards = 0;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    thumbs[x] = NULL;
+    if (s->thumbspecs[x]->frames && !storyboards)
+      continue;
+
+    thumbs[x] = thumbpack_get(s, r->path, r->size, r->mtime, s->thumbspecs[x]);
+    if (thumbs[x])
+      thumbs[x]->path = r->path;
+    else if (s->thumbspecs[x]->frames)
+      (*storyboards)++;
+    else
+      missing++;
+  }
+
+  return missing;
+}
+
+// The largest thumbnail spec, a hint to the image loaders of the size they can decode to
+static MediaScanThumbSpec *largest_thumbspec(MediaScan *s) {
+  MediaScanThumbSpec *largest_spec = NULL;
+  int x;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    int sw = s->thumbspecs[x]->width;
+    int sh = s->thumbspecs[x]->height;
+    if (s->thumbspecs[x]->frames)
+      continue;
+    if (!largest_spec || (sw > largest_spec->width || sh > largest_spec->height))
+      largest_spec = s->thumbspecs[x];
+  }
+
+  return largest_spec;
+}                               /* largest_thumbspec() */
+
+// Create the thumbnails missing from thumbs from the source image i, and the storyboards from the
+// video v with its decoder ready, if there are, then add all thumbnails to the result in spec order
+static void add_thumbnails(MediaScanResult *r, MediaScanImage **thumbs, MediaScanImage *i, MediaScanVideo *v) {
+  MediaScan *s = (MediaScan *)r->_scan;
+  MediaScanImage *made[MAX_THUMBS];
+  int x;
+
+  // The thumbnails not in the pack, all at once so smaller ones can be resized from larger ones
+  memcpy(made, thumbs, s->nthumbspecs * sizeof(MediaScanImage *));
+  if (i)
+    thumb_create_from_image(i, s->thumbspecs, made, s->nthumbspecs);
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    if (!thumbs[x]) {
+      if (s->thumbspecs[x]->frames) {
+        if (v)
+          thumbs[x] = video_create_storyboard(v, r, s->thumbspecs[x]);
+      }
+      else {
+        thumbs[x] = made[x];
+      }
+
+      if (thumbs[x])
+        thumbpack_put(s, r->path, r->size, r->mtime, s->thumbspecs[x], thumbs[x]);
+    }
+
+    if (thumbs[x])
+      result_add_thumbnail(r, thumbs[x]);
+  }
+}
+
+// Containers whose header describes all streams, so probing them can be skipped
+static const char *HeaderFormats = ",mov,matroska,asf,avi,";
+
+static int video_header_format(AVFormatContext *avf) {
+  char name[32];
+  size_t len = strcspn(avf->iformat->name, ",");
+
+  // Only the first name counts, e.g. "mov" of "mov,mp4,m4a,3gp,3g2,mj2"
+  if (len + 3 > sizeof(name))
+    return 0;
+
+  sprintf(name, ",%.*s,", (int)len, avf->iformat->name);
+
+  return strstr(HeaderFormats, name) != NULL;
+}                               /* video_header_format() */
+
+// Do the streams have the parameters scan_video needs: the codec and size of the video and the codec
+// and format of the audio
+static int video_params_complete(AVFormatContext *avf) {
+  unsigned int i;
+  int found = 0;
+
+  for (i = 0; i < avf->nb_streams; i++) {
+    AVStream *st = avf->streams[i];
+    AVCodecParameters *par = st->codecpar;
+
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+      if (st->disposition & AV_DISPOSITION_ATTACHED_PIC)
+        continue;
+      if (par->codec_id == AV_CODEC_ID_NONE || par->width <= 0 || par->height <= 0)
+        return 0;
+      found = 1;
+    }
+    else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+      if (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate <= 0 || par->channels <= 0)
+        return 0;
+      found = 1;
+    }
+  }
+
+  return found;
+}                               /* video_params_complete() */
+
+// Does the header alone have what avformat_find_stream_info() would find and the DLNA profile checks
+// read: the frame rates of the video, and the bitrate and profile of every stream
+static int video_header_complete(AVFormatContext *avf) {
+  unsigned int i;
+
+  if (!video_params_complete(avf))
+    return 0;
+
+  for (i = 0; i < avf->nb_streams; i++) {
+    AVStream *st = avf->streams[i];
+    AVCodecParameters *par = st->codecpar;
+    const AVCodecDescriptor *desc;
+
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+      if (st->disposition & AV_DISPOSITION_ATTACHED_PIC)
+        continue;
+      if (st->r_frame_rate.num <= 0 || st->r_frame_rate.den <= 0 || st->avg_frame_rate.num <= 0 ||
+          st->avg_frame_rate.den <= 0)
+        return 0;
+    }
+    else if (par->codec_type != AVMEDIA_TYPE_AUDIO) {
+      continue;
+    }
+
+    if (par->bit_rate <= 0)
+      return 0;
+
+    // Only codecs that have profiles get one
+    desc = avcodec_descriptor_get(par->codec_id);
+    if (par->profile == FF_PROFILE_UNKNOWN && desc != NULL && desc->profiles != NULL)
+      return 0;
+  }
+
+  return 1;
+}                               /* video_header_complete() */
+
+// Fill in the duration and bitrate avformat_find_stream_info() would have, from the header alone
+static void video_header_timings(AVFormatContext *avf) {
+  unsigned int i;
+  int64_t size;
+
+  if (avf->duration <= 0) {
+    for (i = 0; i < avf->nb_streams; i++) {
+      AVStream *st = avf->streams[i];
+
+      if (st->duration > 0) {
+        int64_t duration = av_rescale_q(st->duration, st->time_base, AV_TIME_BASE_Q);
+        if (duration > avf->duration)
+          avf->duration = duration;
+      }
+    }
+  }
+
+  if (avf->bit_rate <= 0 && avf->duration > 0 && avf->pb) {
+    size = avio_size(avf->pb);
+    if (size > 0)
+      avf->bit_rate = av_rescale(size, 8 * AV_TIME_BASE, avf->duration);
+  }
+}                               /* video_header_timings() */
+
+// Open a video file, with the probe limits set if limited. If the duration is already known, libavformat
+// need not read the end of the file for the last timestamps.
+static int video_open(MediaScanResult *r, AVInputFormat *iformat, int limited, int have_duration,
+                      AVFormatContext **avf) {
+  MediaScan *s = (MediaScan *)r->_scan;
+  AVDictionary *opts = NULL;
+  int ret;
+
+  // Read through the reader the native parsers used, so the bytes they read come from its cache
+  if ((*avf = avformat_alloc_context()) == NULL)
+    return AVERROR(ENOMEM);
+
+  if (((*avf)->pb = reader_avio((Reader *)r->_io)) == NULL) {
+    avformat_free_context(*avf);
+    *avf = NULL;
+    return AVERROR(ENOMEM);
+  }
+
+  if (limited) {
+    if (s->probe_bytes)
+      av_dict_set_int(&opts, "probesize", s->probe_bytes, 0);
+    if (s->analyze_ms)
+      av_dict_set_int(&opts, "analyzeduration", (int64_t)s->analyze_ms * 1000, 0);
+    if (s->fps_frames)
+      av_dict_set_int(&opts, "fpsprobesize", s->fps_frames, 0);
+  }
+
+  if (have_duration)
+    av_dict_set_int(&opts, "skip_estimate_duration_from_pts", 1, 0);
+
+  ret = avformat_open_input(avf, r->path, iformat, &opts);
+  av_dict_free(&opts);
+
+  return ret;
+}                               /* video_open() */
+
+///-------------------------------------------------------------------------------------------------
+///  Open a video file with libavformat and find the parameters of its streams, within the probe
+///   limits if any are set.
+///
+/// @param [in,out] r   The result, r->_avf is set to the opened file.
+/// @param iformat      The format to force, or NULL to guess it.
+/// @param have_duration If the duration is already known and needn't be estimated.
+/// @param [out] avf    The opened file.
+/// @param [out] AVError The libavformat error on failure.
+///
+/// @return 0, or MS_ERROR_FILE if the file could not be opened or MS_ERROR_READ if its streams
+///   could not be read.
+///-------------------------------------------------------------------------------------------------
+
+static int video_probe(MediaScanResult *r, AVInputFormat *iformat, int have_duration, AVFormatContext **avf,
+                       int *AVError) {
+  MediaScan *s = (MediaScan *)r->_scan;
+  int limited = s->probe_bytes || s->analyze_ms || s->fps_frames;
+
+  if ((*AVError = video_open(r, iformat, limited, have_duration, avf)) != 0)
+    return MS_ERROR_FILE;
+
+  r->_avf = (void *)*avf;
+
+  if (limited && video_header_format(*avf) && video_header_complete(*avf)) {
+    // Everything we need is in the header, don't read any further
+    LOG_DEBUG("Using stream parameters from the %s header\n", (*avf)->iformat->name);
+    video_header_timings(*avf);
+    return 0;
+  }
+
+  *AVError = avformat_find_stream_info(*avf, NULL);
+
+  if (limited && (*AVError < 0 || !video_params_complete(*avf))) {
+    // The limited probe missed something, probe again with the defaults
+    LOG_INFO("Probing %s again without limits\n", r->path);
+
+    avformat_close_input(avf);
+    r->_avf = NULL;
+
+    if ((*AVError = video_open(r, iformat, 0, have_duration, avf)) != 0)
+      return MS_ERROR_FILE;
+
+    r->_avf = (void *)*avf;
+
+    *AVError = avformat_find_stream_info(*avf, NULL);
+  }
+
+  return *AVError < 0 ? MS_ERROR_READ : 0;
+}                               /* video_probe() */
+
+// Open a file read by a native parser with libavformat, to decode a frame of it. The codecs of the
+// parsed header are replaced with the ones of the opened file.
+static int video_open_for_frame(MediaScanResult *r, AVInputFormat *iformat, av_codecs_t **codecs) {
+  AVFormatContext *avf = NULL;
+  av_codecs_t *opened;
+  int AVError;
+
+  // The duration came with the header
+  if (video_probe(r, iformat, 1, &avf, &AVError) != 0) {
+    LOG_ERROR("Unable to open video file for thumbnail creation: %s\n", r->path);
+    return 0;
+  }
+
+  opened = av_profile_get_codecs(avf);
+  if (!opened || !opened->vc) {
+    LOG_ERROR("Unable to find the video stream for thumbnail creation: %s\n", r->path);
+    free(opened);
+    return 0;
+  }
+
+  LOG_MEM("destroy video codecs @ %p\n", *codecs);
+  free(*codecs);
+  *codecs = opened;
+  r->video->_codecs = (void *)opened;
+
+  return 1;
+}                               /* video_open_for_frame() */
+
+// The cover art of a video: an attached picture stream, which libavformat and the native parsers
+// make of MP4 covr items and Matroska image attachments. A Matroska cover named "cover" wins over
+// other pictures.
+static AVPacket *video_cover(AVFormatContext *avf) {
+  AVPacket *cover = NULL;
+  unsigned int x;
+
+  for (x = 0; x < avf->nb_streams; x++) {
+    AVStream *st = avf->streams[x];
+    AVDictionaryEntry *filename;
+
+    if (!(st->disposition & AV_DISPOSITION_ATTACHED_PIC) || st->attached_pic.size <= 0)
+      continue;
+
+    filename = av_dict_get(st->metadata, "filename", NULL, 0);
+    if (filename && !strncasecmp(filename->value, "cover", 5))
+      return &st->attached_pic;
+
+    if (!cover)
+      cover = &st->attached_pic;
+  }
+
+  return cover;
+}                               /* video_cover() */
+
+// Load cover art as the source image of the thumbnails. The image readers set the mime type, DLNA
+// profile, EXIF tags and orientation of the result they read from, so the cover is read through a
+// scratch result of its own and the video's result is left alone. No codec is opened and no frame
+// decoded.
+static MediaScanImage *video_create_image_from_cover(MediaScanResult *r, AVPacket *pic) {
+  MediaScanResult *cover;
+  MediaScanImage *i;
+  Buffer *buf;
+
+  if (pic->size < 8)
+    return NULL;
+
+  cover = result_create((MediaScan *)r->_scan);
+  if (cover == NULL)
+    return NULL;
+
+  cover->type = TYPE_IMAGE;
+  cover->path = strdup(r->path);
+
+  buf = (Buffer *)malloc(sizeof(Buffer));
+  cover->_buf = (void *)buf;
+  LOG_MEM("new result buffer @ %p\n", cover->_buf);
+
+  buffer_init(buf, pic->size);
+  buffer_append(buf, pic->data, pic->size);
+
+  // The EXIF orientation of the cover ends up in the image, as for an image file
+  i = cover->image = image_create();
+  i->path = r->path;
+
+  if (!image_read_header(i, cover) || !image_load(i, largest_thumbspec((MediaScan *)r->_scan))) {
+    LOG_WARN("Unable to read the cover art of %s, using a video frame\n", r->path);
+    i = NULL;
+    goto out;
+  }
+
+  // The loaded image no longer reads from the scratch result
+  cover->image = NULL;
+
+  LOG_DEBUG("Using %s cover art for thumbnails: %d x %d\n", i->codec, i->width, i->height);
+
+out:
+  result_destroy(cover);
+
+  return i;
+}                               /* video_create_image_from_cover() */
+
+// Add the thumbnails of a video, making the ones that are not in the pack yet from the cover art,
+// or from a frame if the video has a decoder, and storyboards from frames. If native is set the file
+// was read by a native parser and is opened with libavformat for the frames.
+static void video_add_thumbnails(MediaScanResult *r, AVFormatContext *avf, AVInputFormat *iformat,
+                                 av_codecs_t **codecs, int native) {
+  MediaScanVideo *v = r->video;
+  MediaScanImage *thumbs[MAX_THUMBS];
+  MediaScanImage *i = NULL;
+  MediaScanVideo *frames = NULL;
+  AVPacket *cover = video_cover(avf);
+  int storyboards;
+  int missing = get_packed_thumbnails(r, thumbs, &storyboards);
+
+  // Load the image we'll use for the thumbnail, unless all thumbnails are already in the pack
+  if (missing && cover)
+    i = video_create_image_from_cover(r, cover);
+
+  // Decode frames of the video for the thumbnail without cover art and for the storyboards, all
+  // from the one open file
+  if (((missing && !i) || storyboards) && v->_avc && (!native || video_open_for_frame(r, iformat, codecs))) {
+    if (missing && !i)
+      i = video_create_image_from_frame(v, r);
+    frames = v;
+  }
+
+  add_thumbnails(r, thumbs, i, frames);
+
+  if (i)
+    image_destroy(i);
+}                               /* video_add_thumbnails() */
+
+// Record the sparse keyframe index of a video: the keyframes sampled by the probe of a transport
+// stream, else the container index libavformat reads when it opens a file, else the keyframes of
+// the packets at the start of the file
+static void video_keyframes(MediaScanResult *r, AVInputFormat *iformat, av_codecs_t **codecs, MPEGHeader *mpeg) {
+  MediaScanVideo *v = r->video;
+  int x;
+
+  // A video without keyframes found is not indexed again from the cache
+  v->_indexed = 1;
+
+  if (mpeg->nkeyframes) {
+    for (x = 0; x < mpeg->nkeyframes; x++)
+      video_add_keyframe(v, r->duration_ms, mpeg->keyframes[x].pts_ms, mpeg->keyframes[x].offset);
+    return;
+  }
+
+  // The native parsers don't read the sample tables or cues
+  if (!r->_avf && !video_open_for_frame(r, iformat, codecs))
+    return;
+
+  if (!video_index_keyframes(v, (AVFormatContext *)r->_avf, (*codecs)->vsid, r->duration_ms))
+    video_scan_keyframes(v, (AVFormatContext *)r->_avf, (*codecs)->vsid, r->duration_ms);
+}                               /* video_keyframes() */
+
 ///-------------------------------------------------------------------------------------------------
 ///  Scan a video file with libavformat
 ///
@@ -260,38 +700,47 @@ static int scan_video(MediaScanResult *r) {
   MediaScanVideo *v = NULL;
   MediaScanAudio *a = NULL;
   MediaScan *s = NULL;
+  AVFormatContext *native = NULL;
+  MPEGHeader mpeg;
+  Reader *rd = NULL;
   av_codecs_t *codecs = NULL;
   int AVError = 0;
+  int err;
   int ret = 1;
-  void *i = 0;
 
   if (r->flags & MS_USE_EXTENSION) {
     // Set AVInputFormat based on file extension to avoid guessing
-    while ((iformat = (AVInputFormat *)av_demuxer_iterate(&i))) {
-      if (av_match_ext(r->path, iformat->name))
-        break;
-
-      if (iformat->extensions) {
-        if (av_match_ext(r->path, iformat->extensions))
-          break;
-      }
-    }
+    iformat = formats_find(r->path);
 
     if (iformat)
       LOG_INFO("Forcing format: %s\n", iformat->name);
   }
 
-  if ((AVError = avformat_open_input(&avf, r->path, iformat, NULL)) != 0) {
-    r->error = error_create(r->path, MS_ERROR_FILE, "[libavformat] Unable to open file for reading");
-    r->error->averror = AVError;
+  s = (MediaScan *)r->_scan;
+
+  // Everything reading the file shares one reader, libavformat included
+  if ((rd = reader_open(r->path)) == NULL) {
+    r->error = error_create(r->path, MS_ERROR_FILE, "Unable to open file for reading");
     ret = 0;
     goto out;
   }
-
-  r->_avf = (void *)avf;
-
-  if ((AVError = avformat_find_stream_info(avf, NULL)) < 0) {
-    r->error = error_create(r->path, MS_ERROR_READ, "[libavformat] Unable to find stream info");
+  r->_io = (void *)rd;
+
+  // The start of MPEG-TS/PS files is read once, for the DLNA container and the duration of a TS
+  mpeg_scan(r, rd, &mpeg);
+
+  // MP4/MOV and Matroska/WebM headers are read natively, libavformat only opens those files for a
+  // thumbnail
+  native = mp4_scan(r, rd);
+  if (native == NULL)
+    native = mkv_scan(r, rd);
+  if (native) {
+    avf = native;
+  }
+  else if ((err = video_probe(r, iformat, mpeg.duration > 0, &avf, &AVError)) != 0) {
+    r->error = error_create(r->path, err, err == MS_ERROR_FILE
+                            ? "[libavformat] Unable to open file for reading"
+                            : "[libavformat] Unable to find stream info");
     r->error->averror = AVError;
     ret = 0;
     goto out;
@@ -315,7 +764,7 @@ static int scan_video(MediaScanResult *r) {
     goto out;
   }
 
-  scan_dlna_profile(r, codecs);
+  scan_dlna_profile(r, avf, codecs, &mpeg);
 
   // If scanning for a DLNA profile did not find a mimetype
   // then guess one based on the file extension
@@ -324,6 +773,12 @@ static int scan_video(MediaScanResult *r) {
   }
 
 
+  if (mpeg.duration > 0) {
+    // libavformat only estimated it from the bitrate
+    avf->duration = mpeg.duration;
+    avf->bit_rate = av_rescale(mpeg.size, 8 * AV_TIME_BASE, mpeg.duration);
+  }
+
   r->bitrate = avf->bit_rate;
   r->duration_ms = (int)(avf->duration / 1000);
 
@@ -398,23 +853,13 @@ static int scan_video(MediaScanResult *r) {
     tag_add_item(r->_tag, tag->key, tag->value);
   }
 
-  // Create thumbnail(s) if we found a valid video decoder above
-  s = (MediaScan *)r->_scan;
-  if (s->nthumbspecs && v->_avc) {
-    int x;
-    MediaScanImage *i = video_create_image_from_frame(v, r);  // Decode and load a frame of video we'll use for the thumbnail
-    if (i) {
-      // XXX sort from biggest to smallest, resize in series
-
-      for (x = 0; x < s->nthumbspecs; x++) {
-        MediaScanImage *thumb = thumb_create_from_image(i, s->thumbspecs[x]);
-        if (thumb)
-          result_add_thumbnail(r, thumb);
-      }
+  // Create thumbnail(s) from the cover art, or from a frame if we found a valid video decoder above,
+  // and storyboards from frames
+  if (s->nthumbspecs)
+    video_add_thumbnails(r, avf, iformat, &codecs, native != NULL);
 
-      image_destroy(i);
-    }
-  }
+  if (s->flags & MS_KEYFRAME_INDEX)
+    video_keyframes(r, iformat, &codecs, &mpeg);
 
 out:
   if (codecs) {
@@ -422,6 +867,9 @@ out:
     free(codecs);
   }
 
+  if (native)
+    avformat_free_context(native);
+
   return ret;
 }                               /* scan_video() */
 
@@ -459,29 +907,17 @@ static int scan_image(MediaScanResult *r) {
   // Create thumbnail(s)
   s = (MediaScan *)r->_scan;
   if (s->nthumbspecs) {
-    int x;
-    MediaScanThumbSpec *largest_spec = NULL;
-
-    // Figure out the largest size we're thumbnailing
-    for (x = 0; x < s->nthumbspecs; x++) {
-      int sw = s->thumbspecs[x]->width;
-      int sh = s->thumbspecs[x]->height;
-      if (!largest_spec || (sw > largest_spec->width || sh > largest_spec->height))
-        largest_spec = s->thumbspecs[x];
+    int loaded = 0;
+    MediaScanImage *thumbs[MAX_THUMBS];
+
+    // The image only needs to be loaded if some thumbnails are not in the pack yet
+    if (get_packed_thumbnails(r, thumbs, NULL)) {
+      // Load the source image into memory, we pass the largest spec to give a hint
+      // to the loader when it can optimize the loaded size (JPEG)
+      loaded = image_load(i, largest_thumbspec(s));
     }
 
-    // Load the source image into memory, we pass the spec to give a hint
-    // to the loader when it can optimize the loaded size (JPEG)
-    if (!image_load(i, largest_spec))
-      goto out;
-
-    // XXX sort specs from biggest to smallest, resize in series
-
-    for (x = 0; x < s->nthumbspecs; x++) {
-      MediaScanImage *thumb = thumb_create_from_image(i, s->thumbspecs[x]);
-      if (thumb)
-        result_add_thumbnail(r, thumb);
-    }
+    add_thumbnails(r, thumbs, loaded ? i : NULL, NULL);
   }
 
   // Restore dimensions
@@ -498,6 +934,107 @@ out:
   return ret;
 }
 
+// Make the missing thumbnails of a video result built from the cache. The file is opened with
+// libavformat only for the cover art or frames, its metadata is not scanned again.
+static int scan_video_thumbnails(MediaScanResult *r) {
+  AVFormatContext *avf = NULL;
+  AVInputFormat *iformat = NULL;
+  AVCodec *c;
+  MediaScanVideo *v = r->video;
+  MediaScanImage *thumbs[MAX_THUMBS];
+  Reader *rd;
+  MediaScan *s = (MediaScan *)r->_scan;
+  av_codecs_t *codecs = NULL;
+  int storyboards;
+  int missing = 0;
+  int AVError;
+  int x;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    if (!thumbpack_has(s, r->path, r->size, r->mtime, s->thumbspecs[x]))
+      missing++;
+  }
+
+  if (!missing) {
+    get_packed_thumbnails(r, thumbs, &storyboards);
+    add_thumbnails(r, thumbs, NULL, NULL);
+    return 1;
+  }
+
+  if (r->flags & MS_USE_EXTENSION)
+    iformat = formats_find(r->path);
+
+  if ((rd = reader_open(r->path)) == NULL) {
+    LOG_ERROR("Unable to open video file for thumbnail creation: %s\n", r->path);
+    return 0;
+  }
+  r->_io = (void *)rd;
+
+  // The duration is cached, there's no need to read the end of the file
+  if (video_probe(r, iformat, r->duration_ms > 0, &avf, &AVError) != 0 ||
+      (codecs = av_profile_get_codecs(avf)) == NULL || !codecs->vc) {
+    LOG_ERROR("Unable to open video file for thumbnail creation: %s\n", r->path);
+    free(codecs);
+    return 0;
+  }
+
+  if (avf->duration <= 0)
+    avf->duration = (int64_t)r->duration_ms * 1000;
+
+  c = avcodec_find_decoder(codecs->vc->codec_id);
+  if (c) {
+    v->_codecs = (void *)codecs;
+    v->_avc = (void *)c;
+  }
+
+  video_add_thumbnails(r, avf, iformat, &codecs, 0);
+
+  LOG_MEM("destroy video codecs @ %p\n", codecs);
+  free(codecs);
+  v->_codecs = NULL;
+  v->_avc = NULL;
+
+  return 1;
+}                               /* scan_video_thumbnails() */
+
+// Make the missing thumbnails of an image result built from the cache. The image is read through a
+// scratch result, so the cached mime type, DLNA profile and tags are left alone.
+static int scan_image_thumbnails(MediaScanResult *r) {
+  MediaScan *s = (MediaScan *)r->_scan;
+  MediaScanImage *thumbs[MAX_THUMBS];
+  MediaScanResult *src;
+  MediaScanImage *i;
+  int loaded = 0;
+
+  if (!get_packed_thumbnails(r, thumbs, NULL)) {
+    add_thumbnails(r, thumbs, NULL, NULL);
+    return 1;
+  }
+
+  src = result_create(s);
+  if (src == NULL)
+    return 0;
+
+  src->type = TYPE_IMAGE;
+  src->path = strdup(r->path);
+
+  i = src->image = image_create();
+  i->path = r->path;
+
+  if (ensure_opened_with_buf(src, 8) && image_read_header(i, src))
+    loaded = image_load(i, largest_thumbspec(s));
+
+  if (!loaded)
+    LOG_ERROR("Unable to load image for thumbnail creation: %s\n", r->path);
+
+  // The thumbnails that are in the pack are kept either way
+  add_thumbnails(r, thumbs, loaded ? i : NULL, NULL);
+
+  result_destroy(src);
+
+  return loaded;
+}                               /* scan_image_thumbnails() */
+
 ///-------------------------------------------------------------------------------------------------
 ///  Result create.
 ///
@@ -524,6 +1061,7 @@ MediaScanResult *result_create(MediaScan *s) {
 
   r->_scan = s;
   r->_avf = NULL;
+  r->_io = NULL;
   r->_fp = NULL;
 
   r->hash = 0;
@@ -564,6 +1102,31 @@ int result_scan(MediaScanResult *r) {
   return FALSE;
 }                               /* result_scan() */
 
+///-------------------------------------------------------------------------------------------------
+///  Add the thumbnails of a result built from the cache. Thumbnails in the pack are used as they
+///   are, only those of thumbnail specs added since the file was scanned are made, and the metadata
+///   of the file is not scanned again.
+///
+/// @param [in,out] r The result, with r->size and r->mtime of the file.
+///
+/// @return 1 on success, 0 if the missing thumbnails could not be made.
+///-------------------------------------------------------------------------------------------------
+
+int result_scan_thumbnails(MediaScanResult *r) {
+  MediaScan *s = (MediaScan *)r->_scan;
+
+  if (!s->nthumbspecs)
+    return 1;
+
+  if (r->type == TYPE_VIDEO && r->video)
+    return scan_video_thumbnails(r);
+
+  if (r->type == TYPE_IMAGE && r->image)
+    return scan_image_thumbnails(r);
+
+  return 1;
+}                               /* result_scan_thumbnails() */
+
 void result_create_tag(MediaScanResult *r, const char *type) {
   r->_tag = tag_create(type);
 }
@@ -583,6 +1146,12 @@ void result_destroy(MediaScanResult *r) {
   if (r->path)
     free(r->path);
 
+  if (r->moved_from)
+    free(r->moved_from);
+
+  if (r->duplicate_of)
+    free(r->duplicate_of);
+
   if (r->error)
     error_destroy(r->error);
 
@@ -599,9 +1168,14 @@ void result_destroy(MediaScanResult *r) {
     tag_destroy(r->_tag);
 
   if (r->_avf) {
-    avformat_close_input(r->_avf);
+    AVFormatContext *avf = (AVFormatContext *)r->_avf;
+    avformat_close_input(&avf);
   }
 
+  // After the format context, which may read through it
+  if (r->_io)
+    reader_close((Reader *)r->_io);
+
   if (r->_fp)
     fclose(r->_fp);
 
@@ -632,6 +1206,10 @@ void ms_dump_result(MediaScanResult *r) {
   int i;
 
   LOG_OUTPUT("%s\n", r->path);
+  if (r->moved_from)
+    LOG_OUTPUT("  Moved from:   %s\n", r->moved_from);
+  if (r->duplicate_of)
+    LOG_OUTPUT("  Copy of:      %s\n", r->duplicate_of);
   LOG_OUTPUT("  MIME type:    %s\n", r->mime_type);
   LOG_OUTPUT("  DLNA profile: %s\n", r->dlna_profile);
   LOG_OUTPUT("  File size:    %"PRIu64"\n", r->size);
@@ -652,8 +1230,11 @@ void ms_dump_result(MediaScanResult *r) {
         LOG_OUTPUT("    Samplerate: %d kHz\n", r->audio->samplerate);
         LOG_OUTPUT("    Channels:   %d\n", r->audio->channels);
       }
-      LOG_OUTPUT("  FFmpeg details:\n");
-      av_dump_format(r->_avf, 0, r->path, 0);
+      // Results reused from the cache or read by a native parser may never have been opened with FFmpeg
+      if (r->_avf) {
+        LOG_OUTPUT("  FFmpeg details:\n");
+        av_dump_format(r->_avf, 0, r->path, 0);
+      }
       break;
 
     case TYPE_IMAGE:
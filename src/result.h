@@ -23,6 +23,12 @@ MediaScanResult *result_create(MediaScan *s);
  */
 int result_scan(MediaScanResult *r);
 
+/**
+ * Add the thumbnails of a result built from the cache, making only the ones that are not in the
+ * thumbnail pack. Returns 1 on success.
+ */
+int result_scan_thumbnails(MediaScanResult *r);
+
 void result_create_tag(MediaScanResult *r, const char *type);
 
 void result_destroy(MediaScanResult *r);
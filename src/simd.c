@@ -0,0 +1,85 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\simd.c
+//
+// summary: Picks the SIMD kernels of the resampler and the pixel converters, the best ones the CPU
+//          has unless others are forced to compare them.
+///-------------------------------------------------------------------------------------------------
+
+#include "simd.h"
+
+static int Simd = SIMD_AUTO;
+
+static const char *SimdNames[] = { "C", "SSE2", "AVX2", "NEON" };
+
+// The best kernels of this CPU
+static int simd_cpu(void) {
+#ifdef SIMD_HAVE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+#endif
+#if defined(SIMD_HAVE_SSE2)
+  return SIMD_SSE2;
+#elif defined(SIMD_HAVE_NEON)
+  return SIMD_NEON;
+#else
+  return SIMD_C;
+#endif
+}                               /* simd_cpu() */
+
+// If the kernels were built and the CPU can run them
+static int simd_available(int simd) {
+  switch (simd) {
+    case SIMD_C:
+      return 1;
+#ifdef SIMD_HAVE_SSE2
+    case SIMD_SSE2:
+      return 1;
+#endif
+#ifdef SIMD_HAVE_AVX2
+    case SIMD_AVX2:
+      return simd_cpu() == SIMD_AVX2;
+#endif
+#ifdef SIMD_HAVE_NEON
+    case SIMD_NEON:
+      return 1;
+#endif
+    default:
+      return 0;
+  }
+}                               /* simd_available() */
+
+///-------------------------------------------------------------------------------------------------
+///  Get the kernels in use.
+///
+/// @return SIMD_C, SIMD_SSE2, SIMD_AVX2 or SIMD_NEON.
+///-------------------------------------------------------------------------------------------------
+
+int simd_get(void) {
+  if (Simd == SIMD_AUTO)
+    Simd = simd_cpu();
+
+  return Simd;
+}                               /* simd_get() */
+
+///-------------------------------------------------------------------------------------------------
+///  Force the kernels used, e.g. to compare them. They all give the same result.
+///
+/// @param simd The kernels, or SIMD_AUTO for the best ones of the CPU.
+///
+/// @return The kernels used from now on, the best ones of the CPU if the ones asked for are not
+///  available.
+///-------------------------------------------------------------------------------------------------
+
+int simd_set(int simd) {
+  if (!simd_available(simd))
+    simd = simd_cpu();
+
+  Simd = simd;
+
+  return simd;
+}                               /* simd_set() */
+
+const char *simd_name(int simd) {
+  return simd >= SIMD_C && simd <= SIMD_NEON ? SimdNames[simd] : "auto";
+}
@@ -0,0 +1,32 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define SIMD_HAVE_SSE2
+# include <emmintrin.h>
+// AVX2 code is built for its own functions only and used if the CPU has it
+# if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#  define SIMD_HAVE_AVX2
+#  include <immintrin.h>
+# endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define SIMD_HAVE_NEON
+# include <arm_neon.h>
+#endif
+
+// Kernels of the pixel code, the best one the CPU supports is used unless one is forced
+enum simd {
+  SIMD_AUTO = -1,
+  SIMD_C = 0,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_NEON
+};
+
+int simd_get(void);
+int simd_set(int simd);
+const char *simd_name(int simd);
+
+#endif // _SIMD_H
@@ -13,21 +13,51 @@
 #include "thumb.h"
 #include "image_jpeg.h"
 #include "image_png.h"
-#include "fixed.h"
+#include "resize.h"
+#include "util.h"
 
-MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *spec_orig) {
-  MediaScanImage *thumb;
+#define THUMB_CASCADE 2         // times the size of a thumbnail an image must be to resize it from
 
-  // Create a copy of the spec, so we can adjust width/height as needed
-  MediaScanThumbSpec *spec = (MediaScanThumbSpec *)calloc(sizeof(MediaScanThumbSpec), 1);
-  memcpy(spec, spec_orig, sizeof(MediaScanThumbSpec));
-  LOG_MEM("new MediaScanThumbSpec @ %p\n", spec);
+static int thumb_resize_box(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec);
 
-  thumb = image_create();
-  thumb->path = i->path;
+// Compress the pixbuf of thumb into thumb->data and free it. THUMB_AUTO is PNG for a transparent
+// source or a padded thumbnail, so the padding is transparent, and JPEG otherwise.
+int thumb_compress(MediaScanImage *thumb, MediaScanThumbSpec *spec, int has_alpha) {
+  if (spec->format == THUMB_AUTO) {
+    // Transparent source always gets output as PNG
+    if (has_alpha)
+      spec->format = THUMB_PNG;
+    // Use PNG if any padding was applied so it will be transparent
+    else if (spec->height_padding || spec->width_padding)
+      spec->format = THUMB_PNG;
+    else
+      spec->format = THUMB_JPEG;
+  }
+
+  switch (spec->format) {
+    case THUMB_JPEG:
+      thumb->codec = "JPEG";
+      if (!image_jpeg_compress(thumb, spec))
+        return 0;
+      break;
+
+    case THUMB_PNG:
+    default:
+      thumb->codec = "PNG";
+      if (!image_png_compress(thumb, spec))
+        return 0;
+      break;
+  }
 
-  // Determine thumb dimensions
+  // Free uncompressed resize data we no longer need
+  image_free_pixbuf(thumb);
+
+  return 1;
+}
 
+// Work out the size of the thumbnail of i for spec, and with keep_aspect the size of the image inside
+// the padding
+static void thumb_geometry(MediaScanImage *i, MediaScanThumbSpec *spec) {
   // If the image will be rotated 90 degrees, swap the target values
   if (i->orientation >= 5) {
     if (!spec->height) {
@@ -53,58 +83,193 @@ MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *s
       spec->width = 1;
   }
 
-  LOG_DEBUG("Resizing from %d x %d -> %d x %d\n", i->width, i->height, spec->width, spec->height);
+  // Determine padding if necessary
+  if (spec->keep_aspect) {
+    float source_ar = 1.0f * i->width / i->height;
+    float dest_ar = 1.0f * spec->width / spec->height;
+
+    if (source_ar >= dest_ar) {
+      spec->height_padding = (int)((spec->height - (spec->width / source_ar)) / 2);
+      spec->height_inner = (int)(spec->width / source_ar);
+      if (spec->height_inner < 1) // Avoid divide by 0
+        spec->height_inner = 1;
+    }
+    else {
+      spec->width_padding = (int)((spec->width - (spec->height * source_ar)) / 2);
+      spec->width_inner = (int)(spec->height * source_ar);
+      if (spec->width_inner < 1)  // Avoid divide by 0
+        spec->width_inner = 1;
+    }
+  }
+}                               /* thumb_geometry() */
+
+// Size of the resized image inside the padding
+static void thumb_inner_size(MediaScanThumbSpec *spec, int *width, int *height) {
+  *width = spec->width_padding ? spec->width_inner : spec->width;
+  *height = spec->height_padding ? spec->height_inner : spec->height;
+}
+
+// Resize i, not yet rotated or padded, for the thumbnails of smaller specs
+static MediaScanImage *thumb_scale(MediaScanImage *i, int width, int height) {
+  MediaScanImage *scaled = image_create();
+
+  scaled->path = i->path;
+  scaled->width = width;
+  scaled->height = height;
+  scaled->orientation = i->orientation;
+  scaled->has_alpha = i->has_alpha;
+
+  image_alloc_pixbuf(scaled, width, height);
+
+  if (scaled->_pixbuf == NULL
+      || !resize_box(i->_pixbuf, i->width, i->height, scaled->_pixbuf, width, height, width, i->has_alpha)) {
+    image_destroy(scaled);
+    return NULL;
+  }
+
+  LOG_DEBUG("Scaled %d x %d -> %d x %d for smaller thumbnails\n", i->width, i->height, width, height);
+
+  return scaled;
+}                               /* thumb_scale() */
+
+// Create the thumbnail of i for spec, whose geometry is set, resizing src which is i or a scaled copy
+static MediaScanImage *thumb_create(MediaScanImage *i, MediaScanImage *src, MediaScanThumbSpec *spec) {
+  MediaScanImage *thumb = image_create();
+
+  thumb->path = i->path;
+
+  LOG_DEBUG("Resizing from %d x %d -> %d x %d\n", src->width, src->height, spec->width, spec->height);
 
   thumb->width = spec->width;
   thumb->height = spec->height;
 
   // Resize, will store uncompressed resize data in pixbuf
-  if (!thumb_resize(i, thumb, spec))
+  if (!thumb_resize(src, thumb, spec))
     goto err;
 
-  if (spec->format == THUMB_AUTO) {
-    // Transparent source always gets output as PNG
-    if (i->has_alpha)
-      spec->format = THUMB_PNG;
-    // Use PNG if any padding was applied so it will be transparent
-    else if (spec->height_padding || spec->width_padding)
-      spec->format = THUMB_PNG;
-    else
-      spec->format = THUMB_JPEG;
-  }
   // Compress pixbuf data into thumb->data
-  switch (spec->format) {
-    case THUMB_JPEG:
-      thumb->codec = "JPEG";
-      if (!image_jpeg_compress(thumb, spec))
-        goto err;
-      break;
-
-    case THUMB_PNG:
-    default:
-      thumb->codec = "PNG";
-      if (!image_png_compress(thumb, spec))
-        goto err;
-      break;
-  }
-
-  // Free uncompressed resize data we no longer need
-  image_free_pixbuf(thumb);
+  if (!thumb_compress(thumb, spec, i->has_alpha))
+    goto err;
 
-  goto ok;
+  return thumb;
 
 err:
   LOG_WARN("Thumbnail creation failed for %s\n", i->path);
   image_destroy(thumb);
-  thumb = NULL;
 
-ok:
-  LOG_MEM("destroy MediaScanThumbSpec @ %p\n", spec);
-  free(spec);
+  return NULL;
+}                               /* thumb_create() */
+
+///-------------------------------------------------------------------------------------------------
+///  Create the thumbnails of an image for several specs. The largest is resized from the image, and
+///   each smaller one from the smallest image made so far which is at least THUMB_CASCADE times
+///   its size, so a large photo is read once or twice instead of once per spec. Specs of the same
+///   size, e.g. differing only in format, share one resize.
+///
+/// @param i          The image, loaded.
+/// @param specs      The thumbnail specs, storyboard specs are skipped.
+/// @param [in,out] thumbs The thumbnail of each spec, only created where NULL.
+/// @param nspecs     Number of specs.
+///-------------------------------------------------------------------------------------------------
+
+void thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec **specs, MediaScanImage **thumbs, int nspecs) {
+  MediaScanThumbSpec spec[MAX_THUMBS];
+  MediaScanImage *scaled[MAX_THUMBS];
+  int width[MAX_THUMBS], height[MAX_THUMBS], order[MAX_THUMBS];
+  int nwanted = 0, nscaled = 0;
+  int x, y, k;
+
+  for (x = 0; x < nspecs && x < MAX_THUMBS; x++) {
+    if (thumbs[x] || specs[x]->frames)
+      continue;
+
+    // A copy of the spec, so we can adjust width/height as needed
+    memcpy(&spec[x], specs[x], sizeof(MediaScanThumbSpec));
+    thumb_geometry(i, &spec[x]);
+    thumb_inner_size(&spec[x], &width[x], &height[x]);
+
+    // Largest first
+    for (y = nwanted; y > 0 && width[order[y - 1]] * height[order[y - 1]] < width[x] * height[x]; y--)
+      order[y] = order[y - 1];
+    order[y] = x;
+    nwanted++;
+  }
+
+  for (y = 0; y < nwanted; y++) {
+    MediaScanImage *src = i;
 
-  return thumb;
+    x = order[y];
+
+    // The smallest image made so far of the same size, or large enough to be resized again
+    for (k = nscaled - 1; k >= 0; k--) {
+      if ((scaled[k]->width == width[x] && scaled[k]->height == height[x])
+          || (scaled[k]->width >= THUMB_CASCADE * width[x] && scaled[k]->height >= THUMB_CASCADE * height[x])) {
+        src = scaled[k];
+        break;
+      }
+    }
+
+    // Keep this size for the smaller thumbnails still to come
+    if (y + 1 < nwanted && (src->width != width[x] || src->height != height[x])) {
+      MediaScanImage *s = thumb_scale(src, width[x], height[x]);
+
+      if (s) {
+        scaled[nscaled++] = s;
+        src = s;
+      }
+    }
+
+    thumbs[x] = thumb_create(i, src, &spec[x]);
+  }
+
+  for (k = 0; k < nscaled; k++)
+    image_destroy(scaled[k]);
+}                               /* thumb_create_from_image() */
+
+// Hash the parts of a spec that affect the generated thumbnail, so cached thumbnails can be
+// checked against the current settings
+uint32_t thumb_spec_hash(MediaScanThumbSpec *spec, uint32_t initval) {
+  uint32_t fields[6];
+
+  fields[0] = (uint32_t)spec->format;
+  fields[1] = (uint32_t)spec->width;
+  fields[2] = (uint32_t)spec->height;
+  fields[3] = (uint32_t)spec->keep_aspect;
+  fields[4] = spec->bgcolor;
+  fields[5] = (uint32_t)spec->jpeg_quality;
+
+  // Storyboards also hash their layout, leaving the hash of other specs as it was
+  if (spec->frames) {
+    uint32_t layout[2];
+
+    layout[0] = (uint32_t)spec->frames;
+    layout[1] = (uint32_t)spec->columns;
+    initval = hashlittle(layout, sizeof(layout), initval);
+  }
+
+  return hashlittle(fields, sizeof(fields), initval);
 }
 
+// Fit a storyboard of cells of cell_w x cell_h in a sheet a JPEG can hold, with fewer columns, then
+// fewer frames if it is still too large. A cell dimension of 0 is not known yet and not checked.
+void thumb_storyboard_fit(int cell_w, int cell_h, int *frames, int *columns) {
+  int rows;
+
+  if (cell_w > 0 && *columns * cell_w > THUMB_MAX_SIZE) {
+    *columns = THUMB_MAX_SIZE / cell_w;
+    if (*columns < 1)
+      *columns = 1;
+  }
+
+  rows = (*frames + *columns - 1) / *columns;
+  if (cell_h > 0 && rows * cell_h > THUMB_MAX_SIZE) {
+    rows = THUMB_MAX_SIZE / cell_h;
+    if (rows < 1)
+      rows = 1;
+    *frames = rows * *columns;
+  }
+}                               /* thumb_storyboard_fit() */
+
 void thumb_bgcolor_fill(pix *buf, int size, pix bgcolor) {
   int i;
 
@@ -120,8 +285,8 @@ void thumb_bgcolor_fill(pix *buf, int size, pix bgcolor) {
 int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec) {
   int ret = 1;
 
-  // Special case for equal size without resizing
-  if (src->width == dst->width && src->height == dst->height) {
+  // Special case for equal size without resizing or rotating
+  if (src->width == dst->width && src->height == dst->height && src->orientation == ORIENTATION_NORMAL) {
     dst->_pixbuf = src->_pixbuf;
     dst->_pixbuf_size = src->_pixbuf_size;
     dst->_pixbuf_is_copy = 1;
@@ -131,25 +296,8 @@ int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *s
   // Allocate space for the resized image
   image_alloc_pixbuf(dst, dst->width, dst->height);
 
-  // Determine padding if necessary
+  // Fill the padding with the bgcolor or zeros
   if (spec->keep_aspect) {
-    float source_ar = 1.0f * src->width / src->height;
-    float dest_ar = 1.0f * dst->width / dst->height;
-
-    if (source_ar >= dest_ar) {
-      spec->height_padding = (int)((dst->height - (dst->width / source_ar)) / 2);
-      spec->height_inner = (int)(dst->width / source_ar);
-      if (spec->height_inner < 1) // Avoid divide by 0
-        spec->height_inner = 1;
-    }
-    else {
-      spec->width_padding = (int)((dst->width - (dst->height * source_ar)) / 2);
-      spec->width_inner = (int)(dst->height * source_ar);
-      if (spec->width_inner < 1)  // Avoid divide by 0
-        spec->width_inner = 1;
-    }
-
-    // Fill new space with the bgcolor or zeros
     thumb_bgcolor_fill(dst->_pixbuf, dst->_pixbuf_size, spec->bgcolor);
 
     LOG_DEBUG
@@ -157,7 +305,10 @@ int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *s
        spec->width_padding, spec->width_inner, spec->height_padding, spec->height_inner, spec->bgcolor);
   }
 
-  thumb_resize_gd_fixed(src, dst, spec);
+  if (!thumb_resize_box(src, dst, spec)) {
+    ret = 0;
+    goto out;
+  }
 
   // If the image was rotated, swap the width/height if necessary
   // This is needed for the save_*() functions to output the correct size
@@ -173,68 +324,14 @@ out:
   return ret;
 }
 
-static inline pix get_pix(MediaScanImage *i, int32_t x, int32_t y) {
-  return (i->_pixbuf[(y * i->width) + x]);
-}
-
-static inline void put_pix(MediaScanImage *i, int32_t x, int32_t y, pix col) {
-  i->_pixbuf[(y * i->width) + x] = col;
-}
-
-static inline void put_pix_rotated(MediaScanImage *i, int32_t x, int32_t y, int32_t rotated_width, pix col) {
-  i->_pixbuf[(y * rotated_width) + x] = col;
-}
-
-static inline void get_rotated_coords(MediaScanImage *src, MediaScanImage *dst, int x, int y, int *ox, int *oy) {
-  switch (src->orientation) {
-    case ORIENTATION_MIRROR_HORIZ: // 2
-      *ox = dst->width - 1 - x;
-      *oy = y;
-      break;
-    case ORIENTATION_180:      // 3
-      *ox = dst->width - 1 - x;
-      *oy = dst->height - 1 - y;
-      break;
-    case ORIENTATION_MIRROR_VERT:  // 4
-      *ox = x;
-      *oy = dst->height - 1 - y;
-      break;
-    case ORIENTATION_MIRROR_HORIZ_270_CCW: // 5
-      *ox = y;
-      *oy = x;
-      break;
-    case ORIENTATION_90_CCW:   // 6
-      *ox = dst->height - 1 - y;
-      *oy = x;
-      break;
-    case ORIENTATION_MIRROR_HORIZ_90_CCW:  // 7
-      *ox = dst->height - 1 - y;
-      *oy = dst->width - 1 - x;
-      break;
-    case ORIENTATION_270_CCW:  // 8
-      *ox = y;
-      *oy = dst->width - 1 - x;
-      break;
-    default:
-      if (x == 0 && y == 0)
-        LOG_WARN("Cannot rotate image, unknown orientation value: %d (%s)\n", src->orientation, src->path);
-      *ox = x;
-      *oy = y;
-      break;
-  }
-}
-
-// This is a fixed-point resizer inspired by libgd's copyResampled function
-void thumb_resize_gd_fixed(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec) {
-  int x, y;
-  fixed_t sy1, sy2, sx1, sx2;
-  int dstX = 0, dstY = 0, srcX = 0, srcY = 0;
-  fixed_t width_scale, height_scale;
-
+// Resize src into the area of dst inside the padding. A rotated or mirrored image is resized into a
+// buffer first and its pixels are then moved into place, and a src already of the size of that area
+// is only moved into place.
+static int thumb_resize_box(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec) {
+  int dstX = 0, dstY = 0;
   int dstW = dst->width;
   int dstH = dst->height;
-  int srcW = src->width;
-  int srcH = src->height;
+  pix *buf;
 
   if (spec->height_padding) {
     dstY = spec->height_padding;
@@ -246,159 +343,33 @@ void thumb_resize_gd_fixed(MediaScanImage *src, MediaScanImage *dst, MediaScanTh
     dstW = spec->width_inner;
   }
 
-  width_scale = fixed_div(int_to_fixed(srcW), int_to_fixed(dstW));
-  height_scale = fixed_div(int_to_fixed(srcH), int_to_fixed(dstH));
-
-  for (y = dstY; (y < dstY + dstH); y++) {
-    sy1 = fixed_mul(int_to_fixed(y - dstY), height_scale);
-    sy2 = fixed_mul(int_to_fixed((y + 1) - dstY), height_scale);
-
-    for (x = dstX; (x < dstX + dstW); x++) {
-      fixed_t sx, sy;
-      fixed_t spixels = 0;
-      fixed_t red = 0, green = 0, blue = 0, alpha = 0;
-
-      if (!src->has_alpha)
-        alpha = FIXED_255;
-
-      sx1 = fixed_mul(int_to_fixed(x - dstX), width_scale);
-      sx2 = fixed_mul(int_to_fixed((x + 1) - dstX), width_scale);
-      sy = sy1;
-
-      /*
-         LOG_DEBUG("sx1 %f, sx2 %f, sy1 %f, sy2 %f\n",
-         fixed_to_float(sx1), fixed_to_float(sx2), fixed_to_float(sy1), fixed_to_float(sy2));
-       */
-
-      do {
-        fixed_t yportion;
-
-        //LOG_DEBUG("  yportion(sy %f, sy1 %f, sy2 %f) = ", fixed_to_float(sy), fixed_to_float(sy1), fixed_to_float(sy2));
-
-        if (fixed_floor(sy) == fixed_floor(sy1)) {
-          yportion = FIXED_1 - (sy - fixed_floor(sy));
-          if (yportion > sy2 - sy1) {
-            yportion = sy2 - sy1;
-          }
-          sy = fixed_floor(sy);
-        }
-        else if (sy == fixed_floor(sy2)) {
-          yportion = sy2 - fixed_floor(sy2);
-        }
-        else {
-          yportion = FIXED_1;
-        }
-
-        //LOG_DEBUG("%f\n", fixed_to_float(yportion));
-
-        sx = sx1;
-
-        do {
-          fixed_t xportion;
-          fixed_t pcontribution;
-          pix p;
-
-          //LOG_DEBUG("  xportion(sx %f, sx1 %f, sx2 %f) = ", fixed_to_float(sx), fixed_to_float(sx1), fixed_to_float(sx2));
-
-          if (fixed_floor(sx) == fixed_floor(sx1)) {
-            xportion = FIXED_1 - (sx - fixed_floor(sx));
-            if (xportion > sx2 - sx1) {
-              xportion = sx2 - sx1;
-            }
-            sx = fixed_floor(sx);
-          }
-          else if (sx == fixed_floor(sx2)) {
-            xportion = sx2 - fixed_floor(sx2);
-          }
-          else {
-            xportion = FIXED_1;
-          }
-
-          //LOG_DEBUG("%f\n", fixed_to_float(xportion));
-
-          pcontribution = fixed_mul(xportion, yportion);
-
-          p = get_pix(src, fixed_to_int(sx + srcX), fixed_to_int(sy + srcY));
-
-          /*
-             LOG_DEBUG("  merging with pix %d, %d: src %x (%d %d %d %d), pcontribution %f\n",
-             fixed_to_int(sx + srcX), fixed_to_int(sy + srcY),
-             p, COL_RED(p), COL_GREEN(p), COL_BLUE(p), COL_ALPHA(p), fixed_to_float(pcontribution));
-           */
-
-          red += fixed_mul(int_to_fixed(COL_RED(p)), pcontribution);
-          green += fixed_mul(int_to_fixed(COL_GREEN(p)), pcontribution);
-          blue += fixed_mul(int_to_fixed(COL_BLUE(p)), pcontribution);
-
-          if (src->has_alpha)
-            alpha += fixed_mul(int_to_fixed(COL_ALPHA(p)), pcontribution);
-
-          spixels += pcontribution;
-          sx += FIXED_1;
-        } while (sx < sx2);
-
-        sy += FIXED_1;
-      } while (sy < sy2);
-
-      // If rgba get too large for the fixed-point representation, fallback to the floating point routine
-      // This should only happen with very large images
-      if (red < 0 || green < 0 || blue < 0 || alpha < 0) {
-        LOG_WARN("fixed-point overflow: %d %d %d %d\n", red, green, blue, alpha);
-        // XXX fallback to floating point?
-      }
+  if (src->width == dstW && src->height == dstH) {
+    buf = src->_pixbuf;
+  }
+  else if (src->orientation == ORIENTATION_NORMAL) {
+    return resize_box(src->_pixbuf, src->width, src->height, dst->_pixbuf + dstY * dst->width + dstX, dstW, dstH,
+                      dst->width, src->has_alpha);
+  }
+  else {
+    buf = (pix *)malloc(dstW * dstH * sizeof(pix));
+    if (buf == NULL) {
+      FATAL("Out of memory for rotated thumbnail\n");
+      return 0;
+    }
 
-      if (spixels != 0) {
-        /*
-           LOG_DEBUG("  rgba (%f %f %f %f) spixels %f\n",
-           fixed_to_float(red), fixed_to_float(green), fixed_to_float(blue), fixed_to_float(alpha), fixed_to_float(spixels));
-         */
+    if (!resize_box(src->_pixbuf, src->width, src->height, buf, dstW, dstH, dstW, src->has_alpha)) {
+      free(buf);
+      return 0;
+    }
+  }
 
-        spixels = fixed_div(FIXED_1, spixels);
+  if (src->orientation < ORIENTATION_NORMAL || src->orientation > ORIENTATION_270_CCW)
+    LOG_WARN("Cannot rotate image, unknown orientation value: %d (%s)\n", src->orientation, src->path);
 
-        red = fixed_mul(red, spixels);
-        green = fixed_mul(green, spixels);
-        blue = fixed_mul(blue, spixels);
+  resize_orient(buf, dstW, dstH, dst->_pixbuf, dst->width, dst->height, dstX, dstY, src->orientation);
 
-        if (src->has_alpha)
-          alpha = fixed_mul(alpha, spixels);
-      }
+  if (buf != src->_pixbuf)
+    free(buf);
 
-      /* Clamping to allow for rounding errors above */
-      if (red > FIXED_255)
-        red = FIXED_255;
-      if (green > FIXED_255)
-        green = FIXED_255;
-      if (blue > FIXED_255)
-        blue = FIXED_255;
-      if (src->has_alpha && alpha > FIXED_255)
-        alpha = FIXED_255;
-
-      /*
-         LOG_DEBUG("  -> %d, %d %x (%d %d %d %d)\n",
-         x, y, COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha)),
-         fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha));
-       */
-
-      if (src->orientation != ORIENTATION_NORMAL) {
-        int ox, oy;             // new destination pixel coordinates after rotating
-
-        get_rotated_coords(src, dst, x, y, &ox, &oy);
-
-        if (src->orientation >= 5) {
-          // 90 and 270 rotations, width/height are swapped so we have to use alternate put_pix method
-          put_pix_rotated(dst, ox, oy, dst->height,
-                          COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha))
-            );
-        }
-        else {
-          put_pix(dst, ox, oy, COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha))
-            );
-        }
-      }
-      else {
-        put_pix(dst, x, y, COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha))
-          );
-      }
-    }
-  }
-}
+  return 1;
+}                               /* thumb_resize_box() */
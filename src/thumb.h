@@ -3,9 +3,14 @@
 
 typedef uint32_t pix;
 
-MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *spec);
+// Largest width or height of a thumbnail, the limit of JPEG
+#define THUMB_MAX_SIZE 65535
+
+void thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec **specs, MediaScanImage **thumbs, int nspecs);
+int thumb_compress(MediaScanImage *thumb, MediaScanThumbSpec *spec, int has_alpha);
 int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec);
+uint32_t thumb_spec_hash(MediaScanThumbSpec *spec, uint32_t initval);
 void thumb_bgcolor_fill(pix *buf, int size, pix bgcolor);
-void thumb_resize_gd_fixed(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec);
+void thumb_storyboard_fit(int cell_w, int cell_h, int *frames, int *columns);
 
 #endif // _THUMB_H
@@ -0,0 +1,708 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\thumbpack.c
+//
+// summary: On-disk thumbnail pack. Compressed thumbnails are appended to a single pack file in
+//          each cache shard and found through an index database. Index entries are keyed by a
+//          64-bit hash of the file's path plus a hash of the thumbnail spec, and hold the path,
+//          size and mtime of the file so a thumbnail is never served for another or changed file.
+//          Identical thumbnails are stored once, through a second set of entries keyed by a hash
+//          of the data itself.
+///-------------------------------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libmediascan.h>
+#include <db.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "database.h"
+#include "image.h"
+#include "thumb.h"
+#include "thumbpack.h"
+#include "util.h"
+
+#define THUMBPACK_MAGIC "LMSTPACK"
+#define THUMBPACK_MAGIC_LEN 8
+
+// Index key types
+#define THUMBPACK_KEY_THUMB 'T'       // 'T', 64-bit hash of the file path, spec hash
+#define THUMBPACK_KEY_BLOB  'B'       // 'B', 64-bit hash of the thumbnail data
+
+#define THUMBPACK_THUMB_KEY_SIZE 13
+#define THUMBPACK_BLOB_KEY_SIZE 9
+
+// Thumbnail entries hold offset, length, width, height, codec, file size and mtime, followed by
+// the file path and its terminating NUL
+#define THUMBPACK_THUMB_REC_SIZE 33
+#define THUMBPACK_BLOB_REC_SIZE 12
+
+static void thumbpack_path(MediaScan *s, char *path) {
+  sprintf(path, "%s/%s", ((CacheShard *)s->_shard)->dir, THUMBPACK_FILE);
+}
+
+// Open the pack for reading and appending, writing the header if it is new
+static FILE *thumbpack_fopen(const char *path, int truncate) {
+  FILE *fp;
+  char magic[THUMBPACK_MAGIC_LEN];
+
+  fp = fopen(path, truncate ? "w+b" : "a+b");
+  if (fp == NULL)
+    return NULL;
+
+  SeekFile(fp, 0, SEEK_END);
+  if (TellFile(fp) == 0) {
+    fwrite(THUMBPACK_MAGIC, 1, THUMBPACK_MAGIC_LEN, fp);
+    fflush(fp);
+    return fp;
+  }
+
+  SeekFile(fp, 0, SEEK_SET);
+  if (fread(magic, 1, THUMBPACK_MAGIC_LEN, fp) != THUMBPACK_MAGIC_LEN || memcmp(magic, THUMBPACK_MAGIC, THUMBPACK_MAGIC_LEN)) {
+    LOG_ERROR("%s is not a thumbnail pack\n", path);
+    fclose(fp);
+    return NULL;
+  }
+
+  return fp;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Open the thumbnail pack in cachedir. The index database must already be open.
+///
+/// @return 1 on success, 0 on failure
+///-------------------------------------------------------------------------------------------------
+
+int thumbpack_open(MediaScan *s) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  char path[MAX_PATH_STR_LEN];
+
+  if (shard->thumbpack)
+    return 1;
+
+  thumbpack_path(s, path);
+
+  shard->thumbpack = thumbpack_fopen(path, 0);
+  if (shard->thumbpack == NULL) {
+    LOG_ERROR("Unable to open thumbnail pack %s\n", path);
+    return 0;
+  }
+
+  return 1;
+}                               /* thumbpack_open() */
+
+///-------------------------------------------------------------------------------------------------
+///  Throw away all packed thumbnails.
+///-------------------------------------------------------------------------------------------------
+
+void thumbpack_reset(MediaScan *s) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  char path[MAX_PATH_STR_LEN];
+  u_int32_t discarded;
+
+  if (s->thumbs_dbp != NULL)
+    s->thumbs_dbp->truncate(s->thumbs_dbp, NULL, &discarded, 0);
+
+  if (shard->thumbpack) {
+    fclose(shard->thumbpack);
+    thumbpack_path(s, path);
+    shard->thumbpack = thumbpack_fopen(path, 1);
+  }
+}                               /* thumbpack_reset() */
+
+void thumbpack_close(MediaScan *s) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+
+  if (shard->thumbpack) {
+    fclose(shard->thumbpack);
+    shard->thumbpack = NULL;
+  }
+}                               /* thumbpack_close() */
+
+static void thumbpack_thumb_key(unsigned char *key, const char *path, MediaScanThumbSpec *spec) {
+  uint32_t pc = 0, pb = 0;
+
+  hashlittle2(path, strlen(path), &pc, &pb);
+  key[0] = THUMBPACK_KEY_THUMB;
+  put_u32(key + 1, pc);
+  put_u32(key + 5, pb);
+  put_u32(key + 9, thumb_spec_hash(spec, 0));
+}
+
+// The file path stored in a thumbnail entry, or NULL if the entry is malformed
+static const char *thumbpack_rec_path(DBT *data) {
+  if (data->size <= THUMBPACK_THUMB_REC_SIZE || ((char *)data->data)[data->size - 1] != '\0')
+    return NULL;
+
+  return (char *)data->data + THUMBPACK_THUMB_REC_SIZE;
+}
+
+// Find the index entry of a thumbnail, returns its record or NULL if there is none for this version
+// of the file. The record is only valid until the next database call.
+static unsigned char *thumbpack_find(MediaScan *s, const char *path, uint64_t size, int mtime,
+                                     MediaScanThumbSpec *spec) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  DBT key, data;
+  unsigned char keybuf[THUMBPACK_THUMB_KEY_SIZE];
+  unsigned char *p;
+  const char *rec_path;
+
+  if (s->thumbs_dbp == NULL || shard == NULL || shard->thumbpack == NULL)
+    return NULL;
+
+  thumbpack_thumb_key(keybuf, path, spec);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = keybuf;
+  key.size = sizeof(keybuf);
+
+  if (s->thumbs_dbp->get(s->thumbs_dbp, NULL, &key, &data, 0) != 0)
+    return NULL;
+
+  // offset, length, width, height, codec, file size, file mtime, file path
+  p = (unsigned char *)data.data;
+  rec_path = thumbpack_rec_path(&data);
+
+  // The path hash may collide, and the file may have changed since the thumbnail was made
+  if (rec_path == NULL || strcmp(rec_path, path) || get_u64(p + 21) != size || get_u32(p + 29) != (uint32_t)mtime)
+    return NULL;
+
+  return p;
+}                               /* thumbpack_find() */
+
+///-------------------------------------------------------------------------------------------------
+///  Check if a thumbnail is in the pack, without reading it.
+///
+/// @return 1 if the pack has the thumbnail for this version of the file.
+///-------------------------------------------------------------------------------------------------
+
+int thumbpack_has(MediaScan *s, const char *path, uint64_t size, int mtime, MediaScanThumbSpec *spec) {
+  return thumbpack_find(s, path, size, mtime, spec) != NULL;
+}                               /* thumbpack_has() */
+
+///-------------------------------------------------------------------------------------------------
+///  Load a thumbnail from the pack.
+///
+/// @param [in,out] s  The scan.
+/// @param path        Path of the file the thumbnail was made from.
+/// @param size        Size of the file.
+/// @param mtime       Modification time of the file.
+/// @param spec        The spec the thumbnail was made with.
+///
+/// @return A new thumbnail with its compressed data loaded, or NULL if it is not in the pack or
+///   was made from another version of the file.
+///-------------------------------------------------------------------------------------------------
+
+MediaScanImage *thumbpack_get(MediaScan *s, const char *path, uint64_t size, int mtime, MediaScanThumbSpec *spec) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  MediaScanImage *thumb;
+  Buffer *dbuf;
+  unsigned char *p;
+  uint64_t offset;
+  uint32_t len;
+
+  p = thumbpack_find(s, path, size, mtime, spec);
+  if (p == NULL)
+    return NULL;
+
+  offset = get_u64(p);
+  len = get_u32(p + 8);
+
+  thumb = image_create();
+  thumb->width = (int)get_u32(p + 12);
+  thumb->height = (int)get_u32(p + 16);
+  thumb->codec = p[20] == 'J' ? "JPEG" : "PNG";
+
+  dbuf = (Buffer *)malloc(sizeof(Buffer));
+  LOG_MEM("new thumbnail data buf @ %p\n", dbuf);
+  buffer_init(dbuf, len);
+  thumb->_dbuf = (void *)dbuf;
+
+  if (SeekFile(shard->thumbpack, offset, SEEK_SET) != 0 ||
+      fread(buffer_append_space(dbuf, len), 1, len, shard->thumbpack) != len) {
+    LOG_WARN("Thumbnail pack is missing data at offset %llu\n", (unsigned long long)offset);
+    image_destroy(thumb);
+    return NULL;
+  }
+
+  thumb->_pack_offset = offset;
+
+  return thumb;
+}                               /* thumbpack_get() */
+
+static int thumbpack_index_put(MediaScan *s, unsigned char *keybuf, uint32_t keysize, unsigned char *rec,
+                               uint32_t rec_size) {
+  DBT key, data;
+  int ret;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = keybuf;
+  key.size = keysize;
+  data.data = rec;
+  data.size = rec_size;
+
+  ret = s->thumbs_dbp->put(s->thumbs_dbp, NULL, &key, &data, 0);
+  if (ret != 0) {
+    s->thumbs_dbp->err(s->thumbs_dbp, ret, "Thumbnail index store failed: %s", db_strerror(ret));
+    return 0;
+  }
+
+  return 1;
+}                               /* thumbpack_index_put() */
+
+// Write thumbnail data to the pack unless identical data is already there, and point the index
+// entry in keybuf at it. rec holds the rest of the entry, its first 21 bytes are filled in here.
+static int thumbpack_store(MediaScan *s, unsigned char *keybuf, const unsigned char *buf, uint32_t len,
+                           uint32_t width, uint32_t height, char codec, unsigned char *rec, uint32_t rec_size,
+                           uint64_t *offset) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  DBT key, data;
+  unsigned char blob_key[THUMBPACK_BLOB_KEY_SIZE];
+  unsigned char blob_rec[THUMBPACK_BLOB_REC_SIZE];
+  uint32_t pc = 0, pb = 0;
+
+  // Look for an identical thumbnail first
+  hashlittle2(buf, len, &pc, &pb);
+  blob_key[0] = THUMBPACK_KEY_BLOB;
+  put_u32(blob_key + 1, pc);
+  put_u32(blob_key + 5, pb);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = blob_key;
+  key.size = sizeof(blob_key);
+
+  if (s->thumbs_dbp->get(s->thumbs_dbp, NULL, &key, &data, 0) == 0 && data.size == THUMBPACK_BLOB_REC_SIZE &&
+      get_u32((unsigned char *)data.data + 8) == len) {
+    *offset = get_u64(data.data);
+  }
+  else {
+    SeekFile(shard->thumbpack, 0, SEEK_END);
+    *offset = TellFile(shard->thumbpack);
+
+    if (fwrite(buf, 1, len, shard->thumbpack) != len) {
+      LOG_ERROR("Unable to write to thumbnail pack\n");
+      return 0;
+    }
+
+    // Make the data visible to anyone reading the pack
+    fflush(shard->thumbpack);
+
+    put_u64(blob_rec, *offset);
+    put_u32(blob_rec + 8, len);
+
+    if (!thumbpack_index_put(s, blob_key, sizeof(blob_key), blob_rec, sizeof(blob_rec)))
+      return 0;
+  }
+
+  put_u64(rec, *offset);
+  put_u32(rec + 8, len);
+  put_u32(rec + 12, width);
+  put_u32(rec + 16, height);
+  rec[20] = codec;
+
+  return thumbpack_index_put(s, keybuf, THUMBPACK_THUMB_KEY_SIZE, rec, rec_size);
+}                               /* thumbpack_store() */
+
+///-------------------------------------------------------------------------------------------------
+///  Store a thumbnail in the pack. The data is only appended if an identical thumbnail is not
+///   already packed.
+///
+/// @param [in,out] s     The scan.
+/// @param path           Path of the file the thumbnail was made from.
+/// @param size           Size of the file.
+/// @param mtime          Modification time of the file.
+/// @param spec           The spec the thumbnail was made with.
+/// @param [in,out] thumb The thumbnail, its pack offset is set.
+///-------------------------------------------------------------------------------------------------
+
+void thumbpack_put(MediaScan *s, const char *path, uint64_t size, int mtime, MediaScanThumbSpec *spec,
+                   MediaScanImage *thumb) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  Buffer *dbuf = (Buffer *)thumb->_dbuf;
+  unsigned char keybuf[THUMBPACK_THUMB_KEY_SIZE];
+  unsigned char rec[THUMBPACK_THUMB_REC_SIZE + MAX_PATH_STR_LEN];
+  uint32_t rec_size = THUMBPACK_THUMB_REC_SIZE + strlen(path) + 1;
+  uint64_t offset = 0;
+
+  if (s->thumbs_dbp == NULL || shard->thumbpack == NULL || dbuf == NULL || rec_size > sizeof(rec))
+    return;
+
+  thumbpack_thumb_key(keybuf, path, spec);
+
+  put_u64(rec + 21, size);
+  put_u32(rec + 29, (uint32_t)mtime);
+  memcpy(rec + THUMBPACK_THUMB_REC_SIZE, path, strlen(path) + 1);
+
+  if (thumbpack_store(s, keybuf, buffer_ptr(dbuf), buffer_len(dbuf), (uint32_t)thumb->width,
+                      (uint32_t)thumb->height, !strcmp(thumb->codec, "JPEG") ? 'J' : 'P', rec, rec_size, &offset))
+    thumb->_pack_offset = offset;
+}                               /* thumbpack_put() */
+
+///-------------------------------------------------------------------------------------------------
+///  Give a file the packed thumbnail of another file with the same content, such as the file it
+///   was moved or copied from. Only an index entry is added, no thumbnail data is read or written.
+///
+/// @param [in,out] s  The scan.
+/// @param from        Path of the file the thumbnail was made from.
+/// @param size        Size of both files.
+/// @param from_mtime  Modification time of the file the thumbnail was made from.
+/// @param path        Path of the file to give the thumbnail to.
+/// @param mtime       Modification time of that file.
+/// @param spec        The spec the thumbnail was made with.
+///
+/// @return 1 on success, 0 if from has no thumbnail for spec.
+///-------------------------------------------------------------------------------------------------
+
+int thumbpack_link(MediaScan *s, const char *from, uint64_t size, int from_mtime, const char *path, int mtime,
+                   MediaScanThumbSpec *spec) {
+  unsigned char keybuf[THUMBPACK_THUMB_KEY_SIZE];
+  unsigned char rec[THUMBPACK_THUMB_REC_SIZE + MAX_PATH_STR_LEN];
+  uint32_t rec_size = THUMBPACK_THUMB_REC_SIZE + strlen(path) + 1;
+  unsigned char *p;
+
+  if (rec_size > sizeof(rec))
+    return 0;
+
+  p = thumbpack_find(s, from, size, from_mtime, spec);
+  if (p == NULL)
+    return 0;
+
+  // Same data, size and codec, for another file
+  memcpy(rec, p, 21);
+  put_u64(rec + 21, size);
+  put_u32(rec + 29, (uint32_t)mtime);
+  memcpy(rec + THUMBPACK_THUMB_REC_SIZE, path, strlen(path) + 1);
+
+  thumbpack_thumb_key(keybuf, path, spec);
+
+  return thumbpack_index_put(s, keybuf, THUMBPACK_THUMB_KEY_SIZE, rec, rec_size);
+}                               /* thumbpack_link() */
+
+// Size of the open pack file
+static uint64_t thumbpack_size(FILE *fp) {
+  SeekFile(fp, 0, SEEK_END);
+  return TellFile(fp);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Count the packed thumbnails.
+///
+/// @param [in,out] s   The scan.
+/// @param [out] count  Number of thumbnail index entries.
+/// @param [out] size   Size of the pack file in bytes.
+///-------------------------------------------------------------------------------------------------
+
+void thumbpack_stats(MediaScan *s, int *count, uint64_t *size) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  DBC *cursor = NULL;
+  DBT key, data;
+
+  *count = 0;
+  *size = 0;
+
+  if (s->thumbs_dbp == NULL || shard->thumbpack == NULL)
+    return;
+
+  *size = thumbpack_size(shard->thumbpack);
+
+  if (s->thumbs_dbp->cursor(s->thumbs_dbp, NULL, &cursor, 0) != 0)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+    if (key.size == THUMBPACK_THUMB_KEY_SIZE && ((unsigned char *)key.data)[0] == THUMBPACK_KEY_THUMB)
+      (*count)++;
+  }
+
+  cursor->c_close(cursor);
+}                               /* thumbpack_stats() */
+
+///-------------------------------------------------------------------------------------------------
+///  Check that every index entry points at data inside the pack.
+///
+/// @return The number of bad index entries.
+///-------------------------------------------------------------------------------------------------
+
+int thumbpack_verify(MediaScan *s) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  DBC *cursor = NULL;
+  DBT key, data;
+  uint64_t size;
+  int bad = 0;
+
+  if (s->thumbs_dbp == NULL || shard->thumbpack == NULL)
+    return 0;
+
+  size = thumbpack_size(shard->thumbpack);
+
+  if (s->thumbs_dbp->cursor(s->thumbs_dbp, NULL, &cursor, 0) != 0)
+    return 0;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+    unsigned char type = key.size ? ((unsigned char *)key.data)[0] : 0;
+    int valid;
+
+    if (type == THUMBPACK_KEY_THUMB)
+      valid = key.size == THUMBPACK_THUMB_KEY_SIZE && thumbpack_rec_path(&data) != NULL;
+    else
+      valid = type == THUMBPACK_KEY_BLOB && key.size == THUMBPACK_BLOB_KEY_SIZE && data.size == THUMBPACK_BLOB_REC_SIZE;
+
+    if (!valid || get_u64(data.data) < THUMBPACK_MAGIC_LEN ||
+        get_u64(data.data) + get_u32((unsigned char *)data.data + 8) > size) {
+      LOG_WARN("Thumbnail index entry points outside the pack\n");
+      bad++;
+    }
+  }
+
+  cursor->c_close(cursor);
+
+  return bad;
+}                               /* thumbpack_verify() */
+
+// One thumbnail index entry, copied out of the index while the pack is rewritten
+struct thumbpack_entry {
+  unsigned char key[THUMBPACK_THUMB_KEY_SIZE];
+  unsigned char *rec;
+  uint32_t rec_size;
+  uint64_t old_offset;          // where the data is in the old pack
+  uint64_t new_offset;          // and in the new one
+  int blob;                     // this entry copied the data, the others with the same data share it
+  uint32_t pc, pb;              // hash of the data, the key of its blob entry
+};
+
+// Check if path still has an entry in the path -> change key database
+static int thumbpack_path_cached(MediaScan *s, const char *path) {
+  DBT key, data;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+
+  return s->dbp != NULL && s->dbp->get(s->dbp, NULL, &key, &data, 0) == 0;
+}
+
+static int thumbpack_entry_cmp(const void *a, const void *b) {
+  const struct thumbpack_entry *ea = (const struct thumbpack_entry *)a;
+  const struct thumbpack_entry *eb = (const struct thumbpack_entry *)b;
+
+  return ea->old_offset < eb->old_offset ? -1 : ea->old_offset > eb->old_offset;
+}
+
+// Fill the emptied index with the entries copied out of it, pointing into the new pack or the old one
+static void thumbpack_write_index(MediaScan *s, struct thumbpack_entry *entries, int nentries, int new_pack) {
+  unsigned char blob_key[THUMBPACK_BLOB_KEY_SIZE];
+  unsigned char blob_rec[THUMBPACK_BLOB_REC_SIZE];
+  uint64_t offset;
+  int i;
+
+  for (i = 0; i < nentries; i++) {
+    if (entries[i].rec == NULL)
+      continue;
+
+    offset = new_pack ? entries[i].new_offset : entries[i].old_offset;
+    put_u64(entries[i].rec, offset);
+    thumbpack_index_put(s, entries[i].key, THUMBPACK_THUMB_KEY_SIZE, entries[i].rec, entries[i].rec_size);
+
+    if (entries[i].blob) {
+      blob_key[0] = THUMBPACK_KEY_BLOB;
+      put_u32(blob_key + 1, entries[i].pc);
+      put_u32(blob_key + 5, entries[i].pb);
+      put_u64(blob_rec, offset);
+      put_u32(blob_rec + 8, get_u32(entries[i].rec + 8));
+      thumbpack_index_put(s, blob_key, sizeof(blob_key), blob_rec, sizeof(blob_rec));
+    }
+  }
+}                               /* thumbpack_write_index() */
+
+///-------------------------------------------------------------------------------------------------
+///  Rewrite the pack with only the thumbnails of files that are still cached, dropping data no
+///   index entry points at. The new pack is written next to the old one and renamed over it. The
+///   index is emptied before the rename and filled again afterwards, so at no point does it point
+///   into the wrong pack: if the process dies in between, the thumbnails are made again by the
+///   next scan, and if the rename fails the old entries are put back.
+///
+/// @param [in,out] s  The scan.
+///
+/// @return The number of thumbnail index entries removed, or -1 on failure.
+///-------------------------------------------------------------------------------------------------
+
+int thumbpack_compact(MediaScan *s) {
+  CacheShard *shard = (CacheShard *)s->_shard;
+  struct thumbpack_entry *entries = NULL;
+  struct thumbpack_entry *e;
+  int nentries = 0, maxentries = 0;
+  int removed = 0;
+  int ret = -1;
+  int i;
+  DBC *cursor = NULL;
+  DBT key, data;
+  FILE *oldfp;
+  FILE *newfp;
+  Buffer buf;
+  u_int32_t discarded;
+  uint32_t len;
+  char path[MAX_PATH_STR_LEN];
+  char tmp_path[MAX_PATH_STR_LEN];
+#ifdef WIN32
+  char old_path[MAX_PATH_STR_LEN];
+#endif
+
+  if (s->thumbs_dbp == NULL || shard->thumbpack == NULL)
+    return 0;
+
+  // Copy out the entries that are still needed, the blob entries are rebuilt below
+  if (s->thumbs_dbp->cursor(s->thumbs_dbp, NULL, &cursor, 0) != 0)
+    return -1;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (cursor->c_get(cursor, &key, &data, DB_NEXT) == 0) {
+    const char *rec_path;
+
+    if (key.size != THUMBPACK_THUMB_KEY_SIZE || ((unsigned char *)key.data)[0] != THUMBPACK_KEY_THUMB)
+      continue;
+
+    rec_path = thumbpack_rec_path(&data);
+    if (rec_path == NULL || !thumbpack_path_cached(s, rec_path)) {
+      removed++;
+      continue;
+    }
+
+    if (nentries == maxentries) {
+      maxentries = maxentries ? maxentries * 2 : 256;
+      entries = (struct thumbpack_entry *)realloc(entries, maxentries * sizeof(struct thumbpack_entry));
+      if (entries == NULL) {
+        FATAL("Out of memory compacting thumbnail pack\n");
+        cursor->c_close(cursor);
+        return -1;
+      }
+    }
+
+    e = &entries[nentries++];
+    memset(e, 0, sizeof(struct thumbpack_entry));
+    memcpy(e->key, key.data, THUMBPACK_THUMB_KEY_SIZE);
+    e->rec = (unsigned char *)malloc(data.size);
+    memcpy(e->rec, data.data, data.size);
+    e->rec_size = data.size;
+    e->old_offset = get_u64(data.data);
+  }
+
+  cursor->c_close(cursor);
+
+  // In pack order, so thumbnails that share data are next to each other and the old pack is read
+  // front to back
+  if (nentries)
+    qsort(entries, nentries, sizeof(struct thumbpack_entry), thumbpack_entry_cmp);
+
+  thumbpack_path(s, path);
+  sprintf(tmp_path, "%s.tmp", path);
+
+  newfp = thumbpack_fopen(tmp_path, 1);
+  if (newfp == NULL) {
+    LOG_ERROR("Unable to create %s\n", tmp_path);
+    goto out;
+  }
+
+  oldfp = shard->thumbpack;
+  buffer_init(&buf, 0);
+
+  for (i = 0; i < nentries; i++) {
+    e = &entries[i];
+    len = get_u32(e->rec + 8);
+
+    if (i > 0 && e[-1].rec != NULL && e[-1].old_offset == e->old_offset && get_u32(e[-1].rec + 8) == len) {
+      e->new_offset = e[-1].new_offset;
+      continue;
+    }
+
+    buffer_clear(&buf);
+
+    if (SeekFile(oldfp, e->old_offset, SEEK_SET) != 0 ||
+        fread(buffer_append_space(&buf, len), 1, len, oldfp) != len) {
+      free(e->rec);
+      e->rec = NULL;
+      removed++;
+      continue;
+    }
+
+    e->new_offset = TellFile(newfp);
+    e->blob = 1;
+    hashlittle2(buffer_ptr(&buf), len, &e->pc, &e->pb);
+
+    if (fwrite(buffer_ptr(&buf), 1, len, newfp) != len)
+      break;
+  }
+
+  buffer_free(&buf);
+
+  if (fclose(newfp) != 0 || i < nentries) {
+    LOG_ERROR("Unable to write %s\n", tmp_path);
+    remove(tmp_path);
+    goto out;
+  }
+
+  // Nothing may point into either pack while they are swapped
+  s->thumbs_dbp->truncate(s->thumbs_dbp, NULL, &discarded, 0);
+  s->thumbs_dbp->sync(s->thumbs_dbp, 0);
+
+  thumbpack_close(s);
+
+#ifdef WIN32
+  // rename() will not replace an existing file on Windows, so the old pack is moved out of the way
+  sprintf(old_path, "%s.old", path);
+  remove(old_path);
+  if (rename(path, old_path) != 0) {
+    LOG_ERROR("Unable to replace %s, errno=%d\n", path, errno);
+    remove(tmp_path);
+    thumbpack_write_index(s, entries, nentries, 0);
+    thumbpack_open(s);
+    goto out;
+  }
+#endif
+
+  if (rename(tmp_path, path) != 0) {
+    LOG_ERROR("Unable to replace %s, errno=%d\n", path, errno);
+#ifdef WIN32
+    rename(old_path, path);
+#endif
+    remove(tmp_path);
+    thumbpack_write_index(s, entries, nentries, 0);
+    thumbpack_open(s);
+    goto out;
+  }
+
+#ifdef WIN32
+  remove(old_path);
+#endif
+
+  thumbpack_write_index(s, entries, nentries, 1);
+
+  if (thumbpack_open(s))
+    ret = removed;
+
+out:
+  for (i = 0; i < nentries; i++) {
+    if (entries[i].rec != NULL)
+      free(entries[i].rec);
+  }
+  if (entries != NULL)
+    free(entries);
+
+  return ret;
+}                               /* thumbpack_compact() */
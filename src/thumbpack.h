@@ -0,0 +1,19 @@
+#ifndef _THUMBPACK_H
+#define _THUMBPACK_H
+
+#define THUMBPACK_FILE "libmediascan_thumbs.pack"
+
+int thumbpack_open(MediaScan *s);
+void thumbpack_reset(MediaScan *s);
+void thumbpack_close(MediaScan *s);
+int thumbpack_has(MediaScan *s, const char *path, uint64_t size, int mtime, MediaScanThumbSpec *spec);
+MediaScanImage *thumbpack_get(MediaScan *s, const char *path, uint64_t size, int mtime, MediaScanThumbSpec *spec);
+void thumbpack_put(MediaScan *s, const char *path, uint64_t size, int mtime, MediaScanThumbSpec *spec,
+                   MediaScanImage *thumb);
+int thumbpack_link(MediaScan *s, const char *from, uint64_t size, int from_mtime, const char *path, int mtime,
+                   MediaScanThumbSpec *spec);
+void thumbpack_stats(MediaScan *s, int *count, uint64_t *size);
+int thumbpack_verify(MediaScan *s);
+int thumbpack_compact(MediaScan *s);
+
+#endif // _THUMBPACK_H
@@ -16,15 +16,22 @@
 // OSX/BSD handles 64-bit via stat()
 # define STAT_TYPE struct stat
 # define STAT_FUNC stat
+# define FSEEK64(fp, offset, whence) fseeko(fp, (off_t)(offset), whence)
+# define FTELL64(fp) ftello(fp)
 #else
 // Linux and maybe others need stat64()
 # define STAT_TYPE struct stat64
 # define STAT_FUNC stat64
+# define FSEEK64(fp, offset, whence) fseeko64(fp, (off64_t)(offset), whence)
+# define FTELL64(fp) ftello64(fp)
 #endif
 
 #include <pthread.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 #endif
 
 // If we are on MSVC, disable some stupid MSVC warnings
@@ -33,7 +40,16 @@
 #define snprintf _snprintf
 #endif
 
+#ifdef WIN32
+#define FSEEK64(fp, offset, whence) _fseeki64(fp, offset, whence)
+#define FTELL64(fp) _ftelli64(fp)
+#endif
+
+// Bytes read from each sampled region of a file by FingerprintFile
+#define FINGERPRINT_SAMPLE_SIZE 8192
+
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libmediascan.h>
@@ -91,6 +107,181 @@ uint32_t HashFile(const char *file, int *mtime, uint64_t *size) {
   return hash;
 }                               /* HashFile() */
 
+///-------------------------------------------------------------------------------------------------
+///  Get the device and inode numbers (volume serial and file index on Windows) of a file. A
+///   file keeps its identity when it is renamed or moved within the same filesystem.
+///
+/// @param file File to look up
+/// @param [out] dev Device the file lives on
+/// @param [out] ino Inode of the file
+///
+/// @return 1 on success, 0 if the file could not be examined
+///-------------------------------------------------------------------------------------------------
+
+int GetFileIdentity(const char *file, uint64_t *dev, uint64_t *ino) {
+#ifndef WIN32
+  STAT_TYPE buf;
+#else
+  HANDLE h;
+  BY_HANDLE_FILE_INFORMATION fileInfo;
+  int ok = 0;
+#endif
+
+  *dev = 0;
+  *ino = 0;
+
+#ifdef WIN32
+  h = CreateFile(file, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                 OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return 0;
+
+  if (GetFileInformationByHandle(h, &fileInfo)) {
+    *dev = fileInfo.dwVolumeSerialNumber;
+    *ino = ((uint64_t)fileInfo.nFileIndexHigh << 32) | fileInfo.nFileIndexLow;
+    ok = 1;
+  }
+
+  CloseHandle(h);
+  return ok;
+#else
+  if (STAT_FUNC(file, &buf) == -1)
+    return 0;
+
+  *dev = (uint64_t)buf.st_dev;
+  *ino = (uint64_t)buf.st_ino;
+
+  return 1;
+#endif
+}                               /* GetFileIdentity() */
+
+///-------------------------------------------------------------------------------------------------
+///  Calculate a content fingerprint for a file without reading all of it. Small files are
+///   hashed in full, larger ones are sampled at the start, middle and end.
+///
+/// @param file File to fingerprint
+/// @param size Size of the file, as returned by HashFile
+///
+/// @return 64-bit fingerprint, or 0 if the file could not be read
+///-------------------------------------------------------------------------------------------------
+
+uint64_t FingerprintFile(const char *file, uint64_t size) {
+  FILE *fp;
+  unsigned char *sample;
+  uint64_t offsets[3];
+  uint32_t pc = 0, pb = 0;
+  size_t len;
+  int nsamples;
+  int i;
+
+  fp = fopen(file, "rb");
+  if (fp == NULL) {
+    LOG_WARN("Unable to open %s for fingerprinting\n", file);
+    return 0;
+  }
+
+  sample = (unsigned char *)malloc(FINGERPRINT_SAMPLE_SIZE);
+  LOG_MEM("new fingerprint sample @ %p\n", sample);
+
+  if (size <= FINGERPRINT_SAMPLE_SIZE * 3) {
+    // Read the whole file in sample-sized chunks
+    offsets[0] = 0;
+    nsamples = 1;
+  }
+  else {
+    offsets[0] = 0;
+    offsets[1] = (size / 2) - (FINGERPRINT_SAMPLE_SIZE / 2);
+    offsets[2] = size - FINGERPRINT_SAMPLE_SIZE;
+    nsamples = 3;
+  }
+
+  // Seed with the size so files sharing the sampled regions still differ
+  pc = (uint32_t)(size >> 32);
+  pb = (uint32_t)size;
+
+  for (i = 0; i < nsamples; i++) {
+    if (FSEEK64(fp, offsets[i], SEEK_SET) != 0)
+      goto err;
+
+    while ((len = fread(sample, 1, FINGERPRINT_SAMPLE_SIZE, fp)) > 0) {
+      hashlittle2(sample, len, &pc, &pb);
+
+      // Only the single-sample case keeps reading to the end of the file
+      if (nsamples > 1)
+        break;
+    }
+
+    if (ferror(fp))
+      goto err;
+  }
+
+  goto out;
+
+err:
+  LOG_WARN("Read error while fingerprinting %s\n", file);
+  pc = pb = 0;
+
+out:
+  LOG_MEM("destroy fingerprint sample @ %p\n", sample);
+  free(sample);
+  fclose(fp);
+
+  return ((uint64_t)pc << 32) | pb;
+}                               /* FingerprintFile() */
+
+// 64-bit safe fseek/ftell
+int SeekFile(FILE *fp, uint64_t offset, int whence) {
+  return FSEEK64(fp, offset, whence);
+}
+
+uint64_t TellFile(FILE *fp) {
+  return (uint64_t)FTELL64(fp);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Take an exclusive lock on a file, creating it if needed. The lock belongs to the returned
+///   handle, so it also keeps out a second scan in the same process, and it is released when the
+///   process exits, so a crashed scan does not leave it behind.
+///
+/// @param file File to lock
+///
+/// @return The lock, or -1 if the file is locked by someone else or could not be opened
+///-------------------------------------------------------------------------------------------------
+
+intptr_t LockCacheFile(const char *file) {
+#ifdef WIN32
+  HANDLE h = CreateFile(file, GENERIC_READ | GENERIC_WRITE, 0, // exclusive mode
+                        NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+  if (h == INVALID_HANDLE_VALUE)
+    return -1;
+
+  return (intptr_t)h;
+#else
+  int fd = open(file, O_RDWR | O_CREAT, 0644);
+
+  if (fd == -1)
+    return -1;
+
+  // Not fcntl(), whose locks belong to the process and never conflict within it
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return (intptr_t)fd;
+#endif
+}                               /* LockCacheFile() */
+
+void UnlockCacheFile(intptr_t lock) {
+#ifdef WIN32
+  CloseHandle((HANDLE)lock);
+#else
+  // Closing the file drops the lock
+  close((int)lock);
+#endif
+}                               /* UnlockCacheFile() */
+
 
 // http://sws.dett.de/mini/hexdump-c/
 void hex_dump(void *data, int size) {
@@ -2,6 +2,7 @@
 #define _UTIL_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 int match_file_extension(const char *filename, const char *extensions);
 
@@ -11,7 +12,14 @@ int _GetFileTime(const char *fileName, char *lpszString, long dwSize);
 #endif
 
 uint32_t hashlittle(const void *key, size_t length, uint32_t initval);
+void hashlittle2(const void *key, size_t length, uint32_t *pc, uint32_t *pb);
 uint32_t HashFile(const char *file, int *mtime, uint64_t *size);
+int GetFileIdentity(const char *file, uint64_t *dev, uint64_t *ino);
+uint64_t FingerprintFile(const char *file, uint64_t size);
+int SeekFile(FILE *fp, uint64_t offset, int whence);
+uint64_t TellFile(FILE *fp);
+intptr_t LockCacheFile(const char *file);
+void UnlockCacheFile(intptr_t lock);
 int TouchFile(const char *fileName);
 void hex_dump(void *data, int size);
 
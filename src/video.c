@@ -13,7 +13,6 @@
 #endif
 
 #include <libavformat/avformat.h>
-#include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 
 #ifdef _MSC_VER
@@ -23,11 +22,20 @@
 
 #include "common.h"
 #include "image.h"
+#include "thumb.h"
 #include "video.h"
 #include "error.h"
 #include "util.h"
 #include "libdlna/profiles.h"
 
+#define VIDEO_MAX_PACKETS 200           // read after the seek before giving up on finding a keyframe
+#define VIDEO_MAX_KEYFRAMES 512         // entries in a keyframe index
+#define VIDEO_KEYFRAME_SPACING 2000     // ms between keyframe index entries, at least
+#define VIDEO_INDEX_SCAN_PACKETS 20000  // read from the start of a file without an index, at most
+#define VIDEO_INDEX_SCAN_BYTES (64 * 1024 * 1024)
+
+static const AVRational MillisecondTimeBase = { 1, 1000 };
+
 static void print_averror(int err) {
   char errbuf[128];
   const char *errbuf_ptr = errbuf;
@@ -49,23 +57,185 @@ MediaScanVideo *video_create(void) {
   return v;
 }
 
+// The size to scale a frame of width x height to: just large enough for every thumbnail spec, and
+// never larger than the frame itself. Storyboards scale their frames to their own cells.
+static void video_thumb_size(MediaScan *s, int width, int height, int *thumb_width, int *thumb_height) {
+  double scale = 0;
+  int x;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    MediaScanThumbSpec *spec = s->thumbspecs[x];
+
+    if (spec->frames)
+      continue;
+
+    if (spec->width > 0 && (double)spec->width / width > scale)
+      scale = (double)spec->width / width;
+    if (spec->height > 0 && (double)spec->height / height > scale)
+      scale = (double)spec->height / height;
+  }
+
+  if (scale <= 0 || scale >= 1) {
+    *thumb_width = width;
+    *thumb_height = height;
+    return;
+  }
+
+  *thumb_width = (int)(width * scale + 0.5);
+  *thumb_height = (int)(height * scale + 0.5);
+
+  if (*thumb_width < 1)
+    *thumb_width = 1;
+  if (*thumb_height < 1)
+    *thumb_height = 1;
+}                               /* video_thumb_size() */
+
+///-------------------------------------------------------------------------------------------------
+///  Open a video decoder to decode single keyframes for thumbnails. Each use gets a context of its
+///   own, made from the stream parameters, so the settings of one use don't carry over to the next.
+///   Non-key frames and the loop filter are skipped, the frames are decoded at a lower resolution if
+///   the codec supports it and the thumbnail is at most half the size, and codecs heavy enough to
+///   need it decode with slice threads.
+///
+/// @param vs           The video stream.
+/// @param codec        The decoder.
+/// @param thumb_width  Width of the largest thumbnail.
+/// @param thumb_height Height of the largest thumbnail.
+///
+/// @return The opened decoder, to be freed with avcodec_free_context(), or NULL on failure.
+///-------------------------------------------------------------------------------------------------
+
+AVCodecContext *video_open_decoder(AVStream *vs, const AVCodec *codec, int thumb_width, int thumb_height) {
+  AVCodecContext *vc;
+  int lowres = 0;
+
+  vc = avcodec_alloc_context3(codec);
+  if (vc == NULL) {
+    LOG_ERROR("Couldn't allocate a video decoder context\n");
+    return NULL;
+  }
+
+  if (avcodec_parameters_to_context(vc, vs->codecpar) < 0)
+    goto err;
+
+  vc->skip_frame = AVDISCARD_NONKEY;
+  vc->skip_loop_filter = AVDISCARD_ALL;
+
+  while (lowres < codec->max_lowres
+         && (vc->width >> (lowres + 1)) >= thumb_width && (vc->height >> (lowres + 1)) >= thumb_height)
+    lowres++;
+  vc->lowres = lowres;
+
+  // Only one frame is decoded, so frame threads would not run in parallel, slices can
+  switch (codec->id) {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_VP9:
+    case AV_CODEC_ID_AV1:
+      vc->thread_count = 0;
+      vc->thread_type = FF_THREAD_SLICE;
+      break;
+    default:
+      vc->thread_count = 1;
+      break;
+  }
+
+  if (lowres)
+    LOG_DEBUG("Decoding %s at 1/%d size for a %d x %d thumbnail\n", codec->name, 1 << lowres, thumb_width,
+              thumb_height);
+
+  if (avcodec_open2(vc, codec, NULL) < 0)
+    goto err;
+
+  return vc;
+
+err:
+  avcodec_free_context(&vc);
+  return NULL;
+}                               /* video_open_decoder() */
+
+///-------------------------------------------------------------------------------------------------
+///  Decode the keyframe at or before a position in the video. The container index takes the seek
+///   to the keyframe, so only the packets from there to the next video packet are read.
+///
+/// @param avf          The opened file.
+/// @param vsid         Index of the video stream.
+/// @param vc           The opened decoder.
+/// @param pos          The position, in AV_TIME_BASE units from the start of the video.
+/// @param [out] frame  The decoded frame.
+///
+/// @return 1 if a frame was decoded, 0 if not.
+///-------------------------------------------------------------------------------------------------
+
+int video_decode_frame(AVFormatContext *avf, int vsid, AVCodecContext *vc, int64_t pos, AVFrame *frame) {
+  AVStream *vs = avf->streams[vsid];
+  AVPacket packet;
+  int64_t target = av_rescale_q(pos, AV_TIME_BASE_Q, vs->time_base);
+  int packets = 0;
+  int sent = 0;
+  int ret;
+
+  if (vs->start_time != AV_NOPTS_VALUE)
+    target += vs->start_time;
+
+  if (av_seek_frame(avf, vsid, target, AVSEEK_FLAG_BACKWARD) < 0) {
+    LOG_DEBUG("Couldn't seek to %"PRIi64", decoding from the current position\n", target);
+  }
+
+  av_init_packet(&packet);
+
+  while (packets++ < VIDEO_MAX_PACKETS && (ret = av_read_frame(avf, &packet)) >= 0) {
+    // Skip other streams, and anything before the first keyframe
+    if (packet.stream_index != vsid || (!sent && !(packet.flags & AV_PKT_FLAG_KEY))) {
+      av_packet_unref(&packet);
+      continue;
+    }
+
+    LOG_DEBUG("Using video packet: pos %"PRIi64" size %d, stream_index %d, duration %"PRIi64"\n",
+              packet.pos, packet.size, packet.stream_index, packet.duration);
+
+    ret = avcodec_send_packet(vc, &packet);
+    av_packet_unref(&packet);
+    if (ret < 0 && ret != AVERROR(EAGAIN)) {
+      LOG_DEBUG("Skipping video packet the decoder refused (%d)\n", ret);
+      continue;
+    }
+    sent = 1;
+
+    ret = avcodec_receive_frame(vc, frame);
+    if (ret == 0)
+      return 1;
+
+    if (ret != AVERROR(EAGAIN)) {
+      LOG_ERROR("Error decoding video frame for thumbnail: ");
+      print_averror(ret);
+      return 0;
+    }
+  }
+
+  // The decoder may hold the frame back until it is drained
+  if (sent && avcodec_send_packet(vc, NULL) >= 0 && avcodec_receive_frame(vc, frame) == 0)
+    return 1;
+
+  return 0;
+}                               /* video_decode_frame() */
+
 MediaScanImage *video_create_image_from_frame(MediaScanVideo *v, MediaScanResult *r) {
   MediaScanImage *i = image_create();
   AVFormatContext *avf = (AVFormatContext *)r->_avf;
   av_codecs_t *codecs = (av_codecs_t *)v->_codecs;
   AVCodec *codec = (AVCodec *)v->_avc;
+  AVCodecContext *vc = NULL;
   AVFrame *frame = NULL;
-  AVPacket packet;
-  struct SwsContext *swsc = NULL;
-  int got_picture = 0;
-  int64_t duration_tb = ((double)avf->duration / AV_TIME_BASE) / av_q2d(codecs->vs->time_base);
-  uint8_t *src;
-  int x, y;
-  int ofs = 0;
-  int no_keyframe_found = 0;
-  int skipped_frames = 0;
-
-  if ((avcodec_open2(codecs->vc, codec, NULL)) < 0) {
+  MediaScan *s = (MediaScan *)r->_scan;
+  uint8_t *dst[4] = { NULL, NULL, NULL, NULL };
+  int dst_linesize[4] = { 0, 0, 0, 0 };
+
+  i->path = v->path;
+  video_thumb_size(s, v->width, v->height, &i->width, &i->height);
+
+  vc = video_open_decoder(avf->streams[codecs->vsid], codec, i->width, i->height);
+  if (vc == NULL) {
     LOG_ERROR("Couldn't open video codec %s for thumbnail creation\n", codec->name);
     goto err;
   }
@@ -76,12 +246,6 @@ MediaScanImage *video_create_image_from_frame(MediaScanVideo *v, MediaScanResult
     goto err;
   }
 
-  av_init_packet(&packet);
-
-  i->path = v->path;
-  i->width = v->width;
-  i->height = v->height;
-
   // XXX select best video frame, for example:
   // * Skip frames of all the same color (e.g. blank intro frames
   // * Use edge detection to skip blurry frames
@@ -90,148 +254,332 @@ MediaScanImage *video_create_image_from_frame(MediaScanVideo *v, MediaScanResult
   // * Use a frame some percentage into the video, what percentage?
   // * If really ambitious, use OpenCV for finding a frame with a face?
 
-  // XXX other ways to seek if this fails
-  // XXX for now, seek 10% into the video
-  av_seek_frame(avf, codecs->vsid, (int)((double)duration_tb * 0.1), 0);
-
-  for (;;) {
-    int ret;
-    int rgb_bufsize;
-    AVFrame *frame_rgb = NULL;
-    uint8_t *rgb_buffer = NULL;
+  // XXX for now, use the keyframe 10% into the video
+  if (!video_decode_frame(avf, codecs->vsid, vc, avf->duration > 0 ? avf->duration / 10 : 0, frame)) {
+    LOG_DEBUG("Couldn't find a keyframe, using first frame\n");
+    avcodec_flush_buffers(vc);
 
-    // Give up if we already tried the first frame
-    if (no_keyframe_found) {
+    if (!video_decode_frame(avf, codecs->vsid, vc, 0, frame)) {
       LOG_ERROR("Error decoding video frame for thumbnail: %s\n", v->path);
       goto err;
     }
+  }
 
-    if ((ret = av_read_frame(avf, &packet)) < 0) {
-      if (ret == AVERROR_EOF || skipped_frames > 200) {
-        LOG_DEBUG("Couldn't find a keyframe, using first frame\n");
-        no_keyframe_found = 1;
-        av_seek_frame(avf, codecs->vsid, 0, 0);
-        av_read_frame(avf, &packet);
-      }
-      else {
-        LOG_ERROR("Couldn't read video frame (%s): ", v->path);
-        print_averror(ret);
-        goto err;
-      }
-    }
+  // Scale the frame straight into the pixbuf, which has the layout of AV_PIX_FMT_RGB32_1, to the
+  // size of the largest thumbnail. The context is kept for the next video of this scan.
+  video_thumb_size(s, frame->width, frame->height, &i->width, &i->height);
+
+  s->_swsc = (void *)sws_getCachedContext((struct SwsContext *)s->_swsc,
+                                          frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                          i->width, i->height, AV_PIX_FMT_RGB32_1,
+                                          i->width == frame->width && i->height == frame->height
+                                          ? SWS_FAST_BILINEAR : SWS_BILINEAR, NULL, NULL, NULL);
+  if (!s->_swsc) {
+    LOG_ERROR("Unable to get swscale context\n");
+    goto err;
+  }
 
-    // Skip frame if it's not from the video stream
-    if (!no_keyframe_found && packet.stream_index != codecs->vsid) {
-      av_packet_unref(&packet);
-      skipped_frames++;
-      continue;
-    }
+  image_alloc_pixbuf(i, i->width, i->height);
 
-    // Skip non-key-frames
-    if (!no_keyframe_found && !(packet.flags & AV_PKT_FLAG_KEY)) {
-      av_packet_unref(&packet);
-      skipped_frames++;
-      continue;
-    }
+  dst[0] = (uint8_t *)i->_pixbuf;
+  dst_linesize[0] = i->width * sizeof(uint32_t);
 
-    // Skip invalid packets, not sure why this isn't an error from av_read_frame
-    if (packet.pos < 0) {
-      av_packet_unref(&packet);
-      skipped_frames++;
-      continue;
-    }
+  sws_scale((struct SwsContext *)s->_swsc, (const uint8_t *const *)frame->data, frame->linesize, 0,
+            frame->height, dst, dst_linesize);
 
-    LOG_DEBUG("Using video packet: pos %"PRIi64" size %d, stream_index %d, duration %"PRIi64"\n",
-              packet.pos, packet.size, packet.stream_index, packet.duration);
+  goto out;
 
-    if (((ret = avcodec_send_packet(codecs->vc, &packet)) < 0) || ((ret = avcodec_receive_frame(codecs->vc, frame)) < 0)) {
-      LOG_ERROR("Error decoding video frame for thumbnail: %s\n", v->path);
-      print_averror(ret);
-      goto err;
-    }
+err:
+  image_destroy(i);
+  i = NULL;
 
-    if (!got_picture) {
-      if (skipped_frames > 200) {
-        LOG_ERROR("Error decoding video frame for thumbnail: %s\n", v->path);
-        goto err;
-      }
-      if (!no_keyframe_found) {
-        // Try next frame
-        av_packet_unref(&packet);
-        skipped_frames++;
-        continue;
-      }
-    }
+out:
+  if (frame)
+    av_frame_free(&frame);
 
-    // use swscale to convert from source format to RGBA in our buffer with no resizing
-    // XXX what scaler is fastest here when not actually resizing?
-    swsc = sws_getContext(i->width, i->height, codecs->vc->pix_fmt,
-                          i->width, i->height, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, NULL, NULL, NULL);
-    if (!swsc) {
-      LOG_ERROR("Unable to get swscale context\n");
-      goto err;
-    }
+  if (vc)
+    avcodec_free_context(&vc);
 
-    frame_rgb = av_frame_alloc();
-    if (!frame_rgb) {
-      LOG_ERROR("Couldn't allocate a video frame\n");
-      goto err;
+  return i;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Create a storyboard thumbnail: the keyframes at or before spec->frames positions spread evenly
+///   over the video, each scaled straight into its cell of one sprite sheet. The positions are
+///   visited in order, so the open file is read once from start to end with one open decoder.
+///
+/// @param v         The video.
+/// @param r         The result, with the open file.
+/// @param spec_orig The storyboard spec.
+///
+/// @return The compressed sprite sheet, or NULL if no frame could be decoded.
+///-------------------------------------------------------------------------------------------------
+
+MediaScanImage *video_create_storyboard(MediaScanVideo *v, MediaScanResult *r, MediaScanThumbSpec *spec_orig) {
+  AVFormatContext *avf = (AVFormatContext *)r->_avf;
+  av_codecs_t *codecs = (av_codecs_t *)v->_codecs;
+  AVCodec *codec = (AVCodec *)v->_avc;
+  MediaScan *s = (MediaScan *)r->_scan;
+  MediaScanThumbSpec spec;
+  MediaScanImage *thumb;
+  AVCodecContext *vc = NULL;
+  AVFrame *frame = NULL;
+  int cell_w, cell_h, rows, x;
+  int decoded = 0;
+
+  if (avf->duration <= 0 || v->width <= 0 || v->height <= 0) {
+    LOG_DEBUG("No duration to spread a storyboard over: %s\n", v->path);
+    return NULL;
+  }
+
+  // A copy of the spec, thumb_compress() sets the format of THUMB_AUTO
+  memcpy(&spec, spec_orig, sizeof(MediaScanThumbSpec));
+
+  // The cell size, a missing dimension from the aspect ratio of the video
+  cell_w = spec.width;
+  cell_h = spec.height;
+  if (!cell_h)
+    cell_h = MAX(1, (int)((float)v->height / v->width * cell_w));
+  else if (!cell_w)
+    cell_w = MAX(1, (int)((float)v->width / v->height * cell_h));
+
+  thumb_storyboard_fit(cell_w, cell_h, &spec.frames, &spec.columns);
+  rows = (spec.frames + spec.columns - 1) / spec.columns;
+
+  thumb = image_create();
+  thumb->path = v->path;
+  thumb->width = cell_w * spec.columns;
+  thumb->height = cell_h * rows;
+
+  image_alloc_pixbuf(thumb, thumb->width, thumb->height);
+  thumb_bgcolor_fill(thumb->_pixbuf, thumb->_pixbuf_size, spec.bgcolor);
+
+  vc = video_open_decoder(avf->streams[codecs->vsid], codec, cell_w, cell_h);
+  if (vc == NULL) {
+    LOG_ERROR("Couldn't open video codec %s for storyboard creation\n", codec->name);
+    goto err;
+  }
+
+  frame = av_frame_alloc();
+  if (!frame) {
+    LOG_ERROR("Couldn't allocate a video frame\n");
+    goto err;
+  }
+
+  for (x = 0; x < spec.frames; x++) {
+    // The middle of each of the equal parts of the video
+    int64_t pos = avf->duration * (2 * x + 1) / (2 * spec.frames);
+    uint8_t *dst[4] = { NULL, NULL, NULL, NULL };
+    int dst_linesize[4] = { 0, 0, 0, 0 };
+    int w = cell_w;
+    int h = cell_h;
+
+    avcodec_flush_buffers(vc);
+
+    if (!video_decode_frame(avf, codecs->vsid, vc, pos, frame)) {
+      LOG_DEBUG("No keyframe for storyboard frame %d of %s\n", x, v->path);
+      continue;
     }
 
-    // XXX There is probably a way to get sws_scale to write directly to i->_pixbuf in our RGBA format
+    // Keep the aspect ratio of the frame centered in its cell
+    if (spec.keep_aspect && spec.width && spec.height) {
+      if ((float)frame->width / frame->height > (float)cell_w / cell_h)
+        h = MAX(1, (int)((float)frame->height / frame->width * cell_w));
+      else
+        w = MAX(1, (int)((float)frame->width / frame->height * cell_h));
+    }
 
-    rgb_bufsize = av_image_get_buffer_size(AV_PIX_FMT_RGB24, i->width, i->height, 1);
-    rgb_buffer = (uint8_t*)av_malloc(rgb_bufsize);
-    if (!rgb_buffer) {
-      LOG_ERROR("Couldn't allocate an RGB video buffer\n");
-      av_free(frame_rgb);
+    s->_swsc = (void *)sws_getCachedContext((struct SwsContext *)s->_swsc,
+                                            frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                            w, h, AV_PIX_FMT_RGB32_1, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!s->_swsc) {
+      LOG_ERROR("Unable to get swscale context\n");
       goto err;
     }
-    LOG_MEM("new rgb_buffer of size %d @ %p\n", rgb_bufsize, rgb_buffer);
 
-    av_image_fill_arrays( frame_rgb->data, frame_rgb->linesize, rgb_buffer, AV_PIX_FMT_RGB24, i->width, i->height, 1);
+    dst[0] = (uint8_t *)(thumb->_pixbuf + (x / spec.columns * cell_h + (cell_h - h) / 2) * thumb->width
+                         + x % spec.columns * cell_w + (cell_w - w) / 2);
+    dst_linesize[0] = thumb->width * sizeof(uint32_t);
 
-    // Convert image to RGB24
-    sws_scale(swsc, (const uint8_t *const *)frame->data, frame->linesize, 0, i->height, frame_rgb->data, frame_rgb->linesize);
+    sws_scale((struct SwsContext *)s->_swsc, (const uint8_t *const *)frame->data, frame->linesize, 0,
+              frame->height, dst, dst_linesize);
 
-    // Allocate space for our version of the image
-    image_alloc_pixbuf(i, i->width, i->height);
+    av_frame_unref(frame);
+    decoded++;
+  }
 
-    src = frame_rgb->data[0];
-    ofs = 0;
-    for (y = 0; y < i->height; y++) {
-      for (x = 0; x < i->width * 3; x += 3) {
-        i->_pixbuf[ofs++] = COL(src[x], src[x + 1], src[x + 2]);
-      }
-      src += i->width * 3;
-    }
+  if (!decoded) {
+    LOG_ERROR("Error decoding video frames for storyboard: %s\n", v->path);
+    goto err;
+  }
 
-    // Free the frame
-    LOG_MEM("destroy rgb_buffer @ %p\n", rgb_buffer);
-    av_free(rgb_buffer);
+  LOG_DEBUG("Storyboard of %d/%d frames, %d x %d\n", decoded, spec.frames, thumb->width, thumb->height);
 
-    av_free(frame_rgb);
+  if (!thumb_compress(thumb, &spec, 0))
+    goto err;
 
-    // Done!
-    goto out;
-  }
+  goto out;
 
 err:
-  image_destroy(i);
-  i = NULL;
+  image_destroy(thumb);
+  thumb = NULL;
 
 out:
-  sws_freeContext(swsc);
-  av_packet_unref(&packet);
   if (frame)
-    av_free(frame);
+    av_frame_free(&frame);
+
+  if (vc)
+    avcodec_free_context(&vc);
+
+  return thumb;
+}                               /* video_create_storyboard() */
+
+///-------------------------------------------------------------------------------------------------
+///  Add a keyframe to the sparse index of a video. Keyframes closer than the spacing to the last
+///   entry are left out. The spacing grows with the duration, so the index of a long video still
+///   spans all of it in VIDEO_MAX_KEYFRAMES entries.
+///
+/// @param v           The video.
+/// @param duration_ms Duration of the video.
+/// @param pts_ms      Time of the keyframe from the start of the video.
+/// @param offset      Byte offset of the keyframe in the file.
+///
+/// @return 0 once the index is full, 1 otherwise.
+///-------------------------------------------------------------------------------------------------
+
+int video_add_keyframe(MediaScanVideo *v, int duration_ms, int pts_ms, uint64_t offset) {
+  int spacing = MAX(VIDEO_KEYFRAME_SPACING, duration_ms / VIDEO_MAX_KEYFRAMES);
+  MediaScanKeyframe *k;
+
+  if (v->nkeyframes >= VIDEO_MAX_KEYFRAMES)
+    return 0;
+
+  if (pts_ms < 0 || (v->nkeyframes && pts_ms < v->keyframes[v->nkeyframes - 1].pts_ms + spacing))
+    return 1;
+
+  if (!v->keyframes) {
+    v->keyframes = (MediaScanKeyframe *)malloc(VIDEO_MAX_KEYFRAMES * sizeof(MediaScanKeyframe));
+    if (v->keyframes == NULL) {
+      FATAL("Out of memory for keyframe index\n");
+      return 0;
+    }
+    LOG_MEM("new keyframe index @ %p\n", v->keyframes);
+  }
 
-  avcodec_close(codecs->vc);
+  k = &v->keyframes[v->nkeyframes++];
+  k->pts_ms = pts_ms;
+  k->offset = offset;
 
-  return i;
+  return 1;
+}                               /* video_add_keyframe() */
+
+// The time of a timestamp of stream st from the start of the stream, in ms
+static int video_pts_ms(AVStream *st, int64_t ts) {
+  if (st->start_time != AV_NOPTS_VALUE)
+    ts -= st->start_time;
+
+  return (int)av_rescale_q(ts, st->time_base, MillisecondTimeBase);
 }
 
+///-------------------------------------------------------------------------------------------------
+///  Index the keyframes of a video from the index of its container, the MP4 sample tables,
+///   Matroska cues or the AVI idx1 chunk, which libavformat reads when it opens the file. The
+///   demuxers of containers without one index packets as they read them, which only covers the
+///   start of the file and is not used.
+///
+/// @return The number of keyframes indexed, 0 if the container index does not span the video.
+///-------------------------------------------------------------------------------------------------
+
+int video_index_keyframes(MediaScanVideo *v, AVFormatContext *avf, int vsid, int duration_ms) {
+  AVStream *st = avf->streams[vsid];
+  int last = 0;
+  int n, x;
+
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+  n = avformat_index_get_entries_count(st);
+#else
+  n = st->nb_index_entries;
+#endif
+
+  v->nkeyframes = 0;
+
+  for (x = 0; x < n; x++) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    const AVIndexEntry *e = avformat_index_get_entry(st, x);
+#else
+    const AVIndexEntry *e = &st->index_entries[x];
+#endif
+
+    if (!(e->flags & AVINDEX_KEYFRAME) || e->timestamp == AV_NOPTS_VALUE || e->pos < 0)
+      continue;
+
+    last = video_pts_ms(st, e->timestamp);
+    if (!video_add_keyframe(v, duration_ms, last, (uint64_t)e->pos))
+      break;
+  }
+
+  if (v->nkeyframes && duration_ms > 0 && last < duration_ms / 2) {
+    LOG_DEBUG("Index of %s ends at %d ms of %d, not using it\n", v->path, last, duration_ms);
+    v->nkeyframes = 0;
+  }
+
+  return v->nkeyframes;
+}                               /* video_index_keyframes() */
+
+///-------------------------------------------------------------------------------------------------
+///  Index the keyframes of a video without a container index from its packets, read from the
+///   start of the file up to VIDEO_INDEX_SCAN_BYTES.
+///
+/// @return The number of keyframes indexed.
+///-------------------------------------------------------------------------------------------------
+
+int video_scan_keyframes(MediaScanVideo *v, AVFormatContext *avf, int vsid, int duration_ms) {
+  AVStream *st = avf->streams[vsid];
+  AVPacket packet;
+  int packets = 0;
+  int full = 0;
+
+  v->nkeyframes = 0;
+
+  if (av_seek_frame(avf, vsid, 0, AVSEEK_FLAG_BYTE) < 0
+      && av_seek_frame(avf, vsid, st->start_time != AV_NOPTS_VALUE ? st->start_time : 0, AVSEEK_FLAG_BACKWARD) < 0) {
+    LOG_DEBUG("Couldn't seek to the start of %s to index it\n", v->path);
+    return 0;
+  }
+
+  av_init_packet(&packet);
+
+  while (!full && packets++ < VIDEO_INDEX_SCAN_PACKETS && av_read_frame(avf, &packet) >= 0) {
+    int64_t ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+
+    if (packet.stream_index == vsid && (packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE && packet.pos >= 0)
+      full = !video_add_keyframe(v, duration_ms, video_pts_ms(st, ts), (uint64_t)packet.pos);
+
+    if (packet.pos > VIDEO_INDEX_SCAN_BYTES)
+      full = 1;
+
+    av_packet_unref(&packet);
+  }
+
+  LOG_DEBUG("Indexed %d keyframes from %d packets of %s\n", v->nkeyframes, packets, v->path);
+
+  return v->nkeyframes;
+}                               /* video_scan_keyframes() */
+
 void video_destroy(MediaScanVideo *v) {
+  if (v->keyframes) {
+    LOG_MEM("destroy keyframe index @ %p\n", v->keyframes);
+    free(v->keyframes);
+  }
+
   LOG_MEM("destroy MediaScanVideo @ %p\n", v);
   free(v);
 }
+
+// Free the swscale context kept by a scan
+void video_scaler_destroy(MediaScan *s) {
+  if (s->_swsc) {
+    sws_freeContext((struct SwsContext *)s->_swsc);
+    s->_swsc = NULL;
+  }
+}
@@ -2,7 +2,14 @@
 #define _VIDEO_H
 
 MediaScanVideo *video_create(void);
+AVCodecContext *video_open_decoder(AVStream *vs, const AVCodec *codec, int thumb_width, int thumb_height);
+int video_decode_frame(AVFormatContext *avf, int vsid, AVCodecContext *vc, int64_t pos, AVFrame *frame);
 MediaScanImage *video_create_image_from_frame(MediaScanVideo *v, MediaScanResult *r);
+MediaScanImage *video_create_storyboard(MediaScanVideo *v, MediaScanResult *r, MediaScanThumbSpec *spec);
+int video_add_keyframe(MediaScanVideo *v, int duration_ms, int pts_ms, uint64_t offset);
+int video_index_keyframes(MediaScanVideo *v, AVFormatContext *avf, int vsid, int duration_ms);
+int video_scan_keyframes(MediaScanVideo *v, AVFormatContext *avf, int vsid, int duration_ms);
 void video_destroy(MediaScanVideo *v);
+void video_scaler_destroy(MediaScan *s);
 
 #endif // _VIDEO_H
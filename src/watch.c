@@ -0,0 +1,1229 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\src\watch.c
+//
+// summary: Change watching for MS_WATCH_CHANGES. After the scan has finished, the scan thread
+//          keeps running and picks up changes to the scanned paths. On Linux every directory
+//          found by recurse_dir is watched with inotify; changed files are scanned as a rescan,
+//          new directories are walked and deleted files are removed from the cache.
+//          Changes are held back until they settle: a file is only scanned once it has had no
+//          events and kept its size and mtime for s->watch_settle_ms, so a file that is still
+//          being copied is never decoded half-written. A burst of changes in one directory is
+//          collapsed into a single rescan of the files in that directory.
+//          Directories inotify can't watch, such as those on network filesystems, and all
+//          directories on other platforms are polled instead. The poller keeps the mtime, link
+//          count and entry count of each directory, stats every directory once per interval and
+//          only reads the ones that changed. Some network filesystems don't update the mtime of a
+//          directory, so every few polls the entries of unchanged directories are counted too, and
+//          a directory whose count changed behind an old mtime is counted on every poll from then on.
+//          The interval shrinks while changes are found and grows back to s->watch_interval while
+//          nothing changes.
+///-------------------------------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef WIN32
+#include "win32config.h"
+#endif
+
+#include <libmediascan.h>
+#include <db.h>
+
+#include "common.h"
+#include "cache.h"
+#include "database.h"
+#include "mediascan.h"
+#include "result.h"
+#include "util.h"
+#include "watch.h"
+
+#ifndef WIN32
+
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#endif
+
+#define WATCH_POLL_MS 1000            // how often a watching thread checks for ms_clear_watch/ms_abort
+#define WATCH_SETTLE_POLL_MS 250      // how often pending changes are checked
+#define WATCH_BURST 16                // pending files in one directory that turn into a rescan of its files
+#define WATCH_BUF_SIZE 16384
+#define WATCH_INTERVAL_MIN 10         // shortest poll interval while changes keep coming, in seconds
+#define WATCH_COUNT_POLLS 6           // polls between counting the entries of unchanged directories
+
+// The source of a rename, waiting for its IN_MOVED_TO
+typedef struct {
+  uint32_t cookie;
+  int isdir;
+  char *path;
+} WatchMove;
+
+// A change waiting to settle
+typedef struct {
+  char *path;
+  int isdir;                    // rescan the directory instead of a single file
+  int burst;                    // rescan the files directly in the directory, not its subdirectories
+  int purge;                    // after the rescan, remove cached files below the directory that are gone
+  off_t size;                   // size and mtime when last looked at
+  time_t mtime;
+  uint64_t last;                // time of the last event or change, in ms
+} WatchPending;
+
+// Last seen state of a polled directory
+typedef struct {
+  char *path;                   // NULL once the directory is gone
+  time_t mtime;
+  nlink_t nlink;
+  int nentries;                 // entries when last read, -1 if it was not read by the poller yet
+  int racy;                     // changed too close to when it was looked at to trust its mtime
+  int untrusted;                // its entries changed without a new mtime, so they are counted every poll
+  int next;                     // next snapshot in the same hash bucket, or -1
+} WatchSnapshot;
+
+typedef struct {
+  int fd;                       // inotify instance, -1 if every directory is polled
+  char **dirs;                  // watched directory of each watch descriptor
+  int ndirs;                    // allocated size of dirs
+  int full;                     // set once the watch limit has been reported
+  WatchMove *moves;             // unpaired IN_MOVED_FROM events of the current read
+  int nmoves;
+  int maxmoves;
+  WatchPending *pending;        // changes waiting to settle
+  int npending;
+  int maxpending;
+  WatchSnapshot *snaps;         // polled directories
+  int nsnaps;
+  int maxsnaps;
+  int ndead;                    // snapshots of directories that are gone
+  int *buckets;                 // hash table of snaps by path
+  int nbuckets;
+  int interval;                 // current poll interval, in seconds
+  int polls;                    // polls done
+  uint64_t next_poll;
+} Watch;
+
+// Monotonic time in ms
+static uint64_t watch_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}                               /* watch_now() */
+
+// Add a string to a growing list
+static void watch_push(char ***list, int *n, int *max, const char *str) {
+  if (*n == *max) {
+    char **p = (char **)realloc(*list, (*max * 2 + 16) * sizeof(char *));
+
+    if (p == NULL) {
+      FATAL("Out of memory for change watch\n");
+      return;
+    }
+
+    *list = p;
+    *max = *max * 2 + 16;
+  }
+
+  (*list)[(*n)++] = strdup(str);
+}                               /* watch_push() */
+
+static void watch_free_list(char **list, int n) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    free(list[i]);
+
+  if (list != NULL)
+    free(list);
+}                               /* watch_free_list() */
+
+#ifdef __linux__
+// Changes to a directory on a network filesystem are not seen by inotify if they come from another host
+static int watch_is_remote(const char *dir) {
+  struct statfs sf;
+
+  if (statfs(dir, &sf) != 0)
+    return 0;
+
+  switch ((unsigned int)sf.f_type) {
+    case 0x6969:                // NFS
+    case 0x517B:                // SMB
+    case 0xFF534D42:            // CIFS
+    case 0xFE534D42:            // SMB2
+    case 0x65735546:            // FUSE, e.g. sshfs
+    case 0x564C:                // NCP
+    case 0x73757245:            // Coda
+    case 0x47504653:            // GPFS
+    case 0x00C36400:            // Ceph
+      return 1;
+  }
+
+  return 0;
+}                               /* watch_is_remote() */
+#endif
+
+static int watch_find_snapshot(Watch *w, const char *path) {
+  int i;
+
+  if (w->nbuckets == 0)
+    return -1;
+
+  i = w->buckets[hashlittle(path, strlen(path), 0) & (w->nbuckets - 1)];
+  while (i >= 0) {
+    if (w->snaps[i].path != NULL && !strcmp(w->snaps[i].path, path))
+      return i;
+    i = w->snaps[i].next;
+  }
+
+  return -1;
+}                               /* watch_find_snapshot() */
+
+// Drop the snapshots of directories that are gone and rebuild the hash table
+static void watch_rehash(Watch *w) {
+  int nbuckets = 16;
+  int *buckets;
+  int i, j = 0;
+  uint32_t h;
+
+  while (nbuckets < w->maxsnaps)
+    nbuckets <<= 1;
+
+  buckets = (int *)malloc(nbuckets * sizeof(int));
+  if (buckets == NULL) {
+    FATAL("Out of memory for change watch\n");
+    return;
+  }
+
+  for (i = 0; i < nbuckets; i++)
+    buckets[i] = -1;
+
+  for (i = 0; i < w->nsnaps; i++) {
+    if (w->snaps[i].path == NULL)
+      continue;
+
+    w->snaps[j] = w->snaps[i];
+    h = hashlittle(w->snaps[j].path, strlen(w->snaps[j].path), 0) & (nbuckets - 1);
+    w->snaps[j].next = buckets[h];
+    buckets[h] = j;
+    j++;
+  }
+
+  if (w->buckets != NULL)
+    free(w->buckets);
+
+  w->buckets = buckets;
+  w->nbuckets = nbuckets;
+  w->nsnaps = j;
+  w->ndead = 0;
+}                               /* watch_rehash() */
+
+// Start polling a directory, or take a new snapshot of one that is already polled
+static void watch_add_snapshot(Watch *w, const char *dir) {
+  WatchSnapshot *d;
+  struct stat st;
+  uint32_t h;
+  int i;
+
+  if (stat(dir, &st) != 0)
+    return;
+
+  i = watch_find_snapshot(w, dir);
+  if (i < 0) {
+    if (w->nsnaps == w->maxsnaps) {
+      // Reuse the space of directories that are gone before growing, if there are enough of them
+      if (w->ndead == 0 || w->ndead < w->nsnaps / 2) {
+        int n = w->maxsnaps * 2 + 64;
+        WatchSnapshot *snaps = (WatchSnapshot *)realloc(w->snaps, n * sizeof(WatchSnapshot));
+
+        if (snaps == NULL) {
+          FATAL("Out of memory for change watch\n");
+          return;
+        }
+
+        w->snaps = snaps;
+        w->maxsnaps = n;
+      }
+
+      watch_rehash(w);
+      if (w->nbuckets == 0)
+        return;
+    }
+
+    i = w->nsnaps++;
+    d = &w->snaps[i];
+    d->path = strdup(dir);
+    h = hashlittle(dir, strlen(dir), 0) & (w->nbuckets - 1);
+    d->next = w->buckets[h];
+    w->buckets[h] = i;
+  }
+
+  d = &w->snaps[i];
+  d->mtime = st.st_mtime;
+  d->nlink = st.st_nlink;
+  d->nentries = -1;
+  d->untrusted = 0;
+  d->racy = st.st_mtime >= time(NULL) - 1;
+}                               /* watch_add_snapshot() */
+
+///-------------------------------------------------------------------------------------------------
+///  Start watching. Called before the directories are walked, so recurse_dir can add them.
+///
+/// @param s Scan instance.
+///
+/// @return 1 on success, 0 if the platform cannot watch for changes.
+///-------------------------------------------------------------------------------------------------
+
+int watch_init(MediaScan *s) {
+  Watch *w;
+
+  w = (Watch *)calloc(1, sizeof(Watch));
+  if (w == NULL) {
+    FATAL("Out of memory for change watch\n");
+    return 0;
+  }
+
+  LOG_MEM("new watch @ %p\n", w);
+
+  w->fd = -1;
+  w->interval = s->watch_interval;
+
+#ifdef __linux__
+  if (!s->_watch_poll) {
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0)
+      LOG_WARN("Unable to use inotify, polling for changes instead: %s\n", strerror(errno));
+  }
+#endif
+
+  s->_watch = w;
+
+  return 1;
+}                               /* watch_init() */
+
+///-------------------------------------------------------------------------------------------------
+///  Watch a directory found while walking the scan paths.
+///
+/// @param s Scan instance.
+/// @param dir Full pathname of the directory.
+///-------------------------------------------------------------------------------------------------
+
+void watch_add_dir(MediaScan *s, const char *dir) {
+  Watch *w = (Watch *)s->_watch;
+
+  if (w == NULL)
+    return;
+
+#ifdef __linux__
+  if (w->fd >= 0 && !watch_is_remote(dir)) {
+    int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+
+    if (wd < 0) {
+      if (errno != ENOSPC) {
+        LOG_ERROR("Unable to watch %s: %s\n", dir, strerror(errno));
+        return;
+      }
+
+      if (!w->full) {
+        LOG_WARN("The inotify watch limit was reached at %s, polling the remaining directories instead. "
+                 "Raise fs.inotify.max_user_watches to watch all directories\n", dir);
+        w->full = 1;
+      }
+    }
+    else {
+      if (wd >= w->ndirs) {
+        int n = wd * 2 + 16;
+        char **dirs = (char **)realloc(w->dirs, n * sizeof(char *));
+
+        if (dirs == NULL) {
+          FATAL("Out of memory for change watch\n");
+          inotify_rm_watch(w->fd, wd);
+          return;
+        }
+
+        memset(dirs + w->ndirs, 0, (n - w->ndirs) * sizeof(char *));
+        w->dirs = dirs;
+        w->ndirs = n;
+      }
+
+      // A directory that is already watched keeps its descriptor, under the name it was found by last
+      if (w->dirs[wd] != NULL)
+        free(w->dirs[wd]);
+
+      w->dirs[wd] = strdup(dir);
+
+      LOG_DEBUG("Watching %s (%d)\n", dir, wd);
+      return;
+    }
+  }
+#endif
+
+  watch_add_snapshot(w, dir);
+
+  LOG_DEBUG("Polling %s\n", dir);
+}                               /* watch_add_dir() */
+
+// Stop watching a directory and everything below it
+static void watch_forget_tree(Watch *w, const char *dir) {
+  int i;
+
+#ifdef __linux__
+  for (i = 0; i < w->ndirs; i++) {
+    if (w->dirs[i] != NULL && bdb_path_in_root(w->dirs[i], dir)) {
+      inotify_rm_watch(w->fd, i);
+      free(w->dirs[i]);
+      w->dirs[i] = NULL;
+    }
+  }
+#endif
+
+  for (i = 0; i < w->nsnaps; i++) {
+    if (w->snaps[i].path != NULL && bdb_path_in_root(w->snaps[i].path, dir)) {
+      free(w->snaps[i].path);
+      w->snaps[i].path = NULL;
+      w->ndead++;
+    }
+  }
+}                               /* watch_forget_tree() */
+
+// Remove a file from the cache and report it, if it was scanned before
+static void watch_deleted(MediaScan *s, const char *path) {
+  DBT key, data;
+  MediaScanResult *r;
+
+  bdb_select_shard(s, path);
+
+  if (s->dbp == NULL)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+
+  if (s->dbp->get(s->dbp, NULL, &key, &data, 0) != 0)
+    return;
+
+  LOG_INFO("Deleted %s\n", path);
+
+  cache_delete_path(s, path);
+
+  if (s->flags & MS_INCLUDE_DELETED) {
+    r = result_create(s);
+    if (r == NULL)
+      return;
+
+    r->type = _should_scan(s, path);
+    r->path = strdup(path);
+    r->deleted = 1;
+
+    send_result(s, r);
+  }
+}                               /* watch_deleted() */
+
+// Remove the cached files below a directory that is gone, or if missing is set only those of them
+// that no longer exist
+static void watch_deleted_tree(MediaScan *s, const char *dir, int missing) {
+  char prefix[MAX_PATH_STR_LEN];
+  char **paths = NULL;
+  int npaths = 0, maxpaths = 0;
+  size_t len;
+  DBC *cursor;
+  DBT key, data;
+  struct stat st;
+  int i, ret;
+
+  bdb_select_shard(s, dir);
+
+  if (s->dbp == NULL)
+    return;
+
+  snprintf(prefix, sizeof(prefix), "%s/", dir);
+  len = strlen(prefix);
+
+  if (s->dbp->cursor(s->dbp, NULL, &cursor, 0) != 0)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = prefix;
+  key.size = len;
+
+  // Collect the paths first, watch_deleted changes the database
+  ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+  while (ret == 0 && key.size > len && !strncmp((char *)key.data, prefix, len)) {
+    if (!missing || stat((char *)key.data, &st) != 0)
+      watch_push(&paths, &npaths, &maxpaths, (char *)key.data);
+    ret = cursor->c_get(cursor, &key, &data, DB_NEXT);
+  }
+
+  cursor->c_close(cursor);
+
+  for (i = 0; i < npaths; i++)
+    watch_deleted(s, paths[i]);
+
+  watch_free_list(paths, npaths);
+}                               /* watch_deleted_tree() */
+
+// Scan a file that was written, touched or moved into place
+static void watch_scan_file(MediaScan *s, const char *path) {
+  int type = _should_scan(s, path);
+
+  if (type)
+    ms_scan_file(s, path, type);
+}                               /* watch_scan_file() */
+
+// Walk and scan a directory that was created or moved into place
+static void watch_scan_dir(MediaScan *s, const char *dir) {
+  if (!_should_scan_dir(s, dir))
+    return;
+
+  recurse_dir(s, dir, 0);
+  scan_dirq(s);
+}                               /* watch_scan_dir() */
+
+// Scan the files directly in a directory after a burst of changes to them. Its subdirectories have
+// their own events, so they are not walked.
+static void watch_scan_files(MediaScan *s, const char *dir) {
+  char path[MAX_PATH_STR_LEN];
+  char **names = NULL;
+  int nnames = 0, maxnames = 0;
+  DIR *dirp;
+  struct dirent *dp;
+  struct stat st;
+  int i;
+
+  if ((dirp = opendir(dir)) == NULL) {
+    LOG_ERROR("Unable to open directory %s: %s\n", dir, strerror(errno));
+    return;
+  }
+
+  while ((dp = readdir(dirp)) != NULL) {
+    // recurse_dir skips all dot files
+    if (dp->d_name[0] != '.')
+      watch_push(&names, &nnames, &maxnames, dp->d_name);
+  }
+
+  closedir(dirp);
+
+  for (i = 0; i < nnames && !s->_want_abort; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+
+    if (stat(path, &st) == 0 && !S_ISDIR(st.st_mode))
+      watch_scan_file(s, path);
+  }
+
+  watch_free_list(names, nnames);
+}                               /* watch_scan_files() */
+
+// Is path a file directly inside dir
+static int watch_in_dir(const char *path, const char *dir) {
+  size_t len = strlen(dir);
+
+  return !strncmp(path, dir, len) && path[len] == '/' && strchr(path + len + 1, '/') == NULL;
+}                               /* watch_in_dir() */
+
+// Does a pending change take care of a change to the file path
+static int watch_pending_covers(WatchPending *p, const char *path) {
+  if (p->isdir)
+    return bdb_path_in_root(path, p->path);
+  if (p->burst)
+    return watch_in_dir(path, p->path);
+
+  return !strcmp(path, p->path);
+}                               /* watch_pending_covers() */
+
+static void watch_drop_pending(Watch *w, int i) {
+  if (w->pending[i].path != NULL)
+    free(w->pending[i].path);
+
+  w->pending[i] = w->pending[--w->npending];
+}                               /* watch_drop_pending() */
+
+// Forget pending changes of a path and everything below it
+static void watch_drop_tree(Watch *w, const char *path) {
+  int i = 0;
+
+  while (i < w->npending) {
+    if (bdb_path_in_root(w->pending[i].path, path))
+      watch_drop_pending(w, i);
+    else
+      i++;
+  }
+}                               /* watch_drop_tree() */
+
+static WatchPending *watch_add_pending(Watch *w, const char *path, int isdir) {
+  WatchPending *p;
+
+  if (w->npending == w->maxpending) {
+    int n = w->maxpending * 2 + 16;
+    WatchPending *pending = (WatchPending *)realloc(w->pending, n * sizeof(WatchPending));
+
+    if (pending == NULL) {
+      FATAL("Out of memory for change watch\n");
+      return NULL;
+    }
+
+    w->pending = pending;
+    w->maxpending = n;
+  }
+
+  p = &w->pending[w->npending++];
+  p->path = strdup(path);
+  p->isdir = isdir;
+  p->burst = 0;
+  p->purge = 0;
+  p->size = -1;
+  p->mtime = 0;
+  p->last = watch_now();
+
+  return p;
+}                               /* watch_add_pending() */
+
+// Hold back a rescan of a directory until it has settled, returns the pending rescan that covers it
+static WatchPending *watch_defer_dir(Watch *w, const char *dir) {
+  int i;
+
+  for (i = 0; i < w->npending; i++) {
+    if (w->pending[i].isdir && bdb_path_in_root(dir, w->pending[i].path)) {
+      w->pending[i].last = watch_now();
+      return &w->pending[i];
+    }
+  }
+
+  // The directory rescan covers all changes below it
+  watch_drop_tree(w, dir);
+  return watch_add_pending(w, dir, 1);
+}                               /* watch_defer_dir() */
+
+static void watch_add_pending_file(Watch *w, const char *path) {
+  WatchPending *p;
+  struct stat st;
+
+  p = watch_add_pending(w, path, 0);
+  if (p != NULL && stat(path, &st) == 0) {
+    p->size = st.st_size;
+    p->mtime = st.st_mtime;
+  }
+}                               /* watch_add_pending_file() */
+
+// Hold back a scan of a file until it has settled, without collapsing bursts. Used by the poller,
+// which has already read the whole directory.
+static void watch_pend_file(Watch *w, const char *path) {
+  WatchPending *p;
+  int i;
+
+  for (i = 0; i < w->npending; i++) {
+    p = &w->pending[i];
+
+    if (watch_pending_covers(p, path)) {
+      p->last = watch_now();
+      return;
+    }
+  }
+
+  watch_add_pending_file(w, path);
+}                               /* watch_pend_file() */
+
+// Scan the pending changes that have settled
+static void watch_settle(MediaScan *s) {
+  Watch *w = (Watch *)s->_watch;
+  WatchPending *p;
+  struct stat st;
+  uint64_t now = watch_now();
+  char *path;
+  int i = 0, isdir, burst, purge;
+
+  while (i < w->npending && !s->_want_abort) {
+    p = &w->pending[i];
+
+    if (now - p->last < (uint64_t)s->watch_settle_ms) {
+      i++;
+      continue;
+    }
+
+    if (!p->isdir && !p->burst) {
+      // Gone again, its IN_DELETE takes care of the cache
+      if (stat(p->path, &st) != 0) {
+        watch_drop_pending(w, i);
+        continue;
+      }
+
+      // Still being written by something that doesn't cause events, such as a remote client
+      if (st.st_size != p->size || st.st_mtime != p->mtime) {
+        p->size = st.st_size;
+        p->mtime = st.st_mtime;
+        p->last = now;
+        i++;
+        continue;
+      }
+    }
+
+    path = p->path;
+    isdir = p->isdir;
+    burst = p->burst;
+    purge = p->purge;
+    p->path = NULL;
+    watch_drop_pending(w, i);
+
+    if (isdir) {
+      watch_scan_dir(s, path);
+
+      // Moved files were taken out of the cache by the rescan, what is left and missing is gone
+      if (purge)
+        watch_deleted_tree(s, path, 1);
+    }
+    else if (burst)
+      watch_scan_files(s, path);
+    else
+      watch_scan_file(s, path);
+
+    free(path);
+  }
+}                               /* watch_settle() */
+
+// Is the cached result of a file up to date
+static int watch_is_current(MediaScan *s, const char *path) {
+  DBT key, data;
+  uint32_t hash;
+  uint64_t size;
+  int mtime;
+
+  bdb_select_shard(s, path);
+
+  if (s->dbp == NULL)
+    return 0;
+
+  hash = HashFile(path, &mtime, &size);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+  data.data = &hash;
+  data.size = sizeof(uint32_t);
+
+  return s->dbp->get(s->dbp, NULL, &key, &data, DB_GET_BOTH) == 0;
+}                               /* watch_is_current() */
+
+// Count the entries of a directory the way watch_poll_dir() lists them, -1 if it can't be read
+static int watch_count_dir(const char *dir) {
+  DIR *dirp;
+  struct dirent *dp;
+  int n = 0;
+
+  if ((dirp = opendir(dir)) == NULL)
+    return -1;
+
+  while ((dp = readdir(dirp)) != NULL) {
+    if (dp->d_name[0] != '.')
+      n++;
+  }
+
+  closedir(dirp);
+
+  return n;
+}                               /* watch_count_dir() */
+
+static int watch_name_cmp(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+// Read a polled directory that has changed. New and changed files and new directories are held back
+// until they settle, files that are gone are deleted. Returns the number of changes found.
+static int watch_poll_dir(MediaScan *s, const char *dir, int *nentries) {
+  Watch *w = (Watch *)s->_watch;
+  char path[MAX_PATH_STR_LEN];
+  char prefix[MAX_PATH_STR_LEN];
+  char **names = NULL, **gone = NULL;
+  int nnames = 0, maxnames = 0, ngone = 0, maxgone = 0;
+  DIR *dirp;
+  struct dirent *dp;
+  struct stat st;
+  DBC *cursor;
+  DBT key, data;
+  size_t len;
+  int i, ret, changes = 0;
+
+  if ((dirp = opendir(dir)) == NULL) {
+    LOG_ERROR("Unable to open directory %s: %s\n", dir, strerror(errno));
+    return 0;
+  }
+
+  while ((dp = readdir(dirp)) != NULL) {
+    // recurse_dir skips all dot files
+    if (dp->d_name[0] != '.')
+      watch_push(&names, &nnames, &maxnames, dp->d_name);
+  }
+
+  closedir(dirp);
+
+  *nentries = nnames;
+  qsort(names, nnames, sizeof(char *), watch_name_cmp);
+
+  for (i = 0; i < nnames && !s->_want_abort; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+
+    if (stat(path, &st) != 0)
+      continue;
+
+    if (S_ISDIR(st.st_mode)) {
+      if (watch_find_snapshot(w, path) < 0 && _should_scan_dir(s, path)) {
+        watch_defer_dir(w, path);
+        changes++;
+      }
+    }
+    else if (_should_scan(s, path) && !watch_is_current(s, path)) {
+      watch_pend_file(w, path);
+      changes++;
+    }
+  }
+
+  // Cached files directly in this directory that are no longer listed are gone
+  bdb_select_shard(s, dir);
+
+  if (s->dbp != NULL && s->dbp->cursor(s->dbp, NULL, &cursor, 0) == 0) {
+    snprintf(prefix, sizeof(prefix), "%s/", dir);
+    len = strlen(prefix);
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = prefix;
+    key.size = len;
+
+    ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && key.size > len && !strncmp((char *)key.data, prefix, len)) {
+      char *name = (char *)key.data + len;
+
+      if (strchr(name, '/') == NULL && bsearch(&name, names, nnames, sizeof(char *), watch_name_cmp) == NULL)
+        watch_push(&gone, &ngone, &maxgone, (char *)key.data);
+
+      ret = cursor->c_get(cursor, &key, &data, DB_NEXT);
+    }
+
+    cursor->c_close(cursor);
+  }
+
+  for (i = 0; i < ngone; i++) {
+    watch_drop_tree(w, gone[i]);
+    watch_deleted(s, gone[i]);
+    changes++;
+  }
+
+  watch_free_list(names, nnames);
+  watch_free_list(gone, ngone);
+
+  return changes;
+}                               /* watch_poll_dir() */
+
+// Stat all polled directories and read the ones that changed. Returns the number of changes found.
+static int watch_poll(MediaScan *s) {
+  Watch *w = (Watch *)s->_watch;
+  char dir[MAX_PATH_STR_LEN];
+  WatchSnapshot *d;
+  struct stat st;
+  time_t now;
+  int i, n, count, changes = 0;
+
+  // Count the entries of unchanged directories on this poll
+  count = w->polls++ % WATCH_COUNT_POLLS == WATCH_COUNT_POLLS - 1;
+
+  for (i = 0; i < w->nsnaps && !s->_want_abort; i++) {
+    d = &w->snaps[i];
+
+    if (d->path == NULL)
+      continue;
+
+    strcpy(dir, d->path);
+
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      LOG_INFO("%s is gone\n", dir);
+      watch_forget_tree(w, dir);
+      watch_drop_tree(w, dir);
+      watch_deleted_tree(s, dir, 0);
+      changes++;
+      continue;
+    }
+
+    if (!d->racy && st.st_mtime == d->mtime && st.st_nlink == d->nlink) {
+      if (!count && !d->untrusted)
+        continue;
+
+      n = watch_count_dir(dir);
+      if (d->nentries < 0) {
+        // Not read by the poller yet, this count is what later ones are compared with
+        d->nentries = n;
+        continue;
+      }
+      if (n == d->nentries)
+        continue;
+
+      if (!d->untrusted)
+        LOG_INFO("%s changed without a new mtime, counting its entries on every poll\n", dir);
+      d->untrusted = 1;
+    }
+
+    now = time(NULL);
+    n = 0;
+    changes += watch_poll_dir(s, dir, &n);
+
+    d = &w->snaps[i];
+    LOG_DEBUG("Read %s, %d entries (was %d)\n", dir, n, d->nentries);
+
+    d->mtime = st.st_mtime;
+    d->nlink = st.st_nlink;
+    d->nentries = n;
+
+    // A change in the same second as this read leaves the mtime alone, so read it again next time
+    d->racy = st.st_mtime >= now - 1;
+  }
+
+  return changes;
+}                               /* watch_poll() */
+
+#ifdef __linux__
+
+// Hold back a scan of a file in dir until it has settled
+static void watch_defer_file(MediaScan *s, const char *dir, const char *path) {
+  Watch *w = (Watch *)s->_watch;
+  WatchPending *p;
+  int i, n = 0;
+
+  if (!_should_scan(s, path))
+    return;
+
+  for (i = 0; i < w->npending; i++) {
+    p = &w->pending[i];
+
+    if (watch_pending_covers(p, path)) {
+      p->last = watch_now();
+      return;
+    }
+
+    if (!p->isdir && !p->burst && watch_in_dir(p->path, dir))
+      n++;
+  }
+
+  if (n + 1 >= WATCH_BURST) {
+    LOG_DEBUG("Collapsing changes in %s into a rescan of its files\n", dir);
+
+    // The rescan of the files covers the ones pending, but not the subdirectories
+    i = 0;
+    while (i < w->npending) {
+      if (!w->pending[i].isdir && watch_in_dir(w->pending[i].path, dir))
+        watch_drop_pending(w, i);
+      else
+        i++;
+    }
+
+    p = watch_add_pending(w, dir, 0);
+    if (p != NULL)
+      p->burst = 1;
+    return;
+  }
+
+  watch_add_pending_file(w, path);
+}                               /* watch_defer_file() */
+
+static void watch_add_move(Watch *w, uint32_t cookie, int isdir, const char *path) {
+  if (w->nmoves == w->maxmoves) {
+    int n = w->maxmoves * 2 + 8;
+    WatchMove *moves = (WatchMove *)realloc(w->moves, n * sizeof(WatchMove));
+
+    if (moves == NULL) {
+      FATAL("Out of memory for change watch\n");
+      return;
+    }
+
+    w->moves = moves;
+    w->maxmoves = n;
+  }
+
+  w->moves[w->nmoves].cookie = cookie;
+  w->moves[w->nmoves].isdir = isdir;
+  w->moves[w->nmoves].path = strdup(path);
+  w->nmoves++;
+}                               /* watch_add_move() */
+
+// Returns the source path of a rename, which the caller must free, or NULL if it was not watched
+static char *watch_take_move(Watch *w, uint32_t cookie) {
+  int i;
+
+  for (i = 0; i < w->nmoves; i++) {
+    if (w->moves[i].cookie == cookie) {
+      char *path = w->moves[i].path;
+
+      w->moves[i] = w->moves[--w->nmoves];
+      return path;
+    }
+  }
+
+  return NULL;
+}                               /* watch_take_move() */
+
+static void watch_event(MediaScan *s, struct inotify_event *ev) {
+  Watch *w = (Watch *)s->_watch;
+  char path[MAX_PATH_STR_LEN];
+  const char *dir;
+  char *from;
+  int i;
+
+  if (ev->mask & IN_Q_OVERFLOW) {
+    // Events were lost, all we can do is look at everything again. The rescan only finds new and
+    // changed files, deleted ones are found in the cache afterwards.
+    LOG_WARN("Too many changes to keep up with, rescanning all paths\n");
+    while (w->npending)
+      watch_drop_pending(w, 0);
+    for (i = 0; i < s->npaths; i++) {
+      // Pending paths are absolute, like the watched directories and the cached dirs map
+      char *root = bdb_scan_root(s->paths[i]);
+
+      if (root != NULL) {
+        WatchPending *p = watch_defer_dir(w, root);
+
+        if (p != NULL)
+          p->purge = 1;
+        free(root);
+      }
+    }
+    return;
+  }
+
+  if (ev->wd < 0 || ev->wd >= w->ndirs || w->dirs[ev->wd] == NULL)
+    return;
+
+  if (ev->mask & IN_IGNORED) {
+    free(w->dirs[ev->wd]);
+    w->dirs[ev->wd] = NULL;
+    return;
+  }
+
+  if (ev->len == 0)
+    return;
+
+  dir = w->dirs[ev->wd];
+  snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+
+  if (ev->mask & IN_MOVED_FROM) {
+    watch_add_move(w, ev->cookie, ev->mask & IN_ISDIR, path);
+  }
+  else if ((ev->mask & (IN_MOVED_TO | IN_CREATE)) && (ev->mask & IN_ISDIR)) {
+    from = (ev->mask & IN_MOVED_TO) ? watch_take_move(w, ev->cookie) : NULL;
+
+    if (from != NULL) {
+      watch_forget_tree(w, from);
+      watch_drop_tree(w, from);
+      free(from);
+    }
+
+    // Watch the new directory right away, so changes to its files hold back the rescan.
+    // Files moved within the watched paths are recognized by the rescan and keep their cached data
+    if (_should_scan_dir(s, path)) {
+      watch_add_dir(s, path);
+      watch_defer_dir(w, path);
+    }
+  }
+  else if (ev->mask & IN_ISDIR) {
+    if (ev->mask & IN_DELETE) {
+      watch_drop_tree(w, path);
+      watch_deleted_tree(s, path, 0);
+    }
+  }
+  else if (ev->mask & IN_DELETE) {
+    watch_drop_tree(w, path);
+    watch_deleted(s, path);
+  }
+  else {
+    if (ev->mask & IN_MOVED_TO) {
+      from = watch_take_move(w, ev->cookie);
+      if (from != NULL) {
+        watch_drop_tree(w, from);
+        free(from);
+      }
+    }
+
+    watch_defer_file(s, dir, path);
+  }
+}                               /* watch_event() */
+
+// Handle all pending events, returns 0 if the inotify instance can no longer be read
+static int watch_read(MediaScan *s) {
+  Watch *w = (Watch *)s->_watch;
+  char buf[WATCH_BUF_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int i;
+
+  // Both halves of a rename are queued together, so read until the queue is empty before
+  // deciding a rename was a deletion
+  while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)p;
+      watch_event(s, ev);
+    }
+  }
+
+  if (len < 0 && errno != EAGAIN && errno != EINTR) {
+    LOG_ERROR("Unable to read changes: %s\n", strerror(errno));
+    return 0;
+  }
+
+  // Files moved out of the watched paths are gone as far as the scan is concerned
+  for (i = 0; i < w->nmoves; i++) {
+    watch_drop_tree(w, w->moves[i].path);
+
+    if (w->moves[i].isdir) {
+      watch_forget_tree(w, w->moves[i].path);
+      watch_deleted_tree(s, w->moves[i].path, 0);
+    }
+    else {
+      watch_deleted(s, w->moves[i].path);
+    }
+    free(w->moves[i].path);
+  }
+  w->nmoves = 0;
+
+  return 1;
+}                               /* watch_read() */
+
+#endif
+
+///-------------------------------------------------------------------------------------------------
+///  Handle changes until the scan is aborted or ms_clear_watch is called. Runs on the scan thread.
+///
+/// @param s Scan instance.
+///-------------------------------------------------------------------------------------------------
+
+void watch_run(MediaScan *s) {
+  Watch *w = (Watch *)s->_watch;
+  struct pollfd pfd;
+  int flags = s->flags;
+  int timeout, ret;
+
+  if (w == NULL)
+    return;
+
+  // Changes are scanned as a rescan, so unchanged files are skipped and moved files are recognized
+  s->flags = (s->flags & ~MS_FULL_SCAN) | MS_RESCAN;
+
+  pfd.fd = w->fd;
+  pfd.events = POLLIN;
+
+  w->next_poll = watch_now() + (uint64_t)w->interval * 1000;
+
+  LOG_INFO("Watching for changes\n");
+
+  while (!s->_want_abort) {
+    timeout = w->npending ? WATCH_SETTLE_POLL_MS : WATCH_POLL_MS;
+
+    if (w->fd >= 0) {
+      pfd.revents = 0;
+      ret = poll(&pfd, 1, timeout);
+    }
+    else {
+      ret = poll(NULL, 0, timeout);
+    }
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      LOG_ERROR("Unable to wait for changes: %s\n", strerror(errno));
+      break;
+    }
+
+#ifdef __linux__
+    if (ret > 0 && !watch_read(s))
+      break;
+#endif
+
+    if (w->nsnaps && watch_now() >= w->next_poll) {
+      // Poll more often while things are changing, and back off to the configured interval when idle
+      if (watch_poll(s)) {
+        w->interval /= 2;
+        if (w->interval < WATCH_INTERVAL_MIN)
+          w->interval = WATCH_INTERVAL_MIN;
+      }
+      else {
+        w->interval *= 2;
+      }
+
+      if (w->interval > s->watch_interval)
+        w->interval = s->watch_interval;
+
+      w->next_poll = watch_now() + (uint64_t)w->interval * 1000;
+
+      LOG_DEBUG("Polling again in %d seconds\n", w->interval);
+    }
+
+    watch_settle(s);
+  }
+
+  LOG_INFO("Stopped watching for changes\n");
+
+  s->flags = flags;
+}                               /* watch_run() */
+
+void watch_destroy(MediaScan *s) {
+  Watch *w = (Watch *)s->_watch;
+  int i;
+
+  if (w == NULL)
+    return;
+
+  // Closing the instance removes all of its watches
+  if (w->fd >= 0)
+    close(w->fd);
+
+  watch_free_list(w->dirs, w->ndirs);
+
+  for (i = 0; i < w->nmoves; i++)
+    free(w->moves[i].path);
+  if (w->moves != NULL)
+    free(w->moves);
+
+  for (i = 0; i < w->npending; i++)
+    free(w->pending[i].path);
+  if (w->pending != NULL)
+    free(w->pending);
+
+  for (i = 0; i < w->nsnaps; i++) {
+    if (w->snaps[i].path != NULL)
+      free(w->snaps[i].path);
+  }
+  if (w->snaps != NULL)
+    free(w->snaps);
+  if (w->buckets != NULL)
+    free(w->buckets);
+
+  LOG_MEM("destroy watch @ %p\n", w);
+  free(w);
+
+  s->_watch = NULL;
+}                               /* watch_destroy() */
+
+#else
+
+int watch_init(MediaScan *s) {
+  LOG_WARN("MS_WATCH_CHANGES is not supported on this platform\n");
+  return 0;
+}
+
+void watch_add_dir(MediaScan *s, const char *dir) {
+}
+
+void watch_run(MediaScan *s) {
+}
+
+void watch_destroy(MediaScan *s) {
+}
+
+#endif
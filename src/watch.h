@@ -0,0 +1,9 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+int watch_init(MediaScan *s);
+void watch_add_dir(MediaScan *s, const char *dir);
+void watch_run(MediaScan *s);
+void watch_destroy(MediaScan *s);
+
+#endif // _WATCH_H
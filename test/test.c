@@ -6,14 +6,23 @@
 #ifdef WIN32
 #include <Windows.h>
 #include <direct.h>
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 #endif
 
+#include <jpeglib.h>
 #include <limits.h>
 #include <libmediascan.h>
 #include <libavformat/avformat.h>
 
 #include "../src/mediascan.h"
 #include "../src/common.h"
+#include "../src/buffer.h"
+#include "../src/formats.h"
+#include "../src/reader.h"
 #include "CUnit/CUnit/Headers/Basic.h"
 
 int setupbackground_tests();
@@ -43,6 +52,7 @@ static void my_result_callback(MediaScan *s, MediaScanResult *r, void *userdata)
 
 	result.type = r->type;
 	result.path = strdup(r->path);
+	result.moved_from = r->moved_from ? strdup(r->moved_from) : NULL;
 	result.flags = r->flags;
 
 	if(r->error)
@@ -462,6 +472,808 @@ void test_ms_file_asf_audio(void)	{
 	ms_destroy(s);
 } /* test_ms_file_asf_audio */
 
+static MediaScanVideo mp4_video;
+static MediaScanAudio mp4_audio;
+static int mp4_duration_ms;
+static int mp4_bitrate;
+static char mp4_dlna_profile[32];
+
+static void my_result_callback_mp4(MediaScan *s, MediaScanResult *r, void *userdata) {
+	if (r->video)
+		memcpy(&mp4_video, r->video, sizeof(MediaScanVideo));
+	if (r->audio)
+		memcpy(&mp4_audio, r->audio, sizeof(MediaScanAudio));
+	mp4_duration_ms = r->duration_ms;
+	mp4_bitrate = r->bitrate;
+	if (r->dlna_profile)
+		strncpy(mp4_dlna_profile, r->dlna_profile, sizeof(mp4_dlna_profile) - 1);
+	result_called = TRUE;
+}
+
+// Copy a test data path written with '/' into path, with the separators of the platform
+static void test_data_path(char *path, const char *rel) {
+	strncpy(path, rel, MAX_PATH_STR_LEN - 1);
+	path[MAX_PATH_STR_LEN - 1] = '\0';
+#ifdef WIN32
+	for (; *path; path++) {
+		if (*path == '/')
+			*path = '\\';
+	}
+#endif
+}
+
+// Scan one test video with ms_scan_file using the scan s, what was found is left in mp4_video,
+// mp4_audio, mp4_duration_ms, mp4_bitrate and mp4_dlna_profile
+static void scan_test_video_with(MediaScan *s, const char *rel) {
+	char file[MAX_PATH_STR_LEN];
+
+	test_data_path(file, rel);
+	ms_set_result_callback(s, my_result_callback_mp4);
+	ms_set_error_callback(s, my_error_callback_1);
+
+	memset(&mp4_video, 0, sizeof(MediaScanVideo));
+	memset(&mp4_audio, 0, sizeof(MediaScanAudio));
+	mp4_duration_ms = 0;
+	mp4_bitrate = 0;
+	memset(mp4_dlna_profile, 0, sizeof(mp4_dlna_profile));
+	result_called = FALSE;
+	error_called = FALSE;
+	ms_scan_file(s, file, TYPE_VIDEO);
+
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(error_called == FALSE);
+}
+
+// Scan one test video with the default settings
+static void scan_test_video(const char *rel) {
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	scan_test_video_with(s, rel);
+
+	ms_destroy(s);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test the MP4 header parser against what FFmpeg reports for the same file
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_file_mp4(void)	{
+	scan_test_video("data/video/bars-mpeg4-aac.mp4");
+
+	CU_ASSERT(mp4_video.width == 360);
+	CU_ASSERT(mp4_video.height == 288);
+	CU_ASSERT(mp4_video.fps == 10.0);
+	CU_ASSERT(mp4_video.codec != NULL && !strcmp(mp4_video.codec, "mpeg4"));
+	CU_ASSERT(mp4_audio.codec != NULL && !strcmp(mp4_audio.codec, "aac"));
+	CU_ASSERT(mp4_audio.samplerate == 44100);
+	CU_ASSERT(mp4_audio.channels == 2);
+	CU_ASSERT(mp4_duration_ms == 6107);
+} /* test_ms_file_mp4 */
+
+///-------------------------------------------------------------------------------------------------
+///  Test the Matroska header parser on a WebM file, the same clip as the MP4 test
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_file_webm(void)	{
+	scan_test_video("data/video/bars-vp8-vorbis.webm");
+
+	CU_ASSERT(mp4_video.width == 360);
+	CU_ASSERT(mp4_video.height == 288);
+	CU_ASSERT(mp4_video.fps == 10.0);
+	CU_ASSERT(mp4_video.codec != NULL && !strcmp(mp4_video.codec, "vp8"));
+	CU_ASSERT(mp4_audio.codec != NULL && !strcmp(mp4_audio.codec, "vorbis"));
+	CU_ASSERT(mp4_audio.samplerate == 44100);
+	CU_ASSERT(mp4_audio.channels == 2);
+	CU_ASSERT(mp4_duration_ms == 6107);
+} /* test_ms_file_webm */
+
+///-------------------------------------------------------------------------------------------------
+///  Test the duration of an MPEG-TS file, read from the timestamps at its start and end
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_file_mpegts(void)	{
+	scan_test_video("data/video/bars-mpeg2video-mp2.m2t");
+
+	CU_ASSERT(mp4_video.codec != NULL && !strcmp(mp4_video.codec, "mpeg2video"));
+	CU_ASSERT(mp4_audio.codec != NULL && !strcmp(mp4_audio.codec, "mp2"));
+	CU_ASSERT(mp4_duration_ms == 6000);
+} /* test_ms_file_mpegts */
+
+// Find the demuxer for path the way scan_video() did before the extension table, by matching the
+// name and extensions of every demuxer
+static AVInputFormat *match_demuxer(const char *path) {
+	AVInputFormat *iformat;
+	void *i = 0;
+
+	while ((iformat = (AVInputFormat *)av_demuxer_iterate(&i))) {
+		if (av_match_ext(path, iformat->name))
+			break;
+		if (iformat->extensions && av_match_ext(path, iformat->extensions))
+			break;
+	}
+
+	return iformat;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test the demuxer lookup by extension against matching every demuxer
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_formats_find(void)	{
+	const char *paths[] = {
+		"data/video/bars-mpeg4-aac.mp4", "BARS.MP4", "bars.m4v", "bars.mkv", "bars.webm", "bars.m2t",
+		"bars.mpg", "bars.vob", "bars.avi", "bars.asf", "bars.flv"
+	};
+	AVInputFormat *iformat;
+	int x;
+
+	for (x = 0; x < 11; x++) {
+		iformat = formats_find(paths[x]);
+		CU_ASSERT(iformat != NULL);
+		CU_ASSERT(iformat == match_demuxer(paths[x]));
+	}
+
+	iformat = formats_find("bars.mp4");
+	CU_ASSERT(iformat != NULL && !strcmp(iformat->name, "mov,mp4,m4a,3gp,3g2,mj2"));
+	iformat = formats_find("bars.mkv");
+	CU_ASSERT(iformat != NULL && !strcmp(iformat->name, "matroska,webm"));
+	iformat = formats_find("bars.m2t");
+	CU_ASSERT(iformat != NULL && !strcmp(iformat->name, "mpegts"));
+	iformat = formats_find("bars.avi");
+	CU_ASSERT(iformat != NULL && !strcmp(iformat->name, "avi"));
+
+	// Unknown, missing and overlong extensions
+	CU_ASSERT(formats_find("bars.notavideo") == NULL);
+	CU_ASSERT(formats_find("bars") == NULL);
+	CU_ASSERT(formats_find("data.mp4/bars") == NULL);
+	CU_ASSERT(formats_find("bars.abcdefghijklmnopqrstuvwxyz") == NULL);
+} /* test_ms_formats_find */
+
+///-------------------------------------------------------------------------------------------------
+///  Test that videos scanned with tight probe limits report the same streams and duration as with
+///   FFmpeg's defaults, whether the header had everything or the limited probe had to be retried
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_probe_limits(void)	{
+	const char *files[] = {
+		"data/video/bars-mpeg4-mp2.avi", "data/video/bars-msmpeg4-mp2.asf", "data/video/bars-vp6f-mp3.flv",
+		"data/video/bars-mpeg1video-mp2.mpg", "data/video/bars-mpeg2video-mp2.vob",
+		"data/video/bars-mpeg2video-mp2.m2t", "data/video/bars-mpeg4-aac.mp4", "data/video/bars-mpeg4-mp2.mkv"
+	};
+	MediaScanVideo video;
+	MediaScanAudio audio;
+	char dlna_profile[32];
+	int duration_ms;
+	int bitrate;
+	MediaScan *s;
+	int x;
+
+	for (x = 0; x < 8; x++) {
+		s = ms_create();
+		CU_ASSERT_FATAL(s != NULL);
+		ms_set_probe_limits(s, 0, 0, 0);
+		scan_test_video_with(s, files[x]);
+		ms_destroy(s);
+
+		video = mp4_video;
+		audio = mp4_audio;
+		duration_ms = mp4_duration_ms;
+		bitrate = mp4_bitrate;
+		strcpy(dlna_profile, mp4_dlna_profile);
+
+		s = ms_create();
+		CU_ASSERT_FATAL(s != NULL);
+		ms_set_probe_limits(s, 2048, 1, 1);
+		scan_test_video_with(s, files[x]);
+		ms_destroy(s);
+
+		CU_ASSERT(mp4_video.codec != NULL && video.codec != NULL && !strcmp(mp4_video.codec, video.codec));
+		CU_ASSERT(mp4_video.width == video.width);
+		CU_ASSERT(mp4_video.height == video.height);
+		CU_ASSERT(mp4_audio.codec != NULL && audio.codec != NULL && !strcmp(mp4_audio.codec, audio.codec));
+		CU_ASSERT(mp4_audio.samplerate == audio.samplerate);
+		CU_ASSERT(mp4_audio.channels == audio.channels);
+		CU_ASSERT(mp4_duration_ms == duration_ms);
+		CU_ASSERT(mp4_video.fps == video.fps);
+		CU_ASSERT(mp4_audio.bitrate == audio.bitrate);
+		CU_ASSERT(mp4_bitrate == bitrate);
+		CU_ASSERT_STRING_EQUAL(mp4_dlna_profile, dlna_profile);
+	}
+} /* test_ms_probe_limits */
+
+static int storyboard_nthumbnails;
+static int storyboard_width;
+static int storyboard_height;
+
+static void my_result_callback_storyboard(MediaScan *s, MediaScanResult *r, void *userdata) {
+	MediaScanImage *thumb = ms_result_get_thumbnail(r, 1);
+
+	storyboard_nthumbnails = r->nthumbnails;
+	if (thumb) {
+		storyboard_width = thumb->width;
+		storyboard_height = thumb->height;
+	}
+	result_called = TRUE;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test a storyboard thumbnail next to a normal one, 4 frames of 80 x 64 in 2 rows of 2
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_storyboard(void)	{
+#ifdef WIN32
+	char mp4_file[MAX_PATH_STR_LEN] = "data\\video\\bars-mpeg4-aac.mp4";
+#else
+	char mp4_file[MAX_PATH_STR_LEN] = "data/video/bars-mpeg4-aac.mp4";
+#endif
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, my_result_callback_storyboard);
+	ms_set_error_callback(s, my_error_callback_1);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 100, TRUE, 0, 90);
+	ms_add_storyboard_spec(s, THUMB_AUTO, 80, 0, TRUE, 0, 90, 4, 2);
+
+	storyboard_nthumbnails = 0;
+	storyboard_width = storyboard_height = 0;
+	result_called = FALSE;
+	error_called = FALSE;
+	ms_scan_file(s, mp4_file, TYPE_VIDEO);
+
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(error_called == FALSE);
+	CU_ASSERT(storyboard_nthumbnails == 2);
+	CU_ASSERT(storyboard_width == 160);
+	CU_ASSERT(storyboard_height == 128);
+
+	ms_destroy(s);
+} /* test_ms_storyboard */
+
+static char cover_mime_type[32];
+static int cover_exif_tags;
+static int cover_thumb_width;
+static int cover_thumb_height;
+
+static void my_result_callback_cover(MediaScan *s, MediaScanResult *r, void *userdata) {
+	MediaScanImage *thumb = ms_result_get_thumbnail(r, 0);
+	const char *key = NULL, *value = NULL;
+	int x;
+
+	if (r->mime_type)
+		strncpy(cover_mime_type, r->mime_type, sizeof(cover_mime_type) - 1);
+
+	for (x = 0; x < ms_result_get_tag_count(r); x++) {
+		ms_result_get_tag(r, x, &key, &value);
+		if (!strcmp(r->_tag->type, "Exif") || !strcmp(key, "Orientation"))
+			cover_exif_tags++;
+	}
+
+	if (thumb) {
+		cover_thumb_width = thumb->width;
+		cover_thumb_height = thumb->height;
+	}
+	result_called = TRUE;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test the thumbnail of an MP4 made from its JPEG cover art, whose EXIF orientation 6 turns the
+///  stored 117 x 157 cover upright to 157 x 117. The EXIF data of the cover must not end up in the
+///  video's result.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_video_cover(void)	{
+	char mp4_file[MAX_PATH_STR_LEN];
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	test_data_path(mp4_file, "data/video/bars-mpeg4-aac-cover.mp4");
+	ms_set_result_callback(s, my_result_callback_cover);
+	ms_set_error_callback(s, my_error_callback_1);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, TRUE, 0, 90);
+
+	memset(cover_mime_type, 0, sizeof(cover_mime_type));
+	cover_exif_tags = 0;
+	cover_thumb_width = cover_thumb_height = 0;
+	result_called = FALSE;
+	error_called = FALSE;
+	ms_scan_file(s, mp4_file, TYPE_VIDEO);
+
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(error_called == FALSE);
+	CU_ASSERT(!strncmp(cover_mime_type, "video/", 6));
+	CU_ASSERT(cover_exif_tags == 0);
+	CU_ASSERT(cover_thumb_width == 100);
+	CU_ASSERT(cover_thumb_height == 74);
+
+	ms_destroy(s);
+} /* test_ms_video_cover */
+
+static int keyframe_count;
+static MediaScanKeyframe keyframes[8];
+
+static void my_result_callback_keyframes(MediaScan *s, MediaScanResult *r, void *userdata) {
+	if (r->video) {
+		keyframe_count = r->video->nkeyframes;
+		if (keyframe_count > 0 && keyframe_count <= 8)
+			memcpy(keyframes, r->video->keyframes, keyframe_count * sizeof(MediaScanKeyframe));
+	}
+	result_called = TRUE;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test the keyframe index of an MPEG-TS file, sampled at 3 points: its I frames at 0, 2.5 and 4.5 s
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_keyframe_index(void)	{
+#ifdef WIN32
+	char ts_file[MAX_PATH_STR_LEN] = "data\\video\\bars-mpeg2video-mp2.m2t";
+#else
+	char ts_file[MAX_PATH_STR_LEN] = "data/video/bars-mpeg2video-mp2.m2t";
+#endif
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, my_result_callback_keyframes);
+	ms_set_error_callback(s, my_error_callback_1);
+	ms_set_flags(s, MS_USE_EXTENSION | MS_FULL_SCAN | MS_KEYFRAME_INDEX);
+
+	keyframe_count = 0;
+	result_called = FALSE;
+	error_called = FALSE;
+	ms_scan_file(s, ts_file, TYPE_VIDEO);
+
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(error_called == FALSE);
+	CU_ASSERT_FATAL(keyframe_count == 3);
+	CU_ASSERT(keyframes[0].pts_ms == 0 && keyframes[0].offset == 564);
+	CU_ASSERT(keyframes[1].pts_ms == 2500 && keyframes[1].offset == 86104);
+	CU_ASSERT(keyframes[2].pts_ms == 4500 && keyframes[2].offset == 158108);
+
+	ms_destroy(s);
+} /* test_ms_keyframe_index */
+
+///-------------------------------------------------------------------------------------------------
+///  Test the block-cached reader against fread: reads across block boundaries and past the end,
+///   repeated reads served from the cache, and libavformat reading a whole file through it
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_reader(void)	{
+	const uint32_t reads[][2] = {
+		{ 0, 100 }, { READER_BLOCK_SIZE - 10, 20 }, { 2 * READER_BLOCK_SIZE - 1000, 70000 }, { 150000, 72028 }
+	};
+	char file[MAX_PATH_STR_LEN];
+	unsigned char *data;
+	unsigned char buf[80000];
+	uint64_t bytes_read;
+	AVFormatContext *avf = NULL;
+	Buffer load;
+	Reader *rd;
+	FILE *fp;
+	long size;
+	int x;
+
+	test_data_path(file, "data/video/bars-mpeg2video-mp2.m2t");
+
+	fp = fopen(file, "rb");
+	CU_ASSERT_FATAL(fp != NULL);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(size);
+	CU_ASSERT_FATAL(data != NULL && fread(data, 1, size, fp) == (size_t)size);
+	fclose(fp);
+
+	rd = reader_open(file);
+	CU_ASSERT_FATAL(rd != NULL);
+	CU_ASSERT(rd->size == (uint64_t)size);
+
+	for (x = 0; x < 4; x++) {
+		CU_ASSERT(reader_read(rd, reads[x][0], buf, reads[x][1]) == reads[x][1]);
+		CU_ASSERT(!memcmp(buf, data + reads[x][0], reads[x][1]));
+	}
+
+	// Reading the same parts again doesn't touch the file
+	bytes_read = rd->bytes_read;
+	for (x = 0; x < 4; x++)
+		CU_ASSERT(reader_read(rd, reads[x][0], buf, reads[x][1]) == reads[x][1]);
+	CU_ASSERT(rd->bytes_read == bytes_read);
+	CU_ASSERT(rd->bytes_requested > rd->bytes_read);
+
+	// Short at the end of the file, nothing past it
+	CU_ASSERT(reader_read(rd, size - 50, buf, 100) == 50);
+	CU_ASSERT(!memcmp(buf, data + size - 50, 50));
+	CU_ASSERT(reader_read(rd, size, buf, 100) == 0);
+
+	buffer_init(&load, 0);
+	CU_ASSERT(reader_load(rd, &load, 1000, 70000) == 70000);
+	CU_ASSERT(buffer_len(&load) == 70000 && !memcmp(buffer_ptr(&load), data + 1000, 70000));
+	buffer_free(&load);
+
+	// The file fits in the cache, so libavformat reads no block of it a second time
+	avf = avformat_alloc_context();
+	CU_ASSERT_FATAL(avf != NULL);
+	avf->pb = reader_avio(rd);
+	CU_ASSERT_FATAL(avf->pb != NULL);
+	CU_ASSERT_FATAL(avformat_open_input(&avf, file, NULL, NULL) == 0);
+	CU_ASSERT(!strcmp(avf->iformat->name, "mpegts"));
+	CU_ASSERT(avformat_find_stream_info(avf, NULL) >= 0);
+	CU_ASSERT(avf->nb_streams >= 2);
+	avformat_close_input(&avf);
+	CU_ASSERT(rd->bytes_read <= (uint64_t)size);
+
+	reader_close(rd);
+	free(data);
+} /* test_ms_reader */
+
+static int thumb_width;
+static int thumb_height;
+static unsigned char *thumb_rgb;
+
+// Decode thumbnail index of r, which must be a JPEG, into RGB pixels that must be freed by the caller
+static unsigned char *decode_thumb(MediaScanResult *r, int index) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	const uint8_t *data;
+	unsigned char *rgb;
+	int len;
+
+	data = ms_result_get_thumbnail_data(r, index, &len);
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *)data, len);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+
+	rgb = malloc(cinfo.output_width * cinfo.output_height * 3);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = rgb + cinfo.output_scanline * cinfo.output_width * 3;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+
+	return rgb;
+}
+
+static void my_result_callback_thumb(MediaScan *s, MediaScanResult *r, void *userdata) {
+	MediaScanImage *thumb = ms_result_get_thumbnail(r, 0);
+
+	result_called = TRUE;
+
+	if (!r->nthumbnails || !thumb)
+		return;
+
+	thumb_width = thumb->width;
+	thumb_height = thumb->height;
+	thumb_rgb = decode_thumb(r, 0);
+}
+
+// Scan one test file of type with a single JPEG thumbnail spec. The size of the thumbnail is left in
+// thumb_width and thumb_height, its pixels are returned and must be freed by the caller.
+static unsigned char *scan_test_thumb(const char *rel, enum media_type type, int width, int height,
+                                      int keep_aspect) {
+	char file[MAX_PATH_STR_LEN];
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	test_data_path(file, rel);
+	ms_set_result_callback(s, my_result_callback_thumb);
+	ms_set_error_callback(s, my_error_callback_1);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, width, height, keep_aspect, 0, 90);
+
+	thumb_width = thumb_height = 0;
+	thumb_rgb = NULL;
+	result_called = FALSE;
+	error_called = FALSE;
+	ms_scan_file(s, file, type);
+
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(error_called == FALSE);
+	CU_ASSERT_FATAL(thumb_rgb != NULL);
+
+	ms_destroy(s);
+
+	return thumb_rgb;
+}
+
+static unsigned char *scan_test_image(const char *rel, int width, int height, int keep_aspect) {
+	return scan_test_thumb(rel, TYPE_IMAGE, width, height, keep_aspect);
+}
+
+// Mean difference per channel of two thumbnails of the same size
+static int thumb_diff(const unsigned char *a, const unsigned char *b, int width, int height) {
+	long diff = 0;
+	int x;
+
+	for (x = 0; x < width * height * 3; x++)
+		diff += abs(a[x] - b[x]);
+
+	return (int)(diff / (width * height * 3));
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test the size of image thumbnails given a width, a height, or both with padding
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_image_thumb_size(void)	{
+	unsigned char *rgb;
+
+	rgb = scan_test_image("data/image/jpg/rgb.jpg", 100, 0, FALSE);
+	CU_ASSERT(thumb_width == 100);
+	CU_ASSERT(thumb_height == 74);
+	free(rgb);
+
+	rgb = scan_test_image("data/image/jpg/rgb.jpg", 0, 50, FALSE);
+	CU_ASSERT(thumb_width == 66);
+	CU_ASSERT(thumb_height == 50);
+	free(rgb);
+
+	// The 313 x 234 image is 59 pixels high inside 10 pixels of black padding at the top and bottom
+	rgb = scan_test_image("data/image/jpg/rgb.jpg", 80, 80, TRUE);
+	CU_ASSERT_FATAL(thumb_width == 80 && thumb_height == 80);
+	CU_ASSERT(rgb[(2 * 80 + 40) * 3] + rgb[(2 * 80 + 40) * 3 + 1] + rgb[(2 * 80 + 40) * 3 + 2] < 48);
+	CU_ASSERT(rgb[(40 * 80 + 40) * 3] + rgb[(40 * 80 + 40) * 3 + 1] + rgb[(40 * 80 + 40) * 3 + 2] > 192);
+	free(rgb);
+} /* test_ms_image_thumb_size */
+
+static int cascade_nthumbnails;
+static int cascade_width[2];
+static int cascade_height[2];
+static unsigned char *cascade_rgb[2];
+
+static void my_result_callback_cascade(MediaScan *s, MediaScanResult *r, void *userdata) {
+	int x;
+
+	cascade_nthumbnails = r->nthumbnails;
+	for (x = 0; x < 2 && x < r->nthumbnails; x++) {
+		cascade_width[x] = ms_result_get_thumbnail(r, x)->width;
+		cascade_height[x] = ms_result_get_thumbnail(r, x)->height;
+		cascade_rgb[x] = decode_thumb(r, x);
+	}
+	result_called = TRUE;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test that thumbnails made in one pass, the smaller one from the larger one, match thumbnails
+///   made on their own. The specs are added smallest first, they are still returned in that order.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_image_thumb_cascade(void)	{
+	char file[MAX_PATH_STR_LEN];
+	unsigned char *ref[2];
+	MediaScan *s;
+	int x;
+
+	ref[0] = scan_test_image("data/image/jpg/rgb.jpg", 100, 0, FALSE);
+	ref[1] = scan_test_image("data/image/jpg/rgb.jpg", 200, 0, FALSE);
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+
+	test_data_path(file, "data/image/jpg/rgb.jpg");
+	ms_set_result_callback(s, my_result_callback_cascade);
+	ms_set_error_callback(s, my_error_callback_1);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 200, 0, FALSE, 0, 90);
+
+	cascade_nthumbnails = 0;
+	cascade_rgb[0] = cascade_rgb[1] = NULL;
+	result_called = FALSE;
+	error_called = FALSE;
+	ms_scan_file(s, file, TYPE_IMAGE);
+	ms_destroy(s);
+
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(error_called == FALSE);
+	CU_ASSERT_FATAL(cascade_nthumbnails == 2);
+	CU_ASSERT(cascade_width[0] == 100 && cascade_height[0] == 74);
+	CU_ASSERT(cascade_width[1] == 200 && cascade_height[1] == 149);
+
+	if (cascade_width[0] == 100 && cascade_height[0] == 74)
+		CU_ASSERT(thumb_diff(cascade_rgb[0], ref[0], 100, 74) < 24);
+	if (cascade_width[1] == 200 && cascade_height[1] == 149)
+		CU_ASSERT(thumb_diff(cascade_rgb[1], ref[1], 200, 149) < 24);
+
+	for (x = 0; x < 2; x++) {
+		free(cascade_rgb[x]);
+		free(ref[x]);
+	}
+} /* test_ms_image_thumb_cascade */
+
+///-------------------------------------------------------------------------------------------------
+///  Test that images with each EXIF orientation make the thumbnail of the upright image. They are
+///   rgb.jpg at half size, rotated and mirrored, so their thumbnails are compared with its.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_image_thumb_orientation(void)	{
+	const char *files[] = {
+		"data/image/jpg/exif_mirror_horiz.jpg",         // 2
+		"data/image/jpg/exif_180.jpg",                  // 3
+		"data/image/jpg/exif_mirror_vert.jpg",          // 4
+		"data/image/jpg/exif_mirror_horiz_270_ccw.jpg", // 5
+		"data/image/jpg/exif_90_ccw.jpg",               // 6
+		"data/image/jpg/exif_mirror_horiz_90_ccw.jpg",  // 7
+		"data/image/jpg/exif_270_ccw.jpg"               // 8
+	};
+	unsigned char *ref;
+	unsigned char *rgb;
+	int x;
+
+	ref = scan_test_image("data/image/jpg/rgb.jpg", 100, 0, FALSE);
+	CU_ASSERT_FATAL(thumb_width == 100 && thumb_height == 74);
+
+	// Orientations 5 to 8 are stored 117 x 157, the width of the spec is the height of the stored image
+	for (x = 0; x < 7; x++) {
+		rgb = scan_test_image(files[x], 100, 0, FALSE);
+		CU_ASSERT(thumb_width == 100);
+		CU_ASSERT(thumb_height == 74);
+		if (thumb_width == 100 && thumb_height == 74)
+			CU_ASSERT(thumb_diff(rgb, ref, 100, 74) < 24);
+		free(rgb);
+	}
+
+	free(ref);
+} /* test_ms_image_thumb_orientation */
+
+///-------------------------------------------------------------------------------------------------
+///  Test the thumbnail of an inverted CMYK JPEG against the thumbnail of the same image in RGB. Its
+///   EXIF thumbnail is too small for the spec, so the CMYK image itself is decoded.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_image_thumb_cmyk(void)	{
+	unsigned char *ref;
+	unsigned char *rgb;
+
+	ref = scan_test_image("data/image/jpg/rgb.jpg", 200, 0, FALSE);
+	CU_ASSERT_FATAL(thumb_width == 200 && thumb_height == 149);
+
+	rgb = scan_test_image("data/image/jpg/cmyk.jpg", 200, 0, FALSE);
+	CU_ASSERT(thumb_width == 200);
+	CU_ASSERT(thumb_height == 149);
+	if (thumb_width == 200 && thumb_height == 149)
+		CU_ASSERT(thumb_diff(rgb, ref, 200, 149) < 24);
+
+	free(rgb);
+	free(ref);
+} /* test_ms_image_thumb_cmyk */
+
+///-------------------------------------------------------------------------------------------------
+///  Test when the EXIF thumbnail is used. Both images are red with a blue 160 x 120 EXIF thumbnail,
+///   one of them 320 x 240 and the other 320 x 180, which would be letterboxed in its thumbnail.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_image_exif_thumb(void)	{
+	unsigned char *rgb;
+	unsigned char *p;
+
+	// Large enough and of the same shape, the EXIF thumbnail is used
+	rgb = scan_test_image("data/image/jpg/exif_thumb.jpg", 100, 0, FALSE);
+	CU_ASSERT_FATAL(thumb_width == 100 && thumb_height == 75);
+	p = rgb + (37 * 100 + 50) * 3;
+	CU_ASSERT(p[0] < 56 && p[2] > 200);
+	free(rgb);
+
+	// Smaller than the spec, the image is decoded
+	rgb = scan_test_image("data/image/jpg/exif_thumb.jpg", 200, 0, FALSE);
+	CU_ASSERT_FATAL(thumb_width == 200 && thumb_height == 150);
+	p = rgb + (75 * 200 + 100) * 3;
+	CU_ASSERT(p[0] > 200 && p[2] < 56);
+	free(rgb);
+
+	// Letterboxed, the image is decoded
+	rgb = scan_test_image("data/image/jpg/exif_thumb_letterbox.jpg", 100, 0, FALSE);
+	CU_ASSERT_FATAL(thumb_width == 100 && thumb_height == 56);
+	p = rgb + (28 * 100 + 50) * 3;
+	CU_ASSERT(p[0] > 200 && p[2] < 56);
+	free(rgb);
+} /* test_ms_image_exif_thumb */
+
+///-------------------------------------------------------------------------------------------------
+///  Test video frame thumbnails of several containers and codecs, made one after the other by one
+///   scan so the scaler is reused. The frames are colour bars, so a row of a decoded frame goes
+///   from bright to dark.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_video_thumbnails(void)	{
+	const char *files[] = {
+		"data/video/bars-mpeg4-aac.mp4", "data/video/bars-mpeg4-mp2.mkv", "data/video/bars-vp8-vorbis.webm",
+		"data/video/bars-mpeg2video-mp2.m2t", "data/video/bars-mpeg1video-mp2.mpg",
+		"data/video/bars-mpeg4-mp2.avi", "data/video/bars-msmpeg4-mp2.asf", "data/video/bars-wmv2-wmav2.avi"
+	};
+	char file[MAX_PATH_STR_LEN];
+	MediaScan *s = ms_create();
+	int x, i, lo, hi;
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, my_result_callback_thumb);
+	ms_set_error_callback(s, my_error_callback_1);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+
+	for (x = 0; x < 8; x++) {
+		test_data_path(file, files[x]);
+		thumb_width = thumb_height = 0;
+		thumb_rgb = NULL;
+		result_called = FALSE;
+		error_called = FALSE;
+		ms_scan_file(s, file, TYPE_VIDEO);
+
+		CU_ASSERT(result_called == TRUE);
+		CU_ASSERT(error_called == FALSE);
+		CU_ASSERT(thumb_width == 100);
+		CU_ASSERT(thumb_height == 80);
+
+		if (thumb_rgb != NULL && thumb_width == 100 && thumb_height == 80) {
+			lo = 255;
+			hi = 0;
+			for (i = 0; i < 100; i++) {
+				int red = thumb_rgb[(20 * 100 + i) * 3];
+				if (red < lo)
+					lo = red;
+				if (red > hi)
+					hi = red;
+			}
+			CU_ASSERT(hi - lo > 128);
+		}
+
+		free(thumb_rgb);
+	}
+
+	ms_destroy(s);
+} /* test_ms_video_thumbnails */
+
+///-------------------------------------------------------------------------------------------------
+///  Test that a frame decoded at a reduced resolution for a small thumbnail matches the full frame.
+///   A 90 x 72 thumbnail of a 360 x 288 video is decoded at 1/4 size, and is compared with the
+///   full size thumbnail averaged over 4 x 4 blocks.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_video_lowres(void)	{
+	const char *files[] = {
+		"data/video/bars-mpeg4-aac.mp4", "data/video/bars-mpeg2video-mp2.m2t",
+		"data/video/bars-mpeg1video-mp2.mpg", "data/video/bars-msmpeg4-mp2.asf"
+	};
+	unsigned char scaled[90 * 72 * 3];
+	unsigned char *full;
+	unsigned char *small;
+	int x, y, i, c, bx, by;
+
+	for (i = 0; i < 4; i++) {
+		full = scan_test_thumb(files[i], TYPE_VIDEO, 360, 0, FALSE);
+		CU_ASSERT_FATAL(thumb_width == 360 && thumb_height == 288);
+
+		for (y = 0; y < 72; y++) {
+			for (x = 0; x < 90; x++) {
+				for (c = 0; c < 3; c++) {
+					int sum = 0;
+					for (by = 0; by < 4; by++)
+						for (bx = 0; bx < 4; bx++)
+							sum += full[((y * 4 + by) * 360 + x * 4 + bx) * 3 + c];
+					scaled[(y * 90 + x) * 3 + c] = (unsigned char)(sum / 16);
+				}
+			}
+		}
+
+		small = scan_test_thumb(files[i], TYPE_VIDEO, 90, 0, FALSE);
+		CU_ASSERT(thumb_width == 90);
+		CU_ASSERT(thumb_height == 72);
+		if (thumb_width == 90 && thumb_height == 72)
+			CU_ASSERT(thumb_diff(small, scaled, 90, 72) < 24);
+
+		free(small);
+		free(full);
+	}
+} /* test_ms_video_lowres */
+
 
 ///-------------------------------------------------------------------------------------------------
 ///  Test ms_set_async and ms_set_log_level
@@ -558,6 +1370,477 @@ void test_ms_db(void)	{
 	ms_destroy(s);
 } /* test_ms_db() */
 
+static void copy_file(const char *src, const char *dst) {
+	char buf[4096];
+	size_t len;
+	FILE *in = fopen(src, "rb");
+	FILE *out = fopen(dst, "wb");
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+		fwrite(buf, 1, len, out);
+
+	fclose(in);
+	fclose(out);
+}
+
+// Create the test directory rel_dir with a copy of the test file src_rel under each of the names,
+// dir is set to the directory and files to the paths of the copies
+static void make_test_dir(char *dir, const char *rel_dir, const char *src_rel, char files[][MAX_PATH_STR_LEN],
+                          const char **names, int nnames) {
+	char src_file[MAX_PATH_STR_LEN];
+	char rel_file[MAX_PATH_STR_LEN];
+	int i;
+
+	test_data_path(src_file, src_rel);
+	test_data_path(dir, rel_dir);
+
+#ifdef WIN32
+	_mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+
+	for (i = 0; i < nnames; i++) {
+		snprintf(rel_file, MAX_PATH_STR_LEN, "%s/%s", rel_dir, names[i]);
+		test_data_path(files[i], rel_file);
+		copy_file(src_file, files[i]);
+	}
+}
+
+// Create a scan of the directory dir
+static MediaScan *create_dir_scan(const char *dir, int flags, ResultCallback callback) {
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_add_path(s, dir);
+	ms_set_flags(s, flags);
+	ms_set_result_callback(s, callback);
+	ms_set_error_callback(s, my_error_callback);
+
+	return s;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test that a renamed file is reported as moved by a rescan instead of being scanned again
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_db_moved(void)	{
+	const char *names[] = { "bars.m4v" };
+	char dir[MAX_PATH_STR_LEN];
+	char files[1][MAX_PATH_STR_LEN];
+	char new_file[MAX_PATH_STR_LEN];
+	MediaScan *s;
+
+	make_test_dir(dir, "data/moved", "data/video/bars-mpeg4-aac.m4v", files, names, 1);
+	test_data_path(new_file, "data/moved/renamed.m4v");
+
+	// Scan once to fill the cache
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_FULL_SCAN, my_result_callback);
+	result_called = FALSE;
+	ms_scan(s);
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(result.moved_from == NULL);
+	ms_destroy(s);
+
+	rename(files[0], new_file);
+
+	// The rescan should find the renamed file in the cache
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_RESCAN, my_result_callback);
+	result_called = FALSE;
+	ms_scan(s);
+	CU_ASSERT(result_called == TRUE);
+	// Scanned paths are made absolute, so only compare the file names
+	CU_ASSERT(strstr(result.path, "renamed.m4v") != NULL);
+	CU_ASSERT(result.moved_from != NULL);
+	if (result.moved_from)
+		CU_ASSERT(strstr(result.moved_from, "bars.m4v") != NULL);
+	CU_ASSERT(result.type == TYPE_VIDEO);
+	ms_destroy(s);
+
+	remove(new_file);
+} /* test_ms_db_moved() */
+
+static int duplicate_count = 0;
+
+static void my_duplicate_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	if (r->duplicate_of)
+		duplicate_count++;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test that a copy of a file is cloned from the first result when MS_DETECT_DUPLICATES is set
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_db_duplicates(void)	{
+	const char *names[] = { "copy1.m4v", "copy2.m4v" };
+	char dir[MAX_PATH_STR_LEN];
+	char files[2][MAX_PATH_STR_LEN];
+	MediaScan *s;
+
+	make_test_dir(dir, "data/dupes", "data/video/bars-mpeg4-aac.m4v", files, names, 2);
+
+	// Whichever copy is scanned second is a duplicate of the first
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_FULL_SCAN | MS_DETECT_DUPLICATES, my_duplicate_callback);
+	duplicate_count = 0;
+	ms_scan(s);
+	CU_ASSERT(duplicate_count == 1);
+	ms_destroy(s);
+
+	remove(files[0]);
+	remove(files[1]);
+} /* test_ms_db_duplicates() */
+
+///-------------------------------------------------------------------------------------------------
+///  Test the cache statistics, verification and compaction, and that cache shards are separate
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_cache_tools(void)	{
+	const char *names[] = { "bars.m4v" };
+	char dir[MAX_PATH_STR_LEN];
+	char files[1][MAX_PATH_STR_LEN];
+	char other_dir[MAX_PATH_STR_LEN];
+	MediaScan *s;
+	MediaScanCacheStats *stats;
+
+	make_test_dir(dir, "data/cached", "data/video/bars-mpeg4-aac.m4v", files, names, 1);
+	test_data_path(other_dir, "data/video");
+
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_FULL_SCAN, my_result_callback);
+	ms_scan(s);
+	ms_destroy(s);
+
+	// The unchanged file should be a cache hit on rescan
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_RESCAN, my_result_callback);
+	ms_scan(s);
+
+	stats = ms_cache_stats(s);
+	CU_ASSERT_FATAL(stats != NULL);
+	CU_ASSERT(stats->entries == 1);
+	CU_ASSERT(stats->hits == 1);
+	CU_ASSERT(stats->misses == 0);
+	CU_ASSERT(stats->ndirs == 1);
+	CU_ASSERT(stats->disk_size > 0);
+	ms_cache_stats_destroy(stats);
+
+	CU_ASSERT(ms_cache_verify(s) == 0);
+	ms_destroy(s);
+
+	// A full scan of another path leaves the cache shard of this one alone
+	s = create_dir_scan(other_dir, MS_USE_EXTENSION | MS_FULL_SCAN, my_result_callback);
+	ms_scan(s);
+	ms_destroy(s);
+
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_FULL_SCAN, my_result_callback);
+
+	stats = ms_cache_stats(s);
+	CU_ASSERT_FATAL(stats != NULL);
+	CU_ASSERT(stats->entries == 1);
+	ms_cache_stats_destroy(stats);
+
+	// Nothing to remove from a consistent cache
+	CU_ASSERT(ms_cache_compact(s) == 0);
+	CU_ASSERT(ms_cache_verify(s) == 0);
+	ms_destroy(s);
+
+	remove(files[0]);
+} /* test_ms_cache_tools() */
+
+static int packed_moved;
+static int packed_nthumbnails;
+static uint64_t packed_offset;
+
+static void my_packed_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	packed_moved = r->moved_from != NULL;
+	packed_nthumbnails = r->nthumbnails;
+	packed_offset = 0;
+	if (r->nthumbnails)
+		ms_result_get_thumbnail_pack_offset(r, 0, &packed_offset);
+	result_called = TRUE;
+}
+
+// Scan the directory dir once with a thumbnail spec, the results are left in packed_*
+static void scan_packed_dir(const char *dir, int flags) {
+	MediaScan *s = create_dir_scan(dir, MS_USE_EXTENSION | flags, my_packed_result_callback);
+
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+	packed_moved = packed_nthumbnails = 0;
+	packed_offset = 0;
+	result_called = FALSE;
+	ms_scan(s);
+	CU_ASSERT(result_called == TRUE);
+	ms_destroy(s);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test that the packed thumbnail of a file is reused by rescans, also after the file is renamed
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_thumbpack_reuse(void)	{
+	const char *names[] = { "photo.jpg" };
+	char dir[MAX_PATH_STR_LEN];
+	char files[1][MAX_PATH_STR_LEN];
+	char new_file[MAX_PATH_STR_LEN];
+	uint64_t offset;
+	MediaScan *s;
+	MediaScanCacheStats *stats;
+
+	make_test_dir(dir, "data/packed", "data/image/jpg/rgb.jpg", files, names, 1);
+	test_data_path(new_file, "data/packed/renamed.jpg");
+
+	scan_packed_dir(dir, MS_FULL_SCAN);
+	CU_ASSERT(packed_nthumbnails == 1);
+	CU_ASSERT_FATAL(packed_offset > 0);
+	offset = packed_offset;
+
+	// The moved file gets the thumbnail of its old path, without packing it again
+	rename(files[0], new_file);
+	scan_packed_dir(dir, MS_RESCAN);
+	CU_ASSERT(packed_moved == TRUE);
+	CU_ASSERT(packed_nthumbnails == 1);
+	CU_ASSERT(packed_offset == offset);
+
+	// Compaction drops the entry of the old path and keeps the thumbnail of the new one
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_RESCAN, my_packed_result_callback);
+	CU_ASSERT(ms_cache_compact(s) > 0);
+	stats = ms_cache_stats(s);
+	CU_ASSERT_FATAL(stats != NULL);
+	CU_ASSERT(stats->entries == 1);
+	CU_ASSERT(stats->thumbnails == 1);
+	ms_cache_stats_destroy(stats);
+	ms_destroy(s);
+
+	scan_packed_dir(dir, MS_RESCAN);
+	CU_ASSERT(packed_moved == FALSE);
+	CU_ASSERT(packed_nthumbnails == 1);
+	CU_ASSERT(packed_offset > 0);
+
+	remove(new_file);
+} /* test_ms_thumbpack_reuse() */
+
+///-------------------------------------------------------------------------------------------------
+///  Test that a thumbnail spec added between scans only makes the new thumbnails of unchanged files
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_thumbpack_new_spec(void)	{
+	const char *names[] = { "photo.jpg" };
+	char dir[MAX_PATH_STR_LEN];
+	char files[1][MAX_PATH_STR_LEN];
+	uint64_t offset;
+	MediaScan *s;
+
+	make_test_dir(dir, "data/respec", "data/image/jpg/rgb.jpg", files, names, 1);
+
+	scan_packed_dir(dir, MS_FULL_SCAN);
+	CU_ASSERT(packed_nthumbnails == 1);
+	CU_ASSERT_FATAL(packed_offset > 0);
+	offset = packed_offset;
+
+	// The unchanged file is reported again, with the packed thumbnail and a new one
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_RESCAN, my_packed_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+	ms_add_thumbnail_spec(s, THUMB_PNG, 50, 50, TRUE, 0, 0);
+	result_called = FALSE;
+	ms_scan(s);
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(packed_nthumbnails == 2);
+	CU_ASSERT(packed_offset == offset);
+	ms_destroy(s);
+
+	// Now that both are packed there is nothing to report
+	s = create_dir_scan(dir, MS_USE_EXTENSION | MS_RESCAN, my_packed_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+	ms_add_thumbnail_spec(s, THUMB_PNG, 50, 50, TRUE, 0, 0);
+	result_called = FALSE;
+	ms_scan(s);
+	CU_ASSERT(result_called == FALSE);
+	ms_destroy(s);
+
+	remove(files[0]);
+} /* test_ms_thumbpack_new_spec() */
+
+#ifdef __linux__
+static int watch_results = 0;
+static int watch_deleted = 0;
+static int watch_finished = 0;
+
+static void my_watch_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	if (r->deleted)
+		watch_deleted++;
+	else
+		watch_results++;
+}
+
+static void my_watch_finish_callback(MediaScan *s, void *userdata) {
+	watch_finished++;
+}
+
+// Handle events from the scan thread until *counter reaches want, for at most timeout_ms
+static void watch_wait(MediaScan *s, int *counter, int want, int timeout_ms) {
+	struct pollfd pfd;
+
+	pfd.fd = ms_async_fd(s);
+	pfd.events = POLLIN;
+
+	while (*counter < want && timeout_ms > 0) {
+		if (poll(&pfd, 1, 100) > 0)
+			ms_async_process(s);
+		timeout_ms -= 100;
+	}
+}
+
+// Scan dir with MS_WATCH_CHANGES and wait for the scan to finish, leaving the watch running. With a
+// poll_interval the directories are polled at that interval instead of watched with inotify.
+static MediaScan *start_watch(const char *dir, int settle_ms, int poll_interval) {
+	MediaScan *s = create_dir_scan(dir, MS_USE_EXTENSION | MS_FULL_SCAN | MS_INCLUDE_DELETED | MS_WATCH_CHANGES,
+	                               my_watch_result_callback);
+
+	ms_set_async(s, TRUE);
+	ms_set_watch_settle_time(s, settle_ms);
+	if (poll_interval) {
+		s->_watch_poll = 1;
+		ms_set_watch_interval(s, poll_interval);
+	}
+	ms_set_finish_callback(s, my_watch_finish_callback);
+
+	watch_results = 0;
+	watch_deleted = 0;
+	watch_finished = 0;
+
+	ms_scan(s);
+	watch_wait(s, &watch_finished, 1, 5000);
+	CU_ASSERT(watch_finished == 1);
+	CU_ASSERT(watch_results == 0);
+
+	return s;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Test that MS_WATCH_CHANGES reports new and deleted files after the scan has finished
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_watch_changes(void)	{
+	char dir[MAX_PATH_STR_LEN] = "data/watched";
+	char src_file[MAX_PATH_STR_LEN] = "data/video/bars-mpeg4-aac.m4v";
+	char file[MAX_PATH_STR_LEN] = "data/watched/bars.m4v";
+	MediaScan *s;
+
+	mkdir(dir, 0755);
+	remove(file);
+
+	s = start_watch(dir, 500, 0);
+
+	// A file written after the scan is picked up by the watch, once, after it has settled
+	copy_file(src_file, file);
+	utimes(file, NULL);
+	watch_wait(s, &watch_results, 1, 5000);
+	CU_ASSERT(watch_results == 1);
+	watch_wait(s, &watch_results, 2, 1000);
+	CU_ASSERT(watch_results == 1);
+
+	remove(file);
+	watch_wait(s, &watch_deleted, 1, 5000);
+	CU_ASSERT(watch_deleted == 1);
+
+	ms_clear_watch(s);
+	CU_ASSERT(s->thread == NULL);
+	ms_destroy(s);
+
+	rmdir(dir);
+} /* test_ms_watch_changes() */
+
+///-------------------------------------------------------------------------------------------------
+///  Test that a file still being written is not scanned until it has settled. The file is written
+///   in chunks 100 ms apart, taking longer than the settle time.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_watch_settle(void)	{
+	char dir[MAX_PATH_STR_LEN] = "data/settled";
+	char src_file[MAX_PATH_STR_LEN] = "data/video/bars-mpeg4-aac.m4v";
+	char file[MAX_PATH_STR_LEN] = "data/settled/bars.m4v";
+	char buf[8192];
+	size_t len;
+	FILE *in, *out;
+	MediaScan *s;
+
+	mkdir(dir, 0755);
+	remove(file);
+
+	s = start_watch(dir, 500, 0);
+
+	in = fopen(src_file, "rb");
+	out = fopen(file, "wb");
+	CU_ASSERT_FATAL(in != NULL && out != NULL);
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+		fwrite(buf, 1, len, out);
+		fflush(out);
+		watch_wait(s, &watch_results, 1, 100);
+	}
+
+	fclose(in);
+	fclose(out);
+
+	// Nothing is scanned while the file grows, and it is scanned once when it stops
+	CU_ASSERT(watch_results == 0);
+	watch_wait(s, &watch_results, 1, 5000);
+	CU_ASSERT(watch_results == 1);
+	watch_wait(s, &watch_results, 2, 1000);
+	CU_ASSERT(watch_results == 1);
+
+	ms_clear_watch(s);
+	ms_destroy(s);
+
+	remove(file);
+	rmdir(dir);
+} /* test_ms_watch_settle() */
+
+///-------------------------------------------------------------------------------------------------
+///  Test the poller used where inotify can't watch, polling every second. A file added without a
+///   new mtime of its directory, as happens on some network filesystems, is found by counting the
+///   entries of the directory, which is done every few polls.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_watch_poll(void)	{
+	char dir[MAX_PATH_STR_LEN] = "data/polled";
+	char src_file[MAX_PATH_STR_LEN] = "data/video/bars-mpeg4-aac.m4v";
+	char file1[MAX_PATH_STR_LEN] = "data/polled/bars1.m4v";
+	char file2[MAX_PATH_STR_LEN] = "data/polled/bars2.m4v";
+	struct timespec times[2];
+	struct stat st;
+	MediaScan *s;
+
+	mkdir(dir, 0755);
+	remove(file1);
+	remove(file2);
+
+	s = start_watch(dir, 200, 1);
+
+	copy_file(src_file, file1);
+	watch_wait(s, &watch_results, 1, 5000);
+	CU_ASSERT(watch_results == 1);
+
+	// Put the mtime of the directory back after adding the second file
+	CU_ASSERT_FATAL(stat(dir, &st) == 0);
+	copy_file(src_file, file2);
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	CU_ASSERT(utimensat(AT_FDCWD, dir, times, 0) == 0);
+	watch_wait(s, &watch_results, 2, 15000);
+	CU_ASSERT(watch_results == 2);
+
+	remove(file1);
+	remove(file2);
+	watch_wait(s, &watch_deleted, 2, 5000);
+	CU_ASSERT(watch_deleted == 2);
+
+	ms_clear_watch(s);
+	ms_destroy(s);
+
+	rmdir(dir);
+} /* test_ms_watch_poll() */
+#endif
+
 
 ///-------------------------------------------------------------------------------------------------
 ///  ------------------------------------------------------------------------------------------
@@ -601,13 +1884,43 @@ int run_unit_tests()
 //NULL == CU_add_test(pSuite, "Test of scanning LOTS of files", test_ms_large_directory) ||
 	   NULL == CU_add_test(pSuite, "Test of misc functions", test_ms_misc_functions) ||
   	   NULL == CU_add_test(pSuite, "Simple test of ASF audio file", test_ms_file_asf_audio) ||
-   	   NULL == CU_add_test(pSuite, "Test Berkeley database functionality", test_ms_db)
+  	   NULL == CU_add_test(pSuite, "Test of the MP4 header parser", test_ms_file_mp4) ||
+  	   NULL == CU_add_test(pSuite, "Test of the Matroska header parser", test_ms_file_webm) ||
+  	   NULL == CU_add_test(pSuite, "Test of the MPEG-TS duration probe", test_ms_file_mpegts) ||
+  	   NULL == CU_add_test(pSuite, "Test of the demuxer lookup by extension", test_ms_formats_find) ||
+  	   NULL == CU_add_test(pSuite, "Test of the video probe limits", test_ms_probe_limits) ||
+  	   NULL == CU_add_test(pSuite, "Test of storyboard thumbnails", test_ms_storyboard) ||
+  	   NULL == CU_add_test(pSuite, "Test of cover art thumbnails", test_ms_video_cover) ||
+  	   NULL == CU_add_test(pSuite, "Test of the MPEG-TS keyframe index", test_ms_keyframe_index) ||
+  	   NULL == CU_add_test(pSuite, "Test of the block-cached reader", test_ms_reader) ||
+  	   NULL == CU_add_test(pSuite, "Test of image thumbnail sizes", test_ms_image_thumb_size) ||
+  	   NULL == CU_add_test(pSuite, "Test of thumbnails made from larger ones", test_ms_image_thumb_cascade) ||
+  	   NULL == CU_add_test(pSuite, "Test of EXIF orientation in thumbnails", test_ms_image_thumb_orientation) ||
+  	   NULL == CU_add_test(pSuite, "Test of CMYK JPEG thumbnails", test_ms_image_thumb_cmyk) ||
+  	   NULL == CU_add_test(pSuite, "Test of EXIF thumbnail use", test_ms_image_exif_thumb) ||
+  	   NULL == CU_add_test(pSuite, "Test of video frame thumbnails", test_ms_video_thumbnails) ||
+  	   NULL == CU_add_test(pSuite, "Test of reduced resolution frame decoding", test_ms_video_lowres) ||
+   	   NULL == CU_add_test(pSuite, "Test Berkeley database functionality", test_ms_db) ||
+   	   NULL == CU_add_test(pSuite, "Test detection of moved files", test_ms_db_moved) ||
+   	   NULL == CU_add_test(pSuite, "Test detection of duplicate files", test_ms_db_duplicates) ||
+   	   NULL == CU_add_test(pSuite, "Test cache statistics, compaction and shards", test_ms_cache_tools) ||
+   	   NULL == CU_add_test(pSuite, "Test reuse of packed thumbnails", test_ms_thumbpack_reuse) ||
+   	   NULL == CU_add_test(pSuite, "Test thumbnails of a new thumbnail spec", test_ms_thumbpack_new_spec)
 
 	   )
    {
       CU_cleanup_registry();
       return CU_get_error();
    }
+
+#ifdef __linux__
+   if (NULL == CU_add_test(pSuite, "Test watching for changes", test_ms_watch_changes) ||
+       NULL == CU_add_test(pSuite, "Test settling of watched changes", test_ms_watch_settle) ||
+       NULL == CU_add_test(pSuite, "Test polling for changes", test_ms_watch_poll)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+#endif
 #endif
 
 //   setupbackground_tests();
@@ -0,0 +1,915 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\tools\msbench.c
+//
+// summary: Microbenchmarks of libmediascan internals. Each benchmark times the current code against
+//          the code it replaced, so a change can be checked for the saving it is meant to bring.
+///-------------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <jpeglib.h>
+
+#include <libmediascan.h>
+
+#include "../src/buffer.h"
+#include "../src/common.h"
+#include "../src/fixed.h"
+#include "../src/formats.h"
+#include "../src/image.h"
+#include "../src/image_jpeg.h"
+#include "../src/pixconv.h"
+#include "../src/resize.h"
+#include "../src/simd.h"
+#include "../src/video.h"
+
+// Monotonic time in ns
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double old_ns, double new_ns, int n) {
+  printf("%-24s old %10.1f ns  new %10.1f ns  (%.1fx)\n", name, old_ns / n, new_ns / n,
+         new_ns > 0 ? old_ns / new_ns : 0.0);
+}
+
+static void report_ms(const char *name, double old_ns, double new_ns, int n) {
+  printf("%-24s old %10.2f ms  new %10.2f ms  (%.1fx)\n", name, old_ns / n / 1e6, new_ns / n / 1e6,
+         new_ns > 0 ? old_ns / new_ns : 0.0);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  formats: demuxer lookup by file extension, the hash table against walking all demuxers
+///-------------------------------------------------------------------------------------------------
+
+static const char *FormatPaths[] = {
+  "/media/video/movie.mkv", "/media/video/clip.mp4", "/media/video/old.avi", "/media/video/rec.ts",
+  "/media/video/show.wmv", "/media/video/web.flv", "/media/video/trailer.webm", "/media/video/cam.m2ts",
+  "/media/video/dvd.vob", "/media/video/phone.3gp", "/media/video/CLIP.MOV", "/media/video/notes.xyz",
+  NULL
+};
+
+// The lookup scan_video() used before the table
+static AVInputFormat *find_format_iterate(const char *path) {
+  AVInputFormat *iformat;
+  void *i = 0;
+
+  while ((iformat = (AVInputFormat *)av_demuxer_iterate(&i))) {
+    if (av_match_ext(path, iformat->name))
+      break;
+
+    if (iformat->extensions) {
+      if (av_match_ext(path, iformat->extensions))
+        break;
+    }
+  }
+
+  return iformat;
+}
+
+static int bench_formats(int iterations, int argc, char **argv) {
+  const char **paths = argc ? (const char **)argv : FormatPaths;
+  int npaths = 0;
+  double start, old_ns, new_ns;
+  int i, j, errors = 0;
+
+  while (argc ? npaths < argc : paths[npaths] != NULL)
+    npaths++;
+
+  formats_init();
+
+  for (j = 0; j < npaths; j++) {
+    AVInputFormat *a = find_format_iterate(paths[j]);
+    AVInputFormat *b = formats_find(paths[j]);
+
+    if (a != b) {
+      fprintf(stderr, "Mismatch for %s: %s vs %s\n", paths[j], a ? a->name : "none", b ? b->name : "none");
+      errors++;
+    }
+  }
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    for (j = 0; j < npaths; j++)
+      find_format_iterate(paths[j]);
+  }
+  old_ns = now_ns() - start;
+
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    for (j = 0; j < npaths; j++)
+      formats_find(paths[j]);
+  }
+  new_ns = now_ns() - start;
+
+  report("format per file", old_ns, new_ns, iterations * npaths);
+
+  return errors ? 1 : 0;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  thumbframe: decoding the video frame for a thumbnail, the keyframe seek with the reduced decoder
+///  settings against the search video_create_image_from_frame() did before
+///-------------------------------------------------------------------------------------------------
+
+#define THUMB_WIDTH 320
+
+// The search video_create_image_from_frame() used before: seek to 10% without the backward flag, then read packets
+// until a keyframe of the video stream decodes, with the decoder at full settings
+static int decode_frame_old(AVFormatContext *avf, int vsid, AVCodecContext *vc, const AVCodec *codec, AVFrame *frame) {
+  AVStream *vs = avf->streams[vsid];
+  int64_t duration_tb = ((double)avf->duration / AV_TIME_BASE) / av_q2d(vs->time_base);
+  AVPacket packet;
+  int skipped = 0;
+  int ret = 0;
+
+  if (avcodec_open2(vc, codec, NULL) < 0)
+    return 0;
+
+  av_seek_frame(avf, vsid, (int)((double)duration_tb * 0.1), 0);
+  av_init_packet(&packet);
+
+  while (skipped++ < 200 && av_read_frame(avf, &packet) >= 0) {
+    if (packet.stream_index != vsid || !(packet.flags & AV_PKT_FLAG_KEY)) {
+      av_packet_unref(&packet);
+      continue;
+    }
+
+    ret = avcodec_send_packet(vc, &packet) >= 0 && avcodec_receive_frame(vc, frame) == 0;
+    av_packet_unref(&packet);
+    if (ret)
+      break;
+  }
+
+  return ret;
+}
+
+static int decode_frame_new(AVFormatContext *avf, int vsid, const AVCodec *codec, AVFrame *frame) {
+  AVCodecParameters *par = avf->streams[vsid]->codecpar;
+  int thumb_height = (int)((double)par->height / par->width * THUMB_WIDTH);
+  AVCodecContext *vc;
+  int ret;
+
+  vc = video_open_decoder(avf->streams[vsid], codec, THUMB_WIDTH, thumb_height);
+  if (vc == NULL)
+    return 0;
+
+  ret = video_decode_frame(avf, vsid, vc, avf->duration > 0 ? avf->duration / 10 : 0, frame);
+
+  avcodec_free_context(&vc);
+  return ret;
+}
+
+static int bench_thumbframe(int iterations, int argc, char **argv) {
+  double old_ns = 0, new_ns = 0, start;
+  int i, j, n = 0, errors = 0;
+
+  if (!argc) {
+    fprintf(stderr, "thumbframe needs video files to decode\n");
+    return 1;
+  }
+
+  for (j = 0; j < argc; j++) {
+    AVFormatContext *avf = NULL;
+    AVCodec *codec = NULL;
+    AVCodecContext *vc = NULL;
+    AVFrame *frame = av_frame_alloc();
+    int vsid;
+
+    if (avformat_open_input(&avf, argv[j], NULL, NULL) < 0 || avformat_find_stream_info(avf, NULL) < 0
+        || (vsid = av_find_best_stream(avf, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0) {
+      fprintf(stderr, "Can't open the video of %s\n", argv[j]);
+      errors++;
+      goto next;
+    }
+
+    for (i = 0; i < iterations; i++) {
+      // A fresh context each time, the decoder settings stay in it
+      vc = avcodec_alloc_context3(codec);
+      avcodec_parameters_to_context(vc, avf->streams[vsid]->codecpar);
+      start = now_ns();
+      if (!decode_frame_old(avf, vsid, vc, codec, frame))
+        errors++;
+      old_ns += now_ns() - start;
+      avcodec_free_context(&vc);
+
+      start = now_ns();
+      if (!decode_frame_new(avf, vsid, codec, frame))
+        errors++;
+      new_ns += now_ns() - start;
+
+      av_frame_unref(frame);
+      n++;
+    }
+
+  next:
+    av_frame_free(&frame);
+    if (avf)
+      avformat_close_input(&avf);
+  }
+
+  if (errors)
+    fprintf(stderr, "%d frames could not be decoded\n", errors);
+
+  if (n)
+    report_ms("thumbnail frame", old_ns, new_ns, n);
+
+  return errors ? 1 : 0;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  resize: image thumbnails, the separable resampler against the per-pixel fixed-point loop of
+///  thumb_resize_gd_fixed() it replaced, on 12, 24 and 50 MP sources. The SIMD kernel must give the
+///  same pixels as the C one. The old loop's 12-bit reciprocal of the box area makes it darker by a few
+///  levels when shrinking a lot, so the difference from it is only reported.
+///-------------------------------------------------------------------------------------------------
+
+// thumb_resize_gd_fixed() without the padding and the orientation
+static void resize_gd_fixed(const uint32_t *src, int srcW, int srcH, uint32_t *dst, int dstW, int dstH,
+                            int has_alpha) {
+  fixed_t width_scale = fixed_div(int_to_fixed(srcW), int_to_fixed(dstW));
+  fixed_t height_scale = fixed_div(int_to_fixed(srcH), int_to_fixed(dstH));
+  int x, y;
+
+  for (y = 0; y < dstH; y++) {
+    fixed_t sy1 = fixed_mul(int_to_fixed(y), height_scale);
+    fixed_t sy2 = fixed_mul(int_to_fixed(y + 1), height_scale);
+
+    for (x = 0; x < dstW; x++) {
+      fixed_t sx1 = fixed_mul(int_to_fixed(x), width_scale);
+      fixed_t sx2 = fixed_mul(int_to_fixed(x + 1), width_scale);
+      fixed_t sx, sy = sy1;
+      fixed_t spixels = 0;
+      fixed_t red = 0, green = 0, blue = 0, alpha = has_alpha ? 0 : FIXED_255;
+
+      do {
+        fixed_t yportion;
+
+        if (fixed_floor(sy) == fixed_floor(sy1)) {
+          yportion = FIXED_1 - (sy - fixed_floor(sy));
+          if (yportion > sy2 - sy1)
+            yportion = sy2 - sy1;
+          sy = fixed_floor(sy);
+        }
+        else if (sy == fixed_floor(sy2)) {
+          yportion = sy2 - fixed_floor(sy2);
+        }
+        else {
+          yportion = FIXED_1;
+        }
+
+        sx = sx1;
+
+        do {
+          fixed_t xportion, pcontribution;
+          uint32_t p;
+
+          if (fixed_floor(sx) == fixed_floor(sx1)) {
+            xportion = FIXED_1 - (sx - fixed_floor(sx));
+            if (xportion > sx2 - sx1)
+              xportion = sx2 - sx1;
+            sx = fixed_floor(sx);
+          }
+          else if (sx == fixed_floor(sx2)) {
+            xportion = sx2 - fixed_floor(sx2);
+          }
+          else {
+            xportion = FIXED_1;
+          }
+
+          pcontribution = fixed_mul(xportion, yportion);
+          p = src[fixed_to_int(sy) * srcW + fixed_to_int(sx)];
+
+          red += fixed_mul(int_to_fixed(COL_RED(p)), pcontribution);
+          green += fixed_mul(int_to_fixed(COL_GREEN(p)), pcontribution);
+          blue += fixed_mul(int_to_fixed(COL_BLUE(p)), pcontribution);
+          if (has_alpha)
+            alpha += fixed_mul(int_to_fixed(COL_ALPHA(p)), pcontribution);
+
+          spixels += pcontribution;
+          sx += FIXED_1;
+        } while (sx < sx2);
+
+        sy += FIXED_1;
+      } while (sy < sy2);
+
+      if (spixels != 0) {
+        spixels = fixed_div(FIXED_1, spixels);
+        red = fixed_mul(red, spixels);
+        green = fixed_mul(green, spixels);
+        blue = fixed_mul(blue, spixels);
+        if (has_alpha)
+          alpha = fixed_mul(alpha, spixels);
+      }
+
+      red = MIN(red, FIXED_255);
+      green = MIN(green, FIXED_255);
+      blue = MIN(blue, FIXED_255);
+      alpha = MIN(alpha, FIXED_255);
+
+      dst[y * dstW + x] = COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha));
+    }
+  }
+}                               /* resize_gd_fixed() */
+
+// Largest difference of a channel between two images
+static int resize_max_diff(const uint32_t *a, const uint32_t *b, int n) {
+  const uint8_t *pa = (const uint8_t *)a;
+  const uint8_t *pb = (const uint8_t *)b;
+  int i, diff = 0;
+
+  for (i = 0; i < 4 * n; i++)
+    diff = MAX(diff, abs(pa[i] - pb[i]));
+
+  return diff;
+}
+
+static int bench_resize(int iterations, int argc, char **argv) {
+  static const int Sizes[][2] = { { 4000, 3000 }, { 6000, 4000 }, { 8660, 5773 } };
+  int simd = simd_set(SIMD_AUTO);
+  int s, i, x, y, errors = 0;
+
+  for (s = 0; s < 3; s++) {
+    int srcW = Sizes[s][0], srcH = Sizes[s][1];
+    int dstW = THUMB_WIDTH, dstH = srcH * THUMB_WIDTH / srcW;
+    uint32_t *src = (uint32_t *)malloc((size_t)srcW * srcH * sizeof(uint32_t));
+    uint32_t *old = (uint32_t *)malloc(dstW * dstH * sizeof(uint32_t));
+    uint32_t *c = (uint32_t *)malloc(dstW * dstH * sizeof(uint32_t));
+    uint32_t *new = (uint32_t *)malloc(dstW * dstH * sizeof(uint32_t));
+    uint32_t seed = 1;
+    double start, old_ns = 0, c_ns = 0, new_ns = 0;
+    char name[32];
+    int diff;
+
+    // Gradients with some noise, so neighbouring pixels differ
+    for (y = 0; y < srcH; y++) {
+      for (x = 0; x < srcW; x++) {
+        seed = seed * 1103515245 + 12345;
+        src[(size_t)y * srcW + x] = COL_FULL((x * 255 / srcW) ^ (seed >> 28), (y * 255 / srcH) ^ (seed >> 24 & 0xF),
+                                             (seed >> 16) & 0xFF, 0xFF);
+      }
+    }
+
+    for (i = 0; i < iterations; i++) {
+      start = now_ns();
+      resize_gd_fixed(src, srcW, srcH, old, dstW, dstH, 0);
+      old_ns += now_ns() - start;
+
+      simd_set(SIMD_C);
+      start = now_ns();
+      resize_box(src, srcW, srcH, c, dstW, dstH, dstW, 0);
+      c_ns += now_ns() - start;
+
+      simd_set(simd);
+      start = now_ns();
+      resize_box(src, srcW, srcH, new, dstW, dstH, dstW, 0);
+      new_ns += now_ns() - start;
+    }
+
+    if ((diff = resize_max_diff(c, new, dstW * dstH)) != 0) {
+      fprintf(stderr, "%d x %d: %s differs from C by up to %d\n", srcW, srcH, simd_name(simd), diff);
+      errors++;
+    }
+
+    sprintf(name, "resize %.0f MP C", srcW * (double)srcH / 1e6);
+    report_ms(name, old_ns, c_ns, iterations);
+    sprintf(name, "resize %.0f MP %s", srcW * (double)srcH / 1e6, simd_name(simd));
+    report_ms(name, old_ns, new_ns, iterations);
+    printf("%-24s differs from old by up to %d\n", "", resize_max_diff(old, new, dstW * dstH));
+
+    free(src);
+    free(old);
+    free(c);
+    free(new);
+  }
+
+  return errors ? 1 : 0;
+}                               /* bench_resize() */
+
+///-------------------------------------------------------------------------------------------------
+///  orient: applying the EXIF orientation to a resized image, the tiled pass against the per-pixel
+///  loop of thumb_rotate() it replaced, for all eight orientations of a 1024 and a 4032 pixel wide
+///  image. The C and SIMD kernels must give the same pixels as the old loop.
+///-------------------------------------------------------------------------------------------------
+
+// thumb_rotate() and get_rotated_coords(), src placed at dstX, dstY of a dstW x dstH image
+static void orient_per_pixel(const uint32_t *src, int width, int height, uint32_t *dst, int dstW, int dstH,
+                             int dstX, int dstY, int orientation) {
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++) {
+      int sx = x + dstX, sy = y + dstY, ox, oy;
+
+      switch (orientation) {
+        case ORIENTATION_MIRROR_HORIZ:
+          ox = dstW - 1 - sx;
+          oy = sy;
+          break;
+        case ORIENTATION_180:
+          ox = dstW - 1 - sx;
+          oy = dstH - 1 - sy;
+          break;
+        case ORIENTATION_MIRROR_VERT:
+          ox = sx;
+          oy = dstH - 1 - sy;
+          break;
+        case ORIENTATION_MIRROR_HORIZ_270_CCW:
+          ox = sy;
+          oy = sx;
+          break;
+        case ORIENTATION_90_CCW:
+          ox = dstH - 1 - sy;
+          oy = sx;
+          break;
+        case ORIENTATION_MIRROR_HORIZ_90_CCW:
+          ox = dstH - 1 - sy;
+          oy = dstW - 1 - sx;
+          break;
+        case ORIENTATION_270_CCW:
+          ox = sy;
+          oy = dstW - 1 - sx;
+          break;
+        default:
+          ox = sx;
+          oy = sy;
+          break;
+      }
+
+      if (orientation >= 5)
+        dst[oy * dstH + ox] = src[y * width + x];
+      else
+        dst[oy * dstW + ox] = src[y * width + x];
+    }
+  }
+}                               /* orient_per_pixel() */
+
+static int bench_orient(int iterations, int argc, char **argv) {
+  static const int Sizes[][2] = { { 1024, 768 }, { 4032, 3024 } };
+  int simd = simd_set(SIMD_AUTO);
+  int s, o, i, errors = 0;
+
+  for (s = 0; s < 2; s++) {
+    int w = Sizes[s][0], h = Sizes[s][1];
+    size_t n = (size_t)w * h;
+    uint32_t *src = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t *old = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t *c = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t *new = (uint32_t *)malloc(n * sizeof(uint32_t));
+
+    for (i = 0; i < (int)n; i++)
+      src[i] = (uint32_t)i * 2654435761U;
+
+    for (o = ORIENTATION_NORMAL; o <= ORIENTATION_270_CCW; o++) {
+      double start, old_ns = 0, new_ns = 0;
+      char name[32];
+
+      for (i = 0; i < iterations; i++) {
+        start = now_ns();
+        orient_per_pixel(src, w, h, old, w, h, 0, 0, o);
+        old_ns += now_ns() - start;
+
+        start = now_ns();
+        resize_orient(src, w, h, new, w, h, 0, 0, o);
+        new_ns += now_ns() - start;
+      }
+
+      simd_set(SIMD_C);
+      resize_orient(src, w, h, c, w, h, 0, 0, o);
+      simd_set(simd);
+
+      if (memcmp(old, new, n * sizeof(uint32_t)) || memcmp(old, c, n * sizeof(uint32_t))) {
+        fprintf(stderr, "%d x %d orientation %d: pixels differ from the old loop\n", w, h, o);
+        errors++;
+      }
+
+      sprintf(name, "orient %dx%d %d %s", w, h, o, simd_name(simd));
+      report_ms(name, old_ns, new_ns, iterations);
+    }
+
+    free(src);
+    free(old);
+    free(c);
+    free(new);
+  }
+
+  return errors ? 1 : 0;
+}                               /* bench_orient() */
+
+///-------------------------------------------------------------------------------------------------
+///  pixconv: converting decoded rows of a 12 MP image to pixbuf pixels and back, the row converters
+///  against the per-pixel COL() loops of the decoders and encoders. The C and SIMD converters must
+///  give the same bytes as the old loops.
+///-------------------------------------------------------------------------------------------------
+
+typedef struct {
+  uint8_t Red, Green, Blue;
+} BenchColor;
+
+static BenchColor PixconvColors[256];
+static uint32_t PixconvPalette[256];
+
+static void old_rgb(const uint8_t *ptr, uint32_t *dst, int w) {
+  int x;
+
+  for (x = 0; x < w; x++)
+    dst[x] = COL(ptr[x + x + x], ptr[x + x + x + 1], ptr[x + x + x + 2]);
+}
+
+static void old_cmyk(const uint8_t *row, uint32_t *dst, int w) {
+  int x;
+
+  for (x = 0; x < w; x++) {
+    int c = *row++;
+    int m = *row++;
+    int y = *row++;
+    int k = *row++;
+
+    dst[x] = COL((c * k) / 255, (m * k) / 255, (y * k) / 255);
+  }
+}
+
+static void old_gray(const uint8_t *ptr, uint32_t *dst, int w) {
+  int x;
+
+  for (x = 0; x < w; x++)
+    dst[x] = COL(ptr[x], ptr[x], ptr[x]);
+}
+
+static void old_gray_alpha(const uint8_t *ptr, uint32_t *dst, int w) {
+  int x;
+
+  for (x = 0; x < w; x++)
+    dst[x] = COL_FULL(ptr[x * 2], ptr[x * 2], ptr[x * 2], ptr[x * 2 + 1]);
+}
+
+static void old_rgba(const uint8_t *ptr, uint32_t *dst, int w) {
+  int x;
+
+  for (x = 0; x < w; x++)
+    dst[x] = COL_FULL(ptr[x * 4], ptr[x * 4 + 1], ptr[x * 4 + 2], ptr[x * 4 + 3]);
+}
+
+static void old_bgr(const uint8_t *bptr, uint32_t *dst, int w) {
+  int x;
+
+  for (x = 0; x < w; x++)
+    dst[x] = COL(bptr[3 * x + 2], bptr[3 * x + 1], bptr[3 * x]);
+}
+
+// The GIF loop, transparent index 0
+static void old_palette(const uint8_t *line, uint32_t *dst, int w) {
+  int y;
+
+  for (y = 0; y < w; y++) {
+    BenchColor *c = &PixconvColors[line[y]];
+    dst[y] = COL_FULL(c->Red, c->Green, c->Blue, 0 == line[y] ? 0 : 255);
+  }
+}
+
+static void new_palette(const uint8_t *src, uint32_t *dst, int w) {
+  pixconv_palette(src, dst, w, PixconvPalette);
+}
+
+static void old_to_rgb(const uint32_t *src, uint8_t *data, int w) {
+  int x;
+
+  for (x = 0; x < w; x++) {
+    data[x + x + x] = COL_RED(src[x]);
+    data[x + x + x + 1] = COL_GREEN(src[x]);
+    data[x + x + x + 2] = COL_BLUE(src[x]);
+  }
+}
+
+static void old_to_rgba(const uint32_t *src, uint8_t *ptr, int w) {
+  int x;
+
+  for (x = 0; x < w; x++) {
+    ptr[x * 4] = COL_RED(src[x]);
+    ptr[x * 4 + 1] = COL_GREEN(src[x]);
+    ptr[x * 4 + 2] = COL_BLUE(src[x]);
+    ptr[x * 4 + 3] = COL_ALPHA(src[x]);
+  }
+}
+
+static void old_to_gray_alpha(const uint32_t *src, uint8_t *ptr, int w) {
+  int x;
+
+  for (x = 0; x < w; x++) {
+    ptr[x * 2] = COL_BLUE(src[x]);
+    ptr[x * 2 + 1] = COL_ALPHA(src[x]);
+  }
+}
+
+// *INDENT-OFF*
+static const struct {
+  const char *name;
+  int bytes;                    // per decoded pixel
+  void (*old) (const uint8_t *src, uint32_t *dst, int width);
+  void (*new) (const uint8_t *src, uint32_t *dst, int width);
+  void (*old_out) (const uint32_t *src, uint8_t *dst, int width);
+  void (*new_out) (const uint32_t *src, uint8_t *dst, int width);
+} PixconvFormats[] = {
+  { "rgb", 3, old_rgb, pixconv_rgb, NULL, NULL },
+  { "bgr", 3, old_bgr, pixconv_bgr, NULL, NULL },
+  { "rgba", 4, old_rgba, pixconv_rgba, NULL, NULL },
+  { "gray", 1, old_gray, pixconv_gray, NULL, NULL },
+  { "gray_alpha", 2, old_gray_alpha, pixconv_gray_alpha, NULL, NULL },
+  { "cmyk", 4, old_cmyk, pixconv_cmyk_inverted, NULL, NULL },
+  { "palette", 1, old_palette, new_palette, NULL, NULL },
+  { "to_rgb", 3, NULL, NULL, old_to_rgb, pixconv_to_rgb },
+  { "to_rgba", 4, NULL, NULL, old_to_rgba, pixconv_to_rgba },
+  { "to_gray_alpha", 2, NULL, NULL, old_to_gray_alpha, pixconv_to_gray_alpha },
+  { NULL, 0, NULL, NULL, NULL, NULL }
+};
+// *INDENT-ON*
+
+// Convert all rows of an image, decoded rows into pixels or pixels into rows
+static void pixconv_image(int f, int old, uint8_t *rows, uint32_t *pixels, int w, int h) {
+  int y;
+
+  for (y = 0; y < h; y++) {
+    uint8_t *row = rows + (size_t)y * w * PixconvFormats[f].bytes;
+    uint32_t *px = pixels + (size_t)y * w;
+
+    if (PixconvFormats[f].old)
+      (old ? PixconvFormats[f].old : PixconvFormats[f].new) (row, px, w);
+    else
+      (old ? PixconvFormats[f].old_out : PixconvFormats[f].new_out) (px, row, w);
+  }
+}
+
+static int bench_pixconv(int iterations, int argc, char **argv) {
+  int w = 4000, h = 3000;
+  size_t n = (size_t)w * h;
+  int simd = simd_set(SIMD_AUTO);
+  uint8_t *rows[3];
+  uint32_t *pixels[3];
+  uint32_t seed = 1;
+  int f, i, errors = 0;
+
+  for (i = 0; i < 3; i++) {
+    rows[i] = (uint8_t *)malloc(n * 4);
+    pixels[i] = (uint32_t *)malloc(n * sizeof(uint32_t));
+  }
+
+  for (i = 0; i < 256; i++) {
+    PixconvColors[i].Red = (uint8_t)(i * 7);
+    PixconvColors[i].Green = (uint8_t)(i * 13);
+    PixconvColors[i].Blue = (uint8_t)(i * 29);
+    PixconvPalette[i] = COL_FULL(PixconvColors[i].Red, PixconvColors[i].Green, PixconvColors[i].Blue, i ? 255 : 0);
+  }
+
+  for (f = 0; PixconvFormats[f].name; f++) {
+    double start, old_ns = 0, new_ns = 0;
+    size_t bytes = PixconvFormats[f].old ? n * sizeof(uint32_t) : n * PixconvFormats[f].bytes;
+    char name[32];
+    int k;
+
+    for (i = 0; i < (int)n; i++) {
+      seed = seed * 1103515245 + 12345;
+      pixels[0][i] = seed;
+      memcpy(rows[0] + 4 * (size_t)i, &seed, 4);
+    }
+    for (k = 1; k < 3; k++) {
+      memcpy(pixels[k], pixels[0], n * sizeof(uint32_t));
+      memcpy(rows[k], rows[0], n * 4);
+    }
+
+    for (i = 0; i < iterations; i++) {
+      start = now_ns();
+      pixconv_image(f, 1, rows[0], pixels[0], w, h);
+      old_ns += now_ns() - start;
+
+      start = now_ns();
+      pixconv_image(f, 0, rows[1], pixels[1], w, h);
+      new_ns += now_ns() - start;
+    }
+
+    simd_set(SIMD_C);
+    pixconv_image(f, 0, rows[2], pixels[2], w, h);
+    simd_set(simd);
+
+    if (PixconvFormats[f].old
+        ? memcmp(pixels[0], pixels[1], bytes) || memcmp(pixels[0], pixels[2], bytes)
+        : memcmp(rows[0], rows[1], bytes) || memcmp(rows[0], rows[2], bytes)) {
+      fprintf(stderr, "%s: converters differ from the old loop\n", PixconvFormats[f].name);
+      errors++;
+    }
+
+    sprintf(name, "pixconv %s %s", PixconvFormats[f].name, simd_name(simd));
+    report_ms(name, old_ns, new_ns, iterations);
+  }
+
+  for (i = 0; i < 3; i++) {
+    free(rows[i]);
+    free(pixels[i]);
+  }
+
+  return errors ? 1 : 0;
+}                               /* bench_pixconv() */
+
+///-------------------------------------------------------------------------------------------------
+///  jpegload: loading JPEGs for a thumbnail, 300x300 unless a size is given, the EXIF thumbnail or
+///  the M/8 DCT scale and scanlines decoded in batches, straight into the pixbuf with libjpeg-turbo,
+///  against the 1/N scale and a scanline at a time converted a pixel at a time
+///-------------------------------------------------------------------------------------------------
+
+static int JpegThumbSize = 300;
+
+// The load image_jpeg_load() did before
+static int jpeg_load_old(const char *path) {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  float scale_factor;
+  uint32_t *pixbuf;
+  unsigned char *line[1], *ptr;
+  int w, h, x, ofs = 0;
+  FILE *fp = fopen(path, "rb");
+
+  if (fp == NULL)
+    return 0;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_read_header(&cinfo, TRUE);
+
+  cinfo.do_fancy_upsampling = FALSE;
+  cinfo.do_block_smoothing = FALSE;
+
+  jpeg_calc_output_dimensions(&cinfo);
+  scale_factor = (float)cinfo.output_width / JpegThumbSize;
+  if (scale_factor > ((float)cinfo.output_height / JpegThumbSize))
+    scale_factor = (float)cinfo.output_height / JpegThumbSize;
+  if (scale_factor > 1) {
+    cinfo.scale_denom *= (unsigned int)scale_factor;
+    jpeg_calc_output_dimensions(&cinfo);
+  }
+
+  w = cinfo.output_width;
+  h = cinfo.output_height;
+
+  jpeg_start_decompress(&cinfo);
+
+  pixbuf = (uint32_t *)malloc(w * h * sizeof(uint32_t));
+  ptr = (unsigned char *)malloc(w * cinfo.output_components);
+  line[0] = ptr;
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    jpeg_read_scanlines(&cinfo, line, 1);
+
+    if (cinfo.output_components == 3) {
+      for (x = 0; x < w; x++)
+        pixbuf[ofs++] = COL(ptr[x + x + x], ptr[x + x + x + 1], ptr[x + x + x + 2]);
+    }
+    else if (cinfo.output_components == 4) {
+      unsigned char *row = ptr;
+      for (x = 0; x < w; x++) {
+        int c = *row++;
+        int m = *row++;
+        int y = *row++;
+        int k = *row++;
+
+        pixbuf[ofs++] = COL((c * k) / 255, (m * k) / 255, (y * k) / 255);
+      }
+    }
+    else {
+      for (x = 0; x < w; x++)
+        pixbuf[ofs++] = COL(ptr[x], ptr[x], ptr[x]);
+    }
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(fp);
+  free(ptr);
+  free(pixbuf);
+
+  return 1;
+}
+
+static int jpeg_load_new(const char *path) {
+  MediaScanImage *i = image_create();
+  MediaScanResult r;
+  MediaScanThumbSpec spec;
+  Buffer buf;
+  int ret = 0;
+
+  memset(&r, 0, sizeof(r));
+  memset(&spec, 0, sizeof(spec));
+  spec.width = spec.height = JpegThumbSize;
+  spec.keep_aspect = 1;
+
+  r.path = (char *)path;
+  r.image = i;
+  i->path = path;
+  if ((r._fp = fopen(path, "rb")) == NULL)
+    goto out;
+
+  buffer_init(&buf, BUF_SIZE);
+  r._buf = &buf;
+  buffer_check_load(&buf, r._fp, 2, BUF_SIZE);
+
+  ret = image_jpeg_read_header(i, &r) && image_jpeg_load(i, &spec);
+
+  buffer_free(&buf);
+  fclose(r._fp);
+
+out:
+  image_destroy(i);
+  return ret;
+}
+
+static int bench_jpegload(int iterations, int argc, char **argv) {
+  double old_ns = 0, new_ns = 0, start;
+  int i, j, n = 0, errors = 0;
+
+  if (argc && atoi(argv[0]) > 0) {
+    JpegThumbSize = atoi(argv[0]);
+    argc--;
+    argv++;
+  }
+
+  if (!argc) {
+    fprintf(stderr, "jpegload needs JPEG files to load\n");
+    return 1;
+  }
+
+  for (j = 0; j < argc; j++) {
+    for (i = 0; i < iterations; i++) {
+      start = now_ns();
+      if (!jpeg_load_old(argv[j]))
+        errors++;
+      old_ns += now_ns() - start;
+
+      start = now_ns();
+      if (!jpeg_load_new(argv[j]))
+        errors++;
+      new_ns += now_ns() - start;
+
+      n++;
+    }
+  }
+
+  if (errors)
+    fprintf(stderr, "%d loads failed\n", errors);
+
+  if (n)
+    report_ms("jpeg load", old_ns, new_ns, n);
+
+  return errors ? 1 : 0;
+}                               /* bench_jpegload() */
+
+static const struct {
+  const char *name;
+  int (*func) (int iterations, int argc, char **argv);
+  int iterations;
+  const char *help;
+} Benchmarks[] = {
+  { "formats", bench_formats, 20000, "Demuxer lookup by file extension [path ...]" },
+  { "thumbframe", bench_thumbframe, 20, "Decoding the frame for a video thumbnail video ..." },
+  { "resize", bench_resize, 5, "Resizing 12, 24 and 50 MP images to thumbnails" },
+  { "orient", bench_orient, 20, "Applying the eight EXIF orientations to resized images" },
+  { "pixconv", bench_pixconv, 10, "Converting decoded rows of a 12 MP image to pixels and back" },
+  { "jpegload", bench_jpegload, 10, "Loading JPEGs for a thumbnail [size] jpeg ..." },
+  { NULL, NULL, 0, NULL }
+};
+
+static void usage(const char *prog) {
+  int i;
+
+  fprintf(stderr, "Usage: %s [-n iterations] benchmark [args]\n\n", prog);
+  for (i = 0; Benchmarks[i].name; i++)
+    fprintf(stderr, "  %-10s %s\n", Benchmarks[i].name, Benchmarks[i].help);
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = 0;
+  int i = 1, b;
+
+  if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+    iterations = atoi(argv[i + 1]);
+    i += 2;
+  }
+
+  if (i >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (b = 0; Benchmarks[b].name; b++) {
+    if (!strcmp(argv[i], Benchmarks[b].name))
+      return Benchmarks[b].func(iterations > 0 ? iterations : Benchmarks[b].iterations, argc - i - 1, argv + i + 1);
+  }
+
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,117 @@
+///-------------------------------------------------------------------------------------------------
+// file:  libmediascan\tools\mscache.c
+//
+// summary: Command line tool to inspect, verify and compact a libmediascan cache directory
+///-------------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmediascan.h>
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-d cachedir] stats|verify|compact path ...\n\n", prog);
+  fprintf(stderr, "Works on the cache shards of the given scan paths.\n\n");
+  fprintf(stderr, "  stats    Show the number of cached files, cache size and counters of the last scan\n");
+  fprintf(stderr, "  verify   Check the cache for unusable or dangling entries\n");
+  fprintf(stderr, "  compact  Remove dangling entries and unused thumbnails, shrink the cache files and\n");
+  fprintf(stderr, "           delete stale shards of other paths\n");
+}
+
+static int do_stats(MediaScan *s) {
+  MediaScanCacheStats *stats = ms_cache_stats(s);
+  int lookups;
+  int i;
+
+  if (stats == NULL) {
+    fprintf(stderr, "Unable to open cache\n");
+    return 1;
+  }
+
+  lookups = stats->hits + stats->misses;
+
+  printf("Entries:     %d\n", stats->entries);
+  printf("Thumbnails:  %d\n", stats->thumbnails);
+  printf("Size:        %llu bytes\n", (unsigned long long)stats->disk_size);
+  printf("Last scan:   %d hits, %d misses, %d inserts", stats->hits, stats->misses, stats->inserts);
+  if (lookups)
+    printf(" (%.1f%% hit rate)", 100.0 * stats->hits / lookups);
+  printf("\n");
+
+  if (stats->ndirs) {
+    printf("\nDirectories:\n");
+    for (i = 0; i < stats->ndirs; i++)
+      printf("%8d  %s\n", stats->dirs[i].entries, stats->dirs[i].path);
+  }
+
+  ms_cache_stats_destroy(stats);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  MediaScan *s;
+  const char *cachedir = NULL;
+  const char *cmd;
+  int ret = 0;
+  int n;
+  int i = 1;
+
+  if (argc > 2 && !strcmp(argv[1], "-d")) {
+    cachedir = argv[2];
+    i = 3;
+  }
+
+  if (i + 1 >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  cmd = argv[i++];
+
+  ms_set_log_level(WARN);
+
+  s = ms_create();
+  if (s == NULL)
+    return 1;
+
+  if (cachedir)
+    ms_set_cachedir(s, cachedir);
+
+  for (; i < argc; i++)
+    ms_add_path(s, argv[i]);
+
+  if (!strcmp(cmd, "stats")) {
+    ret = do_stats(s);
+  }
+  else if (!strcmp(cmd, "verify")) {
+    n = ms_cache_verify(s);
+    if (n < 0) {
+      fprintf(stderr, "Unable to open cache\n");
+      ret = 1;
+    }
+    else {
+      printf("%d problems found\n", n);
+      ret = n ? 2 : 0;
+    }
+  }
+  else if (!strcmp(cmd, "compact")) {
+    n = ms_cache_compact(s);
+    if (n < 0) {
+      fprintf(stderr, "Unable to compact cache\n");
+      ret = 1;
+    }
+    else {
+      printf("%d entries removed\n", n);
+    }
+  }
+  else {
+    usage(argv[0]);
+    ret = 1;
+  }
+
+  ms_destroy(s);
+
+  return ret;
+}